@@ -15,6 +15,9 @@ NS_SWIFT_NAME(TFYConfig)
 @property (nonatomic, copy, nullable) NSString *password;        // 密码
 @property (nonatomic, assign) NSTimeInterval timeout;  // 超时时间
 
+// 备用服务器：每项为 @{@"server": 地址, @"server_port": 端口}，仅用于故障切换：VPN 隧道提供者经服务器做握手探测，主服务器不可用或明显变慢时切换到其中健康分最高的一个；不参与按连接的负载均衡
+@property (nonatomic, copy, nullable) NSArray<NSDictionary<NSString *, id> *> *servers;
+
 // SSR 特有配置
 @property (nonatomic, assign, getter=isSSR) BOOL SSR NS_SWIFT_NAME(isSSR);            // 是否为 SSR
 @property (nonatomic, copy, nullable) NSString *protocol;        // SSR 协议
@@ -31,11 +34,18 @@ NS_SWIFT_NAME(TFYConfig)
 @property (nonatomic, assign, getter=isNATEnabled) BOOL enableNAT NS_SWIFT_NAME(natEnabled);          // 启用 NAT 穿透
 @property (nonatomic, assign, getter=isHTTPEnabled) BOOL enableHTTP NS_SWIFT_NAME(httpEnabled);         // 启用 HTTP 代理
 @property (nonatomic, assign) uint16_t httpPort;       // HTTP 代理端口
+@property (nonatomic, assign, getter=isFastOpenEnabled) BOOL enableFastOpen NS_SWIFT_NAME(fastOpenEnabled);  // 启用 TCP 快速打开（预编译核心自带的实现，没有黑洞检测，被中间设备丢弃时不会自动回退）
+@property (nonatomic, assign) NSUInteger mtu;          // 到服务器的路径 MTU，UDP 中继按它封包，隧道 MTU 再减去中继开销；0 表示系统默认
 
 // 规则配置
 @property (nonatomic, assign, getter=isRuleEnabled) BOOL enableRule NS_SWIFT_NAME(ruleEnabled);        // 启用规则路由
 @property (nonatomic, copy, nullable) NSString *activeRuleSetName NS_SWIFT_NAME(activeRuleSet);        // 当前激活的规则集名称
 
+// 内存预算配置（字节，0 表示使用默认值）
+// 预编译中继不向预算记账，目前这两个值只用于统计；用带接入点的源码重新编译中继后，才会收缩缓存、暂停读取并拒绝超限分配
+@property (nonatomic, assign) NSUInteger memorySoftLimit;   // 软上限：统计中的压力阈值
+@property (nonatomic, assign) NSUInteger memoryHardLimit;   // 硬上限：统计中的上限
+
 // 初始化方法
 - (instancetype)initWithServer:(NSString *)server 
                         port:(uint16_t)port 
@@ -49,6 +59,9 @@ NS_SWIFT_NAME(TFYConfig)
 // 验证方法
 - (BOOL)validate:(NSError **)error NS_SWIFT_NAME(validate());
 
+// 切换服务器：目标服务器成为主服务器，原主服务器移入备用列表
+- (TFYSSConfig *)configBySwitchingToServer:(NSDictionary<NSString *, id> *)server NS_SWIFT_NAME(switching(toServer:));
+
 @end
 
 NS_ASSUME_NONNULL_END 
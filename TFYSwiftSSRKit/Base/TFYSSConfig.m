@@ -15,8 +15,12 @@
         _enableNAT = NO;
         _enableHTTP = NO;
         _httpPort = 8118;
+        _enableFastOpen = NO;
+        _mtu = 0;
         _enableRule = NO;
         _activeRuleSetName = nil;
+        _memorySoftLimit = 0;
+        _memoryHardLimit = 0;
     }
     return self;
 }
@@ -30,13 +34,18 @@
         if (json[@"password"]) _password = json[@"password"];
         if (json[@"method"]) _method = json[@"method"];
         if (json[@"timeout"]) _timeout = [json[@"timeout"] doubleValue];
+        if ([json[@"servers"] isKindOfClass:[NSArray class]]) _servers = [json[@"servers"] copy];
         if (json[@"local_address"]) _localAddress = json[@"local_address"];
         if (json[@"core_type"]) _preferredCoreType = [json[@"core_type"] integerValue];
         if (json[@"enable_nat"]) _enableNAT = [json[@"enable_nat"] boolValue];
         if (json[@"enable_http"]) _enableHTTP = [json[@"enable_http"] boolValue];
         if (json[@"http_port"]) _httpPort = [json[@"http_port"] unsignedShortValue];
+        if (json[@"fast_open"]) _enableFastOpen = [json[@"fast_open"] boolValue];
+        if (json[@"mtu"]) _mtu = [json[@"mtu"] unsignedIntegerValue];
         if (json[@"enable_rule"]) _enableRule = [json[@"enable_rule"] boolValue];
         if (json[@"active_rule_set"]) _activeRuleSetName = json[@"active_rule_set"];
+        if (json[@"memory_soft_limit"]) _memorySoftLimit = [json[@"memory_soft_limit"] unsignedIntegerValue];
+        if (json[@"memory_hard_limit"]) _memoryHardLimit = [json[@"memory_hard_limit"] unsignedIntegerValue];
     }
     return self;
 }
@@ -50,13 +59,18 @@
     if (_password) json[@"password"] = _password;
     if (_method) json[@"method"] = _method;
     json[@"timeout"] = @(_timeout);
+    if (_servers.count) json[@"servers"] = _servers;
     if (_localAddress) json[@"local_address"] = _localAddress;
     json[@"core_type"] = @(_preferredCoreType);
     json[@"enable_nat"] = @(_enableNAT);
     json[@"enable_http"] = @(_enableHTTP);
     json[@"http_port"] = @(_httpPort);
+    json[@"fast_open"] = @(_enableFastOpen);
+    if (_mtu) json[@"mtu"] = @(_mtu);
     json[@"enable_rule"] = @(_enableRule);
     if (_activeRuleSetName) json[@"active_rule_set"] = _activeRuleSetName;
+    if (_memorySoftLimit) json[@"memory_soft_limit"] = @(_memorySoftLimit);
+    if (_memoryHardLimit) json[@"memory_hard_limit"] = @(_memoryHardLimit);
     
     return [json copy];
 }
@@ -91,6 +105,25 @@
         return NO;
     }
     
+    // 验证多服务器配置，总数不超过 libev 的 MAX_REMOTE_NUM (10)
+    if (_servers.count + 1 > 10) {
+        if (error) {
+            *error = TFYSSErrorWithCodeAndMessage(TFYSSErrorConfigInvalid, @"Too many servers");
+        }
+        return NO;
+    }
+    for (id entry in _servers) {
+        NSDictionary *server = [entry isKindOfClass:[NSDictionary class]] ? entry : nil;
+        NSString *host = server[@"server"];
+        NSInteger port = [server[@"server_port"] integerValue];
+        if (![host isKindOfClass:[NSString class]] || !host.length || port <= 0 || port > 65535) {
+            if (error) {
+                *error = TFYSSErrorWithCodeAndMessage(TFYSSErrorConfigInvalid, @"Invalid server in servers");
+            }
+            return NO;
+        }
+    }
+    
     if (_localPort == 0 || _localPort > 65535) {
         if (error) {
             *error = TFYSSErrorWithCodeAndMessage(TFYSSErrorConfigInvalid, @"Invalid local port");
@@ -105,6 +138,22 @@
         return NO;
     }
     
+    // MTU 为 0（自动）或 576 ~ 9000
+    if (_mtu && (_mtu < 576 || _mtu > 9000)) {
+        if (error) {
+            *error = TFYSSErrorWithCodeAndMessage(TFYSSErrorConfigInvalid, @"Invalid MTU");
+        }
+        return NO;
+    }
+    
+    // 软上限不能高于硬上限
+    if (_memorySoftLimit && _memoryHardLimit && _memorySoftLimit > _memoryHardLimit) {
+        if (error) {
+            *error = TFYSSErrorWithCodeAndMessage(TFYSSErrorConfigInvalid, @"Memory soft limit exceeds hard limit");
+        }
+        return NO;
+    }
+    
     return YES;
 }
 
@@ -116,14 +165,38 @@
     copy.password = [_password copy];
     copy.method = [_method copy];
     copy.timeout = _timeout;
+    copy.servers = [_servers copy];
     copy.localAddress = [_localAddress copy];
     copy.preferredCoreType = _preferredCoreType;
     copy.enableNAT = _enableNAT;
     copy.enableHTTP = _enableHTTP;
     copy.httpPort = _httpPort;
+    copy.enableFastOpen = _enableFastOpen;
+    copy.mtu = _mtu;
     copy.enableRule = _enableRule;
     copy.activeRuleSetName = [_activeRuleSetName copy];
+    copy.memorySoftLimit = _memorySoftLimit;
+    copy.memoryHardLimit = _memoryHardLimit;
     return copy;
 }
 
+- (TFYSSConfig *)configBySwitchingToServer:(NSDictionary<NSString *, id> *)server {
+    TFYSSConfig *switched = [self copy];
+    NSString *host = server[@"server"];
+    uint16_t port = [server[@"server_port"] unsignedShortValue];
+    
+    NSMutableArray *servers = [NSMutableArray arrayWithObject:@{@"server": _serverHost ?: @"", @"server_port": @(_serverPort)}];
+    for (NSDictionary *entry in _servers) {
+        if ([entry[@"server"] isEqual:host] && [entry[@"server_port"] integerValue] == port) {
+            continue;
+        }
+        [servers addObject:entry];
+    }
+    
+    switched.serverHost = host;
+    switched.serverPort = port;
+    switched.servers = servers;
+    return switched;
+}
+
 @end 
\ No newline at end of file
@@ -26,6 +26,8 @@
 
 // 包含 shadowsocks-libev 的头文件
 #include "../shadowsocks-libev/shadowsocks/include/shadowsocks-libev.h"
+#include "../shadowsocks-libev/shadowsocks/include/membudget.h"
+#include "../shadowsocks-libev/shadowsocks/include/pmtu.h"
 #include "../shadowsocks-libev/antinat/include/antinat.h"
 #include "../shadowsocks-libev/privoxy/include/privoxy_api.h"
 
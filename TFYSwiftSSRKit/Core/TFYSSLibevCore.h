@@ -27,6 +27,9 @@ NS_SWIFT_NAME(TFYLibevCore)
 - (BOOL)stop NS_SWIFT_NAME(stop());
 - (void)getTrafficWithUpload:(uint64_t *)upload download:(uint64_t *)download NS_SWIFT_NAME(getTraffic(upload:download:));
 
+// 内存预算统计：已用、峰值、上限、压力状态及各账户明细
+- (NSDictionary<NSString *, id> *)memoryStatistics NS_SWIFT_NAME(memoryStatistics());
+
 // NAT 相关方法
 - (nullable NSDictionary<NSString *, id> *)detectNATType NS_SWIFT_NAME(detectNATType());
 - (BOOL)enableNATTraversal:(NSString *)server 
@@ -108,6 +108,8 @@
     _ssConfig.method = strdup([self.config.method UTF8String]);
     _ssConfig.password = strdup([self.config.password UTF8String]);
     _ssConfig.timeout = (int)self.config.timeout;
+    _ssConfig.fast_open = self.config.isFastOpenEnabled ? 1 : 0;
+    _ssConfig.mtu = (int)self.config.mtu;
     
     // 添加 SSR 特有字段
     if (self.config.isSSR) {
@@ -122,6 +124,13 @@
         }
     }
     
+    // 配置内存预算（预编译中继不记账，目前只影响统计）
+    mem_budget_config_t budget;
+    memset(&budget, 0, sizeof(mem_budget_config_t));
+    budget.soft_limit = self.config.memorySoftLimit;
+    budget.hard_limit = self.config.memoryHardLimit;
+    mem_budget_configure(&budget);
+    
     // 启动 shadowsocks
     int result = shadowsocks_start(&_ssConfig);
     if (result != 0) {
@@ -198,6 +207,35 @@
     if (download) *download = _downloadTraffic;
 }
 
+- (NSDictionary<NSString *, id> *)memoryStatistics {
+    mem_budget_stats_t stats;
+    mem_budget_stats(&stats);
+    
+    NSMutableArray *accounts = [NSMutableArray arrayWithCapacity:stats.accounts];
+    for (int i = 0; i < stats.accounts; i++) {
+        mem_account_stats_t *account = &stats.account[i];
+        [accounts addObject:@{
+            @"name": account->name ? @(account->name) : @"",
+            @"used": @(account->used),
+            @"peak": @(account->peak),
+            @"denied": @(account->denied),
+            @"shrunk": @(account->shrunk)
+        }];
+    }
+    
+    return @{
+        @"used": @(stats.used),
+        @"peak": @(stats.peak),
+        @"softLimit": @(stats.soft_limit),
+        @"hardLimit": @(stats.hard_limit),
+        @"underPressure": @(stats.level == MEM_BUDGET_PRESSURE),
+        @"pressureEvents": @(stats.pressure_events),
+        @"denied": @(stats.denied),
+        @"pausedReaders": @(stats.paused_readers),
+        @"accounts": accounts
+    };
+}
+
 #pragma mark - NAT Methods
 
 - (NSDictionary<NSString *, id> *)detectNATType {
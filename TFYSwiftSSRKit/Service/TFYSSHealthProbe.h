@@ -0,0 +1,66 @@
+#import <Foundation/Foundation.h>
+#import "TFYSSConfig.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+/**
+ * 服务器健康探测
+ * 周期性向每个服务器发起一次完整的 Shadowsocks 请求：AEAD 加密方法下用配置的密钥经服务器请求
+ * probeTarget，收到并解密出服务器的第一个应答块才算成功，RTT 为请求发出到应答解密的时间；
+ * 其他加密方法只测量 TCP 连接。间隔带随机抖动，连续失败时指数退避。
+ * 健康分取值 0~1：成功率 × min(1, 目标RTT / 平滑RTT)，未探测过的服务器为 1。
+ * 须在隧道提供者进程中使用，并把所有服务器排除在隧道路由之外，否则探测会经过隧道本身。
+ * 所有方法都必须在初始化时传入的队列上调用。
+ */
+@interface TFYSSHealthProbe : NSObject
+
+// 探测间隔（秒），默认 30
+@property (nonatomic, assign) NSTimeInterval interval;
+
+// 退避后的最长间隔（秒），默认 600
+@property (nonatomic, assign) NSTimeInterval maxInterval;
+
+// 单次探测超时（秒），默认 5
+@property (nonatomic, assign) NSTimeInterval timeout;
+
+// 达到满分的 RTT（秒），默认 0.5
+@property (nonatomic, assign) NSTimeInterval targetRTT;
+
+// 健康分低于该值时考虑切换服务器，默认 0.5
+@property (nonatomic, assign) double healthyScore;
+
+// 备用服务器健康分至少高出该值才切换，避免来回切换，默认 0.2
+@property (nonatomic, assign) double switchMargin;
+
+// 经服务器请求的目标，默认 www.gstatic.com:80 上的 HEAD /generate_204
+@property (nonatomic, copy) NSString *probeTarget;
+@property (nonatomic, assign) uint16_t probeTargetPort;
+
+- (instancetype)initWithQueue:(dispatch_queue_t)queue NS_DESIGNATED_INITIALIZER;
+- (instancetype)init NS_UNAVAILABLE;
+
+// 开始探测配置中的主服务器和 servers 中的所有服务器
+- (void)startWithConfig:(TFYSSConfig *)config;
+
+// 停止所有探测并清空结果
+- (void)stop;
+
+// 立即探测一个服务器，正在探测或距上次探测不足 1 秒时忽略
+- (void)probeHost:(NSString *)host port:(uint16_t)port;
+
+// 服务器健康分，不在探测列表中的服务器为 0
+- (double)healthForHost:(NSString *)host port:(uint16_t)port;
+
+// 连续探测失败 3 次及以上视为不可用
+- (BOOL)isDownHost:(NSString *)host port:(uint16_t)port;
+
+/**
+ * 故障切换决策，返回 @{@"server": 地址, @"server_port": 端口}
+ * 当前服务器健康时返回当前服务器；否则返回健康分高出 switchMargin 的最佳备用服务器，
+ * 没有时当前服务器只是变慢则仍返回当前服务器，已不可用则返回 nil，只能重连
+ */
+- (nullable NSDictionary<NSString *, id> *)failoverServerFromHost:(NSString *)host port:(uint16_t)port;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,380 @@
+#import "TFYSSHealthProbe.h"
+#import <Network/Network.h>
+
+#include "../shadowsocks-libev/shadowsocks/include/probeaead.h"
+
+// EWMA 中新样本的权重
+static const double kTFYSSProbeAlpha = 0.3;
+// 探测间隔的随机抖动比例
+static const double kTFYSSProbeJitter = 0.2;
+// 手动触发探测的最小间隔（秒）
+static const NSTimeInterval kTFYSSProbeMinGap = 1.0;
+// 连续失败多少次视为不可用
+static const NSInteger kTFYSSProbeDownFailures = 3;
+// 经服务器请求的内容，服务器应答的第一个块即可判定
+static NSString * const kTFYSSProbeRequest = @"HEAD /generate_204 HTTP/1.1\r\nHost: %@\r\nConnection: close\r\n\r\n";
+
+@interface TFYSSProbeTarget : NSObject
+
+@property (nonatomic, copy) NSString *host;
+@property (nonatomic, assign) uint16_t port;
+@property (nonatomic, strong, nullable) nw_connection_t connection;
+@property (nonatomic, strong, nullable) dispatch_source_t timer;
+@property (nonatomic, assign) NSTimeInterval startTime;
+@property (nonatomic, assign, nullable) void *reply;
+@property (nonatomic, assign) NSTimeInterval finishTime;
+@property (nonatomic, assign) BOOL probed;
+@property (nonatomic, assign) double success;
+@property (nonatomic, assign) double rtt;
+@property (nonatomic, assign) NSInteger failures;
+
+@end
+
+@implementation TFYSSProbeTarget
+@end
+
+@interface TFYSSHealthProbe () {
+    dispatch_queue_t _queue;
+    probe_aead_t _aead;
+    BOOL _aeadEnabled;
+}
+
+// 按添加顺序排列，第一个为主服务器
+@property (nonatomic, strong) NSMutableArray<TFYSSProbeTarget *> *targets;
+
+@end
+
+@implementation TFYSSHealthProbe
+
+- (instancetype)initWithQueue:(dispatch_queue_t)queue {
+    self = [super init];
+    if (self) {
+        _queue = queue;
+        _interval = 30;
+        _maxInterval = 600;
+        _timeout = 5;
+        _targetRTT = 0.5;
+        _healthyScore = 0.5;
+        _switchMargin = 0.2;
+        _probeTarget = @"www.gstatic.com";
+        _probeTargetPort = 80;
+        _targets = [NSMutableArray array];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [self stop];
+}
+
+#pragma mark - Public Methods
+
+- (void)startWithConfig:(TFYSSConfig *)config {
+    [self stop];
+    [self setupHandshakeWithConfig:config];
+
+    if (config.serverHost.length > 0) {
+        [self addTargetWithHost:config.serverHost port:config.serverPort];
+    }
+    for (NSDictionary *server in config.servers) {
+        NSString *host = server[@"server"];
+        uint16_t port = (uint16_t)[server[@"server_port"] integerValue];
+        if ([host isKindOfClass:[NSString class]] && host.length > 0 && port > 0) {
+            [self addTargetWithHost:host port:port];
+        }
+    }
+
+    // 首次探测尽快进行，但各服务器错开
+    for (TFYSSProbeTarget *target in self.targets) {
+        [self scheduleTarget:target after:self.interval * kTFYSSProbeJitter * arc4random_uniform(1001) / 1000.0];
+    }
+}
+
+- (void)stop {
+    for (TFYSSProbeTarget *target in self.targets) {
+        if (target.connection) {
+            nw_connection_cancel(target.connection);
+            target.connection = nil;
+        }
+        [self releaseReplyOfTarget:target];
+        if (target.timer) {
+            dispatch_source_cancel(target.timer);
+            target.timer = nil;
+        }
+    }
+    [self.targets removeAllObjects];
+    
+    if (_aeadEnabled) {
+        probe_aead_release(&_aead);
+        _aeadEnabled = NO;
+    }
+}
+
+- (void)probeHost:(NSString *)host port:(uint16_t)port {
+    TFYSSProbeTarget *target = [self targetWithHost:host port:port];
+    if (!target || target.connection) {
+        return;
+    }
+    if (target.probed && [self now] - target.finishTime < kTFYSSProbeMinGap) {
+        return;
+    }
+    [self runProbe:target];
+}
+
+- (double)healthForHost:(NSString *)host port:(uint16_t)port {
+    TFYSSProbeTarget *target = [self targetWithHost:host port:port];
+    return target ? [self healthOfTarget:target] : 0;
+}
+
+- (BOOL)isDownHost:(NSString *)host port:(uint16_t)port {
+    TFYSSProbeTarget *target = [self targetWithHost:host port:port];
+    return target && target.failures >= kTFYSSProbeDownFailures;
+}
+
+- (NSDictionary<NSString *, id> *)failoverServerFromHost:(NSString *)host port:(uint16_t)port {
+    NSUInteger count = self.targets.count;
+    TFYSSProbeTarget *current = [self targetWithHost:host port:port];
+    if (!current) {
+        return nil;
+    }
+    
+    double health[count];
+    int down[count];
+    for (NSUInteger i = 0; i < count; i++) {
+        health[i] = [self healthOfTarget:self.targets[i]];
+        down[i] = self.targets[i].failures >= kTFYSSProbeDownFailures;
+    }
+    
+    int index = probe_failover(health, down, (int)count, (int)[self.targets indexOfObject:current],
+                               self.healthyScore, self.switchMargin);
+    if (index < 0) {
+        return nil;
+    }
+    TFYSSProbeTarget *target = self.targets[index];
+    return @{@"server": target.host, @"server_port": @(target.port)};
+}
+
+#pragma mark - Private Methods
+
+- (NSTimeInterval)now {
+    return [NSProcessInfo processInfo].systemUptime;
+}
+
+/**
+ * 按配置准备 AEAD 握手
+ * 主密钥与服务器一样由密码派生，所有服务器共用同一密码
+ */
+- (void)setupHandshakeWithConfig:(TFYSSConfig *)config {
+    NSDictionary<NSString *, NSArray<NSNumber *> *> *methods = @{
+        @"aes-128-gcm": @[@(AES_128_GCM), @16],
+        @"aes-192-gcm": @[@(AES_192_GCM), @24],
+        @"aes-256-gcm": @[@(AES_256_GCM), @32],
+        @"chacha20-ietf-poly1305": @[@(CHACHA20_IETF_POLY1305), @32],
+    };
+    NSArray<NSNumber *> *method = config.method ? methods[config.method.lowercaseString] : nil;
+    if (!method || config.password.length == 0) {
+        NSLog(@"加密方法 %@ 不支持握手探测，只探测 TCP 连接", config.method);
+        return;
+    }
+    
+    uint8_t key[32];
+    size_t keyLength = method[1].unsignedIntegerValue;
+    crypto_derive_key(config.password.UTF8String, key, keyLength);
+    
+    NSData *payload = [[NSString stringWithFormat:kTFYSSProbeRequest, self.probeTarget] dataUsingEncoding:NSUTF8StringEncoding];
+    _aeadEnabled = probe_aead_init(&_aead, method[0].intValue, key, keyLength,
+                                   self.probeTarget.UTF8String, self.probeTargetPort,
+                                   payload.bytes, payload.length) == 0;
+    sodium_memzero(key, sizeof(key));
+}
+
+- (void)releaseReplyOfTarget:(TFYSSProbeTarget *)target {
+    if (target.reply) {
+        probe_aead_free(&_aead, target.reply);
+        target.reply = NULL;
+    }
+}
+
+- (void)addTargetWithHost:(NSString *)host port:(uint16_t)port {
+    if ([self targetWithHost:host port:port]) {
+        return;
+    }
+
+    TFYSSProbeTarget *target = [[TFYSSProbeTarget alloc] init];
+    target.host = host;
+    target.port = port;
+    target.timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+
+    __weak typeof(self) weakSelf = self;
+    __weak TFYSSProbeTarget *weakTarget = target;
+    dispatch_source_set_event_handler(target.timer, ^{
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        TFYSSProbeTarget *strongTarget = weakTarget;
+        if (!strongSelf || !strongTarget) {
+            return;
+        }
+        if (strongTarget.connection) {
+            // 探测超时
+            [strongSelf finishProbe:strongTarget success:NO];
+        } else {
+            [strongSelf runProbe:strongTarget];
+        }
+    });
+    dispatch_source_set_timer(target.timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+    dispatch_resume(target.timer);
+
+    [self.targets addObject:target];
+}
+
+- (nullable TFYSSProbeTarget *)targetWithHost:(NSString *)host port:(uint16_t)port {
+    for (TFYSSProbeTarget *target in self.targets) {
+        if (target.port == port && [target.host isEqualToString:host]) {
+            return target;
+        }
+    }
+    return nil;
+}
+
+- (double)healthOfTarget:(TFYSSProbeTarget *)target {
+    if (!target.probed) {
+        return 1.0;
+    }
+    if (target.rtt <= self.targetRTT) {
+        return target.success;
+    }
+    return target.success * self.targetRTT / target.rtt;
+}
+
+- (void)scheduleTarget:(TFYSSProbeTarget *)target after:(NSTimeInterval)delay {
+    dispatch_source_set_timer(target.timer,
+                              dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)),
+                              DISPATCH_TIME_FOREVER,
+                              (int64_t)(0.1 * NSEC_PER_SEC));
+}
+
+/**
+ * 下次探测的延迟
+ * 连续失败 n 次后为 interval × 2^n，不超过 maxInterval，再加上随机抖动
+ */
+- (NSTimeInterval)nextDelayForTarget:(TFYSSProbeTarget *)target {
+    NSTimeInterval delay = self.interval * pow(2, MIN(target.failures, 16));
+    delay = MIN(delay, MAX(self.maxInterval, self.interval));
+    double spread = kTFYSSProbeJitter * (2.0 * arc4random_uniform(1001) / 1000.0 - 1.0);
+    return delay * (1.0 + spread);
+}
+
+- (void)runProbe:(TFYSSProbeTarget *)target {
+    NSString *port = [NSString stringWithFormat:@"%u", target.port];
+    nw_endpoint_t endpoint = nw_endpoint_create_host(target.host.UTF8String, port.UTF8String);
+    nw_parameters_t parameters = nw_parameters_create_secure_tcp(NW_PARAMETERS_DISABLE_PROTOCOL,
+                                                                 NW_PARAMETERS_DEFAULT_CONFIGURATION);
+    nw_connection_t connection = nw_connection_create(endpoint, parameters);
+
+    target.connection = connection;
+    target.startTime = [self now];
+
+    __weak typeof(self) weakSelf = self;
+    __weak TFYSSProbeTarget *weakTarget = target;
+    nw_connection_set_queue(connection, _queue);
+    nw_connection_set_state_changed_handler(connection, ^(nw_connection_state_t state, nw_error_t _Nullable error) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        TFYSSProbeTarget *strongTarget = weakTarget;
+        if (!strongSelf || !strongTarget || strongTarget.connection != connection) {
+            return;
+        }
+        switch (state) {
+            case nw_connection_state_ready:
+                if (strongSelf->_aeadEnabled) {
+                    [strongSelf sendRequestToTarget:strongTarget];
+                } else {
+                    [strongSelf finishProbe:strongTarget success:YES];
+                }
+                break;
+            case nw_connection_state_waiting:
+            case nw_connection_state_failed:
+                [strongSelf finishProbe:strongTarget success:NO];
+                break;
+            default:
+                break;
+        }
+    });
+    nw_connection_start(connection);
+
+    [self scheduleTarget:target after:self.timeout];
+}
+
+/**
+ * 连接建立后发送请求，RTT 改为从请求发出算起
+ */
+- (void)sendRequestToTarget:(TFYSSProbeTarget *)target {
+    char buf[PROBE_AEAD_MAX_REQUEST + 128];
+    void *reply = NULL;
+    ssize_t length = probe_aead_request(&_aead, 0, buf, sizeof(buf), &reply);
+    if (length < 0) {
+        [self finishProbe:target success:NO];
+        return;
+    }
+    
+    target.reply = reply;
+    target.startTime = [self now];
+    
+    dispatch_data_t content = dispatch_data_create(buf, (size_t)length, _queue, DISPATCH_DATA_DESTRUCTOR_DEFAULT);
+    nw_connection_send(target.connection, content, NW_CONNECTION_DEFAULT_MESSAGE_CONTEXT, true, ^(nw_error_t _Nullable error) {
+        // 发送失败时连接状态会变为 failed
+    });
+    [self receiveReplyFromTarget:target connection:target.connection];
+}
+
+- (void)receiveReplyFromTarget:(TFYSSProbeTarget *)target connection:(nw_connection_t)connection {
+    __weak typeof(self) weakSelf = self;
+    __weak TFYSSProbeTarget *weakTarget = target;
+    nw_connection_receive(connection, 1, UINT32_MAX, ^(dispatch_data_t _Nullable content, nw_content_context_t _Nullable context, bool isComplete, nw_error_t _Nullable error) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        TFYSSProbeTarget *strongTarget = weakTarget;
+        if (!strongSelf || !strongTarget || strongTarget.connection != connection) {
+            return;
+        }
+        
+        __block int result = 0;
+        if (content) {
+            dispatch_data_apply(content, ^bool(dispatch_data_t region, size_t offset, const void *buffer, size_t size) {
+                result = probe_aead_response(&strongSelf->_aead, strongTarget.reply, buffer, size);
+                return result == 0;
+            });
+        }
+        
+        if (result != 0) {
+            [strongSelf finishProbe:strongTarget success:result > 0];
+        } else if (error || isComplete) {
+            // 应答解密前连接就结束了
+            [strongSelf finishProbe:strongTarget success:NO];
+        } else {
+            [strongSelf receiveReplyFromTarget:strongTarget connection:connection];
+        }
+    });
+}
+
+- (void)finishProbe:(TFYSSProbeTarget *)target success:(BOOL)success {
+    NSTimeInterval now = [self now];
+    NSTimeInterval rtt = now - target.startTime;
+
+    nw_connection_cancel(target.connection);
+    target.connection = nil;
+    [self releaseReplyOfTarget:target];
+
+    double sample = success ? 1.0 : 0.0;
+    target.success = target.probed ? target.success + kTFYSSProbeAlpha * (sample - target.success) : sample;
+    if (success) {
+        target.rtt = target.probed && target.rtt > 0 ? target.rtt + kTFYSSProbeAlpha * (rtt - target.rtt) : rtt;
+        target.failures = 0;
+    } else {
+        target.failures++;
+        NSLog(@"服务器 %@:%u 探测失败，连续失败 %ld 次", target.host, target.port, (long)target.failures);
+    }
+    target.probed = YES;
+    target.finishTime = now;
+
+    [self scheduleTarget:target after:[self nextDelayForTarget:target]];
+}
+
+@end
@@ -2,7 +2,13 @@
 #import "TFYSSCoreFactory.h"
 #import "TFYSSError.h"
 #import "TFYSSLibevCore+Private.h"
+#import "TFYSSHealthProbe.h"
 #import <NetworkExtension/NetworkExtension.h>
+#import <Network/Network.h>
+#include <arpa/inet.h>
+
+// 健康检查间隔（秒）
+static const NSTimeInterval kTFYSSHealthCheckInterval = 15;
 
 @interface TFYSSPacketTunnelProvider ()
 
@@ -12,19 +18,21 @@
 @property (nonatomic, assign) uint64_t downloadTraffic;
 @property (nonatomic, strong) dispatch_source_t trafficTimer;
 @property (nonatomic, assign) BOOL tunnelActive;
+@property (nonatomic, strong, nullable) TFYSSHealthProbe *healthProbe;
+@property (nonatomic, strong, nullable) dispatch_source_t healthTimer;
 
 @end
 
 @implementation TFYSSPacketTunnelProvider
 
 - (void)startTunnelWithOptions:(NSDictionary<NSString *,NSObject *> *)options completionHandler:(void (^)(NSError * _Nullable))completionHandler {
-    // 从 options 中获取配置
-    NSData *configData = options[@"config"];
-    if (!configData) {
-        // 如果没有直接传递配置数据，尝试从 providerConfiguration 中获取配置
-        NETunnelProviderProtocol *protocol = (NETunnelProviderProtocol *)self.protocolConfiguration;
-        NSDictionary *providerConfig = protocol.providerConfiguration;
-        if (providerConfig) {
+    // 配置以 TFYSSConfig 的 JSON 字典传递，优先取 options，其次取 providerConfiguration
+    NETunnelProviderProtocol *protocol = (NETunnelProviderProtocol *)self.protocolConfiguration;
+    NSDictionary *providerConfig = protocol.providerConfiguration;
+    NSDictionary *json = (NSDictionary *)options[@"config"] ?: providerConfig[@"config"];
+    if (!json) {
+        // 旧版本按字段保存的配置
+        if (providerConfig[@"serverHost"]) {
             // 从 providerConfiguration 创建配置对象
             TFYSSConfig *config = [[TFYSSConfig alloc] init];
             config.serverHost = providerConfig[@"serverHost"];
@@ -48,14 +56,9 @@
         return;
     }
     
-    // 反序列化配置
-    NSError *unarchiveError = nil;
-    TFYSSConfig *config = [NSKeyedUnarchiver unarchivedObjectOfClass:[TFYSSConfig class] fromData:configData error:&unarchiveError];
+    TFYSSConfig *config = [json isKindOfClass:[NSDictionary class]] ? [[TFYSSConfig alloc] initWithJSON:json] : nil;
     if (!config) {
-        NSError *error = [NSError errorWithDomain:TFYSSErrorDomain code:TFYSSErrorConfigInvalid userInfo:@{
-            NSLocalizedDescriptionKey: @"Invalid configuration data",
-            NSUnderlyingErrorKey: unarchiveError ?: [NSError errorWithDomain:TFYSSErrorDomain code:TFYSSErrorConfigInvalid userInfo:nil]
-        }];
+        NSError *error = [NSError errorWithDomain:TFYSSErrorDomain code:TFYSSErrorConfigInvalid userInfo:@{NSLocalizedDescriptionKey: @"Invalid configuration data"}];
         completionHandler(error);
         return;
     }
@@ -127,6 +130,9 @@
         // 设置隧道状态为活跃
         self.tunnelActive = YES;
         
+        // 探测服务器健康状态，必要时故障切换
+        [self startHealthCheck];
+        
         completionHandler(nil);
     }];
 }
@@ -138,6 +144,9 @@
         self.trafficTimer = nil;
     }
     
+    // 停止健康检查
+    [self stopHealthCheck];
+    
     // 停止 Shadowsocks 代理
     if (self.ssCore) {
         [self.ssCore stop];
@@ -172,53 +181,36 @@
         uint64_t upload = 0, download = 0;
         [self getTrafficWithUpload:&upload download:&download];
         
-        NSDictionary *response = @{
+        NSMutableDictionary *response = [NSMutableDictionary dictionaryWithDictionary:@{
             @"upload": @(upload),
             @"download": @(download)
-        };
+        }];
+        
+        // 故障切换后应用据此同步当前服务器
+        if (self.currentConfig.serverHost) {
+            response[@"server"] = self.currentConfig.serverHost;
+            response[@"server_port"] = @(self.currentConfig.serverPort);
+        }
         
         NSData *responseData = [NSJSONSerialization dataWithJSONObject:response options:0 error:nil];
         completionHandler(responseData);
     } else if ([command isEqualToString:@"updateConfig"]) {
-        // 更新配置
-        NSData *configData = message[@"config"];
-        if (configData) {
-            TFYSSConfig *config = [NSKeyedUnarchiver unarchivedObjectOfClass:[TFYSSConfig class] fromData:configData error:nil];
-            if (config) {
-                // 停止当前连接
-                [self.ssCore stop];
-                
-                // 如果启用了 HTTP 代理，停止 Privoxy
-                if (self.currentConfig.enableHTTP) {
-                    ss_privoxy_stop();
-                }
-                
-                // 启动新连接
-                NSError *startError = nil;
-                if ([self.ssCore startWithConfig:config error:&startError]) {
-                    self.currentConfig = config;
-                    
-                    // 如果启用了 HTTP 代理，启动 Privoxy
-                    if (config.enableHTTP) {
-                        privoxy_config_t privoxyConfig;
-                        privoxyConfig.socks5_address = [config.localAddress UTF8String];
-                        privoxyConfig.socks5_port = config.localPort;
-                        privoxyConfig.listen_address = "127.0.0.1";
-                        privoxyConfig.listen_port = config.httpPort;
-                        ss_privoxy_start(&privoxyConfig);
-                    }
-                    
-                    NSDictionary *response = @{@"status": @"success"};
-                    NSData *responseData = [NSJSONSerialization dataWithJSONObject:response options:0 error:nil];
-                    completionHandler(responseData);
-                    return;
-                }
-            }
+        // 更新配置，配置为 TFYSSConfig 的 JSON 字典
+        NSDictionary *json = message[@"config"];
+        TFYSSConfig *config = [json isKindOfClass:[NSDictionary class]] ? [[TFYSSConfig alloc] initWithJSON:json] : nil;
+        if (!config) {
+            NSDictionary *response = @{@"status": @"failed"};
+            completionHandler([NSJSONSerialization dataWithJSONObject:response options:0 error:nil]);
+            return;
         }
         
-        NSDictionary *response = @{@"status": @"failed"};
-        NSData *responseData = [NSJSONSerialization dataWithJSONObject:response options:0 error:nil];
-        completionHandler(responseData);
+        [self updateConfig:config completionHandler:^(NSError * _Nullable error) {
+            if (error) {
+                NSLog(@"更新配置失败: %@", error.localizedDescription);
+            }
+            NSDictionary *response = @{@"status": error ? @"failed" : @"success"};
+            completionHandler([NSJSONSerialization dataWithJSONObject:response options:0 error:nil]);
+        }];
     } else {
         completionHandler(nil);
     }
@@ -239,6 +231,19 @@
 #pragma mark - Private Methods
 
 - (void)setupTunnelNetworkSettings:(TFYSSConfig *)config completionHandler:(void (^)(NSError * _Nullable))completionHandler {
+    // 先解析服务器地址，得到要排除的路由
+    [self excludedRoutesForConfig:config completionHandler:^(NSArray<NEIPv4Route *> *ipv4Routes, NSArray<NEIPv6Route *> *ipv6Routes) {
+        [self setupTunnelNetworkSettings:config
+                      ipv4ExcludedRoutes:ipv4Routes
+                      ipv6ExcludedRoutes:ipv6Routes
+                       completionHandler:completionHandler];
+    }];
+}
+
+- (void)setupTunnelNetworkSettings:(TFYSSConfig *)config
+                ipv4ExcludedRoutes:(NSArray<NEIPv4Route *> *)ipv4Routes
+                ipv6ExcludedRoutes:(NSArray<NEIPv6Route *> *)ipv6Routes
+                 completionHandler:(void (^)(NSError * _Nullable))completionHandler {
     // 创建 VPN 隧道网络设置
     NEPacketTunnelNetworkSettings *settings = [[NEPacketTunnelNetworkSettings alloc] initWithTunnelRemoteAddress:config.serverHost];
     
@@ -247,11 +252,24 @@
     dnsSettings.matchDomains = @[@""];
     settings.DNSSettings = dnsSettings;
     
-    // 配置 IPv4 设置
+    // 配置 IPv4 设置，所有服务器都不经过隧道，故障切换和健康探测才能直连备用服务器
     NEIPv4Settings *ipv4Settings = [[NEIPv4Settings alloc] initWithAddresses:@[@"192.168.1.1"] subnetMasks:@[@"255.255.255.0"]];
     ipv4Settings.includedRoutes = @[[NEIPv4Route defaultRoute]];
+    ipv4Settings.excludedRoutes = ipv4Routes;
     settings.IPv4Settings = ipv4Settings;
     
+    // 配置 IPv6 设置，与 IPv4 相同，IPv6 服务器也不经过隧道
+    NEIPv6Settings *ipv6Settings = [[NEIPv6Settings alloc] initWithAddresses:@[@"fd00:1::1"] networkPrefixLengths:@[@64]];
+    ipv6Settings.includedRoutes = @[[NEIPv6Route defaultRoute]];
+    ipv6Settings.excludedRoutes = ipv6Routes;
+    settings.IPv6Settings = ipv6Settings;
+    
+    // 配置的 MTU 是到服务器的路径 MTU，隧道 MTU 要再减去外层报头和中继的封装开销
+    if (config.mtu > 0) {
+        int family = [config.serverHost containsString:@":"] ? AF_INET6 : AF_INET;
+        settings.MTU = @(pmtu_tunnel_mtu_for(config.mtu, family));
+    }
+    
     // 配置代理设置
     NEProxySettings *proxySettings = [[NEProxySettings alloc] init];
     
@@ -301,6 +319,137 @@ function FindProxyForURL(url, host) {\
     [self setTunnelNetworkSettings:settings completionHandler:completionHandler];
 }
 
+/**
+ * 所有服务器的 IPv4 和 IPv6 地址路由
+ * 主机名在隧道建立前解析，此时 DNS 不经过隧道
+ * getaddrinfo 会阻塞，在后台队列解析，结果回到主队列
+ */
+- (void)excludedRoutesForConfig:(TFYSSConfig *)config completionHandler:(void (^)(NSArray<NEIPv4Route *> *ipv4Routes, NSArray<NEIPv6Route *> *ipv6Routes))completionHandler {
+    NSMutableArray<NSString *> *hosts = [NSMutableArray array];
+    if (config.serverHost.length > 0) {
+        [hosts addObject:config.serverHost];
+    }
+    for (NSDictionary *server in config.servers) {
+        NSString *host = server[@"server"];
+        if ([host isKindOfClass:[NSString class]] && host.length > 0) {
+            [hosts addObject:host];
+        }
+    }
+    
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+        NSMutableOrderedSet<NSString *> *ipv4Addresses = [NSMutableOrderedSet orderedSet];
+        NSMutableOrderedSet<NSString *> *ipv6Addresses = [NSMutableOrderedSet orderedSet];
+        for (NSString *host in hosts) {
+            struct addrinfo hints = {0};
+            struct addrinfo *result = NULL;
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            if (getaddrinfo(host.UTF8String, NULL, &hints, &result) != 0) {
+                NSLog(@"解析服务器 %@ 失败，不排除其路由", host);
+                continue;
+            }
+            for (struct addrinfo *ai = result; ai; ai = ai->ai_next) {
+                char address[INET6_ADDRSTRLEN];
+                if (ai->ai_family == AF_INET) {
+                    struct sockaddr_in *sin = (struct sockaddr_in *)ai->ai_addr;
+                    if (inet_ntop(AF_INET, &sin->sin_addr, address, sizeof(address))) {
+                        [ipv4Addresses addObject:@(address)];
+                    }
+                } else if (ai->ai_family == AF_INET6) {
+                    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ai->ai_addr;
+                    if (inet_ntop(AF_INET6, &sin6->sin6_addr, address, sizeof(address))) {
+                        [ipv6Addresses addObject:@(address)];
+                    }
+                }
+            }
+            freeaddrinfo(result);
+        }
+        
+        NSMutableArray<NEIPv4Route *> *ipv4Routes = [NSMutableArray array];
+        for (NSString *address in ipv4Addresses) {
+            [ipv4Routes addObject:[[NEIPv4Route alloc] initWithDestinationAddress:address subnetMask:@"255.255.255.255"]];
+        }
+        NSMutableArray<NEIPv6Route *> *ipv6Routes = [NSMutableArray array];
+        for (NSString *address in ipv6Addresses) {
+            [ipv6Routes addObject:[[NEIPv6Route alloc] initWithDestinationAddress:address networkPrefixLength:@128]];
+        }
+        
+        dispatch_async(dispatch_get_main_queue(), ^{
+            completionHandler(ipv4Routes, ipv6Routes);
+        });
+    });
+}
+
+/**
+ * 启动服务器健康检查
+ * 探测在隧道提供者进程中进行，服务器路由已排除在隧道之外
+ */
+- (void)startHealthCheck {
+    [self stopHealthCheck];
+    if (!self.currentConfig) {
+        return;
+    }
+    
+    dispatch_queue_t queue = dispatch_get_main_queue();
+    self.healthProbe = [[TFYSSHealthProbe alloc] initWithQueue:queue];
+    [self.healthProbe startWithConfig:self.currentConfig];
+    
+    self.healthTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+    dispatch_source_set_timer(self.healthTimer,
+                              dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kTFYSSHealthCheckInterval * NSEC_PER_SEC)),
+                              (int64_t)(kTFYSSHealthCheckInterval * NSEC_PER_SEC),
+                              (int64_t)(1 * NSEC_PER_SEC));
+    
+    __weak typeof(self) weakSelf = self;
+    dispatch_source_set_event_handler(self.healthTimer, ^{
+        [weakSelf checkServerHealth];
+    });
+    dispatch_resume(self.healthTimer);
+}
+
+- (void)stopHealthCheck {
+    if (self.healthTimer) {
+        dispatch_source_cancel(self.healthTimer);
+        self.healthTimer = nil;
+    }
+    [self.healthProbe stop];
+    self.healthProbe = nil;
+}
+
+/**
+ * 检查服务器健康状态
+ * 当前服务器健康分偏低时切换到明显更健康的备用服务器；
+ * 当前服务器已不可用且没有可切换的服务器时断开隧道，由应用决定是否重连
+ */
+- (void)checkServerHealth {
+    TFYSSConfig *config = self.currentConfig;
+    if (!self.tunnelActive || !config) {
+        return;
+    }
+    
+    NSString *host = config.serverHost;
+    uint16_t port = config.serverPort;
+    NSDictionary *server = [self.healthProbe failoverServerFromHost:host port:port];
+    if (!server) {
+        NSLog(@"服务器 %@:%u 连续探测失败，且没有可用的备用服务器", host, port);
+        [self stopHealthCheck];
+        [self cancelTunnelWithError:[NSError errorWithDomain:TFYSSErrorDomain code:TFYSSErrorServerUnreachable userInfo:@{NSLocalizedDescriptionKey: @"All servers are unreachable"}]];
+        return;
+    }
+    if ([server[@"server"] isEqualToString:host] && [server[@"server_port"] unsignedShortValue] == port) {
+        return;
+    }
+    
+    NSLog(@"服务器 %@:%u 健康分 %.2f，切换到 %@:%@", host, port,
+          [self.healthProbe healthForHost:host port:port], server[@"server"], server[@"server_port"]);
+    // 服务器列表不变，探测结果继续沿用
+    [self applyConfig:[config configBySwitchingToServer:server] completionHandler:^(NSError * _Nullable error) {
+        if (error) {
+            NSLog(@"切换服务器失败: %@", error.localizedDescription);
+        }
+    }];
+}
+
 - (void)setupTrafficTimer {
     dispatch_queue_t queue = dispatch_get_main_queue();
     self.trafficTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
@@ -340,6 +489,19 @@ function FindProxyForURL(url, host) {\
 }
 
 - (void)updateConfig:(TFYSSConfig *)config completionHandler:(void (^)(NSError * _Nullable error))completionHandler NS_SWIFT_NAME(update(config:completionHandler:)) {
+    [self applyConfig:config completionHandler:^(NSError * _Nullable error) {
+        // 服务器列表可能已变化，重新开始探测
+        if (!error && self.tunnelActive) {
+            [self startHealthCheck];
+        }
+        completionHandler(error);
+    }];
+}
+
+/**
+ * 以新配置重启代理并更新隧道网络设置
+ */
+- (void)applyConfig:(TFYSSConfig *)config completionHandler:(void (^)(NSError * _Nullable error))completionHandler {
     // 停止当前连接
     if (self.ssCore) {
         [self.ssCore stop];
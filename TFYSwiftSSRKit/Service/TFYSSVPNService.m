@@ -6,7 +6,6 @@
     dispatch_queue_t _queue;
     dispatch_source_t _trafficTimer;
     dispatch_source_t _connectionTimeoutTimer;
-    dispatch_source_t _connectionHealthTimer;
     dispatch_source_t _reconnectTimer;
 }
 
@@ -263,23 +262,10 @@
         if (self.state == TFYSSVPNStateConnected && self.tunnelManager && self.tunnelManager.connection) {
             NETunnelProviderSession *session = (NETunnelProviderSession *)self.tunnelManager.connection;
             
-            // 将配置序列化为 NSData
-            NSError *archiveError = nil;
-            NSData *configData = [NSKeyedArchiver archivedDataWithRootObject:config requiringSecureCoding:YES error:&archiveError];
-            
-            if (archiveError || !configData) {
-                NSError *error = [NSError errorWithDomain:TFYSSErrorDomain code:TFYSSErrorConfigInvalid userInfo:@{
-                    NSLocalizedDescriptionKey: @"Failed to serialize configuration",
-                    NSUnderlyingErrorKey: archiveError ?: [NSError errorWithDomain:TFYSSErrorDomain code:TFYSSErrorConfigInvalid userInfo:nil]
-                }];
-                if (completion) completion(error);
-                return;
-            }
-            
-            // 发送消息给 PacketTunnelProvider 更新配置
+            // 发送消息给 PacketTunnelProvider 更新配置，配置以 JSON 字典传递
             NSDictionary *message = @{
                 @"command": @"updateConfig",
-                @"config": configData
+                @"config": [config toJSON]
             };
             NSData *messageData = [NSJSONSerialization dataWithJSONObject:message options:0 error:nil];
             
@@ -433,6 +419,19 @@
                             [self notifyTrafficUpdate];
                         });
                     }
+                    
+                    // 隧道提供者故障切换后同步当前服务器
+                    NSString *server = response[@"server"];
+                    NSNumber *serverPort = response[@"server_port"];
+                    if ([server isKindOfClass:[NSString class]] && serverPort) {
+                        dispatch_async(self->_queue, ^{
+                            TFYSSConfig *config = self.currentConfig;
+                            if (config && !([config.serverHost isEqualToString:server] && config.serverPort == serverPort.unsignedShortValue)) {
+                                NSLog(@"隧道已切换到服务器 %@:%@", server, serverPort);
+                                self.currentConfig = [config configBySwitchingToServer:@{@"server": server, @"server_port": serverPort}];
+                            }
+                        });
+                    }
                 } else {
                     NSLog(@"解析流量统计响应失败: %@", error.localizedDescription);
                 }
@@ -604,10 +603,8 @@
                     
                 case NEVPNStatusConnected:
                     [self updateState:TFYSSVPNStateConnected];
-                    // 连接成功，取消任何重连计划
+                    // 连接成功，取消任何重连计划；服务器健康探测和故障切换由隧道提供者负责
                     [self cancelReconnectTimer];
-                    // 启动连接健康检查
-                    [self startConnectionHealthCheck];
                     break;
                     
                 case NEVPNStatusReasserting:
@@ -665,72 +662,6 @@
     }
 }
 
-/**
- * 启动连接健康检查
- * 定期检查VPN连接的健康状态，如果发现问题则尝试重新连接
- */
-- (void)startConnectionHealthCheck {
-    // 取消之前的健康检查
-    [self cancelConnectionHealthCheck];
-    
-    // 创建新的健康检查
-    _connectionHealthTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
-    dispatch_source_set_timer(_connectionHealthTimer, 
-                             dispatch_time(DISPATCH_TIME_NOW, (int64_t)(60 * NSEC_PER_SEC)), 
-                             (int64_t)(60 * NSEC_PER_SEC), 
-                             (int64_t)(1 * NSEC_PER_SEC));
-    
-    __weak typeof(self) weakSelf = self;
-    dispatch_source_set_event_handler(_connectionHealthTimer, ^{
-        __strong typeof(weakSelf) strongSelf = weakSelf;
-        if (strongSelf && strongSelf.state == TFYSSVPNStateConnected) {
-            [strongSelf checkConnectionHealth];
-        }
-    });
-    
-    dispatch_resume(_connectionHealthTimer);
-}
-
-- (void)cancelConnectionHealthCheck {
-    if (_connectionHealthTimer) {
-        dispatch_source_cancel(_connectionHealthTimer);
-        _connectionHealthTimer = nil;
-    }
-}
-
-/**
- * 检查连接健康状态
- * 通过监控流量变化来判断连接是否健康
- */
-- (void)checkConnectionHealth {
-    // 检查最近的流量统计，如果长时间没有流量可能表示连接有问题
-    static NSUInteger noTrafficCount = 0;
-    static uint64_t lastTotalBytes = 0;
-    
-    uint64_t currentTotalBytes = self.uploadTraffic + self.downloadTraffic;
-    
-    if (currentTotalBytes == lastTotalBytes) {
-        noTrafficCount++;
-        NSLog(@"检测到无流量，计数: %lu", (unsigned long)noTrafficCount);
-        
-        // 如果连续5分钟没有流量，尝试重新连接
-        if (noTrafficCount >= 5) {
-            NSLog(@"长时间无流量，尝试重新连接VPN");
-            noTrafficCount = 0;
-            
-            [self stopWithCompletion:^(NSError * _Nullable error) {
-                if (self.autoReconnect) {
-                    [self scheduleReconnect];
-                }
-            }];
-        }
-    } else {
-        // 有流量，重置计数
-        noTrafficCount = 0;
-        lastTotalBytes = currentTotalBytes;
-    }
-}
-
 /**
  * 重置连接
  * 清理当前连接并在需要时重新连接
@@ -817,7 +748,6 @@
  */
 - (void)cleanupAllTimers {
     [self cancelConnectionTimeoutCheck];
-    [self cancelConnectionHealthCheck];
     [self cancelReconnectTimer];
     
     if (_trafficTimer) {
@@ -938,14 +868,8 @@
     NSMutableDictionary *providerConfig = [NSMutableDictionary dictionary];
     [providerConfig setObject:@"shadowsocks" forKey:@"tunnelType"];
     
-    // 添加配置信息
-    NSError *archiveError = nil;
-    NSData *configData = [NSKeyedArchiver archivedDataWithRootObject:config requiringSecureCoding:YES error:&archiveError];
-    if (!archiveError && configData) {
-        [providerConfig setObject:configData forKey:@"config"];
-    } else {
-        NSLog(@"配置序列化失败: %@", archiveError.localizedDescription);
-    }
+    // 添加配置信息，TFYSSConfig 不支持 NSSecureCoding，以 JSON 字典保存
+    [providerConfig setObject:[config toJSON] forKey:@"config"];
     
     protocol.providerConfiguration = providerConfig;
     
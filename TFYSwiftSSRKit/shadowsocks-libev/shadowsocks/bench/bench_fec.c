@@ -0,0 +1,100 @@
+/*
+ * bench_fec.c - FEC encode and recovery cost
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "fec.h"
+#include "test.h"
+
+#define PACKETS 200000
+#define GROUPS  2000
+
+static char (*packets)[FEC_MAX_PACKET];
+static size_t *lengths;
+static int count;
+
+static void
+discard(void *data, const char *packet, size_t len)
+{
+    (void)data;
+    (void)packet;
+    (void)len;
+}
+
+static void
+keep(void *data, const char *packet, size_t len)
+{
+    (void)data;
+    memcpy(packets[count], packet, len);
+    lengths[count++] = len;
+}
+
+static void
+bench(int k, int m, int rounds)
+{
+    fec_config_t config    = { .data = k, .parity = m };
+    fec_encoder_t *encoder = fec_encoder_new(&config, discard, NULL);
+    char buf[1200];
+
+    memset(buf, 7, sizeof(buf));
+    double t = test_now();
+    for (int i = 0; i < rounds; i++)
+        fec_encode(encoder, buf, sizeof(buf), 0);
+    double encode = test_now() - t;
+    fec_encoder_free(encoder);
+
+    packets = malloc((size_t)GROUPS * (k + m) * FEC_MAX_PACKET);
+    lengths = malloc(sizeof(size_t) * GROUPS * (k + m));
+    count   = 0;
+    encoder = fec_encoder_new(&config, keep, NULL);
+    for (int i = 0; i < GROUPS * k; i++)
+        fec_encode(encoder, buf, sizeof(buf), 0);
+
+    // The first m data packets of each group are lost and rebuilt from parity
+    fec_decoder_t *decoder = fec_decoder_new(discard, NULL);
+    t = test_now();
+    for (int i = 0; i < count; i++)
+        if (i % (k + m) >= m)
+            fec_decode(decoder, packets[i], lengths[i]);
+    double decode = test_now() - t;
+
+    fec_decoder_stats_t stats;
+    fec_decoder_stats(decoder, &stats);
+    CHECK(stats.recovered == (uint64_t)GROUPS * m);
+    printf("k=%d m=%d: encode %.0f ns (%.0f MB/s), decode with %d lost per group %.0f ns "
+           "per datagram\n", k, m, encode / rounds * 1e9, rounds * sizeof(buf) / encode / 1e6,
+           m, decode / (GROUPS * k) * 1e9);
+
+    fec_encoder_free(encoder);
+    fec_decoder_free(decoder);
+    free(packets);
+    free(lengths);
+}
+
+int
+main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : PACKETS;
+
+    bench(8, 2, rounds);
+    bench(16, 4, rounds);
+    bench(32, 16, rounds);
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * bench_hkdf.c - Cost of one session subkey, hkdf_psk_derive against crypto_hkdf
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "aead.h"
+#include "blake3.h"
+#include "hkdf.h"
+#include "test.h"
+
+#define ROUNDS 1000000
+
+int
+main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : ROUNDS;
+    uint8_t key[32], salt[32], out[32], context_key[BLAKE3_KEY_LEN];
+    uint8_t sink = 0;
+    hkdf_psk_t psk;
+    blake3_hasher_t hasher;
+
+    for (int i = 0; i < 32; i++) {
+        key[i]  = i * 7 + 1;
+        salt[i] = i * 13 + 5;
+    }
+    hkdf_psk_init(&psk, key, sizeof(key), (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN);
+
+    double t = test_now();
+    for (int i = 0; i < rounds; i++) {
+        salt[0] = (uint8_t)i;
+        hkdf_psk_derive(&psk, salt, sizeof(salt), out, sizeof(out));
+        sink ^= out[0];
+    }
+    double cached = test_now() - t;
+
+    // What aead_ctx_init() in the prebuilt archive runs for every session
+    const mbedtls_md_info_t *sha1 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA1);
+    t = test_now();
+    for (int i = 0; i < rounds; i++) {
+        salt[0] = (uint8_t)i;
+        crypto_hkdf(sha1, salt, sizeof(salt), key, sizeof(key),
+                    (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN, out, sizeof(out));
+        sink ^= out[0];
+    }
+    double archive = test_now() - t;
+
+    t = test_now();
+    for (int i = 0; i < rounds; i++) {
+        salt[0] = (uint8_t)i;
+        test_hkdf_sha1(salt, sizeof(salt), key, sizeof(key),
+                       (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN, out, sizeof(out));
+        sink ^= out[0];
+    }
+    double textbook = test_now() - t;
+
+    printf("hkdf-sha1 32 byte subkey: hkdf_psk_derive %.0f ns, crypto_hkdf %.0f ns, "
+           "textbook %.0f ns\n", cached / rounds * 1e9, archive / rounds * 1e9,
+           textbook / rounds * 1e9);
+
+    t = test_now();
+    for (int i = 0; i < rounds; i++) {
+        salt[0] = (uint8_t)i;
+        blake3_hasher_init_derive_key(&hasher, "shadowsocks 2022 session subkey");
+        blake3_hasher_update(&hasher, salt, sizeof(salt));
+        blake3_hasher_finalize(&hasher, out, sizeof(out));
+        sink ^= out[0];
+    }
+    double full = test_now() - t;
+
+    blake3_derive_context_key("shadowsocks 2022 session subkey", context_key);
+    t = test_now();
+    for (int i = 0; i < rounds; i++) {
+        salt[0] = (uint8_t)i;
+        blake3_hasher_init_derive_key_raw(&hasher, context_key);
+        blake3_hasher_update(&hasher, salt, sizeof(salt));
+        blake3_hasher_finalize(&hasher, out, sizeof(out));
+        sink ^= out[0];
+    }
+    double raw = test_now() - t;
+
+    printf("blake3 2022 subkey: context per call %.0f ns, context hashed once %.0f ns\n",
+           full / rounds * 1e9, raw / rounds * 1e9);
+
+    hkdf_psk_release(&psk);
+    return sink == 0xff ? 1 : 0;
+}
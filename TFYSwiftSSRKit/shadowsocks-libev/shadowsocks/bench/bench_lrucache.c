@@ -0,0 +1,151 @@
+/*
+ * bench_lrucache.c - Sharded LRU cache against one locked uthash
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "lrucache.h"
+#include "uthash.h"
+#include "test.h"
+
+#define ENTRIES 100000
+#define LOOKUPS 2000000
+
+/*
+ * The baseline is cache.h's scheme, whose cache.c is only in the prebuilt
+ * core: one uthash behind one lock, a lookup moving its entry to the back
+ * and a cleanup that scans every entry.
+ */
+typedef struct entry {
+    char *key;
+    void *data;
+    time_t expire;
+    UT_hash_handle hh;
+} entry_t;
+
+static entry_t *baseline;
+static pthread_mutex_t baseline_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+baseline_lookup(const char *key, size_t len)
+{
+    entry_t *e;
+    void *data = NULL;
+
+    pthread_mutex_lock(&baseline_lock);
+    HASH_FIND(hh, baseline, key, len, e);
+    if (e != NULL) {
+        HASH_DELETE(hh, baseline, e);
+        HASH_ADD_KEYPTR(hh, baseline, e->key, len, e);
+        data = e->data;
+    }
+    pthread_mutex_unlock(&baseline_lock);
+    return data;
+}
+
+static void
+baseline_cleanup(void)
+{
+    entry_t *e, *tmp;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&baseline_lock);
+    HASH_ITER(hh, baseline, e, tmp) {
+        if (e->expire <= now) {
+            HASH_DELETE(hh, baseline, e);
+            free(e->key);
+            free(e);
+        }
+    }
+    pthread_mutex_unlock(&baseline_lock);
+}
+
+static lru_cache_t *cache;
+static char keys[ENTRIES][24];
+static size_t lens[ENTRIES];
+static int use_lru, threads, lookups;
+
+static void *
+worker(void *arg)
+{
+    unsigned seed = (unsigned)(long)arg;
+    void *result;
+
+    for (int i = 0; i < lookups / threads; i++) {
+        int k = rand_r(&seed) % ENTRIES;
+        if (use_lru)
+            lru_cache_lookup(cache, keys[k], lens[k], &result);
+        else
+            baseline_lookup(keys[k], lens[k]);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    lookups = argc > 1 ? atoi(argv[1]) : LOOKUPS;
+
+    lru_cache_create(&cache, ENTRIES, NULL);
+    for (int k = 0; k < ENTRIES; k++) {
+        lens[k] = snprintf(keys[k], sizeof(keys[k]), "10.0.%d.%d:%d", k >> 8 & 255, k & 255, k);
+        lru_cache_insert_with_timeout(cache, keys[k], lens[k], keys[k], 60);
+
+        entry_t *e = malloc(sizeof(entry_t));
+        e->key    = malloc(lens[k]);
+        e->data   = keys[k];
+        e->expire = time(NULL) + 60;
+        memcpy(e->key, keys[k], lens[k]);
+        HASH_ADD_KEYPTR(hh, baseline, e->key, lens[k], e);
+    }
+
+    for (threads = 1; threads <= 4; threads *= 2)
+        for (use_lru = 0; use_lru < 2; use_lru++) {
+            pthread_t th[4];
+            double t = test_now();
+            for (long i = 0; i < threads; i++)
+                pthread_create(&th[i], NULL, worker, (void *)(i + 1));
+            for (int i = 0; i < threads; i++)
+                pthread_join(th[i], NULL);
+            printf("%-8s %d threads: %.0f ns per lookup, wall time\n",
+                   use_lru ? "lrucache" : "uthash", threads, (test_now() - t) * 1e9 / lookups);
+        }
+
+    // A cleanup with nothing due
+    double t = test_now();
+    for (int i = 0; i < 100; i++)
+        baseline_cleanup();
+    double scan = test_now() - t;
+    t = test_now();
+    for (int i = 0; i < 100; i++)
+        lru_cache_cleanup_expired(cache);
+    double buckets = test_now() - t;
+    printf("cleanup of %d live entries: uthash %.0f us, lrucache %.2f us\n",
+           ENTRIES, scan * 1e6 / 100, buckets * 1e6 / 100);
+
+    entry_t *e, *tmp;
+    HASH_ITER(hh, baseline, e, tmp) {
+        HASH_DELETE(hh, baseline, e);
+        free(e->key);
+        free(e);
+    }
+    lru_cache_delete(cache, 1);
+    return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * bench_nattable.c - NAT table lookups against uthash with hash_key() strings
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "nattable.h"
+#include "uthash.h"
+#include "test.h"
+
+#define ENTRIES 10000
+#define ROUNDS  2000000
+
+typedef struct entry {
+    char *key;
+    void *data;
+    UT_hash_handle hh;
+} entry_t;
+
+static struct sockaddr_in6 addrs[ENTRIES * 2];
+static nat_key_t keys[ENTRIES * 2];
+static long values[ENTRIES * 2];
+
+// The string key udprelay.c builds per packet
+static char *
+hash_key(const struct sockaddr_in6 *addr)
+{
+    char host[INET6_ADDRSTRLEN];
+    char *key = malloc(64);
+
+    inet_ntop(AF_INET6, &addr->sin6_addr, host, sizeof(host));
+    snprintf(key, 64, "%d%s%d", AF_INET6, host, ntohs(addr->sin6_port));
+    return key;
+}
+
+int
+main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : ROUNDS;
+    long sink  = 0;
+
+    for (int i = 0; i < ENTRIES * 2; i++) {
+        addrs[i].sin6_family           = AF_INET6;
+        addrs[i].sin6_port             = htons(1000 + i % 50000);
+        addrs[i].sin6_addr.s6_addr[0]  = 0x20;
+        addrs[i].sin6_addr.s6_addr[14] = (i >> 8) & 0xff;
+        addrs[i].sin6_addr.s6_addr[15] = i & 0xff;
+        nat_key_set(&keys[i], IPPROTO_UDP, (struct sockaddr *)&addrs[i], NULL);
+        values[i] = i;
+    }
+
+    nat_table_t *table = nat_table_new(ENTRIES * 2, 30, NULL);
+    for (int i = 0; i < ENTRIES; i++)
+        nat_table_insert(table, &keys[i], &values[i]);
+
+    double t = test_now();
+    for (int k = 0; k < rounds; k++) {
+        nat_key_t key;
+        nat_key_set(&key, IPPROTO_UDP, (struct sockaddr *)&addrs[(unsigned)k * 7919u % ENTRIES], NULL);
+        long *v = nat_table_lookup(table, &key);
+        sink += *v;
+    }
+    double hit = test_now() - t;
+
+    t = test_now();
+    for (int k = 0; k < rounds; k++)
+        sink += (long)nat_table_lookup(table, &keys[ENTRIES + (unsigned)k * 7919u % ENTRIES]);
+    double miss = test_now() - t;
+
+    entry_t *cache = NULL;
+    for (int i = 0; i < ENTRIES; i++) {
+        entry_t *e = malloc(sizeof(entry_t));
+        e->key  = hash_key(&addrs[i]);
+        e->data = &values[i];
+        HASH_ADD_KEYPTR(hh, cache, e->key, strlen(e->key), e);
+    }
+
+    int slow_rounds = rounds / 10;
+    t = test_now();
+    for (int k = 0; k < slow_rounds; k++) {
+        entry_t *e;
+        char *key = hash_key(&addrs[(unsigned)k * 7919u % ENTRIES]);
+        HASH_FIND_STR(cache, key, e);
+        sink += *(long *)e->data;
+        free(key);
+    }
+    double uthash = test_now() - t;
+
+    printf("%d entries: nat_key_set + lookup hit %.1f ns, miss %.1f ns; "
+           "hash_key + uthash %.1f ns\n", ENTRIES,
+           hit / rounds * 1e9, miss / rounds * 1e9, uthash / slow_rounds * 1e9);
+
+    // Refused inserts into a full table of live entries: each one sweeps
+    // NAT_TABLE_INSERT_SWEEP slots at most, not the whole table
+    nat_table_t *full = nat_table_new(4096, 30, NULL);
+    int limit         = 4096 * NAT_TABLE_MAX_LOAD / 100;
+    for (int i = 0; i < limit; i++)
+        nat_table_insert(full, &keys[i], &values[i]);
+    int refused = rounds / 10;
+    t = test_now();
+    for (int k = 0; k < refused; k++)
+        sink += nat_table_insert(full, &keys[limit + k % ENTRIES], &values[0]);
+    double insert = test_now() - t;
+    printf("refused insert at the load limit of a 4096 slot table: %.1f ns\n",
+           insert / refused * 1e9);
+
+    entry_t *e, *tmp;
+    HASH_ITER(hh, cache, e, tmp) {
+        HASH_DEL(cache, e);
+        free(e->key);
+        free(e);
+    }
+    nat_table_free(full, 1);
+    nat_table_free(table, 1);
+    return sink == 42 ? 1 : 0;
+}
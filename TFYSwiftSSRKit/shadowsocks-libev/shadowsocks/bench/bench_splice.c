@@ -0,0 +1,123 @@
+/*
+ * bench_splice.c - Relay CPU cost of splice against the ring copy
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "splicerelay.h"
+#include "utils.h"
+#include "test.h"
+
+#define MEGABYTES 256
+
+static struct ev_loop *loop;
+static long bytes;
+
+static void *
+source(void *arg)
+{
+    int fd = *(int *)arg;
+    static char buf[65536];
+
+    for (long sent = 0; sent < bytes;) {
+        ssize_t n = write(fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    shutdown(fd, SHUT_WR);
+    return NULL;
+}
+
+static void *
+sink(void *arg)
+{
+    int fd = *(int *)arg;
+    static char buf[65536];
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+static void
+closed(void *data, int error)
+{
+    (void)data;
+    CHECK(error == 0);
+    ev_break(loop, EVBREAK_ALL);
+}
+
+// A download: the server streams, the application only reads
+static void
+bench(int force_copy)
+{
+    int app, relay_client, relay_remote, server;
+    test_tcp_pair(&app, &relay_client);
+    test_tcp_pair(&relay_remote, &server);
+    setnonblocking(relay_client);
+    setnonblocking(relay_remote);
+    shutdown(app, SHUT_WR);
+
+    loop = ev_loop_new(0);
+    splice_relay_config_t config = { .force_copy = force_copy };
+    splice_relay_t *relay        = splice_relay_new(loop, relay_client, relay_remote,
+                                                    &config, closed, NULL);
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, source, &server);
+    pthread_create(&threads[1], NULL, sink, &app);
+
+    double cpu  = test_cpu_now();
+    double wall = test_now();
+    splice_relay_start(relay);
+    ev_run(loop, 0);
+    cpu  = test_cpu_now() - cpu;
+    wall = test_now() - wall;
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    ring_relay_stats_t up, down;
+    splice_relay_stats(relay, &up, &down);
+    printf("%-6s %ld MB in %.2f s, %.2f GB/s, relay CPU %.3f s (%.0f%% of wall), %llu reads\n",
+           splice_relay_mode(relay) == SPLICE_RELAY_SPLICE ? "splice" : "copy",
+           (long)(down.bytes >> 20), wall, down.bytes / wall / 1e9, cpu, 100 * cpu / wall,
+           (unsigned long long)down.reads);
+
+    splice_relay_free(relay);
+    ev_loop_destroy(loop);
+    close(app);
+    close(relay_client);
+    close(relay_remote);
+    close(server);
+}
+
+int
+main(int argc, char **argv)
+{
+    bytes = (argc > 1 ? atol(argv[1]) : MEGABYTES) << 20;
+
+    for (int i = 0; i < 2; i++) {
+        bench(0);
+        bench(1);
+    }
+    return 0;
+}
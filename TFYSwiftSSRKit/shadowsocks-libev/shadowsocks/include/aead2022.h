@@ -0,0 +1,153 @@
+/*
+ * aead2022.h - Define the SIP022 (2022-blake3-*) AEAD cipher interface
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _AEAD2022_H
+#define _AEAD2022_H
+
+#include <stdint.h>
+#include <mbedtls/aes.h>
+#include <mbedtls/gcm.h>
+
+#include "aead.h"
+#include "replay.h"
+
+#ifndef CRYPTO_NEED_MORE
+#define CRYPTO_NEED_MORE -2
+#endif
+
+// SIP022 cipher methods
+#define AEAD2022_CIPHER_NUM         3
+#define BLAKE3_AES_128_GCM          0
+#define BLAKE3_AES_256_GCM          1
+#define BLAKE3_CHACHA20_POLY1305    2
+
+#define AEAD2022_SUBKEY_CONTEXT     "shadowsocks 2022 session subkey"
+#define AEAD2022_MAX_KEY_LEN        32
+#define AEAD2022_TAG_LEN            16
+#define AEAD2022_NONCE_LEN          12
+#define AEAD2022_XNONCE_LEN         24
+#define AEAD2022_MAX_CHUNK_SIZE     0xFFFF
+#define AEAD2022_TIMESTAMP_WINDOW   30
+// A salt stays acceptable for at most twice the window after it is first seen
+#define AEAD2022_REPLAY_ROTATE      (2 * AEAD2022_TIMESTAMP_WINDOW)
+#define AEAD2022_MAX_PADDING        900
+
+#define AEAD2022_TYPE_REQUEST       0
+#define AEAD2022_TYPE_RESPONSE      1
+
+// type + timestamp + length, plus the request salt in responses
+#define AEAD2022_REQUEST_HEADER_LEN 11
+#define AEAD2022_RESPONSE_HEADER_LEN(salt_len) (11 + (salt_len))
+
+// UDP separate header: session id + packet id
+#define AEAD2022_UDP_HEADER_LEN     16
+
+typedef struct aead2022_cipher {
+    int method;
+    size_t key_len;                 // the salt has the same length
+    uint8_t key[AEAD2022_MAX_KEY_LEN];
+    uint8_t subkey_context[AEAD2022_MAX_KEY_LEN]; // hash of AEAD2022_SUBKEY_CONTEXT
+    replay_filter_t *replay;        // salts of verified requests, may be NULL
+    mbedtls_aes_context header_enc; // UDP separate header, AES methods
+    mbedtls_aes_context header_dec;
+} aead2022_cipher_t;
+
+typedef struct aead2022_ctx {
+    aead2022_cipher_t *cipher;
+    struct aead2022_ctx *peer;      // opposite direction of the same stream
+    int enc;
+    int server;
+    int init;
+    int stage;
+    size_t pending;                 // plaintext length of the next payload chunk
+    uint8_t salt[AEAD2022_MAX_KEY_LEN];
+    uint8_t request_salt[AEAD2022_MAX_KEY_LEN];
+    uint8_t nonce[AEAD2022_NONCE_LEN];
+    uint8_t subkey[AEAD2022_MAX_KEY_LEN];
+    mbedtls_gcm_context gcm;
+    buffer_t *chunk;
+} aead2022_ctx_t;
+
+typedef struct aead2022_udp_session {
+    uint64_t session_id;
+    uint64_t packet_id;             // next outgoing packet id
+    uint8_t subkey[AEAD2022_MAX_KEY_LEN];
+    mbedtls_gcm_context gcm;
+    int peer_valid;
+    uint64_t peer_session_id;
+    uint8_t peer_subkey[AEAD2022_MAX_KEY_LEN];
+    mbedtls_gcm_context peer_gcm;
+    uint64_t window_top;            // highest peer packet id accepted
+    uint64_t window;                // bitmap of the 64 ids below window_top
+} aead2022_udp_session_t;
+
+/*
+ * Return the method index for a "2022-blake3-*" name, or -1.
+ */
+int aead2022_get_method(const char *method);
+int aead2022_is_method(const char *method);
+
+/*
+ * The key of a 2022 method is not derived from a password: psk must be the
+ * base64 encoding of exactly key_len bytes.
+ */
+aead2022_cipher_t *aead2022_init(int method, const char *psk);
+void aead2022_free(aead2022_cipher_t *cipher);
+
+/*
+ * server is 1 on the ss-server side of the stream. Pair the encryption and
+ * decryption contexts of one connection so that the request salt can be
+ * checked (client) or echoed (server) in the response header.
+ */
+void aead2022_ctx_init(aead2022_cipher_t *cipher, aead2022_ctx_t *ctx, int enc, int server);
+void aead2022_ctx_pair(aead2022_ctx_t *e_ctx, aead2022_ctx_t *d_ctx);
+void aead2022_ctx_release(aead2022_ctx_t *ctx);
+
+/*
+ * Stream encryption. On the client the first call must carry the SOCKS5
+ * address header, optionally followed by initial payload.
+ */
+int aead2022_encrypt(buffer_t *plaintext, aead2022_ctx_t *ctx, size_t capacity);
+
+/*
+ * Stream decryption. Returns CRYPTO_NEED_MORE until a whole chunk is
+ * available. On the server the first plaintext is the address header
+ * followed by initial payload, with the padding already stripped.
+ */
+int aead2022_decrypt(buffer_t *ciphertext, aead2022_ctx_t *ctx, size_t capacity);
+
+/*
+ * Client UDP packets. The plaintext is the address header followed by the
+ * payload, as produced for legacy AEAD by udprelay.
+ */
+void aead2022_udp_session_init(aead2022_cipher_t *cipher, aead2022_udp_session_t *session);
+void aead2022_udp_session_release(aead2022_udp_session_t *session);
+int aead2022_udp_encrypt(buffer_t *plaintext, aead2022_cipher_t *cipher,
+                         aead2022_udp_session_t *session, size_t capacity);
+int aead2022_udp_decrypt(buffer_t *ciphertext, aead2022_cipher_t *cipher,
+                         aead2022_udp_session_t *session, size_t capacity);
+
+/*
+ * Length of the SOCKS5 address (ATYP, address, port) at the start of buf,
+ * or -1 if it is truncated or malformed.
+ */
+int aead2022_addr_len(const uint8_t *buf, size_t len);
+
+#endif // _AEAD2022_H
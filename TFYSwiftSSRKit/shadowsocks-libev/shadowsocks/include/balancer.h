@@ -0,0 +1,108 @@
+/*
+ * balancer.h - Define the latency-aware choice between remote servers
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BALANCER_H
+#define _BALANCER_H
+
+#include <stdint.h>
+
+#include "jconf.h"
+
+#define BALANCER_MAX_SERVERS        MAX_REMOTE_NUM
+#define BALANCER_DEFAULT_ALPHA      0.3
+#define BALANCER_DEFAULT_FAILURES   3
+#define BALANCER_DEFAULT_EJECT      10.0        // seconds
+#define BALANCER_MAX_EJECT          300.0
+
+/*
+ * Picks one of listen_ctx_t's remote_addr[remote_num] for each new
+ * connection, instead of rand() % remote_num.
+ *
+ * Every server keeps an EWMA of its connect time and of its failure rate.
+ * Its cost is
+ *
+ *   latency * (pending + 1) / (1 - failure rate)
+ *
+ * where pending counts connects still in progress. BALANCER_P2C compares
+ * two servers drawn at random and takes the cheaper one, which keeps load
+ * off a slow server without sending every connection to the fastest.
+ * BALANCER_LEAST_PENDING takes the server with the fewest pending
+ * connects, with latency as the tie break. A server that has neither
+ * connected nor failed yet costs nothing, so each one gets tried; one
+ * that only failed so far is costed at the sampled servers' mean latency.
+ *
+ * After failures connects in a row a server is ejected for eject seconds,
+ * doubling with each ejection up to BALANCER_MAX_EJECT. Then it is
+ * admitted again, and one success clears its record. When every server is
+ * ejected or down, the one due back first is used anyway, preferring
+ * servers whose health is above 0.
+ *
+ * balancer_set_health() takes the score of active probes (probe.h). It
+ * scales the success rate in the cost, and a server with health 0 is
+ * left out like an ejected one.
+ *
+ * Times are ev_now() seconds. A balancer belongs to one event loop.
+ */
+typedef enum balancer_policy {
+    BALANCER_P2C,
+    BALANCER_LEAST_PENDING
+} balancer_policy_t;
+
+typedef struct balancer_config {
+    balancer_policy_t policy;
+    double alpha;               // EWMA weight of a new sample, 0 for the default
+    int failures;               // in a row before ejection, 0 for the default
+    double eject;               // first ejection in seconds, 0 for the default
+} balancer_config_t;
+
+typedef struct balancer_server_stats {
+    double latency;             // seconds, 0 before the first sample
+    double failure_rate;
+    double health;
+    int pending;
+    int ejected;
+    double ejected_for;         // seconds left
+    uint64_t picks;
+    uint64_t failures;
+    uint64_t ejections;
+} balancer_server_stats_t;
+
+typedef struct balancer balancer_t;
+
+balancer_t *balancer_new(int servers, const balancer_config_t *config);
+void balancer_free(balancer_t *lb);
+
+// Returns a server index, or -1 when there are no servers
+int balancer_pick(balancer_t *lb, double now);
+
+/*
+ * Report how the connect that pick() was for went: ok with its connect
+ * time, or failed (refused, unreachable, timed out). Every pick must be
+ * reported once, or pending never goes back down.
+ */
+void balancer_report(balancer_t *lb, int server, double now, int ok, double connect_time);
+
+// health in [0, 1], as probe_health() returns it
+void balancer_set_health(balancer_t *lb, int server, double health);
+
+void balancer_server_stats(const balancer_t *lb, int server, double now,
+                           balancer_server_stats_t *stats);
+
+#endif // _BALANCER_H
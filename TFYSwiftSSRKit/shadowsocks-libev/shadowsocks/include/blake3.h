@@ -0,0 +1,64 @@
+/*
+ * blake3.h - Define the portable BLAKE3 hash interface
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BLAKE3_H
+#define _BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_KEY_LEN      32
+#define BLAKE3_OUT_LEN      32
+#define BLAKE3_BLOCK_LEN    64
+#define BLAKE3_CHUNK_LEN    1024
+#define BLAKE3_MAX_DEPTH    54
+
+typedef struct blake3_chunk_state {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+    uint8_t flags;
+} blake3_chunk_state_t;
+
+typedef struct blake3_hasher {
+    uint32_t key[8];
+    blake3_chunk_state_t chunk;
+    uint8_t cv_stack_len;
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+} blake3_hasher_t;
+
+void blake3_hasher_init(blake3_hasher_t *self);
+void blake3_hasher_init_keyed(blake3_hasher_t *self, const uint8_t key[BLAKE3_KEY_LEN]);
+void blake3_hasher_init_derive_key(blake3_hasher_t *self, const char *context);
+
+/*
+ * Start a derive_key hasher from a context key computed earlier by
+ * blake3_derive_context_key(), skipping the context hash on every call.
+ */
+void blake3_hasher_init_derive_key_raw(blake3_hasher_t *self,
+                                       const uint8_t context_key[BLAKE3_KEY_LEN]);
+void blake3_derive_context_key(const char *context, uint8_t context_key[BLAKE3_KEY_LEN]);
+
+void blake3_hasher_update(blake3_hasher_t *self, const void *input, size_t input_len);
+void blake3_hasher_finalize(const blake3_hasher_t *self, uint8_t *out, size_t out_len);
+
+#endif // _BLAKE3_H
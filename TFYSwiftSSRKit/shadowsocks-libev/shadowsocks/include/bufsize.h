@@ -0,0 +1,129 @@
+/*
+ * bufsize.h - Define the adaptive per-connection buffer sizing policy
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BUFSIZE_H
+#define _BUFSIZE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ev.h>
+
+#include "encrypt.h"
+
+/*
+ * A connection's buffer starts at min_size. A read that fills it while
+ * the socket still has bytes queued (FIONREAD) grows it by grow_factor, up
+ * to max_size and to what the socket's SO_RCVBUF can deliver in one read.
+ * Growth is held while the peer's send queue (TIOCOUTQ, SO_NWRITE on
+ * Darwin) is above half its SO_SNDBUF: a bigger read would only pile up
+ * behind a slow writer.
+ *
+ * After shrink_reads reads in a row that used less than a quarter of the
+ * buffer it halves, and once the connection has been idle for idle_timeout
+ * seconds it drops back to min_size. Buffers are only resized while empty.
+ */
+
+#define BUF_SIZE_MIN_DEFAULT        2048
+#define BUF_SIZE_MAX_DEFAULT        (256 * 1024)
+#define BUF_SIZE_GROW_DEFAULT       2.0
+#define BUF_SIZE_SHRINK_READS       16
+#define BUF_SIZE_IDLE_DEFAULT       10.0
+#define BUF_SIZE_BUCKETS            8       // min_size << 0 .. << 7
+
+typedef struct buf_policy {
+    size_t min_size;
+    size_t max_size;
+    double grow_factor;
+    int shrink_reads;
+    ev_tstamp idle_timeout;
+} buf_policy_t;
+
+// Frees a buffer_t the way it was allocated, e.g. bfree or slab_bfree
+typedef void (*buf_free_cb)(buffer_t *buf);
+
+typedef struct buf_sizer {
+    buf_free_cb release;    // for the buffer until the sizer replaces it
+    int owned;              // the buffer is now from slab_balloc
+    size_t size;            // target capacity
+    size_t applied;         // target the buffer was last sized for
+    size_t peak;
+    size_t rcvbuf;          // SO_RCVBUF of the read side, 0 if unknown
+    size_t sndbuf;          // SO_SNDBUF of the write side, 0 if unknown
+    int small_reads;
+    int bucket;
+    ev_tstamp last_active;
+    uint32_t grows;
+    uint32_t shrinks;
+} buf_sizer_t;
+
+typedef struct buf_sizer_stats {
+    size_t connections;
+    size_t bytes;           // sum of target sizes
+    uint64_t grows;
+    uint64_t shrinks;
+    uint64_t held;          // growth held back by a full send queue
+    size_t buckets[BUF_SIZE_BUCKETS];   // connections per size
+} buf_sizer_stats_t;
+
+/*
+ * Replace the process-wide policy. Fields left at 0 keep their defaults;
+ * connections pick the change up on their next resize.
+ */
+void buf_policy_configure(const buf_policy_t *policy);
+void buf_policy_get(buf_policy_t *policy);
+
+/*
+ * rfd is the socket this buffer is read from and wfd the one it is
+ * written to; either may be -1. The buffer is taken to come from balloc;
+ * set sizer->release to slab_bfree when it came from slab_balloc, as
+ * conn_pool_acquire() does.
+ */
+void buf_sizer_init(buf_sizer_t *sizer, int rfd, int wfd, ev_tstamp now);
+void buf_sizer_release(buf_sizer_t *sizer);
+
+/*
+ * Record a read of nread bytes into a buffer of capacity bytes and return
+ * the capacity the next read should use.
+ */
+size_t buf_sizer_on_read(buf_sizer_t *sizer, int rfd, int wfd,
+                         size_t nread, size_t capacity, ev_tstamp now);
+
+/*
+ * Return the capacity the connection should drop to if it has been idle
+ * long enough, or its current target otherwise. Meant for the relay's
+ * existing idle timer.
+ */
+size_t buf_sizer_on_idle(buf_sizer_t *sizer, ev_tstamp now);
+
+/*
+ * Bring an empty buffer to the sizer's target with a fresh slab_balloc
+ * block. The old block goes to sizer->release the first time and to
+ * slab_bfree after that. Returns 0 when the buffer is at its target, -1
+ * when it is not empty or the allocation failed, in which case the old
+ * buffer is kept.
+ */
+int buf_sizer_apply(buf_sizer_t *sizer, buffer_t *buf);
+
+// Free the buffer with whichever allocator owns it now
+void buf_sizer_free_buffer(buf_sizer_t *sizer, buffer_t *buf);
+
+void buf_sizer_stats(buf_sizer_stats_t *stats);
+
+#endif // _BUFSIZE_H
@@ -0,0 +1,96 @@
+/*
+ * connpool.h - Define the per-connection object pool interface
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CONNPOOL_H
+#define _CONNPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define CONN_POOL_CACHE_LINE        64
+#define CONN_POOL_DEFAULT_PER_CHUNK 32
+
+/*
+ * Everything that lives exactly as long as one relayed connection, in one
+ * cache-line aligned block from a libcork mempool instead of ten separate
+ * ss_malloc calls. The block comes back wired: the ctx back pointers, the
+ * server's recv/send ctx, e_ctx, d_ctx and chunk, the remote's recv/send
+ * ctx and both buffers. server->remote and remote->server are left NULL
+ * because the relay uses them to tell whether the remote side has been
+ * set up yet; link them with conn_block_link_remote().
+ *
+ * The SSR protocol and obfs objects are not part of the block: they are
+ * created by the plugin's new_obfs() and released by its dispose(), which
+ * free them on their own. chunk.buf, when the relay creates one, is the
+ * relay's to free before release.
+ *
+ * A pool belongs to one event loop and is not thread safe.
+ */
+typedef struct conn_block {
+    server_t server;
+    remote_t remote;
+    server_ctx_t server_recv_ctx;
+    server_ctx_t server_send_ctx;
+    remote_ctx_t remote_recv_ctx;
+    remote_ctx_t remote_send_ctx;
+    enc_ctx_t e_ctx;
+    enc_ctx_t d_ctx;
+    chunk_t chunk;
+    buffer_t server_buf;
+    buffer_t remote_buf;
+    void *origin;                   // element as handed out by the mempool
+} conn_block_t;
+
+typedef struct conn_pool_stats {
+    size_t live;                    // blocks handed out
+    size_t peak;
+    uint64_t acquired;
+    uint64_t released;
+    size_t block_size;              // bytes per connection, buffers excluded
+} conn_pool_stats_t;
+
+typedef struct conn_pool conn_pool_t;
+
+// NULL when the mempool cannot be created
+conn_pool_t *conn_pool_new(size_t per_chunk);
+
+/*
+ * Every block must have been released. The mempool keeps its chunks until
+ * then, so the pool's footprint is its peak connection count.
+ */
+void conn_pool_free(conn_pool_t *pool);
+
+/*
+ * Both buffers are allocated with slab_balloc(buf_size), or left empty
+ * when buf_size is 0. Each block is charged to the pool's memory budget
+ * account; NULL is returned when the budget or the slab refuses.
+ */
+conn_block_t *conn_pool_acquire(conn_pool_t *pool, size_t buf_size);
+void conn_pool_release(conn_pool_t *pool, conn_block_t *block);
+
+void conn_block_link_remote(conn_block_t *block);
+conn_block_t *conn_block_of_server(server_t *server);
+conn_block_t *conn_block_of_remote(remote_t *remote);
+
+void conn_pool_stats(const conn_pool_t *pool, conn_pool_stats_t *stats);
+
+#endif // _CONNPOOL_H
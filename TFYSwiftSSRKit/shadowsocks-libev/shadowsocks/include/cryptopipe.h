@@ -0,0 +1,129 @@
+/*
+ * cryptopipe.h - Define the offloaded AEAD chunk pipeline interface
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CRYPTOPIPE_H
+#define _CRYPTOPIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ev.h>
+
+#include "aead.h"
+
+/*
+ * A legacy AEAD stream is a run of independent chunks, each sealed with
+ * its own nonce: E(len) uses n, E(payload) uses n + 1. Once the loop knows
+ * how many chunks a batch holds it knows every nonce in it, so the batch
+ * can be sealed or opened on another core while the loop moves on.
+ *
+ * The loop thread owns the pipe and its streams. Each worker thread has
+ * one single-producer/single-consumer ring for jobs from the loop and one
+ * for results back; an ev_async wakes the loop, which puts each stream's
+ * results back in submission order before handing them to its callback.
+ *
+ * Offloading only pays for bulk transfers. crypto_pipe_stream_offload()
+ * keeps a per-stream rate estimate and says yes only above the configured
+ * threshold (or while earlier batches are still in flight, so that output
+ * order is preserved); everything else stays inline with no added latency.
+ */
+
+#define CRYPTO_PIPE_DEFAULT_WORKERS     2
+#define CRYPTO_PIPE_MAX_WORKERS         16
+#define CRYPTO_PIPE_DEFAULT_DEPTH       64
+#define CRYPTO_PIPE_DEFAULT_THRESHOLD   (8 * 1024 * 1024)   // bytes per second
+#define CRYPTO_PIPE_DEFAULT_MIN_BATCH   (64 * 1024)
+
+#define CRYPTO_PIPE_CHUNK_SIZE          CHUNK_SIZE_MASK
+#define CRYPTO_PIPE_TAG_LEN             16
+#define CRYPTO_PIPE_NONCE_LEN           12
+#define CRYPTO_PIPE_CANCELLED           -3
+
+typedef struct crypto_pipe_config {
+    int workers;            // worker threads, 0 for the default
+    int queue_depth;        // jobs per worker ring, rounded up to a power of two
+    uint64_t threshold;     // stream rate, bytes per second, to start offloading
+    size_t min_batch;       // smallest batch worth a trip to a worker
+} crypto_pipe_config_t;
+
+typedef struct crypto_pipe_stats {
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t bytes;
+    size_t backlog;         // jobs waiting for a free ring slot
+    int workers;
+} crypto_pipe_stats_t;
+
+typedef struct crypto_pipe crypto_pipe_t;
+typedef struct crypto_pipe_stream crypto_pipe_stream_t;
+
+/*
+ * Called on the loop thread, in submission order per stream. out holds the
+ * result of one crypto_pipe_submit(); status is CRYPTO_OK or CRYPTO_ERROR.
+ * After crypto_pipe_stream_close() outstanding jobs are still returned,
+ * with CRYPTO_PIPE_CANCELLED, so that their buffers can be freed; the
+ * connection must not be touched then.
+ */
+typedef void (*crypto_pipe_cb)(crypto_pipe_stream_t *stream, buffer_t *in, buffer_t *out,
+                               int status, void *data);
+
+crypto_pipe_t *crypto_pipe_new(struct ev_loop *loop, const crypto_pipe_config_t *config);
+void crypto_pipe_free(crypto_pipe_t *pipe);
+void crypto_pipe_stats(crypto_pipe_t *pipe, crypto_pipe_stats_t *stats);
+
+/*
+ * One direction of one connection. method is an AEAD index from aead.h and
+ * subkey the session subkey of the matching cipher_ctx_t.
+ */
+crypto_pipe_stream_t *crypto_pipe_stream_new(crypto_pipe_t *pipe, int method,
+                                             const uint8_t *subkey, size_t key_len,
+                                             crypto_pipe_cb cb, void *data);
+void crypto_pipe_stream_close(crypto_pipe_stream_t *stream);
+size_t crypto_pipe_stream_inflight(const crypto_pipe_stream_t *stream);
+
+/*
+ * Account len bytes to the stream and return 1 if they should go through
+ * crypto_pipe_submit() rather than the inline aead_encrypt/aead_decrypt.
+ */
+int crypto_pipe_stream_offload(crypto_pipe_stream_t *stream, size_t len);
+
+/*
+ * Encryption: in holds len plaintext bytes, out must have room for
+ * crypto_pipe_sealed_len(len). The caller advances its own nonce by
+ * 2 * crypto_pipe_chunks(len).
+ *
+ * Decryption: call crypto_pipe_stream_scan() first and submit exactly the
+ * scanned bytes; out may be the same buffer as in. The caller advances its
+ * nonce by 2 * chunks and keeps the unscanned tail for the next read.
+ */
+size_t crypto_pipe_chunks(size_t len);
+size_t crypto_pipe_sealed_len(size_t len);
+int crypto_pipe_stream_scan(crypto_pipe_stream_t *stream, const uint8_t *nonce,
+                            const uint8_t *buf, size_t len,
+                            size_t *consumed, size_t *chunks);
+int crypto_pipe_submit(crypto_pipe_stream_t *stream, int enc, const uint8_t *nonce,
+                       buffer_t *in, buffer_t *out);
+
+/*
+ * Add n to a little-endian nonce, the bulk form of sodium_increment().
+ */
+void crypto_pipe_nonce_add(uint8_t *nonce, size_t len, uint64_t n);
+
+#endif // _CRYPTOPIPE_H
@@ -0,0 +1,99 @@
+/*
+ * fastopen.h - Define the client side TCP Fast Open connect path
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FASTOPEN_H
+#define _FASTOPEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define FAST_OPEN_MIN_BACKOFF       60          // seconds
+#define FAST_OPEN_MAX_BACKOFF       3600
+#define FAST_OPEN_MAX_NOT_ACKED     3
+
+/*
+ * Connect to the server with the first encrypted payload in the SYN.
+ *
+ *  - Linux: TCP_FASTOPEN_CONNECT, so connect() returns at once and the
+ *    first send() carries the data; sendto(MSG_FASTOPEN) on kernels that
+ *    lack it.
+ *  - Darwin: connectx() with CONNECT_DATA_IDEMPOTENT and
+ *    CONNECT_RESUME_ON_READ_WRITE, then send().
+ *
+ * The kernel keeps the cookie for each server. Each server also gets a
+ * fast_open_server_t that records how TFO has been doing with it. A
+ * connect that sent SYN data and then timed out, or was reset before the
+ * server answered, looks like a middlebox dropping SYNs with data. TFO is
+ * then turned off for that server, for FAST_OPEN_MIN_BACKOFF doubling up to
+ * FAST_OPEN_MAX_BACKOFF. The server's first reply after a clean TFO
+ * connect resets the backoff. FAST_OPEN_MAX_NOT_ACKED connects in a row
+ * whose SYN data was not acknowledged mean the server does not accept it,
+ * and are treated the same way. Once the system rejects TFO outright it
+ * stays off for the process.
+ *
+ * A server's state may be shared by connections on several loops.
+ */
+typedef struct fast_open_server fast_open_server_t;
+
+typedef struct fast_open_conn {
+    fast_open_server_t *server;
+    int attempted;              // connected through the TFO path
+    int syn_data;               // the kernel took data with the connect
+    int connected;
+    int responded;
+} fast_open_conn_t;
+
+typedef struct fast_open_stats {
+    uint64_t attempts;
+    uint64_t syn_data_acked;
+    uint64_t syn_data_not_acked;
+    uint64_t blackholes;        // timeouts and resets after SYN data
+    uint64_t fallbacks;         // connects made without TFO while disabled
+    int enabled;
+    int64_t disabled_for;       // seconds left, 0 when enabled
+} fast_open_stats_t;
+
+fast_open_server_t *fast_open_server_new(void);
+void fast_open_server_free(fast_open_server_t *server);
+
+/*
+ * Start a non-blocking connect on fd and send up to len bytes of data
+ * with it. Returns how many bytes the kernel took, which may be 0 (the
+ * rest is written once the socket is writable), or -1 with errno set.
+ * Without TFO this is a plain connect() and returns 0.
+ */
+ssize_t fast_open_connect(fast_open_conn_t *conn, fast_open_server_t *server, int fd,
+                          const struct sockaddr *addr, socklen_t addr_len,
+                          const void *data, size_t len);
+
+// The socket became writable and SO_ERROR is 0
+void fast_open_connected(fast_open_conn_t *conn, int fd);
+
+// The first bytes arrived from the server
+void fast_open_response(fast_open_conn_t *conn);
+
+// The connect timed out, or the connection failed before any response
+void fast_open_failed(fast_open_conn_t *conn, int error);
+
+void fast_open_stats(const fast_open_server_t *server, fast_open_stats_t *stats);
+
+#endif // _FASTOPEN_H
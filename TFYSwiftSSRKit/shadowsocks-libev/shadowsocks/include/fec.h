@@ -0,0 +1,132 @@
+/*
+ * fec.h - Define Reed-Solomon forward error correction for the UDP relay
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FEC_H
+#define _FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FEC_HEADER_SIZE         8
+#define FEC_LENGTH_SIZE         2           // in front of each data payload
+#define FEC_MAX_DATA            32
+#define FEC_MAX_PARITY          16
+#define FEC_MAX_PAYLOAD         2048
+#define FEC_MAX_PACKET          (FEC_HEADER_SIZE + FEC_LENGTH_SIZE + FEC_MAX_PAYLOAD)
+#define FEC_GROUPS              16          // groups the decoder keeps open
+
+#define FEC_DEFAULT_DATA        8
+#define FEC_DEFAULT_PARITY      2
+#define FEC_DEFAULT_FLUSH       0.01        // seconds a group waits for more data
+#define FEC_DEFAULT_TARGET      0.001       // residual loss the adaptation aims for
+#define FEC_DEFAULT_ALPHA       0.1
+
+/*
+ * Forward error correction for the UDP relay, so that a lost datagram is
+ * rebuilt from its group instead of costing the application a
+ * retransmission timeout.
+ *
+ * The encoder works on the plaintext of relay datagrams, the address
+ * header included, before encryption. Every datagram goes out at once as
+ * a data packet
+ *
+ *   group(4) | index(1) | data(1) | parity(1) | 0(1) | length(2) | payload
+ *
+ * and after data datagrams, or flush seconds after the first one of a
+ * smaller group, parity packets follow. They carry the same header, with
+ * the group's real data count, and the systematic Reed-Solomon code over
+ * GF(2^8) of the length-prefixed payloads, zero padded to the longest.
+ * Parity uses a Cauchy matrix, so any data of the data + parity packets
+ * of a group rebuild the rest. One parity packet is plain XOR parity.
+ *
+ * The decoder hands data packets on as they come and rebuilds missing
+ * ones as soon as enough packets of their group are in; rebuilt
+ * datagrams therefore arrive out of order, which UDP allows. It measures
+ * loss from the groups it retires.
+ *
+ * With adapt set the encoder picks the parity count for each group from
+ * the loss it is given (fec_encoder_set_loss()), the smallest between 1
+ * and max_parity for which a group is lost with probability under
+ * target. Feeding it the decoder's loss of the other direction needs no
+ * extra protocol, if the link is roughly symmetric.
+ *
+ * Both ends must be configured for FEC; there is no negotiation. Times
+ * are ev_now() seconds. Encoders and decoders belong to one event loop.
+ */
+
+typedef void (*fec_output_cb)(void *data, const char *packet, size_t len);
+
+typedef struct fec_config {
+    int data;                   // datagrams per group, 0 for the default
+    int parity;                 // parity packets per group, 0 for the default
+    int adapt;                  // pick parity from the loss
+    int max_parity;             // with adapt, 0 for data / 2
+    double target;              // with adapt, 0 for the default
+    double flush;               // 0 for the default
+} fec_config_t;
+
+typedef struct fec_encoder_stats {
+    int parity;                 // for the next group
+    uint64_t groups;
+    uint64_t data_packets;
+    uint64_t parity_packets;
+    uint64_t oversized;         // payloads over FEC_MAX_PAYLOAD, refused
+} fec_encoder_stats_t;
+
+typedef struct fec_decoder_stats {
+    double loss;
+    uint64_t data_packets;
+    uint64_t parity_packets;
+    uint64_t recovered;
+    uint64_t lost;              // data packets neither received nor rebuilt
+    uint64_t late;              // for a group already retired
+    uint64_t duplicates;
+    uint64_t malformed;
+} fec_decoder_stats_t;
+
+typedef struct fec_encoder fec_encoder_t;
+typedef struct fec_decoder fec_decoder_t;
+
+fec_encoder_t *fec_encoder_new(const fec_config_t *config, fec_output_cb cb, void *data);
+void fec_encoder_free(fec_encoder_t *enc);
+
+// Returns 0, or -1 when len is over FEC_MAX_PAYLOAD
+int fec_encode(fec_encoder_t *enc, const char *payload, size_t len, double now);
+
+/*
+ * Send the parity of a group that has waited flush seconds. Returns when
+ * to call again, or 0 when no group is open.
+ */
+double fec_encoder_poll(fec_encoder_t *enc, double now);
+
+void fec_encoder_set_loss(fec_encoder_t *enc, double loss);
+void fec_encoder_stats(const fec_encoder_t *enc, fec_encoder_stats_t *stats);
+
+// cb gets every datagram payload, received or rebuilt
+fec_decoder_t *fec_decoder_new(fec_output_cb cb, void *data);
+void fec_decoder_free(fec_decoder_t *dec);
+
+// Returns 0, or -1 for a malformed packet
+int fec_decode(fec_decoder_t *dec, const char *packet, size_t len);
+
+double fec_decoder_loss(const fec_decoder_t *dec);
+void fec_decoder_stats(const fec_decoder_t *dec, fec_decoder_stats_t *stats);
+
+#endif // _FEC_H
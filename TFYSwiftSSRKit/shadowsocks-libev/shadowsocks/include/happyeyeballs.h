@@ -0,0 +1,113 @@
+/*
+ * happyeyeballs.h - Define dual-stack connection racing (RFC 8305)
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HAPPYEYEBALLS_H
+#define _HAPPYEYEBALLS_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <ev.h>
+
+#define HAPPY_EYEBALLS_MAX_ADDRS            16
+#define HAPPY_EYEBALLS_ATTEMPT_DELAY        0.25    // seconds
+#define HAPPY_EYEBALLS_MIN_ATTEMPT_DELAY    0.1
+#define HAPPY_EYEBALLS_RESOLUTION_DELAY     0.05
+#define HAPPY_EYEBALLS_DEFAULT_TIMEOUT      10.0
+
+/*
+ * Connects to the first of several addresses of one host that answers,
+ * instead of waiting out the first address get_sockaddr() returned. On a
+ * network with broken IPv6 the IPv4 attempt starts 250 ms later rather
+ * than after a connect timeout.
+ *
+ * Attempts alternate between address families, starting with the
+ * preferred one, and a new one starts every attempt_delay seconds or as
+ * soon as the previous one fails. The first connected socket wins and the
+ * others are closed.
+ *
+ * Addresses may be added while the resolver is still running. Attempts
+ * start at once with an address of the preferred family. With only the
+ * other family in, they start after HAPPY_EYEBALLS_RESOLUTION_DELAY or
+ * once happy_eyeballs_resolved() is called.
+ *
+ * The preferred family is kept per network: the family that won the last
+ * race on it. happy_eyeballs_set_network() switches networks, e.g. when
+ * the default route moves from Wi-Fi to cellular, and remembers the
+ * preference of the last few networks.
+ *
+ * A race belongs to one event loop. The preference cache is shared and
+ * thread safe.
+ */
+
+typedef struct happy_eyeballs_config {
+    double attempt_delay;       // seconds between attempts, 0 for the default
+    double timeout;             // whole race, 0 for the default
+    int (*setup)(void *data, int fd);   // socket options before connect
+    void *data;
+} happy_eyeballs_config_t;
+
+/*
+ * Called once: with the connected, non-blocking socket and its address,
+ * or with fd -1 and the errno of the last failed attempt. The race is
+ * freed after the callback returns.
+ */
+typedef void (*happy_eyeballs_cb)(void *data, int fd, const struct sockaddr *addr,
+                                  socklen_t addr_len, int error);
+
+typedef struct happy_eyeballs happy_eyeballs_t;
+
+typedef struct happy_eyeballs_stats {
+    uint64_t races;
+    uint64_t attempts;
+    uint64_t ipv4_wins;
+    uint64_t ipv6_wins;
+    uint64_t failures;
+    int preferred;              // AF_INET or AF_INET6 on the current network
+} happy_eyeballs_stats_t;
+
+happy_eyeballs_t *happy_eyeballs_new(struct ev_loop *loop, const happy_eyeballs_config_t *config,
+                                     happy_eyeballs_cb cb, void *data);
+
+// Returns 0, or -1 when the race is full or the address is not IP
+int happy_eyeballs_add(happy_eyeballs_t *race, const struct sockaddr *addr, socklen_t addr_len);
+
+// No more addresses; fails the race at once if it has none
+void happy_eyeballs_resolved(happy_eyeballs_t *race);
+
+// Stop without calling back
+void happy_eyeballs_cancel(happy_eyeballs_t *race);
+
+/*
+ * Blocking getaddrinfo() for every address of host, in the system's
+ * RFC 6724 order. Returns how many went into addrs, at most max.
+ */
+int happy_eyeballs_resolve(const char *host, const char *port,
+                           struct sockaddr_storage *addrs, int max);
+
+/*
+ * An opaque id of the current network, 0 for unknown. It has to tell
+ * networks apart, e.g. a hash of the gateway address and the Wi-Fi
+ * BSSID: an interface name alone is the same on every Wi-Fi network.
+ */
+void happy_eyeballs_set_network(uint64_t network);
+
+void happy_eyeballs_stats(happy_eyeballs_stats_t *stats);
+
+#endif // _HAPPYEYEBALLS_H
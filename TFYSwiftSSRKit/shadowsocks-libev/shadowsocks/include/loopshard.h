@@ -0,0 +1,122 @@
+/*
+ * loopshard.h - Define the multi-loop listener sharding interface
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOOPSHARD_H
+#define _LOOPSHARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include <libcork/ds.h>
+
+#include "membudget.h"
+
+#define LOOP_SHARD_MAX_WORKERS      16
+
+/*
+ * N worker threads, each running its own ev_loop with its own listener,
+ * connection list, memory budget attachment and counters. Nothing mutable
+ * is shared between workers: configuration and rules reach them as
+ * immutable snapshots, swapped in by each worker on its own loop.
+ *
+ * With LOOP_SHARD_REUSEPORT every worker binds its own SO_REUSEPORT
+ * socket and the kernel spreads connections across them. Darwin accepts
+ * the option but does not balance between the sockets, so there
+ * LOOP_SHARD_AUTO falls back to LOOP_SHARD_SHARED: one listening socket
+ * watched by every loop. In both modes a woken loop accepts until EAGAIN.
+ */
+typedef enum loop_shard_mode {
+    LOOP_SHARD_AUTO,
+    LOOP_SHARD_REUSEPORT,
+    LOOP_SHARD_SHARED
+} loop_shard_mode_t;
+
+typedef struct loop_shard loop_shard_t;
+typedef struct loop_shard_group loop_shard_group_t;
+
+// Runs on the shard's thread for every accepted, non-blocking socket
+typedef void (*loop_shard_accept_cb)(loop_shard_t *shard, int fd,
+                                     struct sockaddr_storage *addr, void *data);
+
+// Runs on the shard's thread when its loop starts and before it exits
+typedef void (*loop_shard_cb)(loop_shard_t *shard, void *data);
+
+typedef struct loop_shard_config {
+    const char *host;
+    const char *port;
+    int workers;            // 0 for one per online CPU, capped at the maximum
+    int backlog;            // 0 for SOMAXCONN
+    loop_shard_mode_t mode;
+    loop_shard_accept_cb accept_cb;
+    loop_shard_cb start_cb;
+    loop_shard_cb stop_cb;
+    void *data;
+} loop_shard_config_t;
+
+typedef struct loop_shard_stats {
+    uint64_t accepted;
+    uint64_t active;
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+} loop_shard_stats_t;
+
+struct loop_shard {
+    int index;
+    struct ev_loop *loop;
+    struct cork_dllist connections;     // owned by this shard's thread
+    mem_budget_loop_t *budget;
+    void *local;                        // for the caller's per-shard state
+    loop_shard_group_t *group;
+};
+
+/*
+ * Bind the listeners and start the workers. initial is the first snapshot
+ * and release frees snapshots once no worker uses them; both may be NULL.
+ */
+loop_shard_group_t *loop_shard_group_new(const loop_shard_config_t *config,
+                                         void *initial, void (*release)(void *));
+
+// Stop every loop, run the stop callbacks, join and free
+void loop_shard_group_free(loop_shard_group_t *group);
+
+int loop_shard_group_workers(const loop_shard_group_t *group);
+loop_shard_mode_t loop_shard_group_mode(const loop_shard_group_t *group);
+
+/*
+ * Replace the snapshot. Each worker switches at its next loop iteration;
+ * the old snapshot is released after the last one has.
+ */
+void loop_shard_publish(loop_shard_group_t *group, void *snapshot);
+
+// The snapshot this shard currently uses, valid until its next iteration
+void *loop_shard_snapshot(const loop_shard_t *shard);
+
+// Counters, updated from the shard's own thread
+void loop_shard_conn_opened(loop_shard_t *shard);
+void loop_shard_conn_closed(loop_shard_t *shard);
+void loop_shard_add_traffic(loop_shard_t *shard, uint64_t up, uint64_t down);
+
+void loop_shard_stats(const loop_shard_group_t *group, int index,
+                      loop_shard_stats_t *stats);
+void loop_shard_group_stats(const loop_shard_group_t *group,
+                            loop_shard_stats_t *stats);
+
+#endif // _LOOPSHARD_H
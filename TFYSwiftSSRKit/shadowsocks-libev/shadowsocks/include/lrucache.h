@@ -0,0 +1,104 @@
+/*
+ * lrucache.h - Define the sharded LRU cache with bucketed expiry
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LRUCACHE_H
+#define _LRUCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LRU_CACHE_MAX_SHARDS        16
+#define LRU_CACHE_SHARD_MIN         64      // entries per shard before splitting
+#define LRU_CACHE_BUCKETS           64      // seconds of expiry buckets per shard
+
+/*
+ * The cache.h interface without its single lock and full expiry scan.
+ *
+ * A key hashes with a keyed SipHash to one of up to LRU_CACHE_MAX_SHARDS
+ * shards, each with its own lock, hash index, LRU list and capacity share.
+ * Small caches keep fewer shards so that every shard holds at least
+ * LRU_CACHE_SHARD_MIN entries and eviction stays close to global LRU.
+ *
+ * Keys are binary and copied once into the entry, so a 5-tuple or a
+ * sockaddr is used as is instead of being formatted into a string.
+ *
+ * Entries with a timeout sit in per-second expiry buckets, a ring of
+ * LRU_CACHE_BUCKETS. Inserts and lru_cache_cleanup_expired() only visit
+ * the buckets that came due since the last sweep, so expiry costs O(1)
+ * per entry instead of a scan of the cache. An entry due beyond the ring
+ * is filed in its last bucket and moved on when that comes up. A lookup
+ * never returns an expired entry, swept or not.
+ *
+ * Evicted, expired and replaced payloads go to free_cb after the shard
+ * lock is released, so free_cb may call back into the cache.
+ *
+ * With lru_cache_set_budget() the cache charges its entries to a
+ * membudget.h account and gives back least recently used entries when
+ * the budget asks it to shrink. An insert the budget refuses fails with
+ * ENOMEM.
+ *
+ * All calls are thread safe. Return values follow cache.h: 0 or an errno
+ * value, and lru_cache_key_exist() returns 1 or 0.
+ */
+
+typedef struct lru_cache lru_cache_t;
+
+typedef struct lru_cache_stats {
+    size_t entries;
+    size_t capacity;
+    int shards;
+    uint64_t hits;
+    uint64_t misses;            // including expired entries found
+    uint64_t inserts;
+    uint64_t replaced;          // inserts over an existing key
+    uint64_t evictions;         // to make room or on a shrink request
+    uint64_t expired;
+} lru_cache_stats_t;
+
+int lru_cache_create(lru_cache_t **dst, const size_t capacity,
+                     void (*free_cb)(void *element));
+
+// keep_data leaves the payloads to the caller instead of free_cb
+int lru_cache_delete(lru_cache_t *cache, int keep_data);
+
+// result is a void **; it is set to NULL on a miss
+int lru_cache_lookup(lru_cache_t *cache, const void *key, size_t key_len, void *result);
+
+// An insert over an existing key replaces its payload and timeout
+int lru_cache_insert(lru_cache_t *cache, const void *key, size_t key_len, void *data);
+int lru_cache_insert_with_timeout(lru_cache_t *cache, const void *key, size_t key_len,
+                                  void *data, time_t timeout);
+int lru_cache_remove(lru_cache_t *cache, const void *key, size_t key_len);
+int lru_cache_key_exist(lru_cache_t *cache, const void *key, size_t key_len);
+
+// Seconds, for lru_cache_insert(); 0, the default, never expires
+void lru_cache_set_default_timeout(lru_cache_t *cache, time_t timeout);
+void lru_cache_cleanup_expired(lru_cache_t *cache);
+
+/*
+ * Call before the cache is shared. Returns -1 when no account is left or
+ * the budget cannot take what the cache already holds.
+ */
+int lru_cache_set_budget(lru_cache_t *cache, const char *name);
+
+void lru_cache_stats(lru_cache_t *cache, lru_cache_stats_t *stats);
+
+#endif // _LRUCACHE_H
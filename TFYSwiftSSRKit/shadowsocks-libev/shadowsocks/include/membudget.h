@@ -0,0 +1,147 @@
+/*
+ * membudget.h - Define the process-wide memory accountant
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEMBUDGET_H
+#define _MEMBUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ev.h>
+
+/*
+ * A packet tunnel extension is killed as soon as it crosses its memory
+ * limit, so every pool and cache that grows with traffic registers an
+ * account here and charges what it holds.
+ *
+ *  - Below the soft limit nothing happens.
+ *  - Crossing the soft limit raises MEM_BUDGET_PRESSURE: every attached
+ *    loop stops the read watchers it manages through mem_budget_io_*()
+ *    whose connection has writes queued, and asks its accounts to shrink.
+ *    A stopped reader starts again as soon as its own connection's queue
+ *    drains (mem_budget_reader_queued()), so under pressure every
+ *    connection has at most one buffer in flight. All reads run freely
+ *    again once usage falls under resume_ratio * soft.
+ *  - A charge that would cross the hard limit fails and is not recorded,
+ *    so accounted memory never exceeds it.
+ *
+ * Charges are lock free and may come from any thread. Readers and shrink
+ * callbacks run on the loop they were registered with.
+ */
+
+#define MEM_BUDGET_DEFAULT_SOFT     (24 * 1024 * 1024)
+#define MEM_BUDGET_DEFAULT_HARD     (40 * 1024 * 1024)
+#define MEM_BUDGET_DEFAULT_RESUME   0.8
+#define MEM_BUDGET_MAX_ACCOUNTS     32
+
+typedef enum mem_budget_level {
+    MEM_BUDGET_NORMAL,
+    MEM_BUDGET_PRESSURE
+} mem_budget_level_t;
+
+typedef struct mem_budget_config {
+    size_t soft_limit;      // bytes, 0 for the default
+    size_t hard_limit;      // bytes, 0 for the default
+    double resume_ratio;    // of soft_limit, 0 for the default
+} mem_budget_config_t;
+
+typedef struct mem_account_stats {
+    const char *name;
+    size_t used;
+    size_t peak;
+    uint64_t denied;        // charges refused at the hard limit
+    uint64_t shrunk;        // bytes given back to shrink requests
+} mem_account_stats_t;
+
+typedef struct mem_budget_stats {
+    size_t used;
+    size_t peak;
+    size_t soft_limit;
+    size_t hard_limit;
+    mem_budget_level_t level;
+    uint64_t pressure_events;
+    uint64_t denied;
+    size_t paused_readers;
+    int accounts;
+    mem_account_stats_t account[MEM_BUDGET_MAX_ACCOUNTS];
+} mem_budget_stats_t;
+
+typedef struct mem_budget_loop mem_budget_loop_t;
+typedef struct mem_account mem_account_t;
+
+/*
+ * Release up to target bytes and return how many were released. The
+ * callback uncharges what it frees itself.
+ */
+typedef size_t (*mem_shrink_cb)(void *data, size_t target);
+
+/*
+ * A read watcher under budget control. The relay calls mem_budget_io_start
+ * and mem_budget_io_stop where it would call ev_io_start and ev_io_stop,
+ * and reports how many bytes its connection has waiting to be written
+ * with mem_budget_reader_queued() after each read and write. The watcher
+ * runs while the relay wants it and there is no pressure or nothing
+ * queued.
+ */
+typedef struct mem_budget_reader {
+    mem_budget_loop_t *owner;
+    ev_io *io;
+    int wanted;
+    int paused;
+    size_t queued;
+    struct mem_budget_reader *prev;
+    struct mem_budget_reader *next;
+} mem_budget_reader_t;
+
+void mem_budget_configure(const mem_budget_config_t *config);
+
+mem_budget_loop_t *mem_budget_attach(struct ev_loop *loop);
+void mem_budget_detach(mem_budget_loop_t *owner);
+
+/*
+ * owner is the loop the shrink callback runs on. Accounts without a
+ * shrink callback, or whose callback is thread safe, may pass NULL; their
+ * callback then runs on the first attached loop.
+ */
+mem_account_t *mem_budget_register(const char *name, mem_budget_loop_t *owner,
+                                   mem_shrink_cb shrink, void *data);
+
+/*
+ * Bytes still charged stay counted, and may be uncharged later; the slot
+ * is reused once the account is back to zero.
+ */
+void mem_budget_unregister(mem_account_t *account);
+
+/*
+ * Returns 0 when charged, -1 when the charge would exceed the hard limit.
+ */
+int mem_budget_charge(mem_account_t *account, size_t bytes);
+void mem_budget_uncharge(mem_account_t *account, size_t bytes);
+
+mem_budget_level_t mem_budget_level(void);
+
+void mem_budget_reader_init(mem_budget_reader_t *reader, mem_budget_loop_t *owner, ev_io *io);
+void mem_budget_reader_release(mem_budget_reader_t *reader);
+void mem_budget_io_start(mem_budget_reader_t *reader);
+void mem_budget_io_stop(mem_budget_reader_t *reader);
+void mem_budget_reader_queued(mem_budget_reader_t *reader, size_t bytes);
+
+void mem_budget_stats(mem_budget_stats_t *stats);
+
+#endif // _MEMBUDGET_H
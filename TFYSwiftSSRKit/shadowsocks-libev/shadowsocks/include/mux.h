@@ -0,0 +1,209 @@
+/*
+ * mux.h - Define the stream multiplexer carried inside one AEAD connection
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MUX_H
+#define _MUX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "ringrelay.h"
+
+/*
+ * Many proxied connections as streams of one encrypted connection to the
+ * server, so that a short request does not pay for its own handshake,
+ * slow start and salt.
+ *
+ * The framing is yamux's: a 12 byte header, big endian
+ *
+ *   version(1) = 0 | type(1) | flags(2) | stream id(4) | length(4)
+ *
+ * followed by length payload bytes for MUX_DATA. Frames are plaintext of
+ * the connection's AEAD stream. The client opens odd stream ids and the
+ * server even ones. Each stream starts with the usual shadowsocks address
+ * header, so the server side handles a stream like a connection.
+ *
+ * A connection becomes a session when its first address header names
+ * MUX_MAGIC_HOST (see mux_magic_header()). A server without mux support
+ * fails to resolve that name and closes the connection. The client then
+ * goes back to one connection per request for that server.
+ *
+ * Flow control is per stream. A stream may have up to window bytes in
+ * flight. The receiver returns credit with MUX_WINDOW_UPDATE once the
+ * application has passed data on (mux_stream_consumed()) and half the
+ * window is used, so a slow browser socket holds back only its own
+ * stream, not the session.
+ *
+ * The session does no I/O itself. Plaintext bytes received from the
+ * connection go to mux_session_input(). The bytes to encrypt and send sit
+ * in an output ring, read with mux_session_output() and released with
+ * mux_session_consume().
+ *
+ * A session belongs to one event loop and is not thread safe.
+ */
+
+#define MUX_VERSION             0
+#define MUX_HEADER_SIZE         12
+#define MUX_DEFAULT_WINDOW      (256 * 1024)
+#define MUX_DEFAULT_OUTPUT      (256 * 1024)
+#define MUX_DEFAULT_MAX_STREAMS 128
+#define MUX_MAX_FRAME           (16 * 1024)
+#define MUX_MAGIC_HOST          "mux.shadowsocks.arpa"
+
+// Frame types
+#define MUX_DATA                0
+#define MUX_WINDOW_UPDATE       1
+#define MUX_PING                2
+#define MUX_GO_AWAY             3
+
+// Frame flags
+#define MUX_SYN                 0x1
+#define MUX_ACK                 0x2
+#define MUX_FIN                 0x4
+#define MUX_RST                 0x8
+
+typedef enum mux_role {
+    MUX_ROLE_CLIENT,
+    MUX_ROLE_SERVER
+} mux_role_t;
+
+typedef struct mux_session mux_session_t;
+typedef struct mux_stream mux_stream_t;
+
+/*
+ * All callbacks run from mux_session_input(), mux_session_consume() or a
+ * stream call. They may write, close or reset any stream, but must not
+ * free the session; on_output should only arm the connection's write
+ * watcher. After on_close the stream is gone.
+ */
+typedef struct mux_callbacks {
+    void (*on_accept)(void *data, mux_stream_t *stream);    // server role
+    void (*on_data)(void *data, mux_stream_t *stream, const char *buf, size_t len);
+    void (*on_fin)(void *data, mux_stream_t *stream);       // peer half-closed
+    void (*on_writable)(void *data, mux_stream_t *stream);  // after a 0 from write
+    void (*on_close)(void *data, mux_stream_t *stream, int error);
+    void (*on_output)(void *data);                          // output went non-empty
+    void (*on_pong)(void *data, uint32_t opaque);
+} mux_callbacks_t;
+
+typedef struct mux_config {
+    uint32_t window;            // per stream receive window, 0 for the default
+    size_t output_size;         // output ring, 0 for the default
+    int max_streams;            // 0 for the default
+} mux_config_t;
+
+typedef struct mux_stats {
+    int streams;
+    uint64_t opened;
+    uint64_t accepted;
+    uint64_t refused;           // over max_streams or after GO_AWAY
+    uint64_t resets;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t frames_in;
+    uint64_t frames_out;
+    uint64_t stalls;            // writes cut short by window or output space
+} mux_stats_t;
+
+mux_session_t *mux_session_new(mux_role_t role, const mux_config_t *config,
+                               const mux_callbacks_t *callbacks, void *data);
+
+// Frees every stream without calling back
+void mux_session_free(mux_session_t *session);
+
+/*
+ * Feed plaintext from the connection. Returns 0, or -1 on a protocol error
+ * after which the session must be freed.
+ */
+int mux_session_input(mux_session_t *session, const char *buf, size_t len);
+
+int mux_session_output(const mux_session_t *session, struct iovec iov[2]);
+void mux_session_consume(mux_session_t *session, size_t len);
+size_t mux_session_pending(const mux_session_t *session);
+
+int mux_session_ping(mux_session_t *session, uint32_t opaque);
+
+// No new streams either way; the open ones run to completion
+void mux_session_go_away(mux_session_t *session);
+int mux_session_accepting(const mux_session_t *session);
+int mux_session_streams(const mux_session_t *session);
+
+void mux_session_stats(const mux_session_t *session, mux_stats_t *stats);
+
+// NULL when the session is going away or full
+mux_stream_t *mux_stream_open(mux_session_t *session, void *data);
+
+/*
+ * Returns the bytes accepted, which may be fewer than len or 0 when the
+ * peer's window or the output ring is full; on_writable follows once
+ * there is room. -1 when the stream was closed for writing.
+ */
+ssize_t mux_stream_write(mux_stream_t *stream, const char *buf, size_t len);
+
+/*
+ * How many bytes mux_stream_write() would accept now, for writers such as
+ * uot.h that send a record whole or not at all. A short answer does not
+ * schedule on_writable.
+ */
+size_t mux_stream_writable(const mux_stream_t *stream);
+
+// The application passed len bytes from on_data on
+void mux_stream_consumed(mux_stream_t *stream, size_t len);
+
+// Half close: FIN after what has been written
+void mux_stream_close(mux_stream_t *stream);
+
+/*
+ * Abort: RST, and the stream is freed at once without on_close. When the
+ * output ring is full the RST goes out as soon as there is room.
+ */
+void mux_stream_reset(mux_stream_t *stream);
+
+uint32_t mux_stream_id(const mux_stream_t *stream);
+void *mux_stream_data(const mux_stream_t *stream);
+void mux_stream_set_data(mux_stream_t *stream, void *data);
+
+/*
+ * Write the shadowsocks address header that asks for a mux session into
+ * buf and return its length; buf must have room for 4 + the host length.
+ */
+size_t mux_magic_header(char *buf);
+
+// Whether an address header, as the server parsed it, asks for a session
+int mux_is_magic_host(const char *host, size_t len);
+
+/*
+ * Up to sessions connections to one server. pick spreads streams over new
+ * connections first, then puts each on the session with the fewest open.
+ * NULL means the caller should connect a new session and add it, when
+ * mux_pool_can_grow() says so, or fall back to a plain connection.
+ */
+typedef struct mux_pool mux_pool_t;
+
+mux_pool_t *mux_pool_new(int sessions);
+void mux_pool_free(mux_pool_t *pool);
+mux_session_t *mux_pool_pick(mux_pool_t *pool);
+int mux_pool_add(mux_pool_t *pool, mux_session_t *session);
+void mux_pool_remove(mux_pool_t *pool, mux_session_t *session);
+int mux_pool_can_grow(const mux_pool_t *pool);
+
+#endif // _MUX_H
@@ -0,0 +1,111 @@
+/*
+ * nattable.h - Define the UDP NAT table keyed by binary 5-tuples
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NATTABLE_H
+#define _NATTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define NAT_TABLE_MAX_LOAD      75      // percent of the capacity
+#define NAT_TABLE_INSERT_SWEEP  64      // slots an insert at the limit sweeps
+
+/*
+ * The UDP relay's map from a client flow to its remote socket, in place of
+ * the uthash struct cache with its heap allocated hash_key() strings.
+ *
+ * The table is one array of inline entries with linear probing, sized
+ * once at creation; a packet costs a hash and a few compares and never
+ * allocates. Deletion shifts the following entries back, so there are no
+ * tombstones and probe runs stay short.
+ *
+ * Expiry uses generations. The owner advances the table's generation,
+ * say once a second, with nat_table_tick(); a lookup stamps the entry
+ * with the current one. An entry not stamped for timeout generations is
+ * a miss for lookups and is freed by nat_table_sweep(), which walks a few
+ * slots per call, so there is no timer and no full scan under a lock.
+ *
+ * Lookups are lock-free and may run on any thread. Writers take a spin
+ * lock and bump a sequence count around every change; a reader that saw
+ * the count move retries. free_cb runs on the writer's thread, sometimes
+ * under the lock, so it must not call back into the table; and a value
+ * found on another thread must outlive it, e.g. by being freed later by
+ * the loop that owns it.
+ */
+
+typedef struct nat_key {
+    uint8_t family;
+    uint8_t protocol;
+    uint16_t src_port;              // network order
+    uint16_t dst_port;
+    uint16_t reserved;
+    uint8_t src[16];
+    uint8_t dst[16];
+} nat_key_t;
+
+typedef struct nat_table_stats {
+    size_t size;
+    size_t capacity;
+    uint64_t inserts;
+    uint64_t removes;
+    uint64_t expired;
+    uint64_t full;                  // inserts refused
+    uint64_t retries;               // lookups that raced a writer
+    size_t max_probe;
+} nat_table_stats_t;
+
+typedef struct nat_table nat_table_t;
+
+/*
+ * Fill key from a source and an optional destination, zeroing the rest.
+ * The relay keys on the client address alone, as hash_key() did, and
+ * passes dst NULL.
+ */
+void nat_key_set(nat_key_t *key, int protocol,
+                 const struct sockaddr *src, const struct sockaddr *dst);
+
+// capacity is rounded up to a power of two; timeout is in generations
+nat_table_t *nat_table_new(size_t capacity, uint32_t timeout, void (*free_cb)(void *value));
+void nat_table_free(nat_table_t *table, int keep_data);
+
+// NULL on a miss or an expired entry
+void *nat_table_lookup(nat_table_t *table, const nat_key_t *key);
+
+/*
+ * Add or replace. At NAT_TABLE_MAX_LOAD an insert first sweeps up to
+ * NAT_TABLE_INSERT_SWEEP slots from the sweep cursor, so the time under
+ * the lock stays bounded. Returns 0, EINVAL for a NULL value, or ENOSPC
+ * when the table is still full, i.e. when that sweep reclaimed nothing;
+ * regular nat_table_sweep() calls keep that rare.
+ */
+int nat_table_insert(nat_table_t *table, const nat_key_t *key, void *value);
+
+// Returns the value without freeing it, NULL when absent
+void *nat_table_remove(nat_table_t *table, const nat_key_t *key);
+
+void nat_table_tick(nat_table_t *table, uint32_t generation);
+
+// Look at up to budget slots; returns how many entries were freed
+size_t nat_table_sweep(nat_table_t *table, size_t budget);
+
+void nat_table_stats(nat_table_t *table, nat_table_stats_t *stats);
+
+#endif // _NATTABLE_H
@@ -0,0 +1,135 @@
+/*
+ * pmtu.h - Define per-server path MTU discovery for the UDP relay
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PMTU_H
+#define _PMTU_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <ev.h>
+
+#include "jconf.h"
+
+#define PMTU_MAX_SERVERS        MAX_REMOTE_NUM
+#define PMTU_MIN                1280        // IPv6 minimum, assumed to get through
+#define PMTU_MIN_IPV4           576         // lowest a too-big report may set
+#define PMTU_DEFAULT_MAX        1500
+#define PMTU_DEFAULT_TIMEOUT    1.0         // seconds for a probe answer
+#define PMTU_DEFAULT_TRIES      3           // unanswered probes before a size fails
+#define PMTU_DEFAULT_STEP       8           // search stops within this many bytes
+#define PMTU_DEFAULT_REPROBE    600.0       // seconds between searches
+#define PMTU_UDP_HEADER         8
+#define PMTU_RELAY_OVERHEAD     (32 + 16 + 19)  // salt, tag, IPv6 address header
+
+/*
+ * Packetization-layer path MTU discovery (RFC 8899) towards each server,
+ * so that the UDP relay sends the largest datagrams that arrive whole
+ * instead of DEFAULT_PACKET_SIZE or a fixed profile_t.mtu.
+ *
+ * A search is a binary search between the confirmed size and max. Each
+ * step asks the relay to send one probe datagram of the given size with
+ * the don't-fragment bit set (pmtu_set_dont_fragment()), for instance a
+ * DNS query to the server's resolver padded with EDNS(0) padding, and to
+ * report the answer with pmtu_ack(). A size fails after tries probes go
+ * unanswered, or at once when the send fails with EMSGSIZE.
+ *
+ * Every reprobe seconds the search runs again. It first confirms the
+ * current size, so a path that shrank without telling anyone (an ICMP
+ * black hole) is found, then tries to grow. pmtu_too_big() takes an MTU
+ * learnt from ICMP or EMSGSIZE on relay traffic and applies it at once.
+ *
+ * Until its first search ends a server is at PMTU_MIN. pmtu_cb runs
+ * whenever a server's MTU changes.
+ *
+ * A prober belongs to one event loop. pmtu_tunnel_mtu() may be called
+ * from any thread.
+ */
+
+/*
+ * Send a probe of payload bytes of UDP payload to server. Returns 0, or
+ * an errno value; EMSGSIZE fails the size without waiting.
+ */
+typedef int (*pmtu_send_cb)(void *data, int server, size_t payload, uint32_t id);
+typedef void (*pmtu_cb)(void *data, int server, size_t mtu);
+
+typedef struct pmtu_config {
+    size_t max;                 // largest MTU tried, 0 for the default
+    double timeout;             // 0 for the default
+    int tries;                  // 0 for the default
+    size_t step;                // 0 for the default
+    double reprobe;             // 0 for the default
+} pmtu_config_t;
+
+typedef struct pmtu_server_stats {
+    size_t mtu;
+    size_t payload;             // largest UDP payload, pmtu_udp_payload()
+    int searching;
+    size_t trying;              // size being probed, 0 when idle
+    double next_search;         // seconds from now, 0 while searching
+    uint64_t probes;
+    uint64_t acks;
+    uint64_t too_big;
+    uint64_t searches;
+} pmtu_server_stats_t;
+
+typedef struct pmtu pmtu_t;
+
+pmtu_t *pmtu_new(struct ev_loop *loop, const pmtu_config_t *config,
+                 pmtu_send_cb send, pmtu_cb cb, void *data);
+void pmtu_free(pmtu_t *pmtu);
+
+// Returns the server index, or -1 when PMTU_MAX_SERVERS are in
+int pmtu_add(pmtu_t *pmtu, const struct sockaddr *addr);
+void pmtu_start(pmtu_t *pmtu);
+
+void pmtu_ack(pmtu_t *pmtu, int server, uint32_t id);
+void pmtu_too_big(pmtu_t *pmtu, int server, size_t mtu);
+
+// Search again now, e.g. after a network change
+void pmtu_restart(pmtu_t *pmtu);
+
+size_t pmtu_mtu(const pmtu_t *pmtu, int server);
+
+// The largest datagram payload to send to server; the relay takes its own overhead off
+size_t pmtu_udp_payload(const pmtu_t *pmtu, int server);
+
+void pmtu_server_stats(const pmtu_t *pmtu, int server, pmtu_server_stats_t *stats);
+
+/*
+ * The MTU for the tunnel interface: the largest inner IPv4 packet whose
+ * UDP payload the relay can still send in one datagram to the worst
+ * searched server, counting PMTU_RELAY_OVERHEAD. At least PMTU_MIN, or 0
+ * before any search has ended.
+ */
+size_t pmtu_tunnel_mtu(void);
+
+/*
+ * The same for a path MTU of mtu towards a server of family, e.g. one
+ * set by hand: mtu is the outer size, the tunnel MTU is smaller by the
+ * outer headers and PMTU_RELAY_OVERHEAD. At least PMTU_MIN.
+ */
+size_t pmtu_tunnel_mtu_for(size_t mtu, int family);
+
+// IP_DONTFRAG / IPV6_DONTFRAG, or the Linux IP_PMTUDISC_PROBE equivalent
+int pmtu_set_dont_fragment(int fd, int family);
+
+#endif // _PMTU_H
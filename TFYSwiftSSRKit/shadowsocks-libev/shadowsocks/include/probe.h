@@ -0,0 +1,145 @@
+/*
+ * probe.h - Define active health probes of the remote servers
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PROBE_H
+#define _PROBE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <ev.h>
+
+#include "jconf.h"
+
+#define PROBE_MAX_SERVERS           MAX_REMOTE_NUM
+#define PROBE_DEFAULT_INTERVAL      30.0        // seconds
+#define PROBE_DEFAULT_MAX_INTERVAL  600.0
+#define PROBE_DEFAULT_JITTER        0.2
+#define PROBE_DEFAULT_TIMEOUT       5.0
+#define PROBE_DEFAULT_TARGET_RTT    0.5
+#define PROBE_DEFAULT_ALPHA         0.3
+#define PROBE_BUF_SIZE              2048
+
+/*
+ * Measures each remote server on its own schedule instead of guessing
+ * from traffic counters. A probe connects to the server and, when a
+ * handshake is given, sends one encrypted request through it and waits
+ * for the decrypted reply. It yields three times:
+ *
+ *   connect_rtt    SYN to connected
+ *   handshake_rtt  request sent to the first reply byte (the server salt)
+ *   round_trip     request sent to the whole first reply chunk
+ *
+ * Probes repeat every interval seconds, spread by +-jitter so that the
+ * servers and the clients of one server do not probe in step. After n
+ * failures in a row the next probe waits interval * 2^n, up to
+ * max_interval, so that a dead server is not hammered.
+ *
+ * Each server has a health score in [0, 1]:
+ *
+ *   success * min(1, target_rtt / rtt)
+ *
+ * with success and rtt EWMAs of the probe outcomes and of the slowest
+ * time measured. A server that has not been probed yet has health 1.
+ * balancer_set_health() feeds the score to the connection selector.
+ *
+ * A prober belongs to one event loop.
+ */
+
+/*
+ * The encrypted part of a probe. request fills buf with the ciphertext
+ * of an address header and a small payload, e.g. a HEAD request, and
+ * returns its length or -1. response is fed the reply bytes as they come
+ * and returns 1 once a whole chunk decrypted, 0 for more or -1 when the
+ * reply does not decrypt. release frees what request put into ctx. All
+ * three are passed data. probeaead.h implements one for the AEAD ciphers.
+ */
+typedef struct probe_handshake {
+    ssize_t (*request)(void *data, int server, char *buf, size_t size, void **ctx);
+    int (*response)(void *data, void *ctx, const char *buf, size_t len);
+    void (*release)(void *data, void *ctx);
+    void *data;
+} probe_handshake_t;
+
+typedef struct probe_config {
+    double interval;            // seconds between probes, 0 for the default
+    double max_interval;        // longest backoff, 0 for the default
+    double jitter;              // fraction of the interval, 0 for the default
+    double timeout;             // per probe, 0 for the default
+    double target_rtt;          // full score at or below, 0 for the default
+    double alpha;               // EWMA weight of a new probe, 0 for the default
+} probe_config_t;
+
+typedef struct probe_result {
+    int server;
+    int ok;
+    int error;                  // errno of a failed probe
+    double connect_rtt;
+    double handshake_rtt;       // 0 without a handshake
+    double round_trip;
+    double health;              // after this probe
+} probe_result_t;
+
+typedef struct probe_server_stats {
+    double health;
+    double success;
+    double rtt;
+    double connect_rtt;         // last probe, 0 when it failed
+    double handshake_rtt;
+    double round_trip;
+    double next_probe;          // seconds from now
+    int failures;               // in a row
+    uint64_t probes;
+    uint64_t failed;
+} probe_server_stats_t;
+
+typedef void (*probe_cb)(void *data, const probe_result_t *result);
+
+typedef struct probe probe_t;
+
+// handshake may be NULL to measure the TCP connect only
+probe_t *probe_new(struct ev_loop *loop, const probe_config_t *config,
+                   const probe_handshake_t *handshake, probe_cb cb, void *data);
+void probe_free(probe_t *probe);
+
+// Returns the server index, or -1 when PROBE_MAX_SERVERS are in
+int probe_add(probe_t *probe, const struct sockaddr *addr, socklen_t addr_len);
+void probe_start(probe_t *probe);
+
+/*
+ * Probe a server now, e.g. after the relay saw it fail, unless a probe is
+ * running or the last one ended less than a second ago.
+ */
+void probe_trigger(probe_t *probe, int server);
+
+double probe_health(const probe_t *probe, int server);
+void probe_server_stats(const probe_t *probe, int server, probe_server_stats_t *stats);
+
+/*
+ * Failover decision over count health scores, current being the server
+ * in use. Returns current while it scores at least healthy and is not
+ * down, else the best other server when it beats current by margin or
+ * more. With no such server, returns current while it is merely slow and
+ * -1 when it is down, i.e. when only a reconnect is left.
+ */
+int probe_failover(const double *health, const int *down, int count, int current,
+                   double healthy, double margin);
+
+#endif // _PROBE_H
@@ -0,0 +1,70 @@
+/*
+ * probeaead.h - Define the AEAD handshake of the health probes
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PROBEAEAD_H
+#define _PROBEAEAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hkdf.h"
+#include "probe.h"
+
+#define PROBE_AEAD_MAX_REQUEST  1024
+
+/*
+ * A probe_handshake_t for the legacy AEAD ciphers (aes-128-gcm,
+ * aes-192-gcm, aes-256-gcm and chacha20-ietf-poly1305). The request is
+ * what a client sends on a new connection: a fresh salt, then the address
+ * of a target and a small payload sealed as one chunk. The reply passes
+ * once the server's salt and its first chunk decrypt under the same key,
+ * so a server that accepts the TCP connect but has the wrong key, no
+ * route to the target or a stalled relay fails the probe.
+ *
+ * The target should answer a short request quickly, e.g. a HEAD request
+ * to a well known web server on port 80.
+ */
+typedef struct probe_aead {
+    int method;
+    size_t key_len;
+    hkdf_psk_t psk;
+    uint8_t request[PROBE_AEAD_MAX_REQUEST];    // address header | payload
+    size_t request_len;
+} probe_aead_t;
+
+/*
+ * key is the master key from crypto_derive_key(), key_len bytes long for
+ * method. Returns 0, or -1 for an unsupported method, a wrong key length
+ * or a request that does not fit.
+ */
+int probe_aead_init(probe_aead_t *aead, int method, const uint8_t *key, size_t key_len,
+                    const char *host, uint16_t port, const char *payload, size_t payload_len);
+void probe_aead_release(probe_aead_t *aead);
+
+// To be passed to probe_new()
+probe_handshake_t probe_aead_handshake(probe_aead_t *aead);
+
+// The handshake callbacks, for probes that do their own I/O
+ssize_t probe_aead_request(void *data, int server, char *buf, size_t size, void **ctx);
+int probe_aead_response(void *data, void *ctx, const char *buf, size_t len);
+void probe_aead_free(void *data, void *ctx);
+
+#endif // _PROBEAEAD_H
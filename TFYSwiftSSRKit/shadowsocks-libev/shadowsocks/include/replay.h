@@ -0,0 +1,91 @@
+/*
+ * replay.h - Define the sharded salt replay filter interface
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _REPLAY_H
+#define _REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Unlike ppbloom, which keeps one process-global pair of filters, a replay
+ * filter is an object: the salt space is split into shards by a keyed hash,
+ * each shard owns three bloom generations (current, previous, next) and
+ * rotates them on its own once the generation is full, or, if asked for,
+ * too old. Bits are
+ * set with atomic OR, so check/add may run concurrently on any number of
+ * event-loop threads without a lock.
+ */
+
+#define REPLAY_DEFAULT_MEM_BUDGET   (1024 * 1024)
+#define REPLAY_DEFAULT_SHARDS       16
+#define REPLAY_DEFAULT_ERROR        1e-6
+#define REPLAY_MAX_SHARDS           256
+
+typedef struct replay_config {
+    size_t mem_budget;      // total bytes for all shards and generations
+    int shards;             // rounded up to a power of two
+    double error;           // target false-positive rate of a full generation
+    int rotate_interval;    // seconds before a generation is retired, 0 for never
+} replay_config_t;
+
+typedef struct replay_stats {
+    uint64_t checks;        // replay_filter_check calls
+    uint64_t adds;          // replay_filter_add calls
+    uint64_t hits;          // calls of either that reported a replay
+    uint64_t rotations;     // generations retired, all shards
+    size_t bytes;           // memory held by bit arrays
+    size_t capacity;        // entries per shard per generation
+    int shards;
+    int hashes;
+    double fp_rate;         // estimated false-positive rate, mean of shards
+    double fp_rate_max;     // estimated false-positive rate, worst shard
+} replay_stats_t;
+
+typedef struct replay_filter replay_filter_t;
+
+/*
+ * Create a replay filter. A NULL config, or zero fields in it, select the
+ * REPLAY_DEFAULT_* values. Returns NULL on allocation failure.
+ *
+ * By default a generation is only retired once it is full. A rotate
+ * interval bounds how long a salt is remembered to between one and two
+ * intervals, so it is only safe where the protocol refuses anything older
+ * on its own, as SIP022 does with its timestamp (AEAD2022_REPLAY_ROTATE).
+ * Legacy AEAD has no timestamp and must leave it at 0.
+ */
+replay_filter_t *replay_filter_new(const replay_config_t *config);
+void replay_filter_free(replay_filter_t *filter);
+
+/*
+ * Return 1 if the element has been seen within the last one to two
+ * generations (or is a false positive), 0 otherwise.
+ */
+int replay_filter_check(replay_filter_t *filter, const void *buffer, int len);
+
+/*
+ * Insert the element. Returns 1 if it was already present, 0 if it was
+ * newly added, so the usual check+add pair is a single call.
+ */
+int replay_filter_add(replay_filter_t *filter, const void *buffer, int len);
+
+void replay_filter_stats(replay_filter_t *filter, replay_stats_t *stats);
+
+#endif // _REPLAY_H
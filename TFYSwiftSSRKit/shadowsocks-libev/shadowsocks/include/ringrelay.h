@@ -0,0 +1,124 @@
+/*
+ * ringrelay.h - Define the ring buffer relay interface
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RINGRELAY_H
+#define _RINGRELAY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <ev.h>
+
+#include "membudget.h"
+
+#define RING_RELAY_DEFAULT_SIZE     (64 * 1024)
+#define RING_RELAY_DEFAULT_HIGH     0.75
+#define RING_RELAY_DEFAULT_LOW      0.25
+
+/*
+ * A fixed-size byte ring. Free space and pending data each wrap at most
+ * once, so both are described by at most two iovecs, which readv/writev
+ * fill or drain in one call.
+ */
+typedef struct byte_ring {
+    char *data;
+    size_t capacity;
+    size_t head;            // offset of the first pending byte
+    size_t len;             // pending bytes
+} byte_ring_t;
+
+int byte_ring_init(byte_ring_t *ring, size_t capacity);
+void byte_ring_release(byte_ring_t *ring);
+
+#define byte_ring_space(ring) ((ring)->capacity - (ring)->len)
+
+// Return the number of iovecs (0, 1 or 2) filled in
+int byte_ring_free_iov(const byte_ring_t *ring, struct iovec iov[2]);
+int byte_ring_data_iov(const byte_ring_t *ring, struct iovec iov[2]);
+
+void byte_ring_produce(byte_ring_t *ring, size_t n);
+void byte_ring_consume(byte_ring_t *ring, size_t n);
+
+// Copy in up to len bytes and return how many fitted
+size_t byte_ring_put(byte_ring_t *ring, const void *src, size_t len);
+
+ssize_t byte_ring_readv(byte_ring_t *ring, int fd);
+ssize_t byte_ring_writev(byte_ring_t *ring, int fd);
+
+/*
+ * Bytes read from one fd are passed to the transform, which appends its
+ * output to the ring with byte_ring_put and returns 0, or returns -1 to
+ * close the relay. Reads are sized so that len + reserve always fits.
+ */
+typedef int (*ring_transform_cb)(void *data, const char *in, size_t len,
+                                 byte_ring_t *out);
+
+typedef void (*ring_relay_close_cb)(void *data, int error);
+
+typedef struct ring_relay_config {
+    size_t ring_size;       // per direction, 0 for the default
+    double high_mark;       // stop reading above this fill ratio
+    double low_mark;        // resume reading below it
+    ring_transform_cb up;   // client to remote, NULL to copy as is
+    ring_transform_cb down; // remote to client
+    size_t reserve;         // worst case growth of a transform
+    mem_budget_loop_t *budget; // read watchers follow memory pressure, may be NULL
+} ring_relay_config_t;
+
+typedef struct ring_relay_stats {
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t throttled;     // times reading stopped at the high mark
+    size_t pending;
+} ring_relay_stats_t;
+
+typedef struct ring_relay ring_relay_t;
+
+/*
+ * Relay between two connected non-blocking sockets. Each direction has its
+ * own ring and its own pair of watchers, so a read into the ring and a
+ * write out of it are armed at the same time: the reader only stops at the
+ * high mark and the writer only while the ring is empty. Memory per
+ * connection is two rings, whatever the link's bandwidth-delay product.
+ *
+ * An EOF is passed on with shutdown(SHUT_WR) once its ring has drained.
+ * close_cb runs once, with error 0 after both directions have finished or
+ * an errno value otherwise; the fds are not closed. The relay may be freed
+ * from inside close_cb.
+ *
+ * Returns NULL with errno EINVAL when a direction could never read: a
+ * transform's reserve at or above ring_size, or a high mark under one
+ * byte.
+ */
+ring_relay_t *ring_relay_new(struct ev_loop *loop, int client_fd, int remote_fd,
+                             const ring_relay_config_t *config,
+                             ring_relay_close_cb close_cb, void *data);
+void ring_relay_start(ring_relay_t *relay);
+void ring_relay_free(ring_relay_t *relay);
+
+// Queue bytes already read for a direction, e.g. a request parsed ahead
+int ring_relay_push_up(ring_relay_t *relay, const char *buf, size_t len);
+int ring_relay_push_down(ring_relay_t *relay, const char *buf, size_t len);
+
+void ring_relay_stats(const ring_relay_t *relay, ring_relay_stats_t *up,
+                      ring_relay_stats_t *down);
+
+#endif // _RINGRELAY_H
@@ -0,0 +1,103 @@
+/*
+ * slab.h - Define the size-class slab allocator for relay buffers
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "encrypt.h"
+
+/*
+ * Relay buffers come in a few sizes: a UDP datagram, a socket read, a
+ * full AEAD chunk batch. Each size class is carved out of fixed-size
+ * pages, so a long tunnel session reuses the same memory instead of
+ * scattering reallocs over the system heap.
+ *
+ * Every thread keeps a small cache per class and only takes the class
+ * lock to refill or flush it in batches. Pages count against a global
+ * cap; past it, and for requests above the largest class, blocks come
+ * straight from ss_malloc and go straight back on free. A page that
+ * becomes entirely free is returned to the system once the class already
+ * holds a spare one.
+ *
+ * Pages and ss_malloc blocks are charged to the "slab" account of the
+ * memory budget. A request the budget refuses fails like an allocation
+ * failure, and the spare pages are given back under pressure.
+ */
+
+#define SLAB_CLASS_NUM          3
+#define SLAB_CLASS_SMALL        2048
+#define SLAB_CLASS_MEDIUM       (16 * 1024)
+#define SLAB_CLASS_LARGE        (64 * 1024)
+#define SLAB_DEFAULT_CAP        (8 * 1024 * 1024)
+
+typedef struct slab_class_stats {
+    size_t size;            // usable bytes per block
+    size_t pages;
+    size_t blocks;          // blocks in all pages
+    size_t in_use;          // handed out, including thread caches
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t cache_hits;    // served from a thread cache
+} slab_class_stats_t;
+
+typedef struct slab_stats {
+    slab_class_stats_t classes[SLAB_CLASS_NUM];
+    size_t cap;
+    size_t reserved;        // bytes held by pages
+    uint64_t oversize;      // requests above the largest class
+    uint64_t overflow;      // class requests served by ss_malloc past the cap
+} slab_stats_t;
+
+/*
+ * Set the page cap, in bytes. Lowering it does not release pages that
+ * are in use; it only stops new ones from being made.
+ */
+void slab_set_cap(size_t cap);
+
+void *slab_alloc(size_t size, size_t *usable);
+void *slab_realloc(void *ptr, size_t size, size_t *usable);
+void slab_free(void *ptr);
+
+/*
+ * Drop-in replacements for balloc/brealloc/bfree. capacity is set to the
+ * usable size of the block, which may be larger than requested. Buffers
+ * from here must only be grown and freed through these calls.
+ */
+int slab_balloc(buffer_t *ptr, size_t capacity);
+int slab_brealloc(buffer_t *ptr, size_t len, size_t capacity);
+void slab_bfree(buffer_t *ptr);
+
+/*
+ * Return the calling thread's cached blocks to their pages. Called on
+ * thread exit as well.
+ */
+void slab_thread_flush(void);
+
+/*
+ * Free the spare empty pages of every class and return the bytes released.
+ */
+size_t slab_trim(void);
+
+void slab_stats(slab_stats_t *stats);
+
+#endif // _SLAB_H
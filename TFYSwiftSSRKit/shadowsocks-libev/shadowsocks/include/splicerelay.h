@@ -0,0 +1,67 @@
+/*
+ * splicerelay.h - Define the zero-copy relay for direct connections
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SPLICERELAY_H
+#define _SPLICERELAY_H
+
+#include <ev.h>
+
+#include "ringrelay.h"
+
+#define SPLICE_RELAY_PIPE_SIZE      (256 * 1024)
+
+/*
+ * Relay for connections the ACL or rules send direct (remote->direct):
+ * nothing is encrypted, so the bytes never need to enter user space.
+ *
+ * On Linux each direction moves data socket -> pipe -> socket with
+ * splice(2), and the proxy only sees the byte counts. Reading stops while
+ * the pipe is full and resumes once it has been drained.
+ *
+ * Darwin has no socket to socket splice, so there, or when pipes cannot be
+ * made, the relay runs on a ring_relay: one copy through a fixed ring with
+ * readv/writev, still without the per-read buffer_t churn.
+ *
+ * close_cb, stats and ownership of the fds follow ring_relay.
+ */
+typedef enum splice_relay_mode {
+    SPLICE_RELAY_SPLICE,
+    SPLICE_RELAY_COPY
+} splice_relay_mode_t;
+
+typedef struct splice_relay_config {
+    size_t pipe_size;           // 0 for the default, rounded by the kernel
+    int force_copy;             // use the ring path even where splice works
+    mem_budget_loop_t *budget;  // may be NULL
+} splice_relay_config_t;
+
+typedef struct splice_relay splice_relay_t;
+
+splice_relay_t *splice_relay_new(struct ev_loop *loop, int client_fd, int remote_fd,
+                                 const splice_relay_config_t *config,
+                                 ring_relay_close_cb close_cb, void *data);
+void splice_relay_start(splice_relay_t *relay);
+void splice_relay_free(splice_relay_t *relay);
+
+splice_relay_mode_t splice_relay_mode(const splice_relay_t *relay);
+void splice_relay_stats(const splice_relay_t *relay, ring_relay_stats_t *up,
+                        ring_relay_stats_t *down);
+
+#endif // _SPLICERELAY_H
@@ -0,0 +1,98 @@
+/*
+ * timerwheel.h - Define a hierarchical timing wheel for connection timeouts
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+
+#include <stdint.h>
+#include <ev.h>
+
+#include <libcork/ds.h>
+
+#define TIMER_WHEEL_LEVELS              4
+#define TIMER_WHEEL_BITS                6
+#define TIMER_WHEEL_SLOTS               (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_DEFAULT_RESOLUTION  0.1     // seconds
+
+/*
+ * Idle and connect timeouts of many connections on one loop timer,
+ * instead of an ev_timer per context that every read pushes back through
+ * the libev heap.
+ *
+ * The wheel has TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots. A
+ * tick is resolution seconds; level n holds timers due within 64^(n+1)
+ * ticks and is moved down a level when the level below wraps, so start
+ * and stop are O(1) list operations and 4 levels at 100 ms reach 19 days.
+ *
+ * timer_wheel_touch() is the call for the hot path: it only moves the
+ * timer's deadline. The timer stays in its slot, and when the slot comes
+ * due the wheel sees the later deadline and puts the timer back in for
+ * the rest. A connection that keeps reading costs one store per read and
+ * one relink per timeout period.
+ *
+ * Timers fire up to two resolutions late, never early. The loop timer
+ * only runs while the wheel holds timers. A wheel belongs to one event
+ * loop.
+ */
+
+typedef struct timer_wheel timer_wheel_t;
+typedef struct timer_wheel_entry timer_wheel_entry_t;
+
+typedef void (*timer_wheel_cb)(timer_wheel_entry_t *entry, void *data);
+
+// Embedded in the connection context, like the ev_timer it replaces
+struct timer_wheel_entry {
+    struct cork_dllist_item slot;
+    uint64_t expires;           // tick of the slot it is in
+    uint64_t deadline;          // tick it is due, >= expires
+    uint64_t ticks;             // timeout, for touch
+    int active;
+    timer_wheel_cb cb;
+    void *data;
+};
+
+typedef struct timer_wheel_stats {
+    uint64_t timers;            // active now
+    uint64_t fired;
+    uint64_t rearmed;           // relinked after a touch
+    uint64_t cascaded;          // moved down a level
+} timer_wheel_stats_t;
+
+timer_wheel_t *timer_wheel_new(struct ev_loop *loop, double resolution);
+
+// Leaves the remaining timers inactive without calling them
+void timer_wheel_free(timer_wheel_t *wheel);
+
+void timer_wheel_entry_init(timer_wheel_entry_t *entry, timer_wheel_cb cb, void *data);
+
+// (Re)start with a new timeout, e.g. from the connect to the idle timeout
+void timer_wheel_start(timer_wheel_t *wheel, timer_wheel_entry_t *entry, double timeout);
+
+// Push the deadline a full timeout out from now, in O(1)
+void timer_wheel_touch(timer_wheel_t *wheel, timer_wheel_entry_t *entry);
+
+void timer_wheel_stop(timer_wheel_t *wheel, timer_wheel_entry_t *entry);
+
+// Seconds until it fires, 0 when inactive
+double timer_wheel_remaining(const timer_wheel_t *wheel, const timer_wheel_entry_t *entry);
+
+void timer_wheel_stats(const timer_wheel_t *wheel, timer_wheel_stats_t *stats);
+
+#endif // _TIMERWHEEL_H
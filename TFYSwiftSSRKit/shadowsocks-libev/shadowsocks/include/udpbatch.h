@@ -0,0 +1,104 @@
+/*
+ * udpbatch.h - Define the batched UDP socket I/O interface
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _UDPBATCH_H
+#define _UDPBATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "udpcrypto.h"
+
+#define UDP_BATCH_MAX               32
+#define UDP_BATCH_GRO_BUF_SIZE      65535
+
+// Offloads udp_batch_enable_offload() managed to turn on
+#define UDP_BATCH_GRO               0x1
+#define UDP_BATCH_GSO               0x2
+
+/*
+ * A vector of datagrams moved with one recvmmsg/sendmmsg where Linux has
+ * them, and with a recvfrom/sendto loop elsewhere. The packets are
+ * udp_packet_t, so a whole batch goes through udp_crypto_encrypt and
+ * udp_crypto_decrypt in one call, in place.
+ *
+ * Every slot is slot_size bytes. offset says where in the slot a packet's
+ * bytes start: 0 for datagrams on the wire side, udp_crypto_headroom()
+ * for plaintext that is about to be encrypted or was just decrypted.
+ *
+ * With GRO the kernel hands over several datagrams from one sender glued
+ * together; they are split back into slots, and whatever does not fit is
+ * kept for the next receive. A read the kernel truncated is dropped
+ * whole, as is a truncated datagram without GRO. With GSO, runs of
+ * same-size packets to the same address leave as one UDP_SEGMENT send. A
+ * send that the path rejects turns GSO off for the batch and is retried
+ * packet by packet.
+ */
+typedef struct udp_batch_stats {
+    uint64_t syscalls;
+    uint64_t received;
+    uint64_t sent;
+    uint64_t dropped;       // EAGAIN or an error on send
+    uint64_t gro_segments;  // datagrams that arrived coalesced
+    uint64_t gso_segments;  // datagrams that left coalesced
+} udp_batch_stats_t;
+
+typedef struct udp_batch_sys udp_batch_sys_t;
+
+typedef struct udp_batch {
+    int count;
+    int slots;
+    size_t slot_size;
+    int offload;
+    udp_packet_t pkt[UDP_BATCH_MAX];
+    struct sockaddr_storage addr[UDP_BATCH_MAX];
+    socklen_t addr_len[UDP_BATCH_MAX];
+    udp_batch_stats_t stats;
+    udp_batch_sys_t *sys;
+} udp_batch_t;
+
+udp_batch_t *udp_batch_new(int slots, size_t slot_size);
+void udp_batch_free(udp_batch_t *batch);
+
+/*
+ * Turn on GRO and check for GSO on a UDP socket, and remember for this
+ * batch which of them worked. Returns the UDP_BATCH_* flags.
+ */
+int udp_batch_enable_offload(udp_batch_t *batch, int fd);
+
+/*
+ * Receive up to slots datagrams without blocking, placing each at offset
+ * in its slot. Returns the number received, 0 when nothing was waiting,
+ * or -1 on a socket error.
+ */
+int udp_batch_recv(udp_batch_t *batch, int fd, size_t offset);
+
+/*
+ * Send every packet with a non-zero len from offset in its slot to its
+ * addr. Returns the number sent; the rest are dropped, as a single sendto
+ * would drop them.
+ */
+int udp_batch_send(udp_batch_t *batch, int fd, size_t offset);
+
+// Whether GRO data is still waiting to be handed out
+int udp_batch_pending(const udp_batch_t *batch);
+
+#endif // _UDPBATCH_H
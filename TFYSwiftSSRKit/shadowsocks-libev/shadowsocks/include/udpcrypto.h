@@ -0,0 +1,77 @@
+/*
+ * udpcrypto.h - Define the batched, allocation free UDP AEAD interface
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _UDPCRYPTO_H
+#define _UDPCRYPTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aead.h"
+#include "replay.h"
+
+#define UDP_CRYPTO_BATCH 64
+
+/*
+ * One datagram in a caller owned buffer.
+ *
+ * The buffer keeps udp_crypto_headroom() bytes in front of the plaintext
+ * so that udprelay can write the addr_header and payload once, at
+ * data + headroom, and send the packet from data without another copy:
+ *
+ *   encrypt: in  data[headroom, headroom + len) = addr_header | payload
+ *            out data[0, len)                   = salt | ciphertext | tag
+ *   decrypt: in  data[0, len)                   = salt | ciphertext | tag
+ *            out data[headroom, headroom + len) = addr_header | payload
+ *
+ * A packet that fails (too short, no room for the tag, bad tag, replayed
+ * salt) is left with len 0 and skipped by the rest of the batch.
+ */
+typedef struct udp_packet {
+    uint8_t *data;
+    size_t capacity;
+    size_t len;
+} udp_packet_t;
+
+size_t udp_crypto_headroom(const cipher_t *cipher);
+size_t udp_crypto_overhead(const cipher_t *cipher);
+
+/*
+ * Legacy AEAD ciphers from aead_init() only. Both calls work on thread
+ * local contexts that are set up once per thread and cipher, so the per
+ * packet work is the salt, the subkey, its key schedule and the seal;
+ * there is no balloc, no cipher_ctx_t, no mbedtls_md or mbedtls_gcm setup
+ * and no allocation at all. Return the number of packets that were
+ * processed successfully.
+ *
+ * replay may be NULL. When set, decrypted salts are checked against and
+ * added to it, as aead_decrypt_all() does with the ppbloom filter.
+ */
+int udp_crypto_encrypt(cipher_t *cipher, udp_packet_t *pkts, size_t count);
+int udp_crypto_decrypt(cipher_t *cipher, replay_filter_t *replay,
+                       udp_packet_t *pkts, size_t count);
+
+/*
+ * Wipe the calling thread's keys and contexts, e.g. before the thread
+ * exits or the config is reloaded.
+ */
+void udp_crypto_thread_release(void);
+
+#endif // _UDPCRYPTO_H
@@ -0,0 +1,171 @@
+/*
+ * uot.h - Define UDP over TCP framing and the per-server fallback switch
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _UOT_H
+#define _UOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "mux.h"
+
+/*
+ * UDP datagrams carried in a mux stream to the server, for networks that
+ * throttle or drop UDP.
+ *
+ * A UoT stream starts with an address header naming UOT_MAGIC_HOST (see
+ * uot_magic_header()); a server without UoT fails to resolve it and
+ * resets the stream. After that every datagram is one frame
+ *
+ *   address header | length(2, big endian) | payload
+ *
+ * where the address is the destination on the way out and the source on
+ * the way back, so one stream serves every association of a client.
+ *
+ * Datagrams keep UDP semantics: uot_send() writes a frame whole or drops
+ * it when the stream has no room, rather than queueing behind a slow
+ * link. uot_reader_t puts frames back together from the pieces on_data
+ * hands over.
+ *
+ * uot_path_t decides, per server, whether UDP goes direct or over the
+ * stream. The relay sends a small UDP probe now and then, a DNS query to
+ * the server's resolver say, and reports which ones were answered. Past
+ * loss_on in the probe window the server switches to UoT; UDP probes go
+ * on, and once loss has been under loss_off for hold seconds it switches
+ * back. A server that falls back again soon after gets twice the hold,
+ * up to max_hold.
+ *
+ * Times are ev_now() seconds. Readers and paths belong to one event loop.
+ */
+
+#define UOT_MAGIC_HOST          "uot.shadowsocks.arpa"
+#define UOT_MAX_PAYLOAD         65535
+#define UOT_MAX_HEADER          (1 + 1 + 255 + 2 + 2)   // domain address and length
+#define UOT_MAX_FRAME           (UOT_MAX_HEADER + UOT_MAX_PAYLOAD)
+
+#define UOT_DEFAULT_WINDOW      20          // probes
+#define UOT_DEFAULT_MIN_PROBES  5
+#define UOT_DEFAULT_LOSS_ON     0.3
+#define UOT_DEFAULT_LOSS_OFF    0.05
+#define UOT_DEFAULT_TIMEOUT     2.0         // seconds for a probe answer
+#define UOT_DEFAULT_HOLD        30.0        // seconds on UoT before trying UDP
+#define UOT_DEFAULT_MAX_HOLD    600.0
+#define UOT_MAX_WINDOW          64
+
+typedef struct uot_datagram {
+    int atyp;                       // 1 IPv4, 3 domain, 4 IPv6
+    struct sockaddr_storage addr;   // with its port, for 1 and 4
+    const char *host;               // for 3, not terminated
+    size_t host_len;
+    uint16_t port;
+    const char *payload;
+    size_t len;
+} uot_datagram_t;
+
+typedef void (*uot_datagram_cb)(void *data, const uot_datagram_t *dgram);
+
+typedef struct uot_reader {
+    char *buf;                      // a partial frame, UOT_MAX_FRAME once needed
+    size_t len;
+    uint64_t frames;
+    uint64_t bytes;
+} uot_reader_t;
+
+size_t uot_magic_header(char *buf);
+int uot_is_magic_host(const char *host, size_t len);
+
+/*
+ * Write the header of a frame for len payload bytes to or from addr into
+ * buf, which has room for UOT_MAX_HEADER. Returns its length, or 0 for an
+ * unsupported family or an oversized payload.
+ */
+size_t uot_frame_header(char *buf, const struct sockaddr *addr, size_t len);
+size_t uot_frame_header_host(char *buf, const char *host, size_t host_len,
+                             uint16_t port, size_t len);
+
+/*
+ * Parse the frame at the front of buf. Returns its length, 0 when buf
+ * holds only part of it, -1 when it is malformed. dgram points into buf.
+ */
+ssize_t uot_frame_parse(const char *buf, size_t len, uot_datagram_t *dgram);
+
+/*
+ * Send one datagram. Returns 0, or -1 when it was dropped because the
+ * stream has no room for the whole frame or it cannot be framed.
+ */
+int uot_send(mux_stream_t *stream, const struct sockaddr *addr,
+             const char *payload, size_t len);
+
+void uot_reader_init(uot_reader_t *reader);
+void uot_reader_release(uot_reader_t *reader);
+
+/*
+ * Feed bytes from the stream's on_data; cb gets every complete datagram.
+ * Returns the bytes taken, all of len, or -1 on a malformed frame after
+ * which the stream should be reset.
+ */
+ssize_t uot_reader_input(uot_reader_t *reader, const char *buf, size_t len,
+                         uot_datagram_cb cb, void *data);
+
+typedef enum uot_mode {
+    UOT_MODE_AUTO,
+    UOT_MODE_OFF,
+    UOT_MODE_ALWAYS
+} uot_mode_t;
+
+typedef struct uot_path_config {
+    uot_mode_t mode;
+    int window;                 // probes the loss is taken over, 0 for the default
+    int min_probes;             // settled probes before a decision, 0 for the default
+    double loss_on;             // 0 for the default
+    double loss_off;            // 0 for the default
+    double timeout;             // 0 for the default
+    double hold;                // 0 for the default
+    double max_hold;            // 0 for the default
+} uot_path_config_t;
+
+typedef struct uot_path_stats {
+    int tcp;                    // UDP goes over the stream now
+    double loss;                // over the settled probes in the window
+    int settled;
+    double hold;                // before the next try of UDP
+    uint64_t probes;
+    uint64_t answered;
+    uint64_t to_tcp;
+    uint64_t to_udp;
+} uot_path_stats_t;
+
+typedef struct uot_path uot_path_t;
+
+uot_path_t *uot_path_new(const uot_path_config_t *config);
+void uot_path_free(uot_path_t *path);
+
+// Returns the id to match the answer with
+uint32_t uot_path_probe_sent(uot_path_t *path, double now);
+void uot_path_probe_answered(uot_path_t *path, uint32_t id, double now);
+
+// Whether UDP to this server should go over the stream, switching as due
+int uot_path_use_tcp(uot_path_t *path, double now);
+
+void uot_path_stats(uot_path_t *path, double now, uot_path_stats_t *stats);
+
+#endif // _UOT_H
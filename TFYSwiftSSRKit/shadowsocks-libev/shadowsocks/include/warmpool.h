@@ -0,0 +1,97 @@
+/*
+ * warmpool.h - Define the pool of pre-connected sockets to a server
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WARMPOOL_H
+#define _WARMPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <ev.h>
+
+#define WARM_POOL_DEFAULT_MAX_IDLE      8
+#define WARM_POOL_DEFAULT_IDLE_TIMEOUT  15.0
+#define WARM_POOL_DEFAULT_CONN_TIMEOUT  5.0
+#define WARM_POOL_TICK                  1.0
+
+/*
+ * TCP connections to one server, opened before a SOCKS request needs
+ * them so the request does not wait a round trip for the handshake.
+ *
+ * Nothing is ever written on a pooled socket. The relay builds its cipher
+ * context when it takes the socket, so the salt is made and sent with the
+ * first payload as on a fresh connection, and a server that never sees it
+ * used only sees an idle connection.
+ *
+ * Once a second the pool measures how often connections are asked for and
+ * keeps about as many ready as arrive during one connect time (Little's
+ * law), between min_idle and max_idle. Sockets idle longer than
+ * idle_timeout are closed, which should stay under the server's own idle
+ * timeout. An idle socket that turns readable was closed or reset by the
+ * server and is dropped right away, and warm_pool_take() checks again
+ * before handing one out. Connect failures back off refilling, and
+ * nothing is opened while the memory budget is under pressure.
+ *
+ * A pool belongs to one event loop and is not thread safe.
+ */
+typedef int (*warm_pool_setup_cb)(void *data, int fd);
+
+typedef struct warm_pool_config {
+    size_t min_idle;
+    size_t max_idle;            // 0 for the default
+    ev_tstamp idle_timeout;     // 0 for the default
+    ev_tstamp connect_timeout;  // 0 for the default
+    warm_pool_setup_cb setup;   // socket options before connect, may be NULL
+    void *data;
+} warm_pool_config_t;
+
+typedef struct warm_pool_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t opened;
+    uint64_t failed;            // connects that failed or timed out
+    uint64_t expired;           // closed after idle_timeout or when shrinking
+    uint64_t dead;              // closed by the server while idle
+    size_t idle;
+    size_t connecting;
+    size_t target;
+    double rate;                // requests per second
+    double connect_time;        // seconds
+} warm_pool_stats_t;
+
+typedef struct warm_pool warm_pool_t;
+
+warm_pool_t *warm_pool_new(struct ev_loop *loop, const struct sockaddr *addr,
+                           socklen_t addr_len, const warm_pool_config_t *config);
+void warm_pool_start(warm_pool_t *pool);
+
+// Closes every pooled socket
+void warm_pool_free(warm_pool_t *pool);
+
+/*
+ * Returns a connected socket, now owned by the caller, or -1 when none is
+ * ready and the caller should connect as usual. Either way the request
+ * counts towards the arrival rate.
+ */
+int warm_pool_take(warm_pool_t *pool);
+
+void warm_pool_stats(const warm_pool_t *pool, warm_pool_stats_t *stats);
+
+#endif // _WARMPOOL_H
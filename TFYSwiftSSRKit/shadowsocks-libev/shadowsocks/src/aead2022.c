@@ -0,0 +1,727 @@
+/*
+ * aead2022.c - Manage SIP022 (2022-blake3-*) AEAD ciphers
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <sodium.h>
+
+#include "aead2022.h"
+#include "blake3.h"
+#include "utils.h"
+
+/*
+ * Spec: https://github.com/Shadowsocks-NET/shadowsocks-specs/blob/main/2022-1-shadowsocks-2022-edition.md
+ *
+ * TCP request stream:
+ *
+ *  +--------+------------------------+---------------------------+------+
+ *  |  salt  | E(type|timestamp|len)  | E(addr|padlen|padding|..)| ...  |
+ *  +--------+------------------------+---------------------------+------+
+ *
+ * TCP response stream:
+ *
+ *  +--------+---------------------------------------+-------------+------+
+ *  |  salt  | E(type|timestamp|request salt|len)   | E(payload)  | ...  |
+ *  +--------+---------------------------------------+-------------+------+
+ *
+ * followed in both directions by legacy style E(len)|E(payload) chunks with
+ * a 12-byte little-endian counter nonce. The session subkey is
+ * BLAKE3-derive_key(AEAD2022_SUBKEY_CONTEXT, psk || salt).
+ */
+
+enum {
+    STAGE_SALT,
+    STAGE_FIXED,
+    STAGE_VARIABLE,
+    STAGE_LENGTH,
+    STAGE_PAYLOAD
+};
+
+static const char *supported_aead2022_ciphers[AEAD2022_CIPHER_NUM] = {
+    "2022-blake3-aes-128-gcm",
+    "2022-blake3-aes-256-gcm",
+    "2022-blake3-chacha20-poly1305"
+};
+
+static const size_t supported_aead2022_ciphers_key_size[AEAD2022_CIPHER_NUM] = {
+    16, 32, 32
+};
+
+static inline void
+store_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static inline uint16_t
+load_be16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline void
+store_be64(uint8_t *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (uint8_t)v;
+        v  >>= 8;
+    }
+}
+
+static inline uint64_t
+load_be64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static int
+aead2022_check_timestamp(uint64_t ts)
+{
+    int64_t diff = (int64_t)time(NULL) - (int64_t)ts;
+    if (diff > AEAD2022_TIMESTAMP_WINDOW || diff < -AEAD2022_TIMESTAMP_WINDOW) {
+        LOGE("aead2022: timestamp out of window, diff %lld", (long long)diff);
+        return CRYPTO_ERROR;
+    }
+    return CRYPTO_OK;
+}
+
+int
+aead2022_get_method(const char *method)
+{
+    if (method == NULL)
+        return -1;
+    for (int m = 0; m < AEAD2022_CIPHER_NUM; m++)
+        if (strcmp(method, supported_aead2022_ciphers[m]) == 0)
+            return m;
+    return -1;
+}
+
+int
+aead2022_is_method(const char *method)
+{
+    return aead2022_get_method(method) >= 0;
+}
+
+int
+aead2022_addr_len(const uint8_t *buf, size_t len)
+{
+    if (len < 1)
+        return -1;
+
+    size_t need;
+    switch (buf[0] & ADDRTYPE_MASK) {
+    case 1:
+        need = 1 + 4 + 2;
+        break;
+    case 4:
+        need = 1 + 16 + 2;
+        break;
+    case 3:
+        if (len < 2)
+            return -1;
+        need = 1 + 1 + buf[1] + 2;
+        break;
+    default:
+        return -1;
+    }
+
+    return need <= len ? (int)need : -1;
+}
+
+static void
+aead2022_derive_subkey(const aead2022_cipher_t *cipher, const uint8_t *material,
+                       size_t material_len, uint8_t *subkey)
+{
+    blake3_hasher_t hasher;
+    blake3_hasher_init_derive_key_raw(&hasher, cipher->subkey_context);
+    blake3_hasher_update(&hasher, cipher->key, cipher->key_len);
+    blake3_hasher_update(&hasher, material, material_len);
+    blake3_hasher_finalize(&hasher, subkey, cipher->key_len);
+}
+
+static int
+aead2022_setkey(const aead2022_cipher_t *cipher, mbedtls_gcm_context *gcm,
+                const uint8_t *key)
+{
+    if (cipher->method == BLAKE3_CHACHA20_POLY1305)
+        return CRYPTO_OK;
+    if (mbedtls_gcm_setkey(gcm, MBEDTLS_CIPHER_ID_AES, key,
+                           (unsigned int)cipher->key_len * 8) != 0)
+        return CRYPTO_ERROR;
+    return CRYPTO_OK;
+}
+
+/*
+ * Seal m into c (which may alias m) and append the tag.
+ */
+static int
+aead2022_seal(const aead2022_cipher_t *cipher, mbedtls_gcm_context *gcm,
+              const uint8_t *key, const uint8_t *nonce,
+              uint8_t *c, const uint8_t *m, size_t mlen)
+{
+    if (cipher->method == BLAKE3_CHACHA20_POLY1305) {
+        return crypto_aead_chacha20poly1305_ietf_encrypt(c, NULL, m, mlen,
+                                                         NULL, 0, NULL, nonce, key)
+               ? CRYPTO_ERROR : CRYPTO_OK;
+    }
+    return mbedtls_gcm_crypt_and_tag(gcm, MBEDTLS_GCM_ENCRYPT, mlen,
+                                     nonce, AEAD2022_NONCE_LEN, NULL, 0,
+                                     m, c, AEAD2022_TAG_LEN, c + mlen)
+           ? CRYPTO_ERROR : CRYPTO_OK;
+}
+
+static int
+aead2022_open(const aead2022_cipher_t *cipher, mbedtls_gcm_context *gcm,
+              const uint8_t *key, const uint8_t *nonce,
+              uint8_t *m, const uint8_t *c, size_t clen)
+{
+    if (clen < AEAD2022_TAG_LEN)
+        return CRYPTO_ERROR;
+    size_t mlen = clen - AEAD2022_TAG_LEN;
+
+    if (cipher->method == BLAKE3_CHACHA20_POLY1305) {
+        return crypto_aead_chacha20poly1305_ietf_decrypt(m, NULL, NULL, c, clen,
+                                                         NULL, 0, nonce, key)
+               ? CRYPTO_ERROR : CRYPTO_OK;
+    }
+    return mbedtls_gcm_auth_decrypt(gcm, mlen, nonce, AEAD2022_NONCE_LEN,
+                                    NULL, 0, c + mlen, AEAD2022_TAG_LEN, c, m)
+           ? CRYPTO_ERROR : CRYPTO_OK;
+}
+
+static int
+aead2022_chunk_seal(aead2022_ctx_t *ctx, uint8_t *c, const uint8_t *m, size_t mlen)
+{
+    int err = aead2022_seal(ctx->cipher, &ctx->gcm, ctx->subkey, ctx->nonce, c, m, mlen);
+    sodium_increment(ctx->nonce, AEAD2022_NONCE_LEN);
+    return err;
+}
+
+static int
+aead2022_chunk_open(aead2022_ctx_t *ctx, uint8_t *m, const uint8_t *c, size_t clen)
+{
+    int err = aead2022_open(ctx->cipher, &ctx->gcm, ctx->subkey, ctx->nonce, m, c, clen);
+    sodium_increment(ctx->nonce, AEAD2022_NONCE_LEN);
+    return err;
+}
+
+static int
+aead2022_ctx_set_key(aead2022_ctx_t *ctx)
+{
+    aead2022_derive_subkey(ctx->cipher, ctx->salt, ctx->cipher->key_len, ctx->subkey);
+    memset(ctx->nonce, 0, AEAD2022_NONCE_LEN);
+    ctx->init = 1;
+    return aead2022_setkey(ctx->cipher, &ctx->gcm, ctx->subkey);
+}
+
+aead2022_cipher_t *
+aead2022_init(int method, const char *psk)
+{
+    static const int variants[] = {
+        sodium_base64_VARIANT_ORIGINAL,
+        sodium_base64_VARIANT_URLSAFE,
+        sodium_base64_VARIANT_ORIGINAL_NO_PADDING,
+        sodium_base64_VARIANT_URLSAFE_NO_PADDING
+    };
+
+    if (method < 0 || method >= AEAD2022_CIPHER_NUM) {
+        LOGE("aead2022: invalid method %d", method);
+        return NULL;
+    }
+    if (psk == NULL || sodium_init() < 0)
+        return NULL;
+
+    aead2022_cipher_t *cipher = ss_malloc(sizeof(aead2022_cipher_t));
+    memset(cipher, 0, sizeof(aead2022_cipher_t));
+    cipher->method  = method;
+    cipher->key_len = supported_aead2022_ciphers_key_size[method];
+
+    size_t key_len = 0;
+    int decoded    = 0;
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]) && !decoded; i++)
+        decoded = sodium_base642bin(cipher->key, sizeof(cipher->key), psk, strlen(psk),
+                                    NULL, &key_len, NULL, variants[i]) == 0;
+    if (!decoded || key_len != cipher->key_len) {
+        LOGE("aead2022: %s needs a base64 key of %zu bytes",
+             supported_aead2022_ciphers[method], cipher->key_len);
+        sodium_memzero(cipher, sizeof(aead2022_cipher_t));
+        ss_free(cipher);
+        return NULL;
+    }
+
+    // The context string is fixed, hash it once instead of per session
+    blake3_derive_context_key(AEAD2022_SUBKEY_CONTEXT, cipher->subkey_context);
+
+    mbedtls_aes_init(&cipher->header_enc);
+    mbedtls_aes_init(&cipher->header_dec);
+    if (method != BLAKE3_CHACHA20_POLY1305) {
+        mbedtls_aes_setkey_enc(&cipher->header_enc, cipher->key, (unsigned int)cipher->key_len * 8);
+        mbedtls_aes_setkey_dec(&cipher->header_dec, cipher->key, (unsigned int)cipher->key_len * 8);
+    }
+
+    return cipher;
+}
+
+void
+aead2022_free(aead2022_cipher_t *cipher)
+{
+    if (cipher == NULL)
+        return;
+    // The replay filter is owned by whoever attached it
+    mbedtls_aes_free(&cipher->header_enc);
+    mbedtls_aes_free(&cipher->header_dec);
+    sodium_memzero(cipher, sizeof(aead2022_cipher_t));
+    ss_free(cipher);
+}
+
+void
+aead2022_ctx_init(aead2022_cipher_t *cipher, aead2022_ctx_t *ctx, int enc, int server)
+{
+    memset(ctx, 0, sizeof(aead2022_ctx_t));
+    ctx->cipher = cipher;
+    ctx->enc    = enc;
+    ctx->server = server;
+    ctx->stage  = STAGE_SALT;
+    mbedtls_gcm_init(&ctx->gcm);
+
+    if (enc)
+        randombytes_buf(ctx->salt, cipher->key_len);
+}
+
+void
+aead2022_ctx_pair(aead2022_ctx_t *e_ctx, aead2022_ctx_t *d_ctx)
+{
+    e_ctx->peer = d_ctx;
+    d_ctx->peer = e_ctx;
+}
+
+void
+aead2022_ctx_release(aead2022_ctx_t *ctx)
+{
+    if (ctx->chunk != NULL) {
+        bfree(ctx->chunk);
+        ss_free(ctx->chunk);
+    }
+    mbedtls_gcm_free(&ctx->gcm);
+    sodium_memzero(ctx->subkey, sizeof(ctx->subkey));
+}
+
+int
+aead2022_encrypt(buffer_t *plaintext, aead2022_ctx_t *ctx, size_t capacity)
+{
+    static __thread buffer_t tmp = { 0, 0, 0, NULL };
+
+    aead2022_cipher_t *cipher = ctx->cipher;
+    size_t salt_len = cipher->key_len;
+    size_t tag_len  = AEAD2022_TAG_LEN;
+    const uint8_t *p = (const uint8_t *)plaintext->array;
+    size_t plen      = plaintext->len;
+
+    size_t bound = salt_len + AEAD2022_RESPONSE_HEADER_LEN(salt_len) + tag_len
+                   + 2 + AEAD2022_MAX_PADDING + tag_len + plen
+                   + (plen / AEAD2022_MAX_CHUNK_SIZE + 1) * (CHUNK_SIZE_LEN + 2 * tag_len);
+    brealloc(&tmp, bound, capacity);
+    uint8_t *c  = (uint8_t *)tmp.array;
+    size_t clen = 0;
+
+    if (!ctx->init) {
+        memcpy(c, ctx->salt, salt_len);
+        clen = salt_len;
+        if (aead2022_ctx_set_key(ctx))
+            return CRYPTO_ERROR;
+
+        uint8_t hdr[AEAD2022_RESPONSE_HEADER_LEN(AEAD2022_MAX_KEY_LEN)];
+        size_t hlen;
+
+        if (ctx->server) {
+            // The response header announces the length of the first chunk
+            size_t first = min(plen, AEAD2022_MAX_CHUNK_SIZE);
+            hlen   = AEAD2022_RESPONSE_HEADER_LEN(salt_len);
+            hdr[0] = AEAD2022_TYPE_RESPONSE;
+            store_be64(hdr + 1, (uint64_t)time(NULL));
+            memcpy(hdr + 9, ctx->request_salt, salt_len);
+            store_be16(hdr + 9 + salt_len, (uint16_t)first);
+            if (aead2022_chunk_seal(ctx, c + clen, hdr, hlen))
+                return CRYPTO_ERROR;
+            clen += hlen + tag_len;
+
+            if (aead2022_chunk_seal(ctx, c + clen, p, first))
+                return CRYPTO_ERROR;
+            clen += first + tag_len;
+            p    += first;
+            plen -= first;
+        } else {
+            int addr_len = aead2022_addr_len(p, plen);
+            if (addr_len < 0)
+                return CRYPTO_ERROR;
+
+            // Padding is mandatory only when there is no initial payload
+            size_t payload = plen - addr_len;
+            size_t padding = payload == 0 ? randombytes_uniform(AEAD2022_MAX_PADDING) + 1 : 0;
+            size_t room    = AEAD2022_MAX_CHUNK_SIZE - addr_len - 2 - padding;
+            if (payload > room)
+                payload = room;
+            size_t var_len = addr_len + 2 + padding + payload;
+
+            hlen   = AEAD2022_REQUEST_HEADER_LEN;
+            hdr[0] = AEAD2022_TYPE_REQUEST;
+            store_be64(hdr + 1, (uint64_t)time(NULL));
+            store_be16(hdr + 9, (uint16_t)var_len);
+            if (aead2022_chunk_seal(ctx, c + clen, hdr, hlen))
+                return CRYPTO_ERROR;
+            clen += hlen + tag_len;
+
+            uint8_t *v = c + clen;
+            memcpy(v, p, addr_len);
+            store_be16(v + addr_len, (uint16_t)padding);
+            randombytes_buf(v + addr_len + 2, padding);
+            memcpy(v + addr_len + 2 + padding, p + addr_len, payload);
+            if (aead2022_chunk_seal(ctx, v, v, var_len))
+                return CRYPTO_ERROR;
+            clen += var_len + tag_len;
+            p    += addr_len + payload;
+            plen -= addr_len + payload;
+
+            if (ctx->peer != NULL)
+                memcpy(ctx->peer->request_salt, ctx->salt, salt_len);
+        }
+    }
+
+    while (plen > 0) {
+        size_t n = min(plen, AEAD2022_MAX_CHUNK_SIZE);
+        uint8_t len_buf[CHUNK_SIZE_LEN];
+        store_be16(len_buf, (uint16_t)n);
+        if (aead2022_chunk_seal(ctx, c + clen, len_buf, CHUNK_SIZE_LEN))
+            return CRYPTO_ERROR;
+        clen += CHUNK_SIZE_LEN + tag_len;
+        if (aead2022_chunk_seal(ctx, c + clen, p, n))
+            return CRYPTO_ERROR;
+        clen += n + tag_len;
+        p    += n;
+        plen -= n;
+    }
+
+    brealloc(plaintext, clen, capacity);
+    memcpy(plaintext->array, c, clen);
+    plaintext->len = clen;
+
+    return CRYPTO_OK;
+}
+
+int
+aead2022_decrypt(buffer_t *ciphertext, aead2022_ctx_t *ctx, size_t capacity)
+{
+    static __thread buffer_t tmp = { 0, 0, 0, NULL };
+
+    aead2022_cipher_t *cipher = ctx->cipher;
+    size_t salt_len = cipher->key_len;
+    size_t tag_len  = AEAD2022_TAG_LEN;
+
+    if (ctx->chunk == NULL) {
+        ctx->chunk = (buffer_t *)ss_malloc(sizeof(buffer_t));
+        memset(ctx->chunk, 0, sizeof(buffer_t));
+        balloc(ctx->chunk, capacity);
+    }
+
+    buffer_t *chunk = ctx->chunk;
+    brealloc(chunk, chunk->len + ciphertext->len, capacity);
+    memcpy(chunk->array + chunk->len, ciphertext->array, ciphertext->len);
+    chunk->len += ciphertext->len;
+
+    // Plaintext never outgrows the ciphertext it came from
+    brealloc(&tmp, chunk->len, capacity);
+    uint8_t *c  = (uint8_t *)chunk->array;
+    uint8_t *m  = (uint8_t *)tmp.array;
+    size_t off  = 0;
+    size_t plen = 0;
+
+    for (;;) {
+        size_t avail = chunk->len - off;
+
+        if (ctx->stage == STAGE_SALT) {
+            if (avail < salt_len)
+                break;
+            memcpy(ctx->salt, c + off, salt_len);
+            off += salt_len;
+            // Only look here; the salt is added once the header verifies
+            if (ctx->server && cipher->replay != NULL
+                && replay_filter_check(cipher->replay, ctx->salt, (int)salt_len)) {
+                LOGE("aead2022: repeat salt detected");
+                return CRYPTO_ERROR;
+            }
+            if (aead2022_ctx_set_key(ctx))
+                return CRYPTO_ERROR;
+            ctx->stage = STAGE_FIXED;
+        } else if (ctx->stage == STAGE_FIXED) {
+            uint8_t hdr[AEAD2022_RESPONSE_HEADER_LEN(AEAD2022_MAX_KEY_LEN)];
+            size_t hlen = ctx->server ? AEAD2022_REQUEST_HEADER_LEN
+                          : AEAD2022_RESPONSE_HEADER_LEN(salt_len);
+            if (avail < hlen + tag_len)
+                break;
+            if (aead2022_chunk_open(ctx, hdr, c + off, hlen + tag_len))
+                return CRYPTO_ERROR;
+            off += hlen + tag_len;
+
+            int type = ctx->server ? AEAD2022_TYPE_REQUEST : AEAD2022_TYPE_RESPONSE;
+            if (hdr[0] != type || aead2022_check_timestamp(load_be64(hdr + 1)))
+                return CRYPTO_ERROR;
+            if (!ctx->server && sodium_memcmp(hdr + 9, ctx->request_salt, salt_len) != 0) {
+                LOGE("aead2022: response does not match the request salt");
+                return CRYPTO_ERROR;
+            }
+            // Another stream may have authenticated the same salt meanwhile
+            if (ctx->server && cipher->replay != NULL
+                && replay_filter_add(cipher->replay, ctx->salt, (int)salt_len)) {
+                LOGE("aead2022: repeat salt detected");
+                return CRYPTO_ERROR;
+            }
+            ctx->pending = load_be16(hdr + hlen - CHUNK_SIZE_LEN);
+            ctx->stage   = ctx->server ? STAGE_VARIABLE : STAGE_PAYLOAD;
+        } else if (ctx->stage == STAGE_VARIABLE) {
+            if (avail < ctx->pending + tag_len)
+                break;
+            uint8_t *v = m + plen;
+            if (aead2022_chunk_open(ctx, v, c + off, ctx->pending + tag_len))
+                return CRYPTO_ERROR;
+            off += ctx->pending + tag_len;
+
+            int addr_len = aead2022_addr_len(v, ctx->pending);
+            if (addr_len < 0 || ctx->pending < (size_t)addr_len + 2)
+                return CRYPTO_ERROR;
+            size_t padding = load_be16(v + addr_len);
+            if (addr_len + 2 + padding > ctx->pending)
+                return CRYPTO_ERROR;
+            size_t rest = ctx->pending - addr_len - 2 - padding;
+            memmove(v + addr_len, v + addr_len + 2 + padding, rest);
+            plen += addr_len + rest;
+
+            if (ctx->peer != NULL)
+                memcpy(ctx->peer->request_salt, ctx->salt, salt_len);
+            ctx->stage = STAGE_LENGTH;
+        } else if (ctx->stage == STAGE_LENGTH) {
+            uint8_t len_buf[CHUNK_SIZE_LEN];
+            if (avail < CHUNK_SIZE_LEN + tag_len)
+                break;
+            if (aead2022_chunk_open(ctx, len_buf, c + off, CHUNK_SIZE_LEN + tag_len))
+                return CRYPTO_ERROR;
+            off         += CHUNK_SIZE_LEN + tag_len;
+            ctx->pending = load_be16(len_buf);
+            if (ctx->pending == 0)
+                return CRYPTO_ERROR;
+            ctx->stage = STAGE_PAYLOAD;
+        } else {
+            if (avail < ctx->pending + tag_len)
+                break;
+            if (aead2022_chunk_open(ctx, m + plen, c + off, ctx->pending + tag_len))
+                return CRYPTO_ERROR;
+            off       += ctx->pending + tag_len;
+            plen      += ctx->pending;
+            ctx->stage = STAGE_LENGTH;
+        }
+    }
+
+    memmove(chunk->array, chunk->array + off, chunk->len - off);
+    chunk->len -= off;
+
+    if (plen == 0)
+        return CRYPTO_NEED_MORE;
+
+    brealloc(ciphertext, plen, capacity);
+    memcpy(ciphertext->array, m, plen);
+    ciphertext->len = plen;
+
+    return CRYPTO_OK;
+}
+
+void
+aead2022_udp_session_init(aead2022_cipher_t *cipher, aead2022_udp_session_t *session)
+{
+    memset(session, 0, sizeof(aead2022_udp_session_t));
+    randombytes_buf(&session->session_id, sizeof(session->session_id));
+    mbedtls_gcm_init(&session->gcm);
+    mbedtls_gcm_init(&session->peer_gcm);
+
+    if (cipher->method != BLAKE3_CHACHA20_POLY1305) {
+        uint8_t id[8];
+        store_be64(id, session->session_id);
+        aead2022_derive_subkey(cipher, id, sizeof(id), session->subkey);
+        aead2022_setkey(cipher, &session->gcm, session->subkey);
+    }
+}
+
+void
+aead2022_udp_session_release(aead2022_udp_session_t *session)
+{
+    mbedtls_gcm_free(&session->gcm);
+    mbedtls_gcm_free(&session->peer_gcm);
+    sodium_memzero(session, sizeof(aead2022_udp_session_t));
+}
+
+static int
+udp_window_check(const aead2022_udp_session_t *session, uint64_t id)
+{
+    if (!session->peer_valid || id > session->window_top)
+        return CRYPTO_OK;
+    uint64_t diff = session->window_top - id;
+    if (diff >= 64 || (session->window & (1ULL << diff)))
+        return CRYPTO_ERROR;
+    return CRYPTO_OK;
+}
+
+static void
+udp_window_update(aead2022_udp_session_t *session, uint64_t id)
+{
+    if (id > session->window_top) {
+        uint64_t shift = id - session->window_top;
+        session->window     = shift >= 64 ? 1 : (session->window << shift) | 1;
+        session->window_top = id;
+    } else {
+        session->window |= 1ULL << (session->window_top - id);
+    }
+}
+
+int
+aead2022_udp_encrypt(buffer_t *plaintext, aead2022_cipher_t *cipher,
+                     aead2022_udp_session_t *session, size_t capacity)
+{
+    int chacha    = cipher->method == BLAKE3_CHACHA20_POLY1305;
+    size_t prefix = chacha ? AEAD2022_XNONCE_LEN + AEAD2022_UDP_HEADER_LEN
+                    : AEAD2022_UDP_HEADER_LEN;
+    size_t body   = 1 + 8 + 2;     // type, timestamp, padding length
+    size_t plen   = plaintext->len;
+    size_t clen   = prefix + body + plen + AEAD2022_TAG_LEN;
+
+    brealloc(plaintext, clen, capacity);
+    uint8_t *c = (uint8_t *)plaintext->array;
+    memmove(c + prefix + body, c, plen);
+
+    uint8_t *hdr = c + prefix - AEAD2022_UDP_HEADER_LEN;
+    store_be64(hdr, session->session_id);
+    store_be64(hdr + 8, session->packet_id++);
+
+    uint8_t *b = c + prefix;
+    b[0] = AEAD2022_TYPE_REQUEST;
+    store_be64(b + 1, (uint64_t)time(NULL));
+    store_be16(b + 9, 0);
+
+    if (chacha) {
+        // The whole packet after the nonce is sealed with the PSK
+        randombytes_buf(c, AEAD2022_XNONCE_LEN);
+        if (crypto_aead_xchacha20poly1305_ietf_encrypt(hdr, NULL, hdr,
+                                                       AEAD2022_UDP_HEADER_LEN + body + plen,
+                                                       NULL, 0, NULL, c, cipher->key))
+            return CRYPTO_ERROR;
+    } else {
+        // The separate header doubles as the nonce before it is encrypted
+        if (aead2022_seal(cipher, &session->gcm, session->subkey, hdr + 4,
+                          b, b, body + plen))
+            return CRYPTO_ERROR;
+        mbedtls_aes_crypt_ecb(&cipher->header_enc, MBEDTLS_AES_ENCRYPT, hdr, hdr);
+    }
+
+    plaintext->len = clen;
+    return CRYPTO_OK;
+}
+
+int
+aead2022_udp_decrypt(buffer_t *ciphertext, aead2022_cipher_t *cipher,
+                     aead2022_udp_session_t *session, size_t capacity)
+{
+    int chacha    = cipher->method == BLAKE3_CHACHA20_POLY1305;
+    size_t prefix = chacha ? AEAD2022_XNONCE_LEN + AEAD2022_UDP_HEADER_LEN
+                    : AEAD2022_UDP_HEADER_LEN;
+    size_t body   = 1 + 8 + 8 + 2; // type, timestamp, client session id, padding length
+    size_t clen   = ciphertext->len;
+    uint8_t *c    = (uint8_t *)ciphertext->array;
+
+    if (clen < prefix + body + AEAD2022_TAG_LEN)
+        return CRYPTO_ERROR;
+
+    uint8_t *hdr = c + prefix - AEAD2022_UDP_HEADER_LEN;
+    uint8_t *b   = c + prefix;
+    size_t blen  = clen - prefix - AEAD2022_TAG_LEN;
+
+    if (chacha) {
+        if (crypto_aead_xchacha20poly1305_ietf_decrypt(hdr, NULL, NULL, hdr,
+                                                       clen - AEAD2022_XNONCE_LEN,
+                                                       NULL, 0, c, cipher->key))
+            return CRYPTO_ERROR;
+    } else {
+        mbedtls_aes_crypt_ecb(&cipher->header_dec, MBEDTLS_AES_DECRYPT, hdr, hdr);
+    }
+
+    uint64_t sid = load_be64(hdr);
+    uint64_t pid = load_be64(hdr + 8);
+    int new_peer = !session->peer_valid || sid != session->peer_session_id;
+    if (!new_peer && udp_window_check(session, pid))
+        return CRYPTO_ERROR;
+
+    if (!chacha) {
+        if (new_peer) {
+            // Authenticate with a scratch context before replacing the peer key
+            uint8_t id[8], subkey[AEAD2022_MAX_KEY_LEN];
+            mbedtls_gcm_context gcm;
+            store_be64(id, sid);
+            aead2022_derive_subkey(cipher, id, sizeof(id), subkey);
+            mbedtls_gcm_init(&gcm);
+            int err = aead2022_setkey(cipher, &gcm, subkey)
+                      || aead2022_open(cipher, &gcm, subkey, hdr + 4, b, b,
+                                       blen + AEAD2022_TAG_LEN);
+            mbedtls_gcm_free(&gcm);
+            if (err)
+                return CRYPTO_ERROR;
+            memcpy(session->peer_subkey, subkey, cipher->key_len);
+            mbedtls_gcm_free(&session->peer_gcm);
+            mbedtls_gcm_init(&session->peer_gcm);
+            aead2022_setkey(cipher, &session->peer_gcm, session->peer_subkey);
+        } else if (aead2022_open(cipher, &session->peer_gcm, session->peer_subkey,
+                                 hdr + 4, b, b, blen + AEAD2022_TAG_LEN)) {
+            return CRYPTO_ERROR;
+        }
+    }
+
+    if (b[0] != AEAD2022_TYPE_RESPONSE || aead2022_check_timestamp(load_be64(b + 1))
+        || load_be64(b + 9) != session->session_id)
+        return CRYPTO_ERROR;
+    size_t padding = load_be16(b + 17);
+    if (body + padding > blen)
+        return CRYPTO_ERROR;
+
+    if (new_peer) {
+        session->peer_valid      = 1;
+        session->peer_session_id = sid;
+        session->window_top      = pid;
+        session->window          = 1;
+    } else {
+        udp_window_update(session, pid);
+    }
+
+    size_t plen = blen - body - padding;
+    memmove(c, b + body + padding, plen);
+    ciphertext->len = plen;
+    (void)capacity;
+
+    return CRYPTO_OK;
+}
@@ -0,0 +1,272 @@
+/*
+ * balancer.c - Pick remote servers by connect latency and failures
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "balancer.h"
+#include "utils.h"
+
+// A server that always fails still gets a cost, just a large one
+#define BALANCER_MIN_SUCCESS    0.05
+
+// Seconds for an unused server's failure rate to fall by 1/e
+#define BALANCER_FAILURE_DECAY  30.0
+
+// Assumed connect time of a server that failed before any success
+#define BALANCER_PRIOR_LATENCY  1.0
+
+typedef struct balancer_server {
+    double latency;
+    double failure_rate;
+    double last_report;
+    int sampled;
+    int pending;
+    int failures;               // in a row
+    double ejected_until;
+    double eject;               // next ejection length
+    double health;              // from probe.c, 1 without probes
+    uint64_t picks;
+    uint64_t total_failures;
+    uint64_t ejections;
+} balancer_server_t;
+
+struct balancer {
+    balancer_config_t config;
+    int count;
+    balancer_server_t server[BALANCER_MAX_SERVERS];
+};
+
+balancer_t *
+balancer_new(int servers, const balancer_config_t *config)
+{
+    if (servers > BALANCER_MAX_SERVERS)
+        servers = BALANCER_MAX_SERVERS;
+
+    balancer_t *lb = ss_malloc(sizeof(balancer_t));
+    memset(lb, 0, sizeof(balancer_t));
+    lb->count = servers > 0 ? servers : 0;
+    if (config != NULL)
+        lb->config = *config;
+    if (lb->config.alpha <= 0 || lb->config.alpha > 1)
+        lb->config.alpha = BALANCER_DEFAULT_ALPHA;
+    if (lb->config.failures <= 0)
+        lb->config.failures = BALANCER_DEFAULT_FAILURES;
+    if (lb->config.eject <= 0)
+        lb->config.eject = BALANCER_DEFAULT_EJECT;
+
+    for (int i = 0; i < lb->count; i++) {
+        lb->server[i].eject  = lb->config.eject;
+        lb->server[i].health = 1.0;
+    }
+    return lb;
+}
+
+void
+balancer_free(balancer_t *lb)
+{
+    ss_free(lb);
+}
+
+/*
+ * Failures fade while a server is not picked, otherwise a server that
+ * failed a few times would cost too much to ever be tried again.
+ */
+static double
+balancer_failure_rate(const balancer_server_t *s, double now)
+{
+    double idle = now - s->last_report;
+    if (idle <= 0)
+        return s->failure_rate;
+    return s->failure_rate * exp(-idle / BALANCER_FAILURE_DECAY);
+}
+
+/*
+ * A server that never connected has no latency of its own. Until it has
+ * failed it costs nothing, so that it gets tried; after that it is
+ * charged the mean of the sampled servers, and its failures count like
+ * anyone else's.
+ */
+static double
+balancer_latency(const balancer_t *lb, const balancer_server_t *s)
+{
+    if (s->sampled)
+        return s->latency;
+
+    double sum = 0;
+    int n      = 0;
+    for (int i = 0; i < lb->count; i++) {
+        if (lb->server[i].sampled) {
+            sum += lb->server[i].latency;
+            n++;
+        }
+    }
+    return n > 0 ? sum / n : BALANCER_PRIOR_LATENCY;
+}
+
+static double
+balancer_cost(const balancer_t *lb, const balancer_server_t *s, double now)
+{
+    if (!s->sampled && s->total_failures == 0)
+        return 0;
+    double success = (1.0 - balancer_failure_rate(s, now)) * s->health;
+    if (success < BALANCER_MIN_SUCCESS)
+        success = BALANCER_MIN_SUCCESS;
+    return balancer_latency(lb, s) * (s->pending + 1) / success;
+}
+
+static int
+balancer_admitted(const balancer_server_t *s, double now)
+{
+    return now >= s->ejected_until && s->health > 0;
+}
+
+static int
+balancer_better(const balancer_t *lb, int a, int b, double now)
+{
+    const balancer_server_t *sa = &lb->server[a];
+    const balancer_server_t *sb = &lb->server[b];
+
+    if (lb->config.policy == BALANCER_LEAST_PENDING && sa->pending != sb->pending)
+        return sa->pending < sb->pending;
+    double ca = balancer_cost(lb, sa, now);
+    double cb = balancer_cost(lb, sb, now);
+    if (ca != cb)
+        return ca < cb;
+    // Both unsampled, for instance
+    return sa->health > sb->health;
+}
+
+int
+balancer_pick(balancer_t *lb, double now)
+{
+    int admitted[BALANCER_MAX_SERVERS];
+    int n = 0;
+
+    for (int i = 0; i < lb->count; i++)
+        if (balancer_admitted(&lb->server[i], now))
+            admitted[n++] = i;
+
+    int pick = -1;
+    if (n == 0) {
+        // Everything is ejected or down: take the one that is due back first,
+        // and a server that probes still reach over one that they do not
+        for (int i = 0; i < lb->count; i++) {
+            const balancer_server_t *s = &lb->server[i];
+            if (pick == -1
+                || (s->health > 0) > (lb->server[pick].health > 0)
+                || ((s->health > 0) == (lb->server[pick].health > 0)
+                    && s->ejected_until < lb->server[pick].ejected_until))
+                pick = i;
+        }
+    } else if (n == 1) {
+        pick = admitted[0];
+    } else if (lb->config.policy == BALANCER_P2C) {
+        int a = rand() % n;
+        int b = rand() % (n - 1);
+        if (b >= a)
+            b++;
+        pick = balancer_better(lb, admitted[b], admitted[a], now) ? admitted[b] : admitted[a];
+    } else {
+        pick = admitted[0];
+        for (int i = 1; i < n; i++)
+            if (balancer_better(lb, admitted[i], pick, now))
+                pick = admitted[i];
+    }
+
+    if (pick != -1) {
+        lb->server[pick].pending++;
+        lb->server[pick].picks++;
+    }
+    return pick;
+}
+
+void
+balancer_report(balancer_t *lb, int server, double now, int ok, double connect_time)
+{
+    if (server < 0 || server >= lb->count)
+        return;
+
+    balancer_server_t *s = &lb->server[server];
+    double alpha         = lb->config.alpha;
+
+    if (s->pending > 0)
+        s->pending--;
+    s->failure_rate  = balancer_failure_rate(s, now);
+    s->failure_rate += alpha * ((ok ? 0.0 : 1.0) - s->failure_rate);
+    s->last_report   = now;
+
+    if (ok) {
+        if (!s->sampled)
+            s->latency = connect_time;
+        else
+            s->latency += alpha * (connect_time - s->latency);
+        s->sampled  = 1;
+        s->failures = 0;
+        s->eject    = lb->config.eject;
+        return;
+    }
+
+    s->total_failures++;
+    if (++s->failures < lb->config.failures)
+        return;
+
+    LOGI("balancer: ejecting server %d for %.0f seconds", server, s->eject);
+    s->ejected_until = now + s->eject;
+    s->ejections++;
+    s->eject *= 2;
+    if (s->eject > BALANCER_MAX_EJECT)
+        s->eject = BALANCER_MAX_EJECT;
+    // A readmitted server needs one failure, not a full run, to go again
+    s->failures = lb->config.failures - 1;
+}
+
+void
+balancer_set_health(balancer_t *lb, int server, double health)
+{
+    if (server < 0 || server >= lb->count)
+        return;
+    if (health < 0)
+        health = 0;
+    if (health > 1)
+        health = 1;
+    lb->server[server].health = health;
+}
+
+void
+balancer_server_stats(const balancer_t *lb, int server, double now,
+                      balancer_server_stats_t *stats)
+{
+    memset(stats, 0, sizeof(balancer_server_stats_t));
+    if (server < 0 || server >= lb->count)
+        return;
+
+    const balancer_server_t *s = &lb->server[server];
+    stats->latency      = s->latency;
+    stats->failure_rate = balancer_failure_rate(s, now);
+    stats->pending      = s->pending;
+    stats->health       = s->health;
+    stats->ejected      = now < s->ejected_until;
+    stats->ejected_for  = stats->ejected ? s->ejected_until - now : 0;
+    stats->picks        = s->picks;
+    stats->failures     = s->total_failures;
+    stats->ejections    = s->ejections;
+}
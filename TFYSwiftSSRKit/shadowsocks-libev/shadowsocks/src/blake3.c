@@ -0,0 +1,318 @@
+/*
+ * blake3.c - Portable BLAKE3 hash, keyed hash and key derivation
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "blake3.h"
+
+#define CHUNK_START         (1 << 0)
+#define CHUNK_END           (1 << 1)
+#define PARENT              (1 << 2)
+#define ROOT                (1 << 3)
+#define KEYED_HASH          (1 << 4)
+#define DERIVE_KEY_CONTEXT  (1 << 5)
+#define DERIVE_KEY_MATERIAL (1 << 6)
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t MSG_SCHEDULE[7][16] = {
+    { 0, 1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15 },
+    { 2, 6,  3,  10, 7,  0,  4,  13, 1,  11, 12, 5,  9,  14, 15, 8  },
+    { 3, 4,  10, 12, 13, 2,  7,  14, 6,  5,  9,  0,  11, 15, 8,  1  },
+    { 10, 7, 12, 9,  14, 3,  13, 15, 4,  0,  11, 2,  5,  8,  1,  6  },
+    { 12, 13, 9, 11, 15, 10, 14, 8,  7,  2,  5,  3,  0,  1,  6,  4  },
+    { 9, 14, 11, 5,  8,  12, 15, 1,  13, 3,  0,  10, 2,  6,  4,  7  },
+    { 11, 15, 5, 0,  1,  9,  8,  6,  14, 10, 2,  12, 3,  4,  7,  13 },
+};
+
+typedef struct blake3_output {
+    uint32_t cv[8];
+    uint32_t block[16];
+    uint64_t counter;
+    uint32_t block_len;
+    uint32_t flags;
+} blake3_output_t;
+
+static inline uint32_t
+rotr32(uint32_t w, int c)
+{
+    return (w >> c) | (w << (32 - c));
+}
+
+static inline uint32_t
+load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+           | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void
+store32(uint8_t *p, uint32_t w)
+{
+    p[0] = (uint8_t)w;
+    p[1] = (uint8_t)(w >> 8);
+    p[2] = (uint8_t)(w >> 16);
+    p[3] = (uint8_t)(w >> 24);
+}
+
+static void
+words_from_bytes(const uint8_t *bytes, size_t len, uint32_t *words)
+{
+    for (size_t i = 0; i < len / 4; i++)
+        words[i] = load32(bytes + 4 * i);
+}
+
+static inline void
+g(uint32_t *s, int a, int b, int c, int d, uint32_t x, uint32_t y)
+{
+    s[a] = s[a] + s[b] + x;
+    s[d] = rotr32(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + y;
+    s[d] = rotr32(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 7);
+}
+
+static void
+compress(const uint32_t cv[8], const uint32_t block[16], uint64_t counter,
+         uint32_t block_len, uint32_t flags, uint32_t out[16])
+{
+    uint32_t s[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        IV[0], IV[1], IV[2], IV[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags
+    };
+
+    for (int r = 0; r < 7; r++) {
+        const uint8_t *m = MSG_SCHEDULE[r];
+        g(s, 0, 4, 8,  12, block[m[0]],  block[m[1]]);
+        g(s, 1, 5, 9,  13, block[m[2]],  block[m[3]]);
+        g(s, 2, 6, 10, 14, block[m[4]],  block[m[5]]);
+        g(s, 3, 7, 11, 15, block[m[6]],  block[m[7]]);
+        g(s, 0, 5, 10, 15, block[m[8]],  block[m[9]]);
+        g(s, 1, 6, 11, 12, block[m[10]], block[m[11]]);
+        g(s, 2, 7, 8,  13, block[m[12]], block[m[13]]);
+        g(s, 3, 4, 9,  14, block[m[14]], block[m[15]]);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        out[i]     = s[i] ^ s[i + 8];
+        out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+static void
+output_chaining_value(const blake3_output_t *o, uint32_t cv[8])
+{
+    uint32_t out[16];
+    compress(o->cv, o->block, o->counter, o->block_len, o->flags, out);
+    memcpy(cv, out, 32);
+}
+
+static void
+output_root_bytes(const blake3_output_t *o, uint8_t *out, size_t out_len)
+{
+    uint64_t counter = 0;
+    while (out_len > 0) {
+        uint32_t words[16];
+        uint8_t block[BLAKE3_BLOCK_LEN];
+        compress(o->cv, o->block, counter++, o->block_len, o->flags | ROOT, words);
+        for (int i = 0; i < 16; i++)
+            store32(block + 4 * i, words[i]);
+        size_t take = out_len < BLAKE3_BLOCK_LEN ? out_len : BLAKE3_BLOCK_LEN;
+        memcpy(out, block, take);
+        out     += take;
+        out_len -= take;
+    }
+}
+
+static void
+chunk_state_init(blake3_chunk_state_t *cs, const uint32_t key[8],
+                 uint64_t chunk_counter, uint8_t flags)
+{
+    memset(cs, 0, sizeof(blake3_chunk_state_t));
+    memcpy(cs->cv, key, 32);
+    cs->chunk_counter = chunk_counter;
+    cs->flags         = flags;
+}
+
+static size_t
+chunk_state_len(const blake3_chunk_state_t *cs)
+{
+    return BLAKE3_BLOCK_LEN * (size_t)cs->blocks_compressed + cs->block_len;
+}
+
+static uint32_t
+chunk_state_start_flag(const blake3_chunk_state_t *cs)
+{
+    return cs->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void
+chunk_state_update(blake3_chunk_state_t *cs, const uint8_t *input, size_t input_len)
+{
+    while (input_len > 0) {
+        if (cs->block_len == BLAKE3_BLOCK_LEN) {
+            uint32_t block[16], out[16];
+            words_from_bytes(cs->block, BLAKE3_BLOCK_LEN, block);
+            compress(cs->cv, block, cs->chunk_counter, BLAKE3_BLOCK_LEN,
+                     cs->flags | chunk_state_start_flag(cs), out);
+            memcpy(cs->cv, out, 32);
+            cs->blocks_compressed++;
+            cs->block_len = 0;
+            memset(cs->block, 0, BLAKE3_BLOCK_LEN);
+        }
+        size_t want = BLAKE3_BLOCK_LEN - cs->block_len;
+        size_t take = input_len < want ? input_len : want;
+        memcpy(cs->block + cs->block_len, input, take);
+        cs->block_len += (uint8_t)take;
+        input         += take;
+        input_len     -= take;
+    }
+}
+
+static void
+chunk_state_output(const blake3_chunk_state_t *cs, blake3_output_t *o)
+{
+    memcpy(o->cv, cs->cv, 32);
+    words_from_bytes(cs->block, BLAKE3_BLOCK_LEN, o->block);
+    o->counter   = cs->chunk_counter;
+    o->block_len = cs->block_len;
+    o->flags     = cs->flags | chunk_state_start_flag(cs) | CHUNK_END;
+}
+
+static void
+parent_output(const uint32_t left[8], const uint32_t right[8],
+              const uint32_t key[8], uint32_t flags, blake3_output_t *o)
+{
+    memcpy(o->cv, key, 32);
+    memcpy(o->block, left, 32);
+    memcpy(o->block + 8, right, 32);
+    o->counter   = 0;
+    o->block_len = BLAKE3_BLOCK_LEN;
+    o->flags     = flags | PARENT;
+}
+
+static void
+hasher_init_internal(blake3_hasher_t *self, const uint32_t key[8], uint8_t flags)
+{
+    memcpy(self->key, key, 32);
+    chunk_state_init(&self->chunk, key, 0, flags);
+    self->cv_stack_len = 0;
+}
+
+void
+blake3_hasher_init(blake3_hasher_t *self)
+{
+    hasher_init_internal(self, IV, 0);
+}
+
+void
+blake3_hasher_init_keyed(blake3_hasher_t *self, const uint8_t key[BLAKE3_KEY_LEN])
+{
+    uint32_t words[8];
+    words_from_bytes(key, BLAKE3_KEY_LEN, words);
+    hasher_init_internal(self, words, KEYED_HASH);
+}
+
+void
+blake3_derive_context_key(const char *context, uint8_t context_key[BLAKE3_KEY_LEN])
+{
+    blake3_hasher_t hasher;
+    hasher_init_internal(&hasher, IV, DERIVE_KEY_CONTEXT);
+    blake3_hasher_update(&hasher, context, strlen(context));
+    blake3_hasher_finalize(&hasher, context_key, BLAKE3_KEY_LEN);
+}
+
+void
+blake3_hasher_init_derive_key_raw(blake3_hasher_t *self,
+                                  const uint8_t context_key[BLAKE3_KEY_LEN])
+{
+    uint32_t words[8];
+    words_from_bytes(context_key, BLAKE3_KEY_LEN, words);
+    hasher_init_internal(self, words, DERIVE_KEY_MATERIAL);
+}
+
+void
+blake3_hasher_init_derive_key(blake3_hasher_t *self, const char *context)
+{
+    uint8_t context_key[BLAKE3_KEY_LEN];
+    blake3_derive_context_key(context, context_key);
+    blake3_hasher_init_derive_key_raw(self, context_key);
+}
+
+static void
+hasher_add_chunk_cv(blake3_hasher_t *self, uint32_t cv[8], uint64_t total_chunks)
+{
+    // Merge completed subtrees, one per trailing zero bit of the chunk count
+    while ((total_chunks & 1) == 0) {
+        blake3_output_t o;
+        self->cv_stack_len--;
+        parent_output(self->cv_stack[self->cv_stack_len], cv, self->key,
+                      self->chunk.flags, &o);
+        output_chaining_value(&o, cv);
+        total_chunks >>= 1;
+    }
+    memcpy(self->cv_stack[self->cv_stack_len++], cv, 32);
+}
+
+void
+blake3_hasher_update(blake3_hasher_t *self, const void *input, size_t input_len)
+{
+    const uint8_t *in = input;
+
+    while (input_len > 0) {
+        if (chunk_state_len(&self->chunk) == BLAKE3_CHUNK_LEN) {
+            blake3_output_t o;
+            uint32_t cv[8];
+            chunk_state_output(&self->chunk, &o);
+            output_chaining_value(&o, cv);
+            uint64_t total_chunks = self->chunk.chunk_counter + 1;
+            hasher_add_chunk_cv(self, cv, total_chunks);
+            chunk_state_init(&self->chunk, self->key, total_chunks, self->chunk.flags);
+        }
+        size_t want = BLAKE3_CHUNK_LEN - chunk_state_len(&self->chunk);
+        size_t take = input_len < want ? input_len : want;
+        chunk_state_update(&self->chunk, in, take);
+        in        += take;
+        input_len -= take;
+    }
+}
+
+void
+blake3_hasher_finalize(const blake3_hasher_t *self, uint8_t *out, size_t out_len)
+{
+    blake3_output_t o;
+    chunk_state_output(&self->chunk, &o);
+
+    size_t remaining = self->cv_stack_len;
+    while (remaining > 0) {
+        uint32_t cv[8];
+        remaining--;
+        output_chaining_value(&o, cv);
+        parent_output(self->cv_stack[remaining], cv, self->key, self->chunk.flags, &o);
+    }
+    output_root_bytes(&o, out, out_len);
+}
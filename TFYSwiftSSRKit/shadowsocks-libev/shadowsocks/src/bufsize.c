@@ -0,0 +1,286 @@
+/*
+ * bufsize.c - Grow and shrink connection buffers from observed traffic
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "bufsize.h"
+#include "slab.h"
+#include "utils.h"
+
+static atomic_size_t policy_min      = BUF_SIZE_MIN_DEFAULT;
+static atomic_size_t policy_max      = BUF_SIZE_MAX_DEFAULT;
+static _Atomic double policy_grow    = BUF_SIZE_GROW_DEFAULT;
+static atomic_int policy_shrink      = BUF_SIZE_SHRINK_READS;
+static _Atomic double policy_idle    = BUF_SIZE_IDLE_DEFAULT;
+
+static atomic_size_t sizer_connections;
+static atomic_size_t sizer_bytes;
+static atomic_uint_fast64_t sizer_grows;
+static atomic_uint_fast64_t sizer_shrinks;
+static atomic_uint_fast64_t sizer_held;
+static atomic_size_t sizer_buckets[BUF_SIZE_BUCKETS];
+
+void
+buf_policy_configure(const buf_policy_t *policy)
+{
+    size_t min_size = BUF_SIZE_MIN_DEFAULT;
+    size_t max_size = BUF_SIZE_MAX_DEFAULT;
+    double grow     = BUF_SIZE_GROW_DEFAULT;
+    int shrink      = BUF_SIZE_SHRINK_READS;
+    double idle     = BUF_SIZE_IDLE_DEFAULT;
+
+    if (policy != NULL) {
+        if (policy->min_size > 0)
+            min_size = policy->min_size;
+        if (policy->max_size > 0)
+            max_size = policy->max_size;
+        if (policy->grow_factor > 1)
+            grow = policy->grow_factor;
+        if (policy->shrink_reads > 0)
+            shrink = policy->shrink_reads;
+        if (policy->idle_timeout > 0)
+            idle = policy->idle_timeout;
+    }
+    if (max_size < min_size)
+        max_size = min_size;
+
+    atomic_store(&policy_min, min_size);
+    atomic_store(&policy_max, max_size);
+    atomic_store(&policy_grow, grow);
+    atomic_store(&policy_shrink, shrink);
+    atomic_store(&policy_idle, idle);
+}
+
+void
+buf_policy_get(buf_policy_t *policy)
+{
+    policy->min_size     = atomic_load(&policy_min);
+    policy->max_size     = atomic_load(&policy_max);
+    policy->grow_factor  = atomic_load(&policy_grow);
+    policy->shrink_reads = atomic_load(&policy_shrink);
+    policy->idle_timeout = atomic_load(&policy_idle);
+}
+
+static int
+buf_bucket(size_t size)
+{
+    size_t base = atomic_load_explicit(&policy_min, memory_order_relaxed);
+    int bucket  = 0;
+    while (bucket < BUF_SIZE_BUCKETS - 1 && size >= base * 2) {
+        base *= 2;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void
+buf_sizer_set(buf_sizer_t *sizer, size_t size)
+{
+    int bucket = buf_bucket(size);
+
+    atomic_fetch_add_explicit(&sizer_bytes, size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&sizer_bytes, sizer->size, memory_order_relaxed);
+    if (bucket != sizer->bucket) {
+        atomic_fetch_sub_explicit(&sizer_buckets[sizer->bucket], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&sizer_buckets[bucket], 1, memory_order_relaxed);
+        sizer->bucket = bucket;
+    }
+
+    sizer->size        = size;
+    sizer->small_reads = 0;
+    if (size > sizer->peak)
+        sizer->peak = size;
+}
+
+static size_t
+sock_buf_size(int fd, int opt)
+{
+    int size      = 0;
+    socklen_t len = sizeof(size);
+    if (fd < 0 || getsockopt(fd, SOL_SOCKET, opt, &size, &len) == -1 || size < 0)
+        return 0;
+    return (size_t)size;
+}
+
+// Bytes queued for reading
+static size_t
+sock_readable(int fd)
+{
+    int n = 0;
+    if (fd < 0 || ioctl(fd, FIONREAD, &n) == -1 || n < 0)
+        return 0;
+    return (size_t)n;
+}
+
+// Bytes written but not yet acknowledged, or -1 if the platform can't tell
+static ssize_t
+sock_unsent(int fd)
+{
+    int n = 0;
+    if (fd < 0)
+        return -1;
+#if defined(__APPLE__) && defined(SO_NWRITE)
+    socklen_t len = sizeof(n);
+    if (getsockopt(fd, SOL_SOCKET, SO_NWRITE, &n, &len) == -1)
+        return -1;
+#elif defined(TIOCOUTQ)
+    if (ioctl(fd, TIOCOUTQ, &n) == -1)
+        return -1;
+#else
+    return -1;
+#endif
+    return n;
+}
+
+void
+buf_sizer_init(buf_sizer_t *sizer, int rfd, int wfd, ev_tstamp now)
+{
+    memset(sizer, 0, sizeof(buf_sizer_t));
+    sizer->release     = bfree;
+    sizer->size        = atomic_load(&policy_min);
+    sizer->peak        = sizer->size;
+    sizer->bucket      = buf_bucket(sizer->size);
+    sizer->rcvbuf      = sock_buf_size(rfd, SO_RCVBUF);
+    sizer->sndbuf      = sock_buf_size(wfd, SO_SNDBUF);
+    sizer->last_active = now;
+
+    atomic_fetch_add_explicit(&sizer_connections, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&sizer_bytes, sizer->size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&sizer_buckets[sizer->bucket], 1, memory_order_relaxed);
+}
+
+void
+buf_sizer_release(buf_sizer_t *sizer)
+{
+    if (sizer->size == 0)
+        return;
+    atomic_fetch_sub_explicit(&sizer_connections, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&sizer_bytes, sizer->size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&sizer_buckets[sizer->bucket], 1, memory_order_relaxed);
+    sizer->size = 0;
+}
+
+size_t
+buf_sizer_on_read(buf_sizer_t *sizer, int rfd, int wfd,
+                  size_t nread, size_t capacity, ev_tstamp now)
+{
+    size_t min_size = atomic_load_explicit(&policy_min, memory_order_relaxed);
+    size_t max_size = atomic_load_explicit(&policy_max, memory_order_relaxed);
+
+    sizer->last_active = now;
+
+    if (nread >= capacity && capacity > 0) {
+        sizer->small_reads = 0;
+        if (sizer->size >= max_size || sock_readable(rfd) == 0)
+            return sizer->size;
+
+        // The writer is behind, reading more would only queue it here
+        ssize_t unsent = sock_unsent(wfd);
+        if (unsent > 0 && sizer->sndbuf > 0 && (size_t)unsent > sizer->sndbuf / 2) {
+            atomic_fetch_add_explicit(&sizer_held, 1, memory_order_relaxed);
+            return sizer->size;
+        }
+
+        double grow = atomic_load_explicit(&policy_grow, memory_order_relaxed);
+        // The slab may have rounded the block up, grow from what it gave
+        size_t next = (size_t)(max(sizer->size, capacity) * grow);
+        if (sizer->rcvbuf > 0 && next > sizer->rcvbuf)
+            next = max(sizer->size, sizer->rcvbuf);
+        next = min(next, max_size);
+        if (next > sizer->size) {
+            buf_sizer_set(sizer, next);
+            sizer->grows++;
+            atomic_fetch_add_explicit(&sizer_grows, 1, memory_order_relaxed);
+        }
+    } else if (nread < capacity / 4) {
+        int limit = atomic_load_explicit(&policy_shrink, memory_order_relaxed);
+        if (++sizer->small_reads >= limit && sizer->size > min_size) {
+            buf_sizer_set(sizer, max(min_size, sizer->size / 2));
+            sizer->shrinks++;
+            atomic_fetch_add_explicit(&sizer_shrinks, 1, memory_order_relaxed);
+        }
+    } else {
+        sizer->small_reads = 0;
+    }
+
+    // A policy change lowered the ceiling
+    if (sizer->size > max_size)
+        buf_sizer_set(sizer, max_size);
+    return sizer->size;
+}
+
+size_t
+buf_sizer_on_idle(buf_sizer_t *sizer, ev_tstamp now)
+{
+    size_t min_size = atomic_load_explicit(&policy_min, memory_order_relaxed);
+    ev_tstamp idle  = atomic_load_explicit(&policy_idle, memory_order_relaxed);
+
+    if (sizer->size > min_size && now - sizer->last_active >= idle) {
+        buf_sizer_set(sizer, min_size);
+        sizer->shrinks++;
+        atomic_fetch_add_explicit(&sizer_shrinks, 1, memory_order_relaxed);
+    }
+    return sizer->size;
+}
+
+int
+buf_sizer_apply(buf_sizer_t *sizer, buffer_t *buf)
+{
+    if (buf->array != NULL && sizer->applied == sizer->size)
+        return 0;
+    if (buf->len > 0)
+        return -1;
+
+    // Fresh block rather than a realloc: there is nothing to copy
+    buffer_t tmp;
+    if (slab_balloc(&tmp, sizer->size) == -1)
+        return -1;
+    buf_sizer_free_buffer(sizer, buf);
+    *buf = tmp;
+
+    sizer->owned   = 1;
+    sizer->applied = sizer->size;
+    return 0;
+}
+
+void
+buf_sizer_free_buffer(buf_sizer_t *sizer, buffer_t *buf)
+{
+    if (sizer->owned)
+        slab_bfree(buf);
+    else if (sizer->release != NULL)
+        sizer->release(buf);
+}
+
+void
+buf_sizer_stats(buf_sizer_stats_t *stats)
+{
+    memset(stats, 0, sizeof(buf_sizer_stats_t));
+    stats->connections = atomic_load(&sizer_connections);
+    stats->bytes       = atomic_load(&sizer_bytes);
+    stats->grows       = atomic_load(&sizer_grows);
+    stats->shrinks     = atomic_load(&sizer_shrinks);
+    stats->held        = atomic_load(&sizer_held);
+    for (int i = 0; i < BUF_SIZE_BUCKETS; i++)
+        stats->buckets[i] = atomic_load(&sizer_buckets[i]);
+}
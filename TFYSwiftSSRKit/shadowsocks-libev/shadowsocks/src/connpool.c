@@ -0,0 +1,182 @@
+/*
+ * connpool.c - Co-allocate per-connection objects from a libcork mempool
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <libcork/core.h>
+
+#include "connpool.h"
+#include "membudget.h"
+#include "slab.h"
+#include "utils.h"
+
+struct conn_pool {
+    struct cork_mempool *mempool;
+    mem_account_t *account;
+    size_t live;
+    size_t peak;
+    uint64_t acquired;
+    uint64_t released;
+};
+
+/*
+ * The mempool puts a one pointer header in front of each element, so
+ * elements are only pointer aligned. Asking for a cache line more than
+ * needed leaves room to align the block inside its element.
+ */
+#define CONN_POOL_ELEMENT_SIZE (sizeof(conn_block_t) + CONN_POOL_CACHE_LINE)
+
+conn_pool_t *
+conn_pool_new(size_t per_chunk)
+{
+    if (per_chunk == 0)
+        per_chunk = CONN_POOL_DEFAULT_PER_CHUNK;
+
+    conn_pool_t *pool = ss_malloc(sizeof(conn_pool_t));
+    memset(pool, 0, sizeof(conn_pool_t));
+    pool->mempool = cork_mempool_new_size_ex(CONN_POOL_ELEMENT_SIZE,
+                                             per_chunk * (CONN_POOL_ELEMENT_SIZE + sizeof(void *)));
+    if (pool->mempool == NULL) {
+        LOGE("connpool: cannot create the mempool");
+        ss_free(pool);
+        return NULL;
+    }
+    pool->account = mem_budget_register("connpool", NULL, NULL, NULL);
+    return pool;
+}
+
+void
+conn_pool_free(conn_pool_t *pool)
+{
+    if (pool == NULL)
+        return;
+    if (pool->live != 0) {
+        LOGE("connpool: freed with %zu connections alive", pool->live);
+    }
+    mem_budget_unregister(pool->account);
+    cork_mempool_free(pool->mempool);
+    ss_free(pool);
+}
+
+conn_block_t *
+conn_pool_acquire(conn_pool_t *pool, size_t buf_size)
+{
+    if (mem_budget_charge(pool->account, CONN_POOL_ELEMENT_SIZE) == -1)
+        return NULL;
+
+    void *origin = cork_mempool_new_object(pool->mempool);
+    if (origin == NULL) {
+        mem_budget_uncharge(pool->account, CONN_POOL_ELEMENT_SIZE);
+        return NULL;
+    }
+
+    uintptr_t addr = ((uintptr_t)origin + CONN_POOL_CACHE_LINE - 1)
+                     & ~(uintptr_t)(CONN_POOL_CACHE_LINE - 1);
+    conn_block_t *block = (conn_block_t *)addr;
+    memset(block, 0, sizeof(conn_block_t));
+    block->origin = origin;
+
+    server_t *server = &block->server;
+    remote_t *remote = &block->remote;
+
+    server->fd       = -1;
+    server->recv_ctx = &block->server_recv_ctx;
+    server->send_ctx = &block->server_send_ctx;
+    server->e_ctx    = &block->e_ctx;
+    server->d_ctx    = &block->d_ctx;
+    server->chunk    = &block->chunk;
+    server->buf      = &block->server_buf;
+    block->server_recv_ctx.server = server;
+    block->server_send_ctx.server = server;
+
+    remote->fd       = -1;
+    remote->recv_ctx = &block->remote_recv_ctx;
+    remote->send_ctx = &block->remote_send_ctx;
+    remote->buf      = &block->remote_buf;
+    block->remote_recv_ctx.remote = remote;
+    block->remote_send_ctx.remote = remote;
+
+    if (buf_size > 0) {
+        if (slab_balloc(server->buf, buf_size) == -1
+            || slab_balloc(remote->buf, buf_size) == -1) {
+            slab_bfree(server->buf);
+            memset(block, 0, sizeof(conn_block_t));
+            cork_mempool_free_object(pool->mempool, origin);
+            mem_budget_uncharge(pool->account, CONN_POOL_ELEMENT_SIZE);
+            return NULL;
+        }
+        server->buf_capacity = (ssize_t)server->buf->capacity;
+        remote->buf_capacity = (ssize_t)remote->buf->capacity;
+    }
+
+    pool->acquired++;
+    if (++pool->live > pool->peak)
+        pool->peak = pool->live;
+
+    return block;
+}
+
+void
+conn_pool_release(conn_pool_t *pool, conn_block_t *block)
+{
+    if (block == NULL)
+        return;
+
+    slab_bfree(&block->server_buf);
+    slab_bfree(&block->remote_buf);
+
+    void *origin = block->origin;
+    memset(block, 0, sizeof(conn_block_t));
+    cork_mempool_free_object(pool->mempool, origin);
+    mem_budget_uncharge(pool->account, CONN_POOL_ELEMENT_SIZE);
+
+    pool->released++;
+    pool->live--;
+}
+
+void
+conn_block_link_remote(conn_block_t *block)
+{
+    block->server.remote = &block->remote;
+    block->remote.server = &block->server;
+}
+
+conn_block_t *
+conn_block_of_server(server_t *server)
+{
+    return (conn_block_t *)((char *)server - offsetof(conn_block_t, server));
+}
+
+conn_block_t *
+conn_block_of_remote(remote_t *remote)
+{
+    return (conn_block_t *)((char *)remote - offsetof(conn_block_t, remote));
+}
+
+void
+conn_pool_stats(const conn_pool_t *pool, conn_pool_stats_t *stats)
+{
+    stats->live       = pool->live;
+    stats->peak       = pool->peak;
+    stats->acquired   = pool->acquired;
+    stats->released   = pool->released;
+    stats->block_size = CONN_POOL_ELEMENT_SIZE;
+}
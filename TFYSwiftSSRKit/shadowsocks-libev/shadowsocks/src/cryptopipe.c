@@ -0,0 +1,744 @@
+/*
+ * cryptopipe.c - Offload bulk AEAD chunk sealing to worker threads
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mbedtls/gcm.h>
+#include <sodium.h>
+
+#include "cryptopipe.h"
+#include "utils.h"
+
+#define CRYPTO_PIPE_CACHE_LINE  64
+#define CRYPTO_PIPE_LEN_CHUNK   (CHUNK_SIZE_LEN + CRYPTO_PIPE_TAG_LEN)
+#define CRYPTO_PIPE_OVERHEAD    (CRYPTO_PIPE_LEN_CHUNK + CRYPTO_PIPE_TAG_LEN)
+#define CRYPTO_PIPE_MAX_KEY_LEN 32
+#define CRYPTO_PIPE_RATE_WINDOW 0.1
+
+typedef struct crypto_pipe_job {
+    struct crypto_pipe_job *next;
+    crypto_pipe_stream_t *stream;
+    uint64_t seq;
+    int enc;
+    int status;
+    uint8_t nonce[CRYPTO_PIPE_NONCE_LEN];
+    buffer_t *in;
+    buffer_t *out;
+} crypto_pipe_job_t;
+
+/*
+ * Single-producer/single-consumer ring. head is only written by the
+ * consumer and tail only by the producer, each on its own cache line.
+ */
+typedef struct spsc_ring {
+    _Alignas(CRYPTO_PIPE_CACHE_LINE) atomic_size_t head;
+    _Alignas(CRYPTO_PIPE_CACHE_LINE) atomic_size_t tail;
+    _Alignas(CRYPTO_PIPE_CACHE_LINE) size_t mask;
+    crypto_pipe_job_t **slots;
+} spsc_ring_t;
+
+typedef struct crypto_pipe_worker {
+    spsc_ring_t jobs;               // loop -> worker
+    spsc_ring_t done;               // worker -> loop
+    crypto_pipe_t *pipe;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_int sleeping;
+    int started;
+    int outstanding;                // jobs in either ring, loop thread only
+    mbedtls_gcm_context gcm;        // worker thread only
+} crypto_pipe_worker_t;
+
+struct crypto_pipe {
+    struct ev_loop *loop;
+    ev_async async;
+    crypto_pipe_config_t config;
+    int nworkers;
+    crypto_pipe_worker_t *workers;
+    atomic_int stop;
+    crypto_pipe_job_t *backlog_head;
+    crypto_pipe_job_t *backlog_tail;
+    size_t backlog;
+    crypto_pipe_job_t *free_jobs;
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t bytes;
+};
+
+struct crypto_pipe_stream {
+    crypto_pipe_t *pipe;
+    int method;
+    size_t key_len;
+    uint8_t subkey[CRYPTO_PIPE_MAX_KEY_LEN];
+    mbedtls_gcm_context gcm;        // for scanning lengths on the loop thread
+    crypto_pipe_cb cb;
+    void *data;
+    uint64_t next_seq;
+    uint64_t deliver_seq;
+    size_t inflight;                // submitted and not yet delivered
+    crypto_pipe_job_t *pending;     // finished out of order, sorted by seq
+    int closed;
+    int delivering;
+    ev_tstamp window_start;
+    size_t window_bytes;
+    double rate;
+};
+
+static const uint8_t *
+buf_bytes(const buffer_t *buf)
+{
+    return (const uint8_t *)buf->array;
+}
+
+void
+crypto_pipe_nonce_add(uint8_t *nonce, size_t len, uint64_t n)
+{
+    uint64_t carry = n;
+    for (size_t i = 0; i < len && carry; i++) {
+        carry   += nonce[i];
+        nonce[i] = (uint8_t)carry;
+        carry  >>= 8;
+    }
+}
+
+size_t
+crypto_pipe_chunks(size_t len)
+{
+    return (len + CRYPTO_PIPE_CHUNK_SIZE - 1) / CRYPTO_PIPE_CHUNK_SIZE;
+}
+
+size_t
+crypto_pipe_sealed_len(size_t len)
+{
+    return len + crypto_pipe_chunks(len) * CRYPTO_PIPE_OVERHEAD;
+}
+
+static int
+pipe_seal(int method, mbedtls_gcm_context *gcm, const uint8_t *key, const uint8_t *nonce,
+          const uint8_t *m, size_t mlen, uint8_t *c)
+{
+    if (method == CHACHA20_IETF_POLY1305) {
+        unsigned long long tlen = 0;
+        return crypto_aead_chacha20poly1305_ietf_encrypt_detached(c, c + mlen, &tlen, m, mlen,
+                                                                  NULL, 0, NULL, nonce, key)
+               == 0 ? CRYPTO_OK : CRYPTO_ERROR;
+    }
+    return mbedtls_gcm_crypt_and_tag(gcm, MBEDTLS_GCM_ENCRYPT, mlen,
+                                     nonce, CRYPTO_PIPE_NONCE_LEN, NULL, 0,
+                                     m, c, CRYPTO_PIPE_TAG_LEN, c + mlen)
+           == 0 ? CRYPTO_OK : CRYPTO_ERROR;
+}
+
+static int
+pipe_open(int method, mbedtls_gcm_context *gcm, const uint8_t *key, const uint8_t *nonce,
+          const uint8_t *c, size_t mlen, uint8_t *m)
+{
+    if (method == CHACHA20_IETF_POLY1305) {
+        return crypto_aead_chacha20poly1305_ietf_decrypt_detached(m, NULL, c, mlen, c + mlen,
+                                                                  NULL, 0, nonce, key)
+               == 0 ? CRYPTO_OK : CRYPTO_ERROR;
+    }
+    return mbedtls_gcm_auth_decrypt(gcm, mlen, nonce, CRYPTO_PIPE_NONCE_LEN, NULL, 0,
+                                    c + mlen, CRYPTO_PIPE_TAG_LEN, c, m)
+           == 0 ? CRYPTO_OK : CRYPTO_ERROR;
+}
+
+static int
+pipe_setkey(int method, mbedtls_gcm_context *gcm, const uint8_t *key, size_t key_len)
+{
+    if (method == CHACHA20_IETF_POLY1305)
+        return CRYPTO_OK;
+    return mbedtls_gcm_setkey(gcm, MBEDTLS_CIPHER_ID_AES, key, (unsigned int)key_len * 8)
+           == 0 ? CRYPTO_OK : CRYPTO_ERROR;
+}
+
+static size_t
+chunk_len(const uint8_t *len_buf)
+{
+    return ((size_t)len_buf[0] << 8 | len_buf[1]) & CHUNK_SIZE_MASK;
+}
+
+static int
+pipe_encrypt_job(crypto_pipe_job_t *job, mbedtls_gcm_context *gcm)
+{
+    crypto_pipe_stream_t *stream = job->stream;
+    const uint8_t *in = buf_bytes(job->in);
+    uint8_t *out      = (uint8_t *)job->out->array;
+    size_t len        = job->in->len;
+    size_t olen       = 0;
+
+    if (job->out == job->in || job->out->capacity < crypto_pipe_sealed_len(len))
+        return CRYPTO_ERROR;
+
+    for (size_t off = 0; off < len;) {
+        size_t plen = len - off < CRYPTO_PIPE_CHUNK_SIZE ? len - off : CRYPTO_PIPE_CHUNK_SIZE;
+        uint8_t len_buf[CHUNK_SIZE_LEN] = { (uint8_t)(plen >> 8), (uint8_t)plen };
+
+        if (pipe_seal(stream->method, gcm, stream->subkey, job->nonce,
+                      len_buf, CHUNK_SIZE_LEN, out + olen) != CRYPTO_OK)
+            return CRYPTO_ERROR;
+        sodium_increment(job->nonce, CRYPTO_PIPE_NONCE_LEN);
+        olen += CRYPTO_PIPE_LEN_CHUNK;
+
+        if (pipe_seal(stream->method, gcm, stream->subkey, job->nonce,
+                      in + off, plen, out + olen) != CRYPTO_OK)
+            return CRYPTO_ERROR;
+        sodium_increment(job->nonce, CRYPTO_PIPE_NONCE_LEN);
+        olen += plen + CRYPTO_PIPE_TAG_LEN;
+        off  += plen;
+    }
+
+    job->out->idx = 0;
+    job->out->len = olen;
+    return CRYPTO_OK;
+}
+
+static int
+pipe_decrypt_job(crypto_pipe_job_t *job, mbedtls_gcm_context *gcm)
+{
+    crypto_pipe_stream_t *stream = job->stream;
+    uint8_t *in  = (uint8_t *)job->in->array;
+    uint8_t *out = (uint8_t *)job->out->array;
+    size_t len   = job->in->len;
+    size_t olen  = 0;
+    int inplace  = job->out == job->in;
+
+    if (!inplace && job->out->capacity < len)
+        return CRYPTO_ERROR;
+
+    for (size_t off = 0; off < len;) {
+        uint8_t len_buf[CHUNK_SIZE_LEN];
+
+        if (len - off < CRYPTO_PIPE_OVERHEAD)
+            return CRYPTO_ERROR;
+        if (pipe_open(stream->method, gcm, stream->subkey, job->nonce,
+                      in + off, CHUNK_SIZE_LEN, len_buf) != CRYPTO_OK)
+            return CRYPTO_ERROR;
+        sodium_increment(job->nonce, CRYPTO_PIPE_NONCE_LEN);
+
+        size_t plen = chunk_len(len_buf);
+        if (plen == 0 || len - off < CRYPTO_PIPE_OVERHEAD + plen)
+            return CRYPTO_ERROR;
+
+        // Open in place, then close the gap left by the headers and tags
+        uint8_t *payload = in + off + CRYPTO_PIPE_LEN_CHUNK;
+        if (pipe_open(stream->method, gcm, stream->subkey, job->nonce,
+                      payload, plen, inplace ? payload : out + olen) != CRYPTO_OK)
+            return CRYPTO_ERROR;
+        sodium_increment(job->nonce, CRYPTO_PIPE_NONCE_LEN);
+        if (inplace)
+            memmove(out + olen, payload, plen);
+
+        olen += plen;
+        off  += CRYPTO_PIPE_OVERHEAD + plen;
+    }
+
+    job->out->idx = 0;
+    job->out->len = olen;
+    return CRYPTO_OK;
+}
+
+static int
+ring_init(spsc_ring_t *ring, size_t size)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->mask  = size - 1;
+    ring->slots = calloc(size, sizeof(crypto_pipe_job_t *));
+    return ring->slots == NULL ? -1 : 0;
+}
+
+static int
+ring_push(spsc_ring_t *ring, crypto_pipe_job_t *job)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head > ring->mask)
+        return 0;
+    ring->slots[tail & ring->mask] = job;
+    // seq_cst pairs with the sleeping flag, see crypto_pipe_worker_main()
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_seq_cst);
+    return 1;
+}
+
+static crypto_pipe_job_t *
+ring_pop(spsc_ring_t *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail)
+        return NULL;
+    crypto_pipe_job_t *job = ring->slots[head & ring->mask];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return job;
+}
+
+static int
+ring_empty(spsc_ring_t *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_relaxed)
+           == atomic_load_explicit(&ring->tail, memory_order_seq_cst);
+}
+
+static void *
+crypto_pipe_worker_main(void *arg)
+{
+    crypto_pipe_worker_t *worker = arg;
+    crypto_pipe_t *pipe          = worker->pipe;
+
+    for (;;) {
+        crypto_pipe_job_t *job = ring_pop(&worker->jobs);
+
+        if (job == NULL) {
+            /*
+             * Announce the nap before the final look at the ring. The
+             * loop publishes a job before it reads the flag, so one of
+             * the two always sees the other.
+             */
+            pthread_mutex_lock(&worker->lock);
+            atomic_store(&worker->sleeping, 1);
+            while (!atomic_load(&pipe->stop) && ring_empty(&worker->jobs))
+                pthread_cond_wait(&worker->cond, &worker->lock);
+            atomic_store(&worker->sleeping, 0);
+            pthread_mutex_unlock(&worker->lock);
+            if (atomic_load(&pipe->stop) && ring_empty(&worker->jobs))
+                break;
+            continue;
+        }
+
+        crypto_pipe_stream_t *stream = job->stream;
+        job->status = pipe_setkey(stream->method, &worker->gcm, stream->subkey, stream->key_len);
+        if (job->status == CRYPTO_OK)
+            job->status = job->enc ? pipe_encrypt_job(job, &worker->gcm)
+                          : pipe_decrypt_job(job, &worker->gcm);
+
+        // Never full: the loop keeps at most queue_depth jobs per worker
+        ring_push(&worker->done, job);
+        ev_async_send(pipe->loop, &pipe->async);
+    }
+
+    mbedtls_gcm_free(&worker->gcm);
+    return NULL;
+}
+
+static void
+crypto_pipe_wake(crypto_pipe_worker_t *worker)
+{
+    if (atomic_load(&worker->sleeping)) {
+        pthread_mutex_lock(&worker->lock);
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
+static void
+crypto_pipe_stream_free(crypto_pipe_stream_t *stream)
+{
+    mbedtls_gcm_free(&stream->gcm);
+    sodium_memzero(stream, sizeof(crypto_pipe_stream_t));
+    ss_free(stream);
+}
+
+static void
+crypto_pipe_recycle(crypto_pipe_t *pipe, crypto_pipe_job_t *job)
+{
+    job->stream    = NULL;
+    job->in        = NULL;
+    job->out       = NULL;
+    job->next      = pipe->free_jobs;
+    pipe->free_jobs = job;
+}
+
+/*
+ * Hand back everything that is next in line for the stream.
+ */
+static void
+crypto_pipe_deliver(crypto_pipe_stream_t *stream)
+{
+    crypto_pipe_t *pipe = stream->pipe;
+
+    // A callback may complete more of this stream; the outer loop sees them
+    if (stream->delivering)
+        return;
+
+    stream->delivering = 1;
+    while (stream->pending != NULL && stream->pending->seq == stream->deliver_seq) {
+        crypto_pipe_job_t *job = stream->pending;
+        stream->pending = job->next;
+        stream->deliver_seq++;
+        stream->inflight--;
+
+        int status = stream->closed ? CRYPTO_PIPE_CANCELLED : job->status;
+        if (status == CRYPTO_ERROR)
+            pipe->failed++;
+        pipe->completed++;
+
+        buffer_t *in  = job->in;
+        buffer_t *out = job->out;
+        crypto_pipe_recycle(pipe, job);
+        stream->cb(stream, in, out, status, stream->data);
+    }
+    stream->delivering = 0;
+
+    if (stream->closed && stream->inflight == 0)
+        crypto_pipe_stream_free(stream);
+}
+
+static void
+crypto_pipe_complete(crypto_pipe_job_t *job)
+{
+    crypto_pipe_stream_t *stream = job->stream;
+    crypto_pipe_job_t **link     = &stream->pending;
+
+    while (*link != NULL && (*link)->seq < job->seq)
+        link = &(*link)->next;
+    job->next = *link;
+    *link     = job;
+
+    crypto_pipe_deliver(stream);
+}
+
+static void
+crypto_pipe_dispatch(crypto_pipe_t *pipe)
+{
+    while (pipe->backlog_head != NULL) {
+        crypto_pipe_job_t *job = pipe->backlog_head;
+
+        // A closed stream only wants its buffers back
+        if (job->stream->closed) {
+            pipe->backlog_head = job->next;
+            if (pipe->backlog_head == NULL)
+                pipe->backlog_tail = NULL;
+            pipe->backlog--;
+            crypto_pipe_complete(job);
+            continue;
+        }
+
+        crypto_pipe_worker_t *best = NULL;
+        for (int i = 0; i < pipe->nworkers; i++) {
+            crypto_pipe_worker_t *w = &pipe->workers[i];
+            if (w->outstanding < pipe->config.queue_depth
+                && (best == NULL || w->outstanding < best->outstanding))
+                best = w;
+        }
+        if (best == NULL)
+            break;
+
+        pipe->backlog_head = job->next;
+        if (pipe->backlog_head == NULL)
+            pipe->backlog_tail = NULL;
+        pipe->backlog--;
+
+        best->outstanding++;
+        ring_push(&best->jobs, job);
+        crypto_pipe_wake(best);
+    }
+}
+
+static void
+crypto_pipe_drain(crypto_pipe_t *pipe)
+{
+    for (int i = 0; i < pipe->nworkers; i++) {
+        crypto_pipe_worker_t *worker = &pipe->workers[i];
+        crypto_pipe_job_t *job;
+        while ((job = ring_pop(&worker->done)) != NULL) {
+            worker->outstanding--;
+            crypto_pipe_complete(job);
+        }
+    }
+}
+
+static void
+crypto_pipe_async_cb(EV_P_ ev_async *w, int revents)
+{
+    crypto_pipe_t *pipe = (crypto_pipe_t *)w->data;
+
+    crypto_pipe_drain(pipe);
+    crypto_pipe_dispatch(pipe);
+}
+
+static int
+round_pow2(int n)
+{
+    int p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+crypto_pipe_t *
+crypto_pipe_new(struct ev_loop *loop, const crypto_pipe_config_t *config)
+{
+    crypto_pipe_t *pipe = ss_malloc(sizeof(crypto_pipe_t));
+    memset(pipe, 0, sizeof(crypto_pipe_t));
+
+    if (config != NULL)
+        pipe->config = *config;
+    if (pipe->config.workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        // Leave one core to the loop itself
+        pipe->config.workers = cpus > 2 ? (int)cpus - 1 : 1;
+        if (pipe->config.workers > CRYPTO_PIPE_DEFAULT_WORKERS)
+            pipe->config.workers = CRYPTO_PIPE_DEFAULT_WORKERS;
+    }
+    if (pipe->config.workers > CRYPTO_PIPE_MAX_WORKERS)
+        pipe->config.workers = CRYPTO_PIPE_MAX_WORKERS;
+    if (pipe->config.queue_depth <= 0)
+        pipe->config.queue_depth = CRYPTO_PIPE_DEFAULT_DEPTH;
+    pipe->config.queue_depth = round_pow2(pipe->config.queue_depth);
+    if (pipe->config.threshold == 0)
+        pipe->config.threshold = CRYPTO_PIPE_DEFAULT_THRESHOLD;
+    if (pipe->config.min_batch == 0)
+        pipe->config.min_batch = CRYPTO_PIPE_DEFAULT_MIN_BATCH;
+
+    pipe->loop = loop;
+    atomic_init(&pipe->stop, 0);
+    ev_async_init(&pipe->async, crypto_pipe_async_cb);
+    pipe->async.data = pipe;
+    ev_async_start(loop, &pipe->async);
+
+    pipe->workers = calloc(pipe->config.workers, sizeof(crypto_pipe_worker_t));
+    if (pipe->workers == NULL) {
+        crypto_pipe_free(pipe);
+        return NULL;
+    }
+
+    for (int i = 0; i < pipe->config.workers; i++) {
+        crypto_pipe_worker_t *worker = &pipe->workers[i];
+        worker->pipe = pipe;
+        atomic_init(&worker->sleeping, 0);
+        mbedtls_gcm_init(&worker->gcm);
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        pipe->nworkers++;
+
+        if (ring_init(&worker->jobs, pipe->config.queue_depth) != 0
+            || ring_init(&worker->done, pipe->config.queue_depth) != 0
+            || pthread_create(&worker->thread, NULL, crypto_pipe_worker_main, worker) != 0) {
+            LOGE("cryptopipe: failed to start worker %d", i);
+            crypto_pipe_free(pipe);
+            return NULL;
+        }
+        worker->started = 1;
+    }
+
+    return pipe;
+}
+
+void
+crypto_pipe_free(crypto_pipe_t *pipe)
+{
+    if (pipe == NULL)
+        return;
+
+    // Workers finish what is queued, then exit
+    atomic_store(&pipe->stop, 1);
+    for (int i = 0; i < pipe->nworkers; i++) {
+        crypto_pipe_worker_t *worker = &pipe->workers[i];
+        pthread_mutex_lock(&worker->lock);
+        pthread_cond_broadcast(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+        if (worker->started)
+            pthread_join(worker->thread, NULL);
+        else
+            mbedtls_gcm_free(&worker->gcm);
+    }
+
+    // Return the remaining buffers; streams are closed by now
+    crypto_pipe_drain(pipe);
+    while (pipe->backlog_head != NULL) {
+        crypto_pipe_job_t *job = pipe->backlog_head;
+        pipe->backlog_head = job->next;
+        job->stream->closed = 1;
+        crypto_pipe_complete(job);
+    }
+
+    ev_async_stop(pipe->loop, &pipe->async);
+
+    for (int i = 0; i < pipe->nworkers; i++) {
+        crypto_pipe_worker_t *worker = &pipe->workers[i];
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->cond);
+        free(worker->jobs.slots);
+        free(worker->done.slots);
+    }
+    free(pipe->workers);
+
+    while (pipe->free_jobs != NULL) {
+        crypto_pipe_job_t *job = pipe->free_jobs;
+        pipe->free_jobs = job->next;
+        ss_free(job);
+    }
+
+    ss_free(pipe);
+}
+
+void
+crypto_pipe_stats(crypto_pipe_t *pipe, crypto_pipe_stats_t *stats)
+{
+    stats->submitted = pipe->submitted;
+    stats->completed = pipe->completed;
+    stats->failed    = pipe->failed;
+    stats->bytes     = pipe->bytes;
+    stats->backlog   = pipe->backlog;
+    stats->workers   = pipe->nworkers;
+}
+
+crypto_pipe_stream_t *
+crypto_pipe_stream_new(crypto_pipe_t *pipe, int method,
+                       const uint8_t *subkey, size_t key_len,
+                       crypto_pipe_cb cb, void *data)
+{
+    if (method < AES_128_GCM || method > CHACHA20_IETF_POLY1305
+        || key_len > CRYPTO_PIPE_MAX_KEY_LEN || cb == NULL)
+        return NULL;
+
+    crypto_pipe_stream_t *stream = ss_malloc(sizeof(crypto_pipe_stream_t));
+    memset(stream, 0, sizeof(crypto_pipe_stream_t));
+    stream->pipe    = pipe;
+    stream->method  = method;
+    stream->key_len = key_len;
+    memcpy(stream->subkey, subkey, key_len);
+    stream->cb   = cb;
+    stream->data = data;
+
+    mbedtls_gcm_init(&stream->gcm);
+    if (pipe_setkey(method, &stream->gcm, subkey, key_len) != CRYPTO_OK) {
+        crypto_pipe_stream_free(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+void
+crypto_pipe_stream_close(crypto_pipe_stream_t *stream)
+{
+    if (stream == NULL)
+        return;
+    stream->closed = 1;
+    if (stream->inflight == 0 && !stream->delivering)
+        crypto_pipe_stream_free(stream);
+}
+
+size_t
+crypto_pipe_stream_inflight(const crypto_pipe_stream_t *stream)
+{
+    return stream->inflight;
+}
+
+int
+crypto_pipe_stream_offload(crypto_pipe_stream_t *stream, size_t len)
+{
+    crypto_pipe_t *pipe = stream->pipe;
+    ev_tstamp now       = ev_now(pipe->loop);
+
+    if (stream->window_start == 0)
+        stream->window_start = now;
+    stream->window_bytes += len;
+
+    ev_tstamp elapsed = now - stream->window_start;
+    if (elapsed >= CRYPTO_PIPE_RATE_WINDOW) {
+        double rate = stream->window_bytes / elapsed;
+        stream->rate = stream->rate == 0 ? rate : 0.7 * stream->rate + 0.3 * rate;
+        stream->window_start = now;
+        stream->window_bytes = 0;
+    }
+
+    // Later data must not overtake batches that are still with a worker
+    if (stream->inflight > 0)
+        return 1;
+
+    return stream->rate >= (double)pipe->config.threshold && len >= pipe->config.min_batch;
+}
+
+int
+crypto_pipe_stream_scan(crypto_pipe_stream_t *stream, const uint8_t *nonce,
+                        const uint8_t *buf, size_t len,
+                        size_t *consumed, size_t *chunks)
+{
+    uint8_t n[CRYPTO_PIPE_NONCE_LEN];
+    size_t off = 0, count = 0;
+
+    memcpy(n, nonce, CRYPTO_PIPE_NONCE_LEN);
+    while (len - off >= CRYPTO_PIPE_LEN_CHUNK) {
+        uint8_t len_buf[CHUNK_SIZE_LEN];
+        if (pipe_open(stream->method, &stream->gcm, stream->subkey, n,
+                      buf + off, CHUNK_SIZE_LEN, len_buf) != CRYPTO_OK)
+            return CRYPTO_ERROR;
+
+        size_t plen = chunk_len(len_buf);
+        if (plen == 0)
+            return CRYPTO_ERROR;
+        if (len - off < CRYPTO_PIPE_OVERHEAD + plen)
+            break;
+
+        off += CRYPTO_PIPE_OVERHEAD + plen;
+        count++;
+        crypto_pipe_nonce_add(n, CRYPTO_PIPE_NONCE_LEN, 2);
+    }
+
+    *consumed = off;
+    *chunks   = count;
+    return CRYPTO_OK;
+}
+
+int
+crypto_pipe_submit(crypto_pipe_stream_t *stream, int enc, const uint8_t *nonce,
+                   buffer_t *in, buffer_t *out)
+{
+    crypto_pipe_t *pipe = stream->pipe;
+
+    if (stream->closed || in == NULL || out == NULL || in->len == 0)
+        return CRYPTO_ERROR;
+
+    crypto_pipe_job_t *job = pipe->free_jobs;
+    if (job != NULL)
+        pipe->free_jobs = job->next;
+    else
+        job = ss_malloc(sizeof(crypto_pipe_job_t));
+    memset(job, 0, sizeof(crypto_pipe_job_t));
+
+    job->stream = stream;
+    job->seq    = stream->next_seq++;
+    job->enc    = enc;
+    job->in     = in;
+    job->out    = out;
+    memcpy(job->nonce, nonce, CRYPTO_PIPE_NONCE_LEN);
+
+    stream->inflight++;
+    pipe->submitted++;
+    pipe->bytes += in->len;
+
+    if (pipe->backlog_tail != NULL)
+        pipe->backlog_tail->next = job;
+    else
+        pipe->backlog_head = job;
+    pipe->backlog_tail = job;
+    pipe->backlog++;
+
+    crypto_pipe_dispatch(pipe);
+    return CRYPTO_OK;
+}
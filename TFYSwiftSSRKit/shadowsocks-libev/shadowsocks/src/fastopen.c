@@ -0,0 +1,276 @@
+/*
+ * fastopen.c - Client side TCP Fast Open with per-server fallback
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "fastopen.h"
+#include "utils.h"
+
+#ifdef __linux__
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT    30
+#endif
+#ifndef MSG_FASTOPEN
+#define MSG_FASTOPEN            0x20000000
+#endif
+#ifndef TCPI_OPT_SYN_DATA
+#define TCPI_OPT_SYN_DATA       32
+#endif
+#define HAVE_FAST_OPEN 1
+#elif defined(CONNECT_DATA_IDEMPOTENT)
+#define HAVE_FAST_OPEN 1
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct fast_open_server {
+    atomic_int_fast64_t disabled_until;
+    atomic_int backoff;
+    atomic_int not_acked;           // in a row
+    atomic_uint_fast64_t attempts;
+    atomic_uint_fast64_t syn_data_acked;
+    atomic_uint_fast64_t syn_data_not_acked;
+    atomic_uint_fast64_t blackholes;
+    atomic_uint_fast64_t fallbacks;
+};
+
+// Cleared for good when the system refuses TFO
+static atomic_int fast_open_system = 1;
+#ifdef __linux__
+static atomic_int fast_open_connect_opt = 1;
+#endif
+
+static int64_t
+fast_open_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec;
+}
+
+static int
+fast_open_unsupported(int error)
+{
+    return error == EOPNOTSUPP || error == EPROTONOSUPPORT || error == ENOPROTOOPT;
+}
+
+static void
+fast_open_disable(fast_open_server_t *server)
+{
+    int backoff = atomic_load(&server->backoff);
+    backoff = backoff == 0 ? FAST_OPEN_MIN_BACKOFF : backoff * 2;
+    if (backoff > FAST_OPEN_MAX_BACKOFF)
+        backoff = FAST_OPEN_MAX_BACKOFF;
+    atomic_store(&server->backoff, backoff);
+    atomic_store(&server->not_acked, 0);
+    atomic_store(&server->disabled_until, fast_open_now() + backoff);
+    LOGI("fastopen: disabled for %d seconds", backoff);
+}
+
+fast_open_server_t *
+fast_open_server_new(void)
+{
+    fast_open_server_t *server = ss_malloc(sizeof(fast_open_server_t));
+    memset(server, 0, sizeof(fast_open_server_t));
+    return server;
+}
+
+void
+fast_open_server_free(fast_open_server_t *server)
+{
+    ss_free(server);
+}
+
+#ifdef HAVE_FAST_OPEN
+
+// Returns bytes taken, -1 with errno set, or -2 to fall back to connect()
+static ssize_t
+fast_open_syn(int fd, const struct sockaddr *addr, socklen_t addr_len,
+              const void *data, size_t len)
+{
+    ssize_t s;
+
+#ifdef __linux__
+    int opt = 1;
+    if (atomic_load(&fast_open_connect_opt)
+        && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt, sizeof(opt)) == -1)
+        atomic_store(&fast_open_connect_opt, 0);
+
+    if (atomic_load(&fast_open_connect_opt)) {
+        if (connect(fd, addr, addr_len) == -1 && errno != EINPROGRESS)
+            return -1;
+        s = send(fd, data, len, MSG_NOSIGNAL);
+    } else {
+        s = sendto(fd, data, len, MSG_FASTOPEN | MSG_NOSIGNAL, addr, addr_len);
+    }
+#else
+    sa_endpoints_t endpoints;
+    memset(&endpoints, 0, sizeof(sa_endpoints_t));
+    endpoints.sae_dstaddr    = addr;
+    endpoints.sae_dstaddrlen = addr_len;
+
+    if (connectx(fd, &endpoints, SAE_ASSOCID_ANY,
+                 CONNECT_RESUME_ON_READ_WRITE | CONNECT_DATA_IDEMPOTENT,
+                 NULL, 0, NULL, NULL) == -1) {
+        if (fast_open_unsupported(errno)) {
+            atomic_store(&fast_open_system, 0);
+            return -2;
+        }
+        if (errno != EINPROGRESS)
+            return -1;
+    }
+    s = send(fd, data, len, 0);
+#endif
+
+    if (s >= 0)
+        return s;
+    // No cookie yet: the SYN asked for one and the data waits
+    if (errno == EINPROGRESS || errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+    if (fast_open_unsupported(errno)) {
+        atomic_store(&fast_open_system, 0);
+        return -2;
+    }
+    return -1;
+}
+
+#endif // HAVE_FAST_OPEN
+
+ssize_t
+fast_open_connect(fast_open_conn_t *conn, fast_open_server_t *server, int fd,
+                  const struct sockaddr *addr, socklen_t addr_len,
+                  const void *data, size_t len)
+{
+    memset(conn, 0, sizeof(fast_open_conn_t));
+    conn->server = server;
+
+#ifdef HAVE_FAST_OPEN
+    if (len > 0 && atomic_load(&fast_open_system)) {
+        if (fast_open_now() < atomic_load(&server->disabled_until)) {
+            atomic_fetch_add(&server->fallbacks, 1);
+        } else {
+            ssize_t s = fast_open_syn(fd, addr, addr_len, data, len);
+            if (s != -2) {
+                if (s >= 0) {
+                    conn->attempted = 1;
+                    conn->syn_data  = s > 0;
+                    atomic_fetch_add(&server->attempts, 1);
+                }
+                return s;
+            }
+            LOGI("fastopen: not supported by the system");
+        }
+    }
+#endif
+
+    if (connect(fd, addr, addr_len) == -1 && errno != EINPROGRESS)
+        return -1;
+    return 0;
+}
+
+void
+fast_open_connected(fast_open_conn_t *conn, int fd)
+{
+    if (!conn->attempted || conn->connected)
+        return;
+    conn->connected = 1;
+
+    fast_open_server_t *server = conn->server;
+    int acked                  = -1;
+
+#if defined(__linux__)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (conn->syn_data && getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+        acked = (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+#elif defined(TCP_CONNECTION_INFO)
+    struct tcp_connection_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_CONNECTION_INFO, &info, &len) == 0) {
+        conn->syn_data = info.tcpi_tfo_syn_data_sent;
+        if (info.tcpi_tfo_send_blackhole) {
+            atomic_fetch_add(&server->blackholes, 1);
+            fast_open_disable(server);
+            return;
+        }
+        if (conn->syn_data)
+            acked = info.tcpi_tfo_syn_data_acked;
+    }
+#endif
+
+    if (acked == 1) {
+        atomic_fetch_add(&server->syn_data_acked, 1);
+        atomic_store(&server->not_acked, 0);
+    } else if (acked == 0) {
+        atomic_fetch_add(&server->syn_data_not_acked, 1);
+        // The cookie is stale or the server ignores the data
+        if (atomic_fetch_add(&server->not_acked, 1) + 1 >= FAST_OPEN_MAX_NOT_ACKED)
+            fast_open_disable(server);
+    }
+}
+
+void
+fast_open_response(fast_open_conn_t *conn)
+{
+    if (!conn->attempted || conn->responded)
+        return;
+    conn->responded = 1;
+    atomic_store(&conn->server->backoff, 0);
+}
+
+void
+fast_open_failed(fast_open_conn_t *conn, int error)
+{
+    if (!conn->attempted || conn->responded)
+        return;
+    conn->responded = 1;
+
+    // The server or the route is down, SYN data has nothing to do with it
+    if (error == ECONNREFUSED || error == ENETUNREACH || error == EHOSTUNREACH)
+        return;
+    if (!conn->syn_data)
+        return;
+
+    atomic_fetch_add(&conn->server->blackholes, 1);
+    fast_open_disable(conn->server);
+}
+
+void
+fast_open_stats(const fast_open_server_t *server, fast_open_stats_t *stats)
+{
+    fast_open_server_t *s = (fast_open_server_t *)server;
+    int64_t left          = atomic_load(&s->disabled_until) - fast_open_now();
+
+    stats->attempts           = atomic_load(&s->attempts);
+    stats->syn_data_acked     = atomic_load(&s->syn_data_acked);
+    stats->syn_data_not_acked = atomic_load(&s->syn_data_not_acked);
+    stats->blackholes         = atomic_load(&s->blackholes);
+    stats->fallbacks          = atomic_load(&s->fallbacks);
+    stats->disabled_for       = left > 0 ? left : 0;
+    stats->enabled            = atomic_load(&fast_open_system) && left <= 0;
+}
@@ -0,0 +1,539 @@
+/*
+ * fec.c - Reed-Solomon forward error correction for the UDP relay
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "fec.h"
+#include "utils.h"
+
+#define FEC_MAX_SHARDS          (FEC_MAX_DATA + FEC_MAX_PARITY)
+#define FEC_CODED_MAX           (FEC_LENGTH_SIZE + FEC_MAX_PAYLOAD)
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul[256][256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static void
+gf_init(void)
+{
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; i++)
+        gf_exp[i] = gf_exp[i - 255];
+
+    for (int a = 1; a < 256; a++)
+        for (int b = 1; b < 256; b++)
+            gf_mul[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t
+gf_inv(uint8_t a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+/*
+ * Cauchy matrix entry for parity j and data i: 1 / (x_j + y_i) with
+ * x_j = FEC_MAX_DATA + j and y_i = i, which never meet. It does not
+ * depend on the group size, so short groups use the same code.
+ */
+static uint8_t
+fec_coefficient(int parity, int data)
+{
+    return gf_inv((uint8_t)((FEC_MAX_DATA + parity) ^ data));
+}
+
+// dst[0, len) += c * src[0, len)
+static void
+fec_mul_add(uint8_t *dst, const uint8_t *src, size_t len, uint8_t c)
+{
+    const uint8_t *row = gf_mul[c];
+
+    if (c == 1) {
+        for (size_t i = 0; i < len; i++)
+            dst[i] ^= src[i];
+        return;
+    }
+    for (size_t i = 0; i < len; i++)
+        dst[i] ^= row[src[i]];
+}
+
+static void
+fec_put_header(char *buf, uint32_t group, int index, int data, int parity)
+{
+    buf[0] = (char)(group >> 24);
+    buf[1] = (char)(group >> 16);
+    buf[2] = (char)(group >> 8);
+    buf[3] = (char)group;
+    buf[4] = (char)index;
+    buf[5] = (char)data;
+    buf[6] = (char)parity;
+    buf[7] = 0;
+}
+
+struct fec_encoder {
+    fec_config_t config;
+    fec_output_cb cb;
+    void *data;
+    int parity;                 // of the open group
+    int next_parity;
+    uint32_t group;
+    int count;                  // data packets in the open group
+    double opened;
+    size_t longest;             // coded length, with the length field
+    fec_encoder_stats_t stats;
+    char packet[FEC_MAX_PACKET];
+    uint8_t acc[FEC_MAX_PARITY][FEC_CODED_MAX];
+};
+
+fec_encoder_t *
+fec_encoder_new(const fec_config_t *config, fec_output_cb cb, void *data)
+{
+    pthread_once(&gf_once, gf_init);
+
+    fec_encoder_t *enc = ss_malloc(sizeof(fec_encoder_t));
+    memset(enc, 0, sizeof(fec_encoder_t));
+    enc->cb   = cb;
+    enc->data = data;
+    if (config != NULL)
+        enc->config = *config;
+
+    if (enc->config.data <= 0 || enc->config.data > FEC_MAX_DATA)
+        enc->config.data = FEC_DEFAULT_DATA;
+    if (enc->config.parity <= 0 || enc->config.parity > FEC_MAX_PARITY)
+        enc->config.parity = FEC_DEFAULT_PARITY;
+    if (enc->config.max_parity <= 0 || enc->config.max_parity > FEC_MAX_PARITY)
+        enc->config.max_parity = enc->config.data / 2 > 1 ? enc->config.data / 2 : 1;
+    if (enc->config.target <= 0 || enc->config.target >= 1)
+        enc->config.target = FEC_DEFAULT_TARGET;
+    if (enc->config.flush <= 0)
+        enc->config.flush = FEC_DEFAULT_FLUSH;
+
+    enc->next_parity = enc->config.parity;
+    if (enc->config.adapt && enc->next_parity > enc->config.max_parity)
+        enc->next_parity = enc->config.max_parity;
+    return enc;
+}
+
+void
+fec_encoder_free(fec_encoder_t *enc)
+{
+    ss_free(enc);
+}
+
+static void
+fec_encoder_close(fec_encoder_t *enc)
+{
+    for (int j = 0; j < enc->parity; j++) {
+        fec_put_header(enc->packet, enc->group, enc->count + j, enc->count, enc->parity);
+        memcpy(enc->packet + FEC_HEADER_SIZE, enc->acc[j], enc->longest);
+        enc->cb(enc->data, enc->packet, FEC_HEADER_SIZE + enc->longest);
+        memset(enc->acc[j], 0, enc->longest);
+    }
+
+    enc->stats.parity_packets += enc->parity;
+    enc->stats.groups++;
+    enc->group++;
+    enc->count   = 0;
+    enc->longest = 0;
+}
+
+int
+fec_encode(fec_encoder_t *enc, const char *payload, size_t len, double now)
+{
+    if (len > FEC_MAX_PAYLOAD) {
+        enc->stats.oversized++;
+        return -1;
+    }
+
+    if (enc->count == 0) {
+        enc->opened = now;
+        enc->parity = enc->next_parity;
+    }
+
+    char *coded = enc->packet + FEC_HEADER_SIZE;
+    fec_put_header(enc->packet, enc->group, enc->count, enc->config.data, enc->parity);
+    coded[0] = (char)(len >> 8);
+    coded[1] = (char)len;
+    memcpy(coded + FEC_LENGTH_SIZE, payload, len);
+    enc->cb(enc->data, enc->packet, FEC_HEADER_SIZE + FEC_LENGTH_SIZE + len);
+    enc->stats.data_packets++;
+
+    size_t coded_len = FEC_LENGTH_SIZE + len;
+    for (int j = 0; j < enc->parity; j++)
+        fec_mul_add(enc->acc[j], (const uint8_t *)coded, coded_len,
+                    fec_coefficient(j, enc->count));
+    if (coded_len > enc->longest)
+        enc->longest = coded_len;
+
+    if (++enc->count == enc->config.data)
+        fec_encoder_close(enc);
+    return 0;
+}
+
+double
+fec_encoder_poll(fec_encoder_t *enc, double now)
+{
+    if (enc->count == 0)
+        return 0;
+    if (now - enc->opened < enc->config.flush)
+        return enc->opened + enc->config.flush;
+    fec_encoder_close(enc);
+    return 0;
+}
+
+// Probability that more than parity of data + parity packets are lost
+static double
+fec_group_loss(int data, int parity, double loss)
+{
+    int n          = data + parity;
+    double term    = pow(1 - loss, n);      // none lost
+    double covered = term;
+
+    for (int i = 1; i <= parity; i++) {
+        term    *= (double)(n - i + 1) / i * loss / (1 - loss);
+        covered += term;
+    }
+    return 1 - covered;
+}
+
+void
+fec_encoder_set_loss(fec_encoder_t *enc, double loss)
+{
+    if (!enc->config.adapt)
+        return;
+
+    int parity = enc->config.max_parity;
+    if (loss <= 0) {
+        parity = 1;
+    } else if (loss < 1) {
+        for (int m = 1; m < enc->config.max_parity; m++) {
+            if (fec_group_loss(enc->config.data, m, loss) <= enc->config.target) {
+                parity = m;
+                break;
+            }
+        }
+    }
+    enc->next_parity = parity;
+}
+
+void
+fec_encoder_stats(const fec_encoder_t *enc, fec_encoder_stats_t *stats)
+{
+    *stats        = enc->stats;
+    stats->parity = enc->next_parity;
+}
+
+typedef struct fec_group {
+    uint32_t id;
+    int used;
+    int data;                   // from a parity packet once one came, else intended
+    int parity;
+    int from_parity;
+    int done;                   // every data packet handed on
+    uint64_t have;              // shard slots in: data i at i, parity j at FEC_MAX_DATA + j
+    uint64_t delivered;
+    size_t len[FEC_MAX_SHARDS];
+    uint8_t *shard[FEC_MAX_SHARDS];
+} fec_group_t;
+
+struct fec_decoder {
+    fec_output_cb cb;
+    void *data;
+    double loss;
+    int measured;
+    fec_decoder_stats_t stats;
+    fec_group_t group[FEC_GROUPS];
+    uint8_t out[FEC_CODED_MAX];
+};
+
+fec_decoder_t *
+fec_decoder_new(fec_output_cb cb, void *data)
+{
+    pthread_once(&gf_once, gf_init);
+
+    fec_decoder_t *dec = ss_malloc(sizeof(fec_decoder_t));
+    memset(dec, 0, sizeof(fec_decoder_t));
+    dec->cb   = cb;
+    dec->data = data;
+    return dec;
+}
+
+static void
+fec_group_release(fec_group_t *g)
+{
+    for (int i = 0; i < FEC_MAX_SHARDS; i++)
+        if (g->shard[i] != NULL)
+            ss_free(g->shard[i]);
+}
+
+// Count what the group lost and free it
+static void
+fec_group_retire(fec_decoder_t *dec, fec_group_t *g)
+{
+    if (!g->used)
+        return;
+
+    int received = 0;
+    for (int i = 0; i < g->data; i++)
+        received += (g->have >> i) & 1;
+    for (int j = 0; j < g->parity; j++)
+        received += (g->have >> (FEC_MAX_DATA + j)) & 1;
+
+    // Without parity only the gaps below the last data packet are known
+    int data = g->data;
+    if (!g->from_parity)
+        for (data = g->data; data > 0 && !((g->delivered >> (data - 1)) & 1); data--) ;
+    for (int i = 0; i < data; i++)
+        if (!((g->delivered >> i) & 1))
+            dec->stats.lost++;
+
+    double sample = 1.0 - (double)received / (g->data + g->parity);
+    if (!dec->measured)
+        dec->loss = sample;
+    else
+        dec->loss += FEC_DEFAULT_ALPHA * (sample - dec->loss);
+    dec->measured = 1;
+
+    fec_group_release(g);
+    memset(g, 0, sizeof(fec_group_t));
+}
+
+void
+fec_decoder_free(fec_decoder_t *dec)
+{
+    for (int i = 0; i < FEC_GROUPS; i++)
+        fec_group_release(&dec->group[i]);
+    ss_free(dec);
+}
+
+static void
+fec_deliver(fec_decoder_t *dec, fec_group_t *g, int index, const uint8_t *coded, size_t len)
+{
+    size_t payload = (size_t)coded[0] << 8 | coded[1];
+
+    if (payload + FEC_LENGTH_SIZE > len) {
+        dec->stats.malformed++;
+        return;
+    }
+    g->delivered |= 1ULL << index;
+    dec->cb(dec->data, (const char *)coded + FEC_LENGTH_SIZE, payload);
+}
+
+// Gauss-Jordan over GF(2^8); a is n x n and becomes the identity
+static int
+fec_invert(uint8_t a[FEC_MAX_DATA][FEC_MAX_DATA], uint8_t inv[FEC_MAX_DATA][FEC_MAX_DATA], int n)
+{
+    for (int i = 0; i < n; i++) {
+        memset(inv[i], 0, n);
+        inv[i][i] = 1;
+    }
+
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && a[pivot][col] == 0)
+            pivot++;
+        if (pivot == n)
+            return -1;
+        if (pivot != col) {
+            uint8_t tmp[FEC_MAX_DATA];
+            memcpy(tmp, a[col], n);
+            memcpy(a[col], a[pivot], n);
+            memcpy(a[pivot], tmp, n);
+            memcpy(tmp, inv[col], n);
+            memcpy(inv[col], inv[pivot], n);
+            memcpy(inv[pivot], tmp, n);
+        }
+
+        uint8_t scale = gf_inv(a[col][col]);
+        for (int j = 0; j < n; j++) {
+            a[col][j]   = gf_mul[scale][a[col][j]];
+            inv[col][j] = gf_mul[scale][inv[col][j]];
+        }
+        for (int row = 0; row < n; row++) {
+            uint8_t f = a[row][col];
+            if (row == col || f == 0)
+                continue;
+            for (int j = 0; j < n; j++) {
+                a[row][j]   ^= gf_mul[f][a[col][j]];
+                inv[row][j] ^= gf_mul[f][inv[col][j]];
+            }
+        }
+    }
+    return 0;
+}
+
+// Rebuild the missing data packets once k packets of the group are in
+static void
+fec_recover(fec_decoder_t *dec, fec_group_t *g)
+{
+    int k = g->data;
+    int rows[FEC_MAX_DATA];
+    int n = 0;
+
+    for (int i = 0; i < k; i++)
+        if ((g->have >> i) & 1)
+            rows[n++] = i;
+    for (int j = 0; j < g->parity && n < k; j++)
+        if ((g->have >> (FEC_MAX_DATA + j)) & 1)
+            rows[n++] = FEC_MAX_DATA + j;
+    if (n < k)
+        return;
+
+    uint8_t a[FEC_MAX_DATA][FEC_MAX_DATA];
+    uint8_t inv[FEC_MAX_DATA][FEC_MAX_DATA];
+    for (int r = 0; r < k; r++) {
+        if (rows[r] < FEC_MAX_DATA) {
+            memset(a[r], 0, k);
+            a[r][rows[r]] = 1;
+        } else {
+            for (int c = 0; c < k; c++)
+                a[r][c] = fec_coefficient(rows[r] - FEC_MAX_DATA, c);
+        }
+    }
+    if (fec_invert(a, inv, k) != 0)
+        return;
+
+    for (int i = 0; i < k; i++) {
+        if ((g->delivered >> i) & 1)
+            continue;
+
+        size_t longest = 0;
+        memset(dec->out, 0, sizeof(dec->out));
+        for (int r = 0; r < k; r++) {
+            if (inv[i][r] == 0)
+                continue;
+            fec_mul_add(dec->out, g->shard[rows[r]], g->len[rows[r]], inv[i][r]);
+            if (g->len[rows[r]] > longest)
+                longest = g->len[rows[r]];
+        }
+        dec->stats.recovered++;
+        fec_deliver(dec, g, i, dec->out, longest);
+    }
+}
+
+static void
+fec_group_check(fec_decoder_t *dec, fec_group_t *g)
+{
+    uint64_t all = g->data >= 64 ? ~0ULL : (1ULL << g->data) - 1;
+
+    if (g->from_parity && (g->delivered & all) != all)
+        fec_recover(dec, g);
+    if (g->from_parity && (g->delivered & all) == all) {
+        g->done = 1;
+        fec_group_release(g);
+        memset(g->shard, 0, sizeof(g->shard));
+    }
+}
+
+int
+fec_decode(fec_decoder_t *dec, const char *packet, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)packet;
+
+    if (len < FEC_HEADER_SIZE) {
+        dec->stats.malformed++;
+        return -1;
+    }
+
+    uint32_t id = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    int index   = p[4];
+    int k       = p[5];
+    int m       = p[6];
+    int parity  = index >= k;
+    size_t size = len - FEC_HEADER_SIZE;
+
+    if (p[7] != 0 || k == 0 || k > FEC_MAX_DATA || m == 0 || m > FEC_MAX_PARITY
+        || index >= k + m || size < FEC_LENGTH_SIZE || size > FEC_CODED_MAX
+        || (!parity && ((size_t)p[8] << 8 | p[9]) != size - FEC_LENGTH_SIZE)) {
+        dec->stats.malformed++;
+        return -1;
+    }
+
+    if (parity)
+        dec->stats.parity_packets++;
+    else
+        dec->stats.data_packets++;
+
+    fec_group_t *g = &dec->group[id % FEC_GROUPS];
+    if (g->used && g->id != id) {
+        if ((int32_t)(id - g->id) < 0) {
+            // The group is gone: pass data on as it is, parity is of no use
+            dec->stats.late++;
+            if (!parity)
+                dec->cb(dec->data, packet + FEC_HEADER_SIZE + FEC_LENGTH_SIZE,
+                        size - FEC_LENGTH_SIZE);
+            return 0;
+        }
+        fec_group_retire(dec, g);
+    }
+    if (!g->used) {
+        g->used   = 1;
+        g->id     = id;
+        g->data   = k;
+        g->parity = m;
+    }
+
+    int slot = parity ? FEC_MAX_DATA + index - k : index;
+    if ((g->have >> slot) & 1) {
+        dec->stats.duplicates++;
+        return 0;
+    }
+    g->have |= 1ULL << slot;
+
+    if (parity) {
+        g->data        = k;
+        g->parity      = m;
+        g->from_parity = 1;
+    } else if (!((g->delivered >> index) & 1)) {
+        fec_deliver(dec, g, index, p + FEC_HEADER_SIZE, size);
+    }
+
+    if (g->done)
+        return 0;
+    g->shard[slot] = ss_malloc(size);
+    memcpy(g->shard[slot], p + FEC_HEADER_SIZE, size);
+    g->len[slot] = size;
+    fec_group_check(dec, g);
+    return 0;
+}
+
+double
+fec_decoder_loss(const fec_decoder_t *dec)
+{
+    return dec->loss;
+}
+
+void
+fec_decoder_stats(const fec_decoder_t *dec, fec_decoder_stats_t *stats)
+{
+    *stats      = dec->stats;
+    stats->loss = dec->loss;
+}
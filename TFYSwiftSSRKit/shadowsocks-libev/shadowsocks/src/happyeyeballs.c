@@ -0,0 +1,420 @@
+/*
+ * happyeyeballs.c - Race connects across address families (RFC 8305)
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "happyeyeballs.h"
+#include "netutils.h"
+#include "utils.h"
+
+// Networks whose preferred family is remembered
+#define HAPPY_EYEBALLS_NETWORKS 8
+
+typedef struct happy_eyeballs_attempt {
+    happy_eyeballs_t *race;
+    int fd;
+    int index;
+    ev_io io;
+} happy_eyeballs_attempt_t;
+
+struct happy_eyeballs {
+    struct ev_loop *loop;
+    happy_eyeballs_config_t config;
+    happy_eyeballs_cb cb;
+    void *data;
+    struct sockaddr_storage addr[HAPPY_EYEBALLS_MAX_ADDRS];
+    socklen_t addr_len[HAPPY_EYEBALLS_MAX_ADDRS];
+    int tried[HAPPY_EYEBALLS_MAX_ADDRS];
+    happy_eyeballs_attempt_t attempt[HAPPY_EYEBALLS_MAX_ADDRS];
+    int count;
+    int running;
+    int started;
+    int resolved;
+    int preferred;
+    int last_family;
+    int last_error;
+    ev_timer delay;             // next attempt, or the resolution delay
+    ev_timer timeout;
+};
+
+static pthread_mutex_t happy_eyeballs_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t happy_eyeballs_network;
+static uint64_t happy_eyeballs_clock;
+static struct {
+    uint64_t network;
+    int family;
+    uint64_t used;
+} happy_eyeballs_cache[HAPPY_EYEBALLS_NETWORKS];
+static happy_eyeballs_stats_t happy_eyeballs_totals;
+
+static void happy_eyeballs_next(happy_eyeballs_t *race);
+
+// IPv6 first on a network we know nothing about, as RFC 6724 has it
+static int
+happy_eyeballs_preferred(void)
+{
+    int family = AF_INET6;
+
+    pthread_mutex_lock(&happy_eyeballs_lock);
+    for (int i = 0; i < HAPPY_EYEBALLS_NETWORKS; i++)
+        if (happy_eyeballs_cache[i].used != 0
+            && happy_eyeballs_cache[i].network == happy_eyeballs_network) {
+            family                       = happy_eyeballs_cache[i].family;
+            happy_eyeballs_cache[i].used = ++happy_eyeballs_clock;
+            break;
+        }
+    pthread_mutex_unlock(&happy_eyeballs_lock);
+    return family;
+}
+
+static void
+happy_eyeballs_record(int family)
+{
+    pthread_mutex_lock(&happy_eyeballs_lock);
+    int slot = 0;
+    for (int i = 0; i < HAPPY_EYEBALLS_NETWORKS; i++) {
+        if (happy_eyeballs_cache[i].used != 0
+            && happy_eyeballs_cache[i].network == happy_eyeballs_network) {
+            slot = i;
+            break;
+        }
+        if (happy_eyeballs_cache[i].used < happy_eyeballs_cache[slot].used)
+            slot = i;
+    }
+    happy_eyeballs_cache[slot].network = happy_eyeballs_network;
+    happy_eyeballs_cache[slot].family  = family;
+    happy_eyeballs_cache[slot].used    = ++happy_eyeballs_clock;
+
+    if (family == AF_INET6)
+        happy_eyeballs_totals.ipv6_wins++;
+    else
+        happy_eyeballs_totals.ipv4_wins++;
+    pthread_mutex_unlock(&happy_eyeballs_lock);
+}
+
+static void
+happy_eyeballs_count(uint64_t *counter)
+{
+    pthread_mutex_lock(&happy_eyeballs_lock);
+    (*counter)++;
+    pthread_mutex_unlock(&happy_eyeballs_lock);
+}
+
+static void
+happy_eyeballs_free(happy_eyeballs_t *race)
+{
+    for (int i = 0; i < race->count; i++) {
+        happy_eyeballs_attempt_t *attempt = &race->attempt[i];
+        if (attempt->fd != -1) {
+            ev_io_stop(race->loop, &attempt->io);
+            close(attempt->fd);
+        }
+    }
+    ev_timer_stop(race->loop, &race->delay);
+    ev_timer_stop(race->loop, &race->timeout);
+    ss_free(race);
+}
+
+static void
+happy_eyeballs_fail(happy_eyeballs_t *race, int error)
+{
+    happy_eyeballs_count(&happy_eyeballs_totals.failures);
+    race->cb(race->data, -1, NULL, 0, error != 0 ? error : EHOSTUNREACH);
+    happy_eyeballs_free(race);
+}
+
+static void
+happy_eyeballs_win(happy_eyeballs_t *race, happy_eyeballs_attempt_t *winner)
+{
+    int fd = winner->fd;
+
+    ev_io_stop(race->loop, &winner->io);
+    winner->fd = -1;
+    happy_eyeballs_record(race->addr[winner->index].ss_family);
+
+    race->cb(race->data, fd, (struct sockaddr *)&race->addr[winner->index],
+             race->addr_len[winner->index], 0);
+    happy_eyeballs_free(race);
+}
+
+static void
+happy_eyeballs_io_cb(EV_P_ ev_io *w, int revents)
+{
+    happy_eyeballs_attempt_t *attempt = w->data;
+    happy_eyeballs_t *race            = attempt->race;
+    int error                         = 0;
+    socklen_t len                     = sizeof(error);
+
+    if (getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+        error = errno;
+    if (error == 0) {
+        happy_eyeballs_win(race, attempt);
+        return;
+    }
+
+    ev_io_stop(EV_A_ w);
+    close(attempt->fd);
+    attempt->fd = -1;
+    race->running--;
+    race->last_error = error;
+
+    // A failed attempt makes way for the next one at once
+    happy_eyeballs_next(race);
+}
+
+static void
+happy_eyeballs_delay_cb(EV_P_ ev_timer *w, int revents)
+{
+    happy_eyeballs_next(w->data);
+}
+
+static void
+happy_eyeballs_timeout_cb(EV_P_ ev_timer *w, int revents)
+{
+    happy_eyeballs_fail(w->data, ETIMEDOUT);
+}
+
+// The other family than the last attempt's when there is one, else any
+static int
+happy_eyeballs_pick(const happy_eyeballs_t *race)
+{
+    int want  = race->last_family == 0 ? race->preferred
+                : race->last_family == AF_INET6 ? AF_INET : AF_INET6;
+    int other = -1;
+
+    for (int i = 0; i < race->count; i++) {
+        if (race->tried[i])
+            continue;
+        if (race->addr[i].ss_family == want)
+            return i;
+        if (other == -1)
+            other = i;
+    }
+    return other;
+}
+
+static int
+happy_eyeballs_start(happy_eyeballs_t *race, int index)
+{
+    happy_eyeballs_attempt_t *attempt = &race->attempt[index];
+    const struct sockaddr_storage *addr = &race->addr[index];
+
+    race->tried[index] = 1;
+    race->last_family  = addr->ss_family;
+    happy_eyeballs_count(&happy_eyeballs_totals.attempts);
+
+    int fd = socket(addr->ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == -1) {
+        race->last_error = errno;
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    setnonblocking(fd);
+
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#ifdef SO_NOSIGPIPE
+    set_nosigpipe(fd);
+#endif
+
+    if (race->config.setup != NULL && race->config.setup(race->config.data, fd) == -1) {
+        race->last_error = errno;
+        close(fd);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)addr, race->addr_len[index]) == -1
+        && errno != EINPROGRESS) {
+        race->last_error = errno;
+        close(fd);
+        return -1;
+    }
+
+    attempt->fd = fd;
+    ev_io_init(&attempt->io, happy_eyeballs_io_cb, fd, EV_WRITE);
+    attempt->io.data = attempt;
+    ev_io_start(race->loop, &attempt->io);
+    race->running++;
+    return 0;
+}
+
+static void
+happy_eyeballs_next(happy_eyeballs_t *race)
+{
+    ev_timer_stop(race->loop, &race->delay);
+    race->started = 1;
+
+    int index;
+    while ((index = happy_eyeballs_pick(race)) != -1) {
+        if (happy_eyeballs_start(race, index) == 0) {
+            ev_timer_set(&race->delay, race->config.attempt_delay, 0);
+            ev_timer_start(race->loop, &race->delay);
+            return;
+        }
+    }
+
+    // Nothing left to try; wait for the resolver or the attempts in flight
+    if (race->running == 0 && race->resolved)
+        happy_eyeballs_fail(race, race->last_error);
+}
+
+happy_eyeballs_t *
+happy_eyeballs_new(struct ev_loop *loop, const happy_eyeballs_config_t *config,
+                   happy_eyeballs_cb cb, void *data)
+{
+    happy_eyeballs_t *race = ss_malloc(sizeof(happy_eyeballs_t));
+    memset(race, 0, sizeof(happy_eyeballs_t));
+    race->loop = loop;
+    race->cb   = cb;
+    race->data = data;
+    if (config != NULL)
+        race->config = *config;
+    if (race->config.attempt_delay <= 0)
+        race->config.attempt_delay = HAPPY_EYEBALLS_ATTEMPT_DELAY;
+    if (race->config.attempt_delay < HAPPY_EYEBALLS_MIN_ATTEMPT_DELAY)
+        race->config.attempt_delay = HAPPY_EYEBALLS_MIN_ATTEMPT_DELAY;
+    if (race->config.timeout <= 0)
+        race->config.timeout = HAPPY_EYEBALLS_DEFAULT_TIMEOUT;
+    race->preferred = happy_eyeballs_preferred();
+
+    for (int i = 0; i < HAPPY_EYEBALLS_MAX_ADDRS; i++) {
+        race->attempt[i].race  = race;
+        race->attempt[i].fd    = -1;
+        race->attempt[i].index = i;
+    }
+
+    ev_timer_init(&race->delay, happy_eyeballs_delay_cb, 0, 0);
+    race->delay.data = race;
+    ev_timer_init(&race->timeout, happy_eyeballs_timeout_cb, race->config.timeout, 0);
+    race->timeout.data = race;
+    ev_timer_start(loop, &race->timeout);
+
+    happy_eyeballs_count(&happy_eyeballs_totals.races);
+    return race;
+}
+
+int
+happy_eyeballs_add(happy_eyeballs_t *race, const struct sockaddr *addr, socklen_t addr_len)
+{
+    if (race->count >= HAPPY_EYEBALLS_MAX_ADDRS || addr_len > sizeof(struct sockaddr_storage))
+        return -1;
+    if (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)
+        return -1;
+
+    // Resolvers may hand the same address over twice
+    for (int i = 0; i < race->count; i++)
+        if (race->addr_len[i] == addr_len && memcmp(&race->addr[i], addr, addr_len) == 0)
+            return 0;
+
+    int index = race->count++;
+    memcpy(&race->addr[index], addr, addr_len);
+    race->addr_len[index] = addr_len;
+
+    if (!race->started) {
+        if (addr->sa_family == race->preferred) {
+            happy_eyeballs_next(race);
+        } else if (!ev_is_active(&race->delay)) {
+            // Give the preferred family's answer a moment to arrive
+            ev_timer_set(&race->delay, HAPPY_EYEBALLS_RESOLUTION_DELAY, 0);
+            ev_timer_start(race->loop, &race->delay);
+        }
+    } else if (!ev_is_active(&race->delay)) {
+        // Every earlier attempt failed while this address was on its way
+        happy_eyeballs_next(race);
+    }
+    return 0;
+}
+
+void
+happy_eyeballs_resolved(happy_eyeballs_t *race)
+{
+    race->resolved = 1;
+
+    if (race->count == 0) {
+        happy_eyeballs_fail(race, EHOSTUNREACH);
+        return;
+    }
+    if (!race->started || (race->running == 0 && !ev_is_active(&race->delay)))
+        happy_eyeballs_next(race);
+}
+
+void
+happy_eyeballs_cancel(happy_eyeballs_t *race)
+{
+    happy_eyeballs_free(race);
+}
+
+int
+happy_eyeballs_resolve(const char *host, const char *port,
+                       struct sockaddr_storage *addrs, int max)
+{
+    struct addrinfo hints;
+    struct addrinfo *result, *rp;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_ADDRCONFIG;
+
+    int err = getaddrinfo(host, port, &hints, &result);
+    if (err != 0) {
+        LOGE("getaddrinfo: %s", gai_strerror(err));
+        return 0;
+    }
+
+    int count = 0;
+    for (rp = result; rp != NULL && count < max; rp = rp->ai_next) {
+        if (rp->ai_family != AF_INET && rp->ai_family != AF_INET6)
+            continue;
+        if (rp->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+        memset(&addrs[count], 0, sizeof(struct sockaddr_storage));
+        memcpy(&addrs[count], rp->ai_addr, rp->ai_addrlen);
+        count++;
+    }
+    freeaddrinfo(result);
+    return count;
+}
+
+void
+happy_eyeballs_set_network(uint64_t network)
+{
+    pthread_mutex_lock(&happy_eyeballs_lock);
+    happy_eyeballs_network = network;
+    pthread_mutex_unlock(&happy_eyeballs_lock);
+}
+
+void
+happy_eyeballs_stats(happy_eyeballs_stats_t *stats)
+{
+    int preferred = happy_eyeballs_preferred();
+
+    pthread_mutex_lock(&happy_eyeballs_lock);
+    *stats = happy_eyeballs_totals;
+    pthread_mutex_unlock(&happy_eyeballs_lock);
+    stats->preferred = preferred;
+}
@@ -0,0 +1,161 @@
+/*
+ * hkdf.c - HKDF-SHA1 session subkey derivation with precomputed PSK state
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <mbedtls/sha1.h>
+#include <sodium.h>
+
+#include "aead.h"
+#include "hkdf.h"
+
+#define SHA1_BLOCK_LEN 64
+
+typedef struct hmac_sha1 {
+    mbedtls_sha1_context inner;     // state after (key ^ ipad)
+    mbedtls_sha1_context outer;     // state after (key ^ opad)
+} hmac_sha1_t;
+
+/*
+ * Absorb the padded key once. Keys here are a salt or a PRK, both shorter
+ * than a SHA1 block, so the key never needs to be hashed first.
+ */
+static void
+hmac_sha1_setup(hmac_sha1_t *hmac, const uint8_t *key, size_t key_len)
+{
+    uint8_t pad[SHA1_BLOCK_LEN];
+
+    memset(pad, 0x36, SHA1_BLOCK_LEN);
+    for (size_t i = 0; i < key_len; i++)
+        pad[i] ^= key[i];
+    mbedtls_sha1_init(&hmac->inner);
+    mbedtls_sha1_starts(&hmac->inner);
+    mbedtls_sha1_update(&hmac->inner, pad, SHA1_BLOCK_LEN);
+
+    memset(pad, 0x5c, SHA1_BLOCK_LEN);
+    for (size_t i = 0; i < key_len; i++)
+        pad[i] ^= key[i];
+    mbedtls_sha1_init(&hmac->outer);
+    mbedtls_sha1_starts(&hmac->outer);
+    mbedtls_sha1_update(&hmac->outer, pad, SHA1_BLOCK_LEN);
+
+    sodium_memzero(pad, sizeof(pad));
+}
+
+static void
+hmac_sha1_release(hmac_sha1_t *hmac)
+{
+    mbedtls_sha1_free(&hmac->inner);
+    mbedtls_sha1_free(&hmac->outer);
+}
+
+/*
+ * HMAC over up to three message parts, leaving the pad states untouched so
+ * they can be reused for the next block.
+ */
+static void
+hmac_sha1_mac(const hmac_sha1_t *hmac,
+              const uint8_t *m1, size_t l1,
+              const uint8_t *m2, size_t l2,
+              const uint8_t *m3, size_t l3,
+              uint8_t out[HKDF_SHA1_LEN])
+{
+    mbedtls_sha1_context ctx;
+    uint8_t digest[HKDF_SHA1_LEN];
+
+    mbedtls_sha1_init(&ctx);
+    mbedtls_sha1_clone(&ctx, &hmac->inner);
+    mbedtls_sha1_update(&ctx, m1, l1);
+    mbedtls_sha1_update(&ctx, m2, l2);
+    mbedtls_sha1_update(&ctx, m3, l3);
+    mbedtls_sha1_finish(&ctx, digest);
+
+    mbedtls_sha1_clone(&ctx, &hmac->outer);
+    mbedtls_sha1_update(&ctx, digest, HKDF_SHA1_LEN);
+    mbedtls_sha1_finish(&ctx, out);
+
+    mbedtls_sha1_free(&ctx);
+    sodium_memzero(digest, sizeof(digest));
+}
+
+int
+hkdf_psk_init(hkdf_psk_t *psk, const uint8_t *key, size_t key_len,
+              const uint8_t *info, size_t info_len)
+{
+    memset(psk, 0, sizeof(hkdf_psk_t));
+    if (key_len > sizeof(psk->key) || info_len > sizeof(psk->info))
+        return -1;
+
+    memcpy(psk->key, key, key_len);
+    psk->key_len = key_len;
+    memcpy(psk->info, info, info_len);
+    psk->info_len = info_len;
+
+    return 0;
+}
+
+int
+hkdf_psk_init_cipher(hkdf_psk_t *psk, const cipher_t *cipher)
+{
+    return hkdf_psk_init(psk, cipher->key, cipher->key_len,
+                         (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN);
+}
+
+void
+hkdf_psk_release(hkdf_psk_t *psk)
+{
+    sodium_memzero(psk, sizeof(hkdf_psk_t));
+}
+
+int
+hkdf_psk_derive(const hkdf_psk_t *psk, const uint8_t *salt, size_t salt_len,
+                uint8_t *okm, size_t okm_len)
+{
+    hmac_sha1_t hmac;
+    uint8_t prk[HKDF_SHA1_LEN];
+    uint8_t t[HKDF_SHA1_LEN];
+    size_t t_len = 0;
+
+    if (salt_len > SHA1_BLOCK_LEN || okm_len > HKDF_MAX_OKM_LEN)
+        return -1;
+
+    // Extract: PRK = HMAC(salt, psk)
+    hmac_sha1_setup(&hmac, salt, salt_len);
+    hmac_sha1_mac(&hmac, psk->key, psk->key_len, NULL, 0, NULL, 0, prk);
+    hmac_sha1_release(&hmac);
+
+    // Expand: T(i) = HMAC(PRK, T(i-1) || info || i), PRK pads set up once
+    hmac_sha1_setup(&hmac, prk, HKDF_SHA1_LEN);
+    for (uint8_t i = 1; okm_len > 0; i++) {
+        hmac_sha1_mac(&hmac, t, t_len, psk->info, psk->info_len, &i, 1, t);
+        t_len = HKDF_SHA1_LEN;
+
+        size_t n = okm_len < HKDF_SHA1_LEN ? okm_len : HKDF_SHA1_LEN;
+        memcpy(okm, t, n);
+        okm     += n;
+        okm_len -= n;
+    }
+    hmac_sha1_release(&hmac);
+
+    sodium_memzero(prk, sizeof(prk));
+    sodium_memzero(t, sizeof(t));
+
+    return 0;
+}
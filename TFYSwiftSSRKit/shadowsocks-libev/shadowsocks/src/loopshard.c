@@ -0,0 +1,436 @@
+/*
+ * loopshard.c - Run the local listener on several event loops
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "loopshard.h"
+#include "netutils.h"
+#include "utils.h"
+
+typedef struct loop_shard_snap {
+    atomic_int refs;
+    void *value;
+} loop_shard_snap_t;
+
+typedef struct loop_shard_worker {
+    loop_shard_t shard;                 // first, so a shard is its worker
+    pthread_t thread;
+    int running;
+    int listen_fd;
+    int owns_fd;
+    ev_io accept_watcher;
+    ev_async stop_watcher;
+    ev_async update_watcher;
+    loop_shard_snap_t *snap;
+    atomic_uint_fast64_t accepted;
+    atomic_uint_fast64_t active;
+    atomic_uint_fast64_t bytes_up;
+    atomic_uint_fast64_t bytes_down;
+} loop_shard_worker_t;
+
+struct loop_shard_group {
+    loop_shard_config_t config;
+    loop_shard_mode_t mode;
+    int workers;
+    pthread_mutex_t lock;
+    loop_shard_snap_t *current;
+    void (*release)(void *);
+    loop_shard_worker_t worker[LOOP_SHARD_MAX_WORKERS];
+};
+
+static loop_shard_snap_t *
+loop_shard_snap_new(void *value)
+{
+    loop_shard_snap_t *snap = ss_malloc(sizeof(loop_shard_snap_t));
+    atomic_init(&snap->refs, 1);
+    snap->value = value;
+    return snap;
+}
+
+static void
+loop_shard_snap_unref(loop_shard_group_t *group, loop_shard_snap_t *snap)
+{
+    if (snap == NULL || atomic_fetch_sub(&snap->refs, 1) != 1)
+        return;
+    if (group->release != NULL && snap->value != NULL)
+        group->release(snap->value);
+    ss_free(snap);
+}
+
+static int
+loop_shard_listen(const loop_shard_config_t *config, int reuseport)
+{
+    struct addrinfo hints, *result, *rp;
+    int listen_fd = -1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+
+    int s = getaddrinfo(config->host, config->port, &hints, &result);
+    if (s != 0) {
+        LOGE("loopshard: getaddrinfo: %s", gai_strerror(s));
+        return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        listen_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (listen_fd == -1)
+            continue;
+
+        int opt = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef SO_NOSIGPIPE
+        setsockopt(listen_fd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+        if ((!reuseport || set_reuseport(listen_fd) == 0)
+            && bind(listen_fd, rp->ai_addr, rp->ai_addrlen) == 0
+            && listen(listen_fd, config->backlog > 0 ? config->backlog : SOMAXCONN) == 0) {
+            setnonblocking(listen_fd);
+            break;
+        }
+
+        close(listen_fd);
+        listen_fd = -1;
+    }
+
+    freeaddrinfo(result);
+    return listen_fd;
+}
+
+static void
+loop_shard_accept_cb_ev(EV_P_ ev_io *w, int revents)
+{
+    loop_shard_worker_t *worker = (loop_shard_worker_t *)w->data;
+    loop_shard_group_t *group   = worker->shard.group;
+
+    // Until EAGAIN: a backlog left behind would wake every loop again
+    for (;;) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        int fd        = accept(worker->listen_fd, (struct sockaddr *)&addr, &len);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // EAGAIN, or another loop took it first when the socket is shared
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ERROR("loopshard: accept");
+            return;
+        }
+
+        setnonblocking(fd);
+#ifdef SO_NOSIGPIPE
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+
+        atomic_fetch_add_explicit(&worker->accepted, 1, memory_order_relaxed);
+        if (group->config.accept_cb != NULL)
+            group->config.accept_cb(&worker->shard, fd, &addr, group->config.data);
+        else
+            close(fd);
+    }
+}
+
+static void
+loop_shard_stop_cb(EV_P_ ev_async *w, int revents)
+{
+    ev_break(EV_A_ EVBREAK_ALL);
+}
+
+static void
+loop_shard_update_cb(EV_P_ ev_async *w, int revents)
+{
+    loop_shard_worker_t *worker = (loop_shard_worker_t *)w->data;
+    loop_shard_group_t *group   = worker->shard.group;
+    loop_shard_snap_t *old      = NULL;
+
+    pthread_mutex_lock(&group->lock);
+    if (worker->snap != group->current) {
+        old          = worker->snap;
+        worker->snap = group->current;
+        if (worker->snap != NULL)
+            atomic_fetch_add(&worker->snap->refs, 1);
+    }
+    pthread_mutex_unlock(&group->lock);
+
+    loop_shard_snap_unref(group, old);
+}
+
+static void *
+loop_shard_main(void *arg)
+{
+    loop_shard_worker_t *worker = (loop_shard_worker_t *)arg;
+    loop_shard_group_t *group   = worker->shard.group;
+
+    if (group->config.start_cb != NULL)
+        group->config.start_cb(&worker->shard, group->config.data);
+
+    ev_run(worker->shard.loop, 0);
+
+    if (group->config.stop_cb != NULL)
+        group->config.stop_cb(&worker->shard, group->config.data);
+    return NULL;
+}
+
+static void
+loop_shard_close_listeners(loop_shard_group_t *group)
+{
+    for (int i = 0; i < group->workers; i++) {
+        loop_shard_worker_t *worker = &group->worker[i];
+        if (worker->owns_fd && worker->listen_fd != -1)
+            close(worker->listen_fd);
+        worker->listen_fd = -1;
+        worker->owns_fd   = 0;
+    }
+}
+
+static int
+loop_shard_bind(loop_shard_group_t *group)
+{
+    if (group->mode == LOOP_SHARD_REUSEPORT) {
+        int i;
+        for (i = 0; i < group->workers; i++) {
+            int fd = loop_shard_listen(&group->config, 1);
+            if (fd == -1)
+                break;
+            group->worker[i].listen_fd = fd;
+            group->worker[i].owns_fd   = 1;
+        }
+        if (i == group->workers)
+            return 0;
+
+        LOGI("loopshard: SO_REUSEPORT unavailable, sharing one listener");
+        loop_shard_close_listeners(group);
+        group->mode = LOOP_SHARD_SHARED;
+    }
+
+    int fd = loop_shard_listen(&group->config, 0);
+    if (fd == -1)
+        return -1;
+    for (int i = 0; i < group->workers; i++) {
+        group->worker[i].listen_fd = fd;
+        group->worker[i].owns_fd   = i == 0;
+    }
+    return 0;
+}
+
+loop_shard_group_t *
+loop_shard_group_new(const loop_shard_config_t *config,
+                     void *initial, void (*release)(void *))
+{
+    loop_shard_group_t *group = ss_malloc(sizeof(loop_shard_group_t));
+    memset(group, 0, sizeof(loop_shard_group_t));
+    group->config  = *config;
+    group->release = release;
+    group->current = loop_shard_snap_new(initial);
+    pthread_mutex_init(&group->lock, NULL);
+
+    group->workers = config->workers;
+    if (group->workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        group->workers = cpus > 0 ? (int)cpus : 1;
+    }
+    if (group->workers > LOOP_SHARD_MAX_WORKERS)
+        group->workers = LOOP_SHARD_MAX_WORKERS;
+
+    group->mode = config->mode;
+    if (group->mode == LOOP_SHARD_AUTO) {
+#ifdef __linux__
+        group->mode = LOOP_SHARD_REUSEPORT;
+#else
+        group->mode = LOOP_SHARD_SHARED;
+#endif
+    }
+
+    for (int i = 0; i < group->workers; i++)
+        group->worker[i].listen_fd = -1;
+
+    if (loop_shard_bind(group) == -1) {
+        LOGE("loopshard: failed to listen on %s:%s", config->host, config->port);
+        loop_shard_snap_unref(group, group->current);
+        pthread_mutex_destroy(&group->lock);
+        ss_free(group);
+        return NULL;
+    }
+
+    for (int i = 0; i < group->workers; i++) {
+        loop_shard_worker_t *worker = &group->worker[i];
+        loop_shard_t *shard         = &worker->shard;
+
+        shard->index  = i;
+        shard->group  = group;
+        shard->loop   = ev_loop_new(EVFLAG_AUTO);
+        shard->budget = mem_budget_attach(shard->loop);
+        cork_dllist_init(&shard->connections);
+
+        worker->snap = group->current;
+        atomic_fetch_add(&worker->snap->refs, 1);
+
+        ev_io_init(&worker->accept_watcher, loop_shard_accept_cb_ev, worker->listen_fd, EV_READ);
+        ev_async_init(&worker->stop_watcher, loop_shard_stop_cb);
+        ev_async_init(&worker->update_watcher, loop_shard_update_cb);
+        worker->accept_watcher.data = worker;
+        worker->update_watcher.data = worker;
+        ev_io_start(shard->loop, &worker->accept_watcher);
+        ev_async_start(shard->loop, &worker->stop_watcher);
+        ev_async_start(shard->loop, &worker->update_watcher);
+    }
+
+    for (int i = 0; i < group->workers; i++) {
+        loop_shard_worker_t *worker = &group->worker[i];
+        if (pthread_create(&worker->thread, NULL, loop_shard_main, worker) != 0) {
+            ERROR("loopshard: pthread_create");
+            loop_shard_group_free(group);
+            return NULL;
+        }
+        worker->running = 1;
+    }
+
+    return group;
+}
+
+void
+loop_shard_group_free(loop_shard_group_t *group)
+{
+    if (group == NULL)
+        return;
+
+    for (int i = 0; i < group->workers; i++) {
+        loop_shard_worker_t *worker = &group->worker[i];
+        if (worker->running)
+            ev_async_send(worker->shard.loop, &worker->stop_watcher);
+    }
+
+    for (int i = 0; i < group->workers; i++) {
+        loop_shard_worker_t *worker = &group->worker[i];
+        loop_shard_t *shard         = &worker->shard;
+        if (worker->running)
+            pthread_join(worker->thread, NULL);
+        if (shard->loop == NULL)
+            continue;
+
+        ev_io_stop(shard->loop, &worker->accept_watcher);
+        ev_async_stop(shard->loop, &worker->stop_watcher);
+        ev_async_stop(shard->loop, &worker->update_watcher);
+        mem_budget_detach(shard->budget);
+        ev_loop_destroy(shard->loop);
+        loop_shard_snap_unref(group, worker->snap);
+    }
+
+    loop_shard_close_listeners(group);
+    loop_shard_snap_unref(group, group->current);
+    pthread_mutex_destroy(&group->lock);
+    ss_free(group);
+}
+
+int
+loop_shard_group_workers(const loop_shard_group_t *group)
+{
+    return group->workers;
+}
+
+loop_shard_mode_t
+loop_shard_group_mode(const loop_shard_group_t *group)
+{
+    return group->mode;
+}
+
+void
+loop_shard_publish(loop_shard_group_t *group, void *snapshot)
+{
+    loop_shard_snap_t *snap = loop_shard_snap_new(snapshot);
+
+    pthread_mutex_lock(&group->lock);
+    loop_shard_snap_t *old = group->current;
+    group->current = snap;
+    pthread_mutex_unlock(&group->lock);
+
+    loop_shard_snap_unref(group, old);
+
+    for (int i = 0; i < group->workers; i++) {
+        loop_shard_worker_t *worker = &group->worker[i];
+        ev_async_send(worker->shard.loop, &worker->update_watcher);
+    }
+}
+
+void *
+loop_shard_snapshot(const loop_shard_t *shard)
+{
+    const loop_shard_worker_t *worker = (const loop_shard_worker_t *)shard;
+    return worker->snap != NULL ? worker->snap->value : NULL;
+}
+
+void
+loop_shard_conn_opened(loop_shard_t *shard)
+{
+    loop_shard_worker_t *worker = (loop_shard_worker_t *)shard;
+    atomic_fetch_add_explicit(&worker->active, 1, memory_order_relaxed);
+}
+
+void
+loop_shard_conn_closed(loop_shard_t *shard)
+{
+    loop_shard_worker_t *worker = (loop_shard_worker_t *)shard;
+    atomic_fetch_sub_explicit(&worker->active, 1, memory_order_relaxed);
+}
+
+void
+loop_shard_add_traffic(loop_shard_t *shard, uint64_t up, uint64_t down)
+{
+    loop_shard_worker_t *worker = (loop_shard_worker_t *)shard;
+    atomic_fetch_add_explicit(&worker->bytes_up, up, memory_order_relaxed);
+    atomic_fetch_add_explicit(&worker->bytes_down, down, memory_order_relaxed);
+}
+
+void
+loop_shard_stats(const loop_shard_group_t *group, int index,
+                 loop_shard_stats_t *stats)
+{
+    memset(stats, 0, sizeof(loop_shard_stats_t));
+    if (index < 0 || index >= group->workers)
+        return;
+
+    loop_shard_worker_t *worker = (loop_shard_worker_t *)&group->worker[index];
+    stats->accepted   = atomic_load_explicit(&worker->accepted, memory_order_relaxed);
+    stats->active     = atomic_load_explicit(&worker->active, memory_order_relaxed);
+    stats->bytes_up   = atomic_load_explicit(&worker->bytes_up, memory_order_relaxed);
+    stats->bytes_down = atomic_load_explicit(&worker->bytes_down, memory_order_relaxed);
+}
+
+void
+loop_shard_group_stats(const loop_shard_group_t *group, loop_shard_stats_t *stats)
+{
+    memset(stats, 0, sizeof(loop_shard_stats_t));
+    for (int i = 0; i < group->workers; i++) {
+        loop_shard_stats_t one;
+        loop_shard_stats(group, i, &one);
+        stats->accepted   += one.accepted;
+        stats->active     += one.active;
+        stats->bytes_up   += one.bytes_up;
+        stats->bytes_down += one.bytes_down;
+    }
+}
@@ -0,0 +1,540 @@
+/*
+ * lrucache.c - Sharded LRU cache with bucketed expiry
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sodium.h>
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "lrucache.h"
+#include "membudget.h"
+#include "utils.h"
+
+#define LRU_CACHE_MIN_INDEX     8
+#define LRU_CACHE_SHRINK_BATCH  16      // entries per shard lock on a shrink
+
+typedef struct lru_cache_entry {
+    struct lru_cache_entry *next;       // hash chain, then the list to free
+    struct cork_dllist_item lru;        // most recently used at the head
+    struct cork_dllist_item expiry;     // only with an expire time
+    uint64_t hash;
+    time_t expire_time;                 // 0 for never
+    void *data;
+    size_t key_len;
+    char key[];
+} lru_cache_entry_t;
+
+typedef struct lru_cache_shard {
+    pthread_mutex_t lock;
+    lru_cache_entry_t **index;
+    size_t mask;
+    size_t count;
+    size_t capacity;
+    size_t bytes;
+    struct cork_dllist lru;
+    struct cork_dllist bucket[LRU_CACHE_BUCKETS];
+    time_t swept;                       // the buckets before this second are done
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t replaced;
+    uint64_t evictions;
+    uint64_t expired;
+} lru_cache_shard_t;
+
+struct lru_cache {
+    int shards;
+    size_t capacity;
+    void (*free_cb)(void *element);
+    _Atomic time_t default_timeout;
+    mem_account_t *account;
+    atomic_uint shrink_next;
+    uint8_t key[crypto_shorthash_KEYBYTES];
+    lru_cache_shard_t shard[];
+};
+
+static size_t
+lru_cache_entry_size(const lru_cache_entry_t *entry)
+{
+    return sizeof(lru_cache_entry_t) + entry->key_len;
+}
+
+static uint64_t
+lru_cache_hash(const lru_cache_t *cache, const void *key, size_t key_len)
+{
+    uint64_t hash;
+    crypto_shorthash((unsigned char *)&hash, key, key_len, cache->key);
+    return hash;
+}
+
+static lru_cache_shard_t *
+lru_cache_shard(lru_cache_t *cache, uint64_t hash)
+{
+    return &cache->shard[(hash >> 32) & (cache->shards - 1)];
+}
+
+// The link that points at the entry for key, or at the end of its chain
+static lru_cache_entry_t **
+lru_cache_find(lru_cache_shard_t *shard, uint64_t hash, const void *key, size_t key_len)
+{
+    lru_cache_entry_t **link = &shard->index[hash & shard->mask];
+
+    while (*link != NULL) {
+        lru_cache_entry_t *entry = *link;
+        if (entry->hash == hash && entry->key_len == key_len
+            && memcmp(entry->key, key, key_len) == 0)
+            break;
+        link = &entry->next;
+    }
+    return link;
+}
+
+static lru_cache_entry_t **
+lru_cache_link_of(lru_cache_shard_t *shard, lru_cache_entry_t *entry)
+{
+    lru_cache_entry_t **link = &shard->index[entry->hash & shard->mask];
+
+    while (*link != entry)
+        link = &(*link)->next;
+    return link;
+}
+
+/*
+ * Take the entry out of the shard and onto garbage, to be freed once the
+ * lock is dropped.
+ */
+static void
+lru_cache_detach(lru_cache_shard_t *shard, lru_cache_entry_t **link,
+                 lru_cache_entry_t **garbage)
+{
+    lru_cache_entry_t *entry = *link;
+
+    *link = entry->next;
+    cork_dllist_remove(&entry->lru);
+    if (entry->expire_time != 0)
+        cork_dllist_remove(&entry->expiry);
+    shard->count--;
+    shard->bytes -= lru_cache_entry_size(entry);
+
+    entry->next = *garbage;
+    *garbage = entry;
+}
+
+static void
+lru_cache_release(lru_cache_t *cache, lru_cache_entry_t *garbage, int keep_data)
+{
+    while (garbage != NULL) {
+        lru_cache_entry_t *entry = garbage;
+        garbage = entry->next;
+
+        if (!keep_data && cache->free_cb != NULL && entry->data != NULL)
+            cache->free_cb(entry->data);
+        if (cache->account != NULL)
+            mem_budget_uncharge(cache->account, lru_cache_entry_size(entry));
+        ss_free(entry);
+    }
+}
+
+// Entries due past the ring wait in its last bucket
+static void
+lru_cache_file(lru_cache_shard_t *shard, lru_cache_entry_t *entry)
+{
+    time_t slot = entry->expire_time;
+
+    if (slot == 0)
+        return;
+    if (slot < shard->swept)
+        slot = shard->swept;
+    if (slot > shard->swept + LRU_CACHE_BUCKETS - 1)
+        slot = shard->swept + LRU_CACHE_BUCKETS - 1;
+    cork_dllist_add(&shard->bucket[slot % LRU_CACHE_BUCKETS], &entry->expiry);
+}
+
+// Visit the buckets that came due since the last sweep
+static void
+lru_cache_sweep(lru_cache_shard_t *shard, time_t now, lru_cache_entry_t **garbage)
+{
+    // After a long idle spell every bucket is due, and each is visited once
+    if (now - shard->swept >= LRU_CACHE_BUCKETS)
+        shard->swept = now - LRU_CACHE_BUCKETS + 1;
+
+    while (shard->swept <= now) {
+        struct cork_dllist pending;
+        struct cork_dllist_item *curr;
+
+        cork_dllist_init(&pending);
+        if (!cork_dllist_is_empty(&shard->bucket[shard->swept % LRU_CACHE_BUCKETS]))
+            cork_dllist_add_list_to_tail(&pending, &shard->bucket[shard->swept % LRU_CACHE_BUCKETS]);
+        // Refiled entries land in later buckets, never in this one
+        shard->swept++;
+
+        while ((curr = cork_dllist_head(&pending)) != NULL) {
+            lru_cache_entry_t *entry = cork_container_of(curr, lru_cache_entry_t, expiry);
+            if (entry->expire_time <= now) {
+                lru_cache_detach(shard, lru_cache_link_of(shard, entry), garbage);
+                shard->expired++;
+            } else {
+                cork_dllist_remove(curr);
+                lru_cache_file(shard, entry);
+            }
+        }
+    }
+}
+
+// Double the index while it holds more entries than buckets
+static void
+lru_cache_grow(lru_cache_shard_t *shard)
+{
+    size_t size = shard->mask + 1;
+
+    if (shard->count < size || size >= shard->capacity)
+        return;
+
+    lru_cache_entry_t **index = ss_malloc(2 * size * sizeof(lru_cache_entry_t *));
+    memset(index, 0, 2 * size * sizeof(lru_cache_entry_t *));
+    for (size_t i = 0; i < size; i++) {
+        lru_cache_entry_t *entry = shard->index[i];
+        while (entry != NULL) {
+            lru_cache_entry_t *next = entry->next;
+            entry->next = index[entry->hash & (2 * size - 1)];
+            index[entry->hash & (2 * size - 1)] = entry;
+            entry = next;
+        }
+    }
+    ss_free(shard->index);
+    shard->index = index;
+    shard->mask  = 2 * size - 1;
+}
+
+int
+lru_cache_create(lru_cache_t **dst, const size_t capacity,
+                 void (*free_cb)(void *element))
+{
+    if (dst == NULL || capacity == 0)
+        return EINVAL;
+
+    int shards = 1;
+    while (shards < LRU_CACHE_MAX_SHARDS
+           && capacity / (2 * shards) >= LRU_CACHE_SHARD_MIN)
+        shards *= 2;
+
+    size_t size        = sizeof(lru_cache_t) + shards * sizeof(lru_cache_shard_t);
+    lru_cache_t *cache = ss_malloc(size);
+    memset(cache, 0, size);
+    cache->shards   = shards;
+    cache->capacity = capacity;
+    cache->free_cb  = free_cb;
+    atomic_init(&cache->default_timeout, 0);
+    atomic_init(&cache->shrink_next, 0);
+    randombytes_buf(cache->key, sizeof(cache->key));
+
+    time_t now = time(NULL);
+    for (int i = 0; i < shards; i++) {
+        lru_cache_shard_t *shard = &cache->shard[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = capacity / shards + ((size_t)i < capacity % shards);
+        shard->mask     = LRU_CACHE_MIN_INDEX - 1;
+        shard->index    = ss_malloc(LRU_CACHE_MIN_INDEX * sizeof(lru_cache_entry_t *));
+        memset(shard->index, 0, LRU_CACHE_MIN_INDEX * sizeof(lru_cache_entry_t *));
+        shard->swept = now;
+        cork_dllist_init(&shard->lru);
+        for (int b = 0; b < LRU_CACHE_BUCKETS; b++)
+            cork_dllist_init(&shard->bucket[b]);
+    }
+
+    *dst = cache;
+    return 0;
+}
+
+int
+lru_cache_delete(lru_cache_t *cache, int keep_data)
+{
+    if (cache == NULL)
+        return EINVAL;
+
+    for (int i = 0; i < cache->shards; i++) {
+        lru_cache_shard_t *shard     = &cache->shard[i];
+        lru_cache_entry_t *garbage   = NULL;
+        struct cork_dllist_item *curr;
+
+        while ((curr = cork_dllist_head(&shard->lru)) != NULL) {
+            lru_cache_entry_t *entry = cork_container_of(curr, lru_cache_entry_t, lru);
+            lru_cache_detach(shard, lru_cache_link_of(shard, entry), &garbage);
+        }
+        lru_cache_release(cache, garbage, keep_data);
+        ss_free(shard->index);
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    if (cache->account != NULL)
+        mem_budget_unregister(cache->account);
+    ss_free(cache);
+    return 0;
+}
+
+int
+lru_cache_lookup(lru_cache_t *cache, const void *key, size_t key_len, void *result)
+{
+    if (cache == NULL || key == NULL || result == NULL)
+        return EINVAL;
+
+    void **dirty_result        = (void **)result;
+    uint64_t hash              = lru_cache_hash(cache, key, key_len);
+    lru_cache_shard_t *shard   = lru_cache_shard(cache, hash);
+    lru_cache_entry_t *garbage = NULL;
+    time_t now                 = time(NULL);
+
+    *dirty_result = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    lru_cache_entry_t **link = lru_cache_find(shard, hash, key, key_len);
+    lru_cache_entry_t *entry = *link;
+    if (entry != NULL && entry->expire_time != 0 && entry->expire_time <= now) {
+        lru_cache_detach(shard, link, &garbage);
+        shard->expired++;
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        cork_dllist_remove(&entry->lru);
+        cork_dllist_add_to_head(&shard->lru, &entry->lru);
+        *dirty_result = entry->data;
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    lru_cache_release(cache, garbage, 0);
+    return 0;
+}
+
+int
+lru_cache_insert(lru_cache_t *cache, const void *key, size_t key_len, void *data)
+{
+    if (cache == NULL)
+        return EINVAL;
+    return lru_cache_insert_with_timeout(cache, key, key_len, data,
+                                         atomic_load(&cache->default_timeout));
+}
+
+int
+lru_cache_insert_with_timeout(lru_cache_t *cache, const void *key, size_t key_len,
+                              void *data, time_t timeout)
+{
+    if (cache == NULL || key == NULL || data == NULL)
+        return EINVAL;
+
+    size_t size = sizeof(lru_cache_entry_t) + key_len;
+    if (cache->account != NULL && mem_budget_charge(cache->account, size) != 0)
+        return ENOMEM;
+
+    time_t now               = time(NULL);
+    lru_cache_entry_t *entry = ss_malloc(size);
+    entry->hash        = lru_cache_hash(cache, key, key_len);
+    entry->expire_time = timeout > 0 ? now + timeout : 0;
+    entry->data        = data;
+    entry->key_len     = key_len;
+    memcpy(entry->key, key, key_len);
+
+    lru_cache_shard_t *shard   = lru_cache_shard(cache, entry->hash);
+    lru_cache_entry_t *garbage = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    lru_cache_sweep(shard, now, &garbage);
+
+    lru_cache_entry_t **link = lru_cache_find(shard, entry->hash, key, key_len);
+    if (*link != NULL) {
+        // The caller may insert the payload it already has under this key
+        if ((*link)->data == data)
+            (*link)->data = NULL;
+        lru_cache_detach(shard, link, &garbage);
+        shard->replaced++;
+    } else if (shard->count >= shard->capacity) {
+        lru_cache_entry_t *oldest = cork_container_of(cork_dllist_tail(&shard->lru),
+                                                      lru_cache_entry_t, lru);
+        lru_cache_detach(shard, lru_cache_link_of(shard, oldest), &garbage);
+        shard->evictions++;
+    }
+
+    shard->count++;
+    shard->bytes += size;
+    shard->inserts++;
+    lru_cache_grow(shard);
+    entry->next = shard->index[entry->hash & shard->mask];
+    shard->index[entry->hash & shard->mask] = entry;
+    cork_dllist_add_to_head(&shard->lru, &entry->lru);
+    lru_cache_file(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+
+    lru_cache_release(cache, garbage, 0);
+    return 0;
+}
+
+int
+lru_cache_remove(lru_cache_t *cache, const void *key, size_t key_len)
+{
+    if (cache == NULL || key == NULL)
+        return EINVAL;
+
+    uint64_t hash              = lru_cache_hash(cache, key, key_len);
+    lru_cache_shard_t *shard   = lru_cache_shard(cache, hash);
+    lru_cache_entry_t *garbage = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    lru_cache_entry_t **link = lru_cache_find(shard, hash, key, key_len);
+    if (*link != NULL)
+        lru_cache_detach(shard, link, &garbage);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (garbage == NULL)
+        return EINVAL;
+    lru_cache_release(cache, garbage, 0);
+    return 0;
+}
+
+int
+lru_cache_key_exist(lru_cache_t *cache, const void *key, size_t key_len)
+{
+    if (cache == NULL || key == NULL)
+        return 0;
+
+    uint64_t hash            = lru_cache_hash(cache, key, key_len);
+    lru_cache_shard_t *shard = lru_cache_shard(cache, hash);
+    time_t now               = time(NULL);
+
+    pthread_mutex_lock(&shard->lock);
+    lru_cache_entry_t *entry = *lru_cache_find(shard, hash, key, key_len);
+    int exist = entry != NULL && (entry->expire_time == 0 || entry->expire_time > now);
+    pthread_mutex_unlock(&shard->lock);
+
+    return exist;
+}
+
+void
+lru_cache_set_default_timeout(lru_cache_t *cache, time_t timeout)
+{
+    if (cache != NULL)
+        atomic_store(&cache->default_timeout, timeout > 0 ? timeout : 0);
+}
+
+void
+lru_cache_cleanup_expired(lru_cache_t *cache)
+{
+    if (cache == NULL)
+        return;
+
+    time_t now = time(NULL);
+    for (int i = 0; i < cache->shards; i++) {
+        lru_cache_shard_t *shard   = &cache->shard[i];
+        lru_cache_entry_t *garbage = NULL;
+
+        pthread_mutex_lock(&shard->lock);
+        lru_cache_sweep(shard, now, &garbage);
+        pthread_mutex_unlock(&shard->lock);
+
+        lru_cache_release(cache, garbage, 0);
+    }
+}
+
+// Give back least recently used entries, a batch per shard in turn
+static size_t
+lru_cache_shrink(void *data, size_t target)
+{
+    lru_cache_t *cache = data;
+    size_t released    = 0;
+    int empty          = 0;
+
+    while (released < target && empty < cache->shards) {
+        unsigned int next          = atomic_fetch_add(&cache->shrink_next, 1);
+        lru_cache_shard_t *shard   = &cache->shard[next % cache->shards];
+        lru_cache_entry_t *garbage = NULL;
+        struct cork_dllist_item *curr = NULL;
+
+        pthread_mutex_lock(&shard->lock);
+        for (int n = 0; n < LRU_CACHE_SHRINK_BATCH && released < target; n++) {
+            curr = cork_dllist_tail(&shard->lru);
+            if (curr == NULL)
+                break;
+            lru_cache_entry_t *entry = cork_container_of(curr, lru_cache_entry_t, lru);
+            released += lru_cache_entry_size(entry);
+            lru_cache_detach(shard, lru_cache_link_of(shard, entry), &garbage);
+            shard->evictions++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        empty = garbage == NULL ? empty + 1 : 0;
+        lru_cache_release(cache, garbage, 0);
+    }
+    return released;
+}
+
+int
+lru_cache_set_budget(lru_cache_t *cache, const char *name)
+{
+    if (cache == NULL || cache->account != NULL)
+        return -1;
+
+    mem_account_t *account = mem_budget_register(name, NULL, lru_cache_shrink, cache);
+    if (account == NULL)
+        return -1;
+
+    size_t bytes = 0;
+    for (int i = 0; i < cache->shards; i++) {
+        pthread_mutex_lock(&cache->shard[i].lock);
+        bytes += cache->shard[i].bytes;
+        pthread_mutex_unlock(&cache->shard[i].lock);
+    }
+    if (mem_budget_charge(account, bytes) != 0) {
+        mem_budget_unregister(account);
+        return -1;
+    }
+
+    cache->account = account;
+    return 0;
+}
+
+void
+lru_cache_stats(lru_cache_t *cache, lru_cache_stats_t *stats)
+{
+    memset(stats, 0, sizeof(lru_cache_stats_t));
+    if (cache == NULL)
+        return;
+
+    stats->capacity = cache->capacity;
+    stats->shards   = cache->shards;
+    for (int i = 0; i < cache->shards; i++) {
+        lru_cache_shard_t *shard = &cache->shard[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->entries   += shard->count;
+        stats->hits      += shard->hits;
+        stats->misses    += shard->misses;
+        stats->inserts   += shard->inserts;
+        stats->replaced  += shard->replaced;
+        stats->evictions += shard->evictions;
+        stats->expired   += shard->expired;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
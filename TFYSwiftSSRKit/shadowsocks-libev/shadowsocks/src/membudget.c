@@ -0,0 +1,505 @@
+/*
+ * membudget.c - Process-wide memory accounting with soft and hard limits
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "membudget.h"
+#include "utils.h"
+
+// While under pressure, ask for memory back again this often
+#define MEM_BUDGET_RETRY_INTERVAL 1.0
+
+struct mem_account {
+    int in_use;
+    atomic_int closing;         // unregistered with bytes still charged
+    const char *name;
+    mem_budget_loop_t *owner;
+    mem_shrink_cb shrink;
+    void *data;
+    atomic_size_t used;
+    atomic_size_t peak;
+    atomic_uint_fast64_t denied;
+    atomic_uint_fast64_t shrunk;
+};
+
+struct mem_budget_loop {
+    struct ev_loop *loop;
+    ev_async async;
+    ev_timer retry;
+    mem_budget_reader_t *readers;
+    struct mem_budget_loop *next;
+};
+
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static mem_account_t budget_accounts[MEM_BUDGET_MAX_ACCOUNTS];
+static mem_budget_loop_t *budget_loops;
+
+static atomic_size_t budget_used;
+static atomic_size_t budget_peak;
+static atomic_size_t budget_soft   = MEM_BUDGET_DEFAULT_SOFT;
+static atomic_size_t budget_hard   = MEM_BUDGET_DEFAULT_HARD;
+static atomic_size_t budget_resume = (size_t)(MEM_BUDGET_DEFAULT_SOFT * MEM_BUDGET_DEFAULT_RESUME);
+static atomic_int budget_level     = MEM_BUDGET_NORMAL;
+static atomic_uint_fast64_t budget_pressure_events;
+static atomic_uint_fast64_t budget_denied;
+static atomic_size_t budget_paused;
+
+static void
+update_peak(atomic_size_t *peak, size_t value)
+{
+    size_t cur = atomic_load_explicit(peak, memory_order_relaxed);
+    while (value > cur
+           && !atomic_compare_exchange_weak_explicit(peak, &cur, value,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed))
+        ;
+}
+
+static void
+mem_budget_notify(void)
+{
+    pthread_mutex_lock(&budget_lock);
+    for (mem_budget_loop_t *l = budget_loops; l != NULL; l = l->next)
+        ev_async_send(l->loop, &l->async);
+    pthread_mutex_unlock(&budget_lock);
+}
+
+static void
+mem_budget_set_level(mem_budget_level_t from, mem_budget_level_t to)
+{
+    int expected = from;
+    if (atomic_compare_exchange_strong(&budget_level, &expected, to)) {
+        if (to == MEM_BUDGET_PRESSURE) {
+            atomic_fetch_add_explicit(&budget_pressure_events, 1, memory_order_relaxed);
+            LOGI("membudget: soft limit reached, %zu bytes in use",
+                 atomic_load(&budget_used));
+        }
+        mem_budget_notify();
+    }
+}
+
+static void
+mem_budget_evaluate(size_t used)
+{
+    if (used > atomic_load(&budget_soft))
+        mem_budget_set_level(MEM_BUDGET_NORMAL, MEM_BUDGET_PRESSURE);
+    else if (used < atomic_load(&budget_resume))
+        mem_budget_set_level(MEM_BUDGET_PRESSURE, MEM_BUDGET_NORMAL);
+}
+
+void
+mem_budget_configure(const mem_budget_config_t *config)
+{
+    size_t soft   = MEM_BUDGET_DEFAULT_SOFT;
+    size_t hard   = MEM_BUDGET_DEFAULT_HARD;
+    double resume = MEM_BUDGET_DEFAULT_RESUME;
+
+    if (config != NULL) {
+        if (config->soft_limit > 0)
+            soft = config->soft_limit;
+        if (config->hard_limit > 0)
+            hard = config->hard_limit;
+        if (config->resume_ratio > 0 && config->resume_ratio < 1)
+            resume = config->resume_ratio;
+    }
+    if (soft > hard)
+        soft = hard;
+
+    atomic_store(&budget_soft, soft);
+    atomic_store(&budget_hard, hard);
+    atomic_store(&budget_resume, (size_t)(soft * resume));
+
+    mem_budget_evaluate(atomic_load(&budget_used));
+}
+
+mem_budget_level_t
+mem_budget_level(void)
+{
+    return (mem_budget_level_t)atomic_load(&budget_level);
+}
+
+int
+mem_budget_charge(mem_account_t *account, size_t bytes)
+{
+    size_t hard = atomic_load(&budget_hard);
+    size_t cur  = atomic_load(&budget_used);
+
+    do {
+        if (bytes > hard || cur > hard - bytes) {
+            atomic_fetch_add_explicit(&budget_denied, 1, memory_order_relaxed);
+            if (account != NULL)
+                atomic_fetch_add_explicit(&account->denied, 1, memory_order_relaxed);
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&budget_used, &cur, cur + bytes));
+
+    update_peak(&budget_peak, cur + bytes);
+    if (account != NULL) {
+        size_t used = atomic_fetch_add_explicit(&account->used, bytes, memory_order_relaxed);
+        update_peak(&account->peak, used + bytes);
+    }
+
+    if (cur + bytes > atomic_load(&budget_soft))
+        mem_budget_evaluate(cur + bytes);
+    return 0;
+}
+
+// Take up to bytes off counter without going below zero
+static size_t
+mem_budget_take(atomic_size_t *counter, size_t bytes)
+{
+    size_t cur = atomic_load(counter);
+    size_t take;
+
+    do {
+        take = bytes < cur ? bytes : cur;
+    } while (take > 0 && !atomic_compare_exchange_weak(counter, &cur, cur - take));
+    return take;
+}
+
+// Free the slot of an unregistered account once it is back to zero
+static void
+mem_budget_retire(mem_account_t *account)
+{
+    pthread_mutex_lock(&budget_lock);
+    if (account->in_use && atomic_load(&account->closing)
+        && atomic_load(&account->used) == 0) {
+        atomic_store(&account->closing, 0);
+        account->in_use = 0;
+    }
+    pthread_mutex_unlock(&budget_lock);
+}
+
+void
+mem_budget_uncharge(mem_account_t *account, size_t bytes)
+{
+    if (account != NULL) {
+        // An account gives back at most what it holds
+        bytes = mem_budget_take(&account->used, bytes);
+        if (atomic_load(&account->closing) && atomic_load(&account->used) == 0)
+            mem_budget_retire(account);
+    }
+    mem_budget_take(&budget_used, bytes);
+
+    if (atomic_load_explicit(&budget_level, memory_order_relaxed) == MEM_BUDGET_PRESSURE)
+        mem_budget_evaluate(atomic_load(&budget_used));
+}
+
+mem_account_t *
+mem_budget_register(const char *name, mem_budget_loop_t *owner,
+                    mem_shrink_cb shrink, void *data)
+{
+    mem_account_t *account = NULL;
+
+    pthread_mutex_lock(&budget_lock);
+    for (int i = 0; i < MEM_BUDGET_MAX_ACCOUNTS; i++) {
+        if (!budget_accounts[i].in_use) {
+            account = &budget_accounts[i];
+            break;
+        }
+    }
+    if (account != NULL) {
+        account->in_use = 1;
+        account->name   = name;
+        account->owner  = owner;
+        account->shrink = shrink;
+        account->data   = data;
+        atomic_store(&account->closing, 0);
+        atomic_store(&account->used, 0);
+        atomic_store(&account->peak, 0);
+        atomic_store(&account->denied, 0);
+        atomic_store(&account->shrunk, 0);
+    }
+    pthread_mutex_unlock(&budget_lock);
+
+    if (account == NULL) {
+        LOGE("membudget: no room to register %s", name);
+    }
+    return account;
+}
+
+void
+mem_budget_unregister(mem_account_t *account)
+{
+    if (account == NULL)
+        return;
+
+    pthread_mutex_lock(&budget_lock);
+    account->shrink = NULL;
+    account->owner  = NULL;
+    atomic_store(&account->closing, 1);
+    pthread_mutex_unlock(&budget_lock);
+
+    // What is still charged is uncharged as it comes back
+    mem_budget_retire(account);
+}
+
+/*
+ * Run the shrink callbacks that belong to this loop. Callbacks are copied
+ * out first so that they may charge, uncharge or unregister freely; each
+ * one is read again under the lock before it runs, so an account that an
+ * earlier callback, or another thread, unregistered is skipped.
+ */
+static void
+mem_budget_shrink(mem_budget_loop_t *owner)
+{
+    mem_account_t *targets[MEM_BUDGET_MAX_ACCOUNTS];
+    int n = 0;
+
+    pthread_mutex_lock(&budget_lock);
+    int primary = budget_loops == owner;
+    for (int i = 0; i < MEM_BUDGET_MAX_ACCOUNTS; i++) {
+        mem_account_t *a = &budget_accounts[i];
+        if (a->in_use && a->shrink != NULL
+            && (a->owner == owner || (a->owner == NULL && primary)))
+            targets[n++] = a;
+    }
+    pthread_mutex_unlock(&budget_lock);
+
+    for (int i = 0; i < n; i++) {
+        size_t used   = atomic_load(&budget_used);
+        size_t resume = atomic_load(&budget_resume);
+        if (used <= resume)
+            break;
+
+        pthread_mutex_lock(&budget_lock);
+        mem_shrink_cb shrink = targets[i]->shrink;
+        void *data           = targets[i]->data;
+        pthread_mutex_unlock(&budget_lock);
+        if (shrink == NULL)
+            continue;
+
+        size_t released = shrink(data, used - resume);
+        atomic_fetch_add_explicit(&targets[i]->shrunk, released, memory_order_relaxed);
+    }
+}
+
+static void
+mem_budget_pause(mem_budget_reader_t *reader)
+{
+    ev_io_stop(reader->owner->loop, reader->io);
+    reader->paused = 1;
+    atomic_fetch_add(&budget_paused, 1);
+}
+
+static void
+mem_budget_resume(mem_budget_reader_t *reader)
+{
+    reader->paused = 0;
+    atomic_fetch_sub(&budget_paused, 1);
+    ev_io_start(reader->owner->loop, reader->io);
+}
+
+/*
+ * Under pressure only readers whose connection has writes queued stop.
+ * The others, and each one whose queue drains, may read one more buffer,
+ * so no connection waits on the global level, which slab and pool memory
+ * kept for reuse can hold up indefinitely.
+ */
+static void
+mem_budget_apply(mem_budget_loop_t *owner)
+{
+    if (mem_budget_level() == MEM_BUDGET_PRESSURE) {
+        for (mem_budget_reader_t *r = owner->readers; r != NULL; r = r->next)
+            if (r->wanted && !r->paused && r->queued > 0)
+                mem_budget_pause(r);
+        mem_budget_shrink(owner);
+        if (!ev_is_active(&owner->retry))
+            ev_timer_again(owner->loop, &owner->retry);
+    } else {
+        for (mem_budget_reader_t *r = owner->readers; r != NULL; r = r->next)
+            if (r->paused)
+                mem_budget_resume(r);
+        ev_timer_stop(owner->loop, &owner->retry);
+    }
+}
+
+static void
+mem_budget_async_cb(EV_P_ ev_async *w, int revents)
+{
+    mem_budget_apply((mem_budget_loop_t *)w->data);
+}
+
+static void
+mem_budget_retry_cb(EV_P_ ev_timer *w, int revents)
+{
+    mem_budget_loop_t *owner = (mem_budget_loop_t *)w->data;
+    // Usage may have dropped without crossing the resume mark in uncharge
+    mem_budget_evaluate(atomic_load(&budget_used));
+    mem_budget_apply(owner);
+}
+
+mem_budget_loop_t *
+mem_budget_attach(struct ev_loop *loop)
+{
+    mem_budget_loop_t *owner = ss_malloc(sizeof(mem_budget_loop_t));
+    memset(owner, 0, sizeof(mem_budget_loop_t));
+    owner->loop = loop;
+
+    ev_async_init(&owner->async, mem_budget_async_cb);
+    owner->async.data = owner;
+    ev_async_start(loop, &owner->async);
+
+    ev_init(&owner->retry, mem_budget_retry_cb);
+    owner->retry.repeat = MEM_BUDGET_RETRY_INTERVAL;
+    owner->retry.data   = owner;
+
+    pthread_mutex_lock(&budget_lock);
+    mem_budget_loop_t **tail = &budget_loops;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = owner;
+    pthread_mutex_unlock(&budget_lock);
+
+    // Pick up a level that was raised before this loop existed
+    if (mem_budget_level() == MEM_BUDGET_PRESSURE)
+        ev_async_send(loop, &owner->async);
+
+    return owner;
+}
+
+void
+mem_budget_detach(mem_budget_loop_t *owner)
+{
+    if (owner == NULL)
+        return;
+
+    pthread_mutex_lock(&budget_lock);
+    for (mem_budget_loop_t **link = &budget_loops; *link != NULL; link = &(*link)->next) {
+        if (*link == owner) {
+            *link = owner->next;
+            break;
+        }
+    }
+    for (int i = 0; i < MEM_BUDGET_MAX_ACCOUNTS; i++)
+        if (budget_accounts[i].owner == owner)
+            budget_accounts[i].owner = NULL;
+    pthread_mutex_unlock(&budget_lock);
+
+    while (owner->readers != NULL)
+        mem_budget_reader_release(owner->readers);
+
+    ev_async_stop(owner->loop, &owner->async);
+    ev_timer_stop(owner->loop, &owner->retry);
+    ss_free(owner);
+}
+
+void
+mem_budget_reader_init(mem_budget_reader_t *reader, mem_budget_loop_t *owner, ev_io *io)
+{
+    memset(reader, 0, sizeof(mem_budget_reader_t));
+    reader->owner = owner;
+    reader->io    = io;
+    reader->next  = owner->readers;
+    if (owner->readers != NULL)
+        owner->readers->prev = reader;
+    owner->readers = reader;
+}
+
+void
+mem_budget_reader_release(mem_budget_reader_t *reader)
+{
+    mem_budget_loop_t *owner = reader->owner;
+    if (owner == NULL)
+        return;
+
+    mem_budget_io_stop(reader);
+    if (reader->prev != NULL)
+        reader->prev->next = reader->next;
+    else
+        owner->readers = reader->next;
+    if (reader->next != NULL)
+        reader->next->prev = reader->prev;
+    reader->prev  = reader->next = NULL;
+    reader->owner = NULL;
+}
+
+void
+mem_budget_io_start(mem_budget_reader_t *reader)
+{
+    reader->wanted = 1;
+    if (mem_budget_level() == MEM_BUDGET_PRESSURE && reader->queued > 0) {
+        if (!reader->paused) {
+            reader->paused = 1;
+            atomic_fetch_add(&budget_paused, 1);
+        }
+        return;
+    }
+    // A pause from an earlier pressure period that nothing resumed
+    if (reader->paused) {
+        reader->paused = 0;
+        atomic_fetch_sub(&budget_paused, 1);
+    }
+    ev_io_start(reader->owner->loop, reader->io);
+}
+
+void
+mem_budget_reader_queued(mem_budget_reader_t *reader, size_t bytes)
+{
+    reader->queued = bytes;
+    if (reader->owner == NULL || !reader->wanted)
+        return;
+
+    if (bytes == 0 && reader->paused)
+        mem_budget_resume(reader);
+    else if (bytes > 0 && !reader->paused && mem_budget_level() == MEM_BUDGET_PRESSURE)
+        mem_budget_pause(reader);
+}
+
+void
+mem_budget_io_stop(mem_budget_reader_t *reader)
+{
+    reader->wanted = 0;
+    if (reader->paused) {
+        reader->paused = 0;
+        atomic_fetch_sub(&budget_paused, 1);
+    }
+    ev_io_stop(reader->owner->loop, reader->io);
+}
+
+void
+mem_budget_stats(mem_budget_stats_t *stats)
+{
+    memset(stats, 0, sizeof(mem_budget_stats_t));
+    stats->used            = atomic_load(&budget_used);
+    stats->peak            = atomic_load(&budget_peak);
+    stats->soft_limit      = atomic_load(&budget_soft);
+    stats->hard_limit      = atomic_load(&budget_hard);
+    stats->level           = mem_budget_level();
+    stats->pressure_events = atomic_load(&budget_pressure_events);
+    stats->denied          = atomic_load(&budget_denied);
+    stats->paused_readers  = atomic_load(&budget_paused);
+
+    pthread_mutex_lock(&budget_lock);
+    for (int i = 0; i < MEM_BUDGET_MAX_ACCOUNTS; i++) {
+        mem_account_t *a = &budget_accounts[i];
+        if (!a->in_use)
+            continue;
+        mem_account_stats_t *out = &stats->account[stats->accounts++];
+        out->name   = a->name;
+        out->used   = atomic_load(&a->used);
+        out->peak   = atomic_load(&a->peak);
+        out->denied = atomic_load(&a->denied);
+        out->shrunk = atomic_load(&a->shrunk);
+    }
+    pthread_mutex_unlock(&budget_lock);
+}
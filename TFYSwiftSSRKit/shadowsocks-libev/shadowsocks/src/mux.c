@@ -0,0 +1,806 @@
+/*
+ * mux.c - Multiplex proxied streams over one connection to the server
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "mux.h"
+#include "uthash.h"
+#include "utils.h"
+
+// Output kept free for control frames, which data writes cannot use
+#define MUX_CONTROL_RESERVE     1024
+
+// Control frames still owed by a stream
+#define MUX_PENDING_SYN         0x1
+#define MUX_PENDING_ACK         0x2
+#define MUX_PENDING_FIN         0x4
+#define MUX_PENDING_UPDATE      0x8
+
+struct mux_stream {
+    UT_hash_handle hh;
+    mux_session_t *session;
+    uint32_t id;
+    void *data;
+    uint32_t send_window;       // bytes we may still send
+    uint32_t recv_window;       // bytes the peer may still send
+    uint32_t credit;            // consumed, not yet returned to the peer
+    int pending;
+    int local_fin;              // mux_stream_close() was called
+    int fin_sent;
+    int remote_fin;
+    int blocked;
+    int dead;                   // freed while the streams were being walked
+    struct mux_stream *next_dead;
+};
+
+struct mux_session {
+    mux_role_t role;
+    mux_config_t config;
+    mux_callbacks_t cb;
+    void *data;
+    mux_stream_t *streams;
+    int nstreams;
+    uint32_t next_id;
+    byte_ring_t out;
+    int local_go_away;
+    int remote_go_away;
+    int go_away_pending;
+    int pong_pending;
+    uint32_t pong_opaque;
+    uint32_t *resets;           // ids of freed streams still owed an RST
+    int nresets;
+    int resets_size;
+    int pending;                // streams with pending control frames
+    int blocked;                // streams waiting for on_writable
+    int walking;                // HASH_ITER loops in progress
+    mux_stream_t *dead;         // freed once no loop is walking
+
+    // Frame being parsed
+    uint8_t hdr[MUX_HEADER_SIZE];
+    size_t hdr_len;
+    uint32_t frame_id;
+    uint16_t frame_flags;
+    uint32_t frame_left;        // payload bytes still to come
+
+    mux_stats_t stats;
+};
+
+static void
+mux_put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void
+mux_put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t
+mux_get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Returns -1 when the output ring has no room for the whole frame
+static int
+mux_put_frame(mux_session_t *session, uint8_t type, uint16_t flags, uint32_t id,
+              uint32_t length, const char *payload, size_t len)
+{
+    if (byte_ring_space(&session->out) < MUX_HEADER_SIZE + len)
+        return -1;
+
+    uint8_t hdr[MUX_HEADER_SIZE];
+    hdr[0] = MUX_VERSION;
+    hdr[1] = type;
+    mux_put_u16(hdr + 2, flags);
+    mux_put_u32(hdr + 4, id);
+    mux_put_u32(hdr + 8, length);
+
+    int was_empty = session->out.len == 0;
+    byte_ring_put(&session->out, hdr, MUX_HEADER_SIZE);
+    if (len > 0)
+        byte_ring_put(&session->out, payload, len);
+    session->stats.frames_out++;
+
+    if (was_empty && session->cb.on_output != NULL)
+        session->cb.on_output(session->data);
+    return 0;
+}
+
+static mux_stream_t *
+mux_find(mux_session_t *session, uint32_t id)
+{
+    mux_stream_t *stream = NULL;
+    HASH_FIND(hh, session->streams, &id, sizeof(uint32_t), stream);
+    return stream;
+}
+
+static mux_stream_t *
+mux_stream_new(mux_session_t *session, uint32_t id, void *data)
+{
+    mux_stream_t *stream = ss_malloc(sizeof(mux_stream_t));
+    memset(stream, 0, sizeof(mux_stream_t));
+    stream->session     = session;
+    stream->id          = id;
+    stream->data        = data;
+    stream->send_window = MUX_DEFAULT_WINDOW;
+    stream->recv_window = session->config.window;
+    HASH_ADD(hh, session->streams, id, sizeof(uint32_t), stream);
+    session->nstreams++;
+    return stream;
+}
+
+static void
+mux_stream_free(mux_stream_t *stream)
+{
+    mux_session_t *session = stream->session;
+
+    if (stream->pending)
+        session->pending--;
+    if (stream->blocked)
+        session->blocked--;
+    stream->pending = 0;
+    stream->blocked = 0;
+    HASH_DEL(session->streams, stream);
+    session->nstreams--;
+
+    /*
+     * A callback run from a HASH_ITER loop may free any stream, including
+     * the one the loop saved as its next. Keep the memory until the loop
+     * is done; a deleted element still links to its old successor.
+     */
+    if (session->walking > 0) {
+        stream->dead      = 1;
+        stream->next_dead = session->dead;
+        session->dead     = stream;
+        return;
+    }
+    ss_free(stream);
+}
+
+static void
+mux_walk_begin(mux_session_t *session)
+{
+    session->walking++;
+}
+
+static void
+mux_walk_end(mux_session_t *session)
+{
+    if (--session->walking > 0)
+        return;
+    while (session->dead != NULL) {
+        mux_stream_t *stream = session->dead;
+        session->dead = stream->next_dead;
+        ss_free(stream);
+    }
+}
+
+static void
+mux_stream_finish(mux_stream_t *stream, int error)
+{
+    mux_session_t *session = stream->session;
+    if (session->cb.on_close != NULL)
+        session->cb.on_close(session->data, stream, error);
+    mux_stream_free(stream);
+}
+
+static void
+mux_stream_set_pending(mux_stream_t *stream, int flag)
+{
+    if (!stream->pending)
+        stream->session->pending++;
+    stream->pending |= flag;
+}
+
+/*
+ * Write the control frames a stream owes, in order. The window announced
+ * with SYN/ACK is the default one; a larger configured window goes out as
+ * the first update.
+ */
+static void
+mux_stream_flush(mux_stream_t *stream)
+{
+    mux_session_t *session = stream->session;
+    int had_pending        = stream->pending != 0;
+
+    if (stream->pending & (MUX_PENDING_SYN | MUX_PENDING_ACK)) {
+        uint16_t flags = stream->pending & MUX_PENDING_SYN ? MUX_SYN : MUX_ACK;
+        uint32_t delta = session->config.window - MUX_DEFAULT_WINDOW;
+        if (mux_put_frame(session, MUX_WINDOW_UPDATE, flags, stream->id, delta, NULL, 0) == -1)
+            return;
+        stream->pending &= ~(MUX_PENDING_SYN | MUX_PENDING_ACK);
+    }
+
+    if (stream->pending & MUX_PENDING_UPDATE) {
+        if (mux_put_frame(session, MUX_WINDOW_UPDATE, 0, stream->id, stream->credit,
+                          NULL, 0) == -1)
+            return;
+        stream->recv_window += stream->credit;
+        stream->credit       = 0;
+        stream->pending     &= ~MUX_PENDING_UPDATE;
+    }
+
+    if (stream->pending & MUX_PENDING_FIN) {
+        if (mux_put_frame(session, MUX_DATA, MUX_FIN, stream->id, 0, NULL, 0) == -1)
+            return;
+        stream->fin_sent = 1;
+        stream->pending &= ~MUX_PENDING_FIN;
+    }
+
+    if (had_pending && stream->pending == 0)
+        session->pending--;
+
+    if (stream->fin_sent && stream->remote_fin)
+        mux_stream_finish(stream, 0);
+}
+
+/*
+ * An RST must not be lost to a full output ring: the stream is gone on
+ * our side, and the peer would keep it open for good. Queue its id until
+ * there is room.
+ */
+static void
+mux_send_reset(mux_session_t *session, uint32_t id)
+{
+    if (session->nresets == 0
+        && mux_put_frame(session, MUX_WINDOW_UPDATE, MUX_RST, id, 0, NULL, 0) == 0)
+        return;
+
+    if (session->nresets == session->resets_size) {
+        session->resets_size = session->resets_size ? session->resets_size * 2 : 8;
+        session->resets      = ss_realloc(session->resets,
+                                          session->resets_size * sizeof(uint32_t));
+    }
+    session->resets[session->nresets++] = id;
+}
+
+static void
+mux_session_flush(mux_session_t *session)
+{
+    if (session->pong_pending
+        && mux_put_frame(session, MUX_PING, MUX_ACK, 0, session->pong_opaque, NULL, 0) == 0)
+        session->pong_pending = 0;
+
+    if (session->nresets > 0) {
+        int sent = 0;
+        while (sent < session->nresets
+               && mux_put_frame(session, MUX_WINDOW_UPDATE, MUX_RST, session->resets[sent],
+                                0, NULL, 0) == 0)
+            sent++;
+        session->nresets -= sent;
+        memmove(session->resets, session->resets + sent, session->nresets * sizeof(uint32_t));
+    }
+
+    if (session->go_away_pending
+        && mux_put_frame(session, MUX_GO_AWAY, 0, 0, 0, NULL, 0) == 0)
+        session->go_away_pending = 0;
+
+    if (session->pending > 0) {
+        mux_stream_t *stream, *tmp;
+        mux_walk_begin(session);
+        HASH_ITER(hh, session->streams, stream, tmp) {
+            if (!stream->dead && stream->pending)
+                mux_stream_flush(stream);
+        }
+        mux_walk_end(session);
+    }
+}
+
+mux_session_t *
+mux_session_new(mux_role_t role, const mux_config_t *config,
+                const mux_callbacks_t *callbacks, void *data)
+{
+    mux_session_t *session = ss_malloc(sizeof(mux_session_t));
+    memset(session, 0, sizeof(mux_session_t));
+    session->role    = role;
+    session->data    = data;
+    session->next_id = role == MUX_ROLE_CLIENT ? 1 : 2;
+    if (config != NULL)
+        session->config = *config;
+    if (callbacks != NULL)
+        session->cb = *callbacks;
+
+    if (session->config.window < MUX_DEFAULT_WINDOW)
+        session->config.window = MUX_DEFAULT_WINDOW;
+    if (session->config.output_size == 0)
+        session->config.output_size = MUX_DEFAULT_OUTPUT;
+    if (session->config.max_streams <= 0)
+        session->config.max_streams = MUX_DEFAULT_MAX_STREAMS;
+
+    if (byte_ring_init(&session->out, session->config.output_size) == -1) {
+        ss_free(session);
+        return NULL;
+    }
+    return session;
+}
+
+void
+mux_session_free(mux_session_t *session)
+{
+    if (session == NULL)
+        return;
+
+    mux_stream_t *stream, *tmp;
+    HASH_ITER(hh, session->streams, stream, tmp) {
+        HASH_DEL(session->streams, stream);
+        ss_free(stream);
+    }
+    while (session->dead != NULL) {
+        stream        = session->dead;
+        session->dead = stream->next_dead;
+        ss_free(stream);
+    }
+    ss_free(session->resets);
+    byte_ring_release(&session->out);
+    ss_free(session);
+}
+
+// A stream frame has been fully read
+static void
+mux_frame_done(mux_session_t *session)
+{
+    mux_stream_t *stream = mux_find(session, session->frame_id);
+    if (stream == NULL)
+        return;
+
+    if (session->frame_flags & MUX_RST) {
+        session->stats.resets++;
+        mux_stream_finish(stream, ECONNRESET);
+        return;
+    }
+
+    if ((session->frame_flags & MUX_FIN) && !stream->remote_fin) {
+        stream->remote_fin = 1;
+        if (session->cb.on_fin != NULL)
+            session->cb.on_fin(session->data, stream);
+        stream = mux_find(session, session->frame_id);
+        if (stream != NULL && stream->fin_sent)
+            mux_stream_finish(stream, 0);
+    }
+}
+
+static int
+mux_frame_header(mux_session_t *session)
+{
+    const uint8_t *hdr = session->hdr;
+    uint8_t type       = hdr[1];
+    uint16_t flags     = (uint16_t)(hdr[2] << 8 | hdr[3]);
+    uint32_t id        = mux_get_u32(hdr + 4);
+    uint32_t length    = mux_get_u32(hdr + 8);
+
+    if (hdr[0] != MUX_VERSION)
+        return -1;
+    session->stats.frames_in++;
+
+    switch (type) {
+    case MUX_PING:
+        if (flags & MUX_SYN) {
+            session->pong_pending = 1;
+            session->pong_opaque  = length;
+            mux_session_flush(session);
+        } else if ((flags & MUX_ACK) && session->cb.on_pong != NULL) {
+            session->cb.on_pong(session->data, length);
+        }
+        return 0;
+    case MUX_GO_AWAY:
+        session->remote_go_away = 1;
+        return 0;
+    case MUX_DATA:
+    case MUX_WINDOW_UPDATE:
+        break;
+    default:
+        return -1;
+    }
+
+    if (id == 0)
+        return -1;
+
+    session->frame_id    = id;
+    session->frame_flags = flags;
+    session->frame_left  = type == MUX_DATA ? length : 0;
+
+    mux_stream_t *stream = mux_find(session, id);
+
+    if (flags & MUX_SYN) {
+        // The peer opens ids of the other parity
+        uint32_t parity = session->role == MUX_ROLE_CLIENT ? 0 : 1;
+        if ((id & 1) != parity || stream != NULL)
+            return -1;
+
+        if (session->local_go_away || session->nstreams >= session->config.max_streams) {
+            session->stats.refused++;
+            mux_send_reset(session, id);
+            session->frame_flags = 0;
+            return 0;
+        }
+
+        stream = mux_stream_new(session, id, NULL);
+        session->stats.accepted++;
+        mux_stream_set_pending(stream, MUX_PENDING_ACK);
+        mux_stream_flush(stream);
+        if (session->cb.on_accept != NULL)
+            session->cb.on_accept(session->data, stream);
+        stream = mux_find(session, id);
+    }
+
+    if (stream == NULL)
+        return 0;           // reset here earlier, drop what was in flight
+
+    if (type == MUX_WINDOW_UPDATE) {
+        // More credit than a window can hold is a protocol error
+        if (length > UINT32_MAX - stream->send_window)
+            return -1;
+        stream->send_window += length;
+        if (length > 0 && stream->blocked) {
+            stream->blocked = 0;
+            session->blocked--;
+            if (session->cb.on_writable != NULL)
+                session->cb.on_writable(session->data, stream);
+        }
+    } else if (length > stream->recv_window) {
+        return -1;
+    } else {
+        stream->recv_window -= length;
+    }
+
+    if (session->frame_left == 0)
+        mux_frame_done(session);
+    return 0;
+}
+
+int
+mux_session_input(mux_session_t *session, const char *buf, size_t len)
+{
+    while (len > 0) {
+        if (session->frame_left > 0) {
+            size_t n = len < session->frame_left ? len : session->frame_left;
+            mux_stream_t *stream = mux_find(session, session->frame_id);
+            if (stream != NULL && session->cb.on_data != NULL)
+                session->cb.on_data(session->data, stream, buf, n);
+            session->stats.bytes_in += n;
+            session->frame_left     -= n;
+            buf                     += n;
+            len                     -= n;
+            if (session->frame_left == 0)
+                mux_frame_done(session);
+            continue;
+        }
+
+        size_t n = MUX_HEADER_SIZE - session->hdr_len;
+        if (n > len)
+            n = len;
+        memcpy(session->hdr + session->hdr_len, buf, n);
+        session->hdr_len += n;
+        buf              += n;
+        len              -= n;
+
+        if (session->hdr_len == MUX_HEADER_SIZE) {
+            session->hdr_len = 0;
+            if (mux_frame_header(session) == -1)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int
+mux_session_output(const mux_session_t *session, struct iovec iov[2])
+{
+    return byte_ring_data_iov(&session->out, iov);
+}
+
+size_t
+mux_session_pending(const mux_session_t *session)
+{
+    return session->out.len;
+}
+
+void
+mux_session_consume(mux_session_t *session, size_t len)
+{
+    byte_ring_consume(&session->out, len);
+    mux_session_flush(session);
+
+    if (session->blocked > 0) {
+        mux_stream_t *stream, *tmp;
+        mux_walk_begin(session);
+        HASH_ITER(hh, session->streams, stream, tmp) {
+            if (stream->dead || !stream->blocked || stream->send_window == 0)
+                continue;
+            stream->blocked = 0;
+            session->blocked--;
+            if (session->cb.on_writable != NULL)
+                session->cb.on_writable(session->data, stream);
+        }
+        mux_walk_end(session);
+    }
+}
+
+int
+mux_session_ping(mux_session_t *session, uint32_t opaque)
+{
+    return mux_put_frame(session, MUX_PING, MUX_SYN, 0, opaque, NULL, 0);
+}
+
+void
+mux_session_go_away(mux_session_t *session)
+{
+    if (session->local_go_away)
+        return;
+    session->local_go_away   = 1;
+    session->go_away_pending = 1;
+    mux_session_flush(session);
+}
+
+int
+mux_session_accepting(const mux_session_t *session)
+{
+    return !session->local_go_away && !session->remote_go_away
+           && session->nstreams < session->config.max_streams;
+}
+
+int
+mux_session_streams(const mux_session_t *session)
+{
+    return session->nstreams;
+}
+
+void
+mux_session_stats(const mux_session_t *session, mux_stats_t *stats)
+{
+    *stats         = session->stats;
+    stats->streams = session->nstreams;
+}
+
+mux_stream_t *
+mux_stream_open(mux_session_t *session, void *data)
+{
+    if (!mux_session_accepting(session) || session->next_id > UINT32_MAX - 2)
+        return NULL;
+
+    mux_stream_t *stream = mux_stream_new(session, session->next_id, data);
+    session->next_id += 2;
+    session->stats.opened++;
+    mux_stream_set_pending(stream, MUX_PENDING_SYN);
+    mux_stream_flush(stream);
+    return stream;
+}
+
+static void
+mux_stream_block(mux_stream_t *stream)
+{
+    if (!stream->blocked) {
+        stream->blocked = 1;
+        stream->session->blocked++;
+    }
+    stream->session->stats.stalls++;
+}
+
+ssize_t
+mux_stream_write(mux_stream_t *stream, const char *buf, size_t len)
+{
+    mux_session_t *session = stream->session;
+
+    if (stream->local_fin)
+        return -1;
+    // Data may not overtake the SYN or ACK
+    if (stream->pending & (MUX_PENDING_SYN | MUX_PENDING_ACK)) {
+        mux_stream_block(stream);
+        return 0;
+    }
+
+    size_t total = 0;
+    while (total < len) {
+        size_t space = byte_ring_space(&session->out);
+        if (space <= MUX_CONTROL_RESERVE + MUX_HEADER_SIZE)
+            break;
+        space -= MUX_CONTROL_RESERVE + MUX_HEADER_SIZE;
+
+        size_t n = len - total;
+        if (n > stream->send_window)
+            n = stream->send_window;
+        if (n > MUX_MAX_FRAME)
+            n = MUX_MAX_FRAME;
+        if (n > space)
+            n = space;
+        if (n == 0)
+            break;
+
+        mux_put_frame(session, MUX_DATA, 0, stream->id, (uint32_t)n, buf + total, n);
+        stream->send_window     -= (uint32_t)n;
+        session->stats.bytes_out += n;
+        total                   += n;
+    }
+
+    if (total < len)
+        mux_stream_block(stream);
+    return (ssize_t)total;
+}
+
+size_t
+mux_stream_writable(const mux_stream_t *stream)
+{
+    const mux_session_t *session = stream->session;
+
+    if (stream->local_fin || (stream->pending & (MUX_PENDING_SYN | MUX_PENDING_ACK)))
+        return 0;
+
+    // What mux_stream_write() would take, a frame header per MUX_MAX_FRAME
+    size_t room   = 0;
+    size_t space  = byte_ring_space(&session->out);
+    size_t window = stream->send_window;
+    while (window > 0 && space > MUX_CONTROL_RESERVE + MUX_HEADER_SIZE) {
+        size_t n = space - MUX_CONTROL_RESERVE - MUX_HEADER_SIZE;
+        if (n > window)
+            n = window;
+        if (n > MUX_MAX_FRAME)
+            n = MUX_MAX_FRAME;
+        room   += n;
+        window -= n;
+        space  -= n + MUX_HEADER_SIZE;
+    }
+    return room;
+}
+
+void
+mux_stream_consumed(mux_stream_t *stream, size_t len)
+{
+    stream->credit += (uint32_t)len;
+    if (stream->remote_fin || stream->credit < stream->session->config.window / 2)
+        return;
+    mux_stream_set_pending(stream, MUX_PENDING_UPDATE);
+    mux_stream_flush(stream);
+}
+
+void
+mux_stream_close(mux_stream_t *stream)
+{
+    if (stream->local_fin)
+        return;
+    stream->local_fin = 1;
+    mux_stream_set_pending(stream, MUX_PENDING_FIN);
+    mux_stream_flush(stream);
+}
+
+void
+mux_stream_reset(mux_stream_t *stream)
+{
+    mux_session_t *session = stream->session;
+    mux_send_reset(session, stream->id);
+    session->stats.resets++;
+    mux_stream_free(stream);
+}
+
+uint32_t
+mux_stream_id(const mux_stream_t *stream)
+{
+    return stream->id;
+}
+
+void *
+mux_stream_data(const mux_stream_t *stream)
+{
+    return stream->data;
+}
+
+void
+mux_stream_set_data(mux_stream_t *stream, void *data)
+{
+    stream->data = data;
+}
+
+size_t
+mux_magic_header(char *buf)
+{
+    size_t len = sizeof(MUX_MAGIC_HOST) - 1;
+    buf[0] = 3;             // domain name
+    buf[1] = (char)len;
+    memcpy(buf + 2, MUX_MAGIC_HOST, len);
+    buf[2 + len] = 0;       // port 0
+    buf[3 + len] = 0;
+    return 4 + len;
+}
+
+int
+mux_is_magic_host(const char *host, size_t len)
+{
+    return len == sizeof(MUX_MAGIC_HOST) - 1 && memcmp(host, MUX_MAGIC_HOST, len) == 0;
+}
+
+struct mux_pool {
+    int sessions;
+    int count;
+    mux_session_t **session;
+};
+
+mux_pool_t *
+mux_pool_new(int sessions)
+{
+    if (sessions <= 0)
+        sessions = 1;
+
+    mux_pool_t *pool = ss_malloc(sizeof(mux_pool_t));
+    memset(pool, 0, sizeof(mux_pool_t));
+    pool->sessions = sessions;
+    pool->session  = ss_malloc(sessions * sizeof(mux_session_t *));
+    return pool;
+}
+
+// The sessions themselves belong to their connections
+void
+mux_pool_free(mux_pool_t *pool)
+{
+    if (pool == NULL)
+        return;
+    ss_free(pool->session);
+    ss_free(pool);
+}
+
+mux_session_t *
+mux_pool_pick(mux_pool_t *pool)
+{
+    mux_session_t *best = NULL;
+    for (int i = 0; i < pool->count; i++) {
+        mux_session_t *session = pool->session[i];
+        if (!mux_session_accepting(session))
+            continue;
+        if (best == NULL || session->nstreams < best->nstreams)
+            best = session;
+    }
+
+    // Spread over new connections before piling onto busy ones
+    if (best != NULL && best->nstreams > 0 && mux_pool_can_grow(pool))
+        return NULL;
+    return best;
+}
+
+int
+mux_pool_add(mux_pool_t *pool, mux_session_t *session)
+{
+    if (pool->count == pool->sessions)
+        return -1;
+    pool->session[pool->count++] = session;
+    return 0;
+}
+
+void
+mux_pool_remove(mux_pool_t *pool, mux_session_t *session)
+{
+    for (int i = 0; i < pool->count; i++) {
+        if (pool->session[i] == session) {
+            pool->session[i] = pool->session[--pool->count];
+            return;
+        }
+    }
+}
+
+int
+mux_pool_can_grow(const mux_pool_t *pool)
+{
+    return pool->count < pool->sessions;
+}
@@ -0,0 +1,388 @@
+/*
+ * nattable.c - Open addressing UDP NAT table with lock-free lookups
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <sodium.h>
+
+#include "nattable.h"
+#include "utils.h"
+
+_Static_assert(sizeof(nat_key_t) == 40, "nat_key_t must pack to five words");
+
+typedef struct nat_slot {
+    nat_key_t key;
+    _Atomic(void *) value;          // NULL when the slot is empty
+    uint32_t hash;
+    _Atomic uint32_t used;          // generation of the last lookup
+} nat_slot_t;
+
+struct nat_table {
+    _Atomic uint32_t seq;           // odd while a writer is at work
+    _Atomic uint32_t generation;
+    atomic_flag lock;
+    uint32_t timeout;
+    size_t mask;
+    size_t limit;
+    size_t cursor;
+    uint64_t seed;
+    void (*free_cb)(void *value);
+    _Atomic uint64_t retries;
+    nat_table_stats_t stats;
+    nat_slot_t *slots;
+};
+
+void
+nat_key_set(nat_key_t *key, int protocol,
+            const struct sockaddr *src, const struct sockaddr *dst)
+{
+    memset(key, 0, sizeof(nat_key_t));
+    key->family   = src->sa_family;
+    key->protocol = protocol;
+
+    if (src->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)src;
+        key->src_port = in->sin_port;
+        memcpy(key->src, &in->sin_addr, sizeof(in->sin_addr));
+    } else if (src->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)src;
+        key->src_port = in6->sin6_port;
+        memcpy(key->src, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+
+    if (dst == NULL)
+        return;
+    if (dst->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)dst;
+        key->dst_port = in->sin_port;
+        memcpy(key->dst, &in->sin_addr, sizeof(in->sin_addr));
+    } else if (dst->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)dst;
+        key->dst_port = in6->sin6_port;
+        memcpy(key->dst, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+}
+
+// Multiply-xorshift over the five key words, keyed per table
+static uint32_t
+nat_hash(const nat_table_t *table, const nat_key_t *key)
+{
+    uint64_t word[5];
+    uint64_t h = table->seed;
+
+    memcpy(word, key, sizeof(word));
+    for (int i = 0; i < 5; i++) {
+        h ^= word[i];
+        h *= 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static int
+nat_expired(const nat_table_t *table, const nat_slot_t *slot)
+{
+    uint32_t generation = atomic_load_explicit(&table->generation, memory_order_relaxed);
+    uint32_t used       = atomic_load_explicit(&slot->used, memory_order_relaxed);
+    return generation - used > table->timeout;
+}
+
+static void
+nat_write_begin(nat_table_t *table)
+{
+    while (atomic_flag_test_and_set_explicit(&table->lock, memory_order_acquire))
+        ;
+    atomic_fetch_add_explicit(&table->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void
+nat_write_end(nat_table_t *table)
+{
+    atomic_fetch_add_explicit(&table->seq, 1, memory_order_release);
+    atomic_flag_clear_explicit(&table->lock, memory_order_release);
+}
+
+static void
+nat_slot_move(nat_slot_t *dst, nat_slot_t *src)
+{
+    memcpy(&dst->key, &src->key, sizeof(nat_key_t));
+    dst->hash = src->hash;
+    atomic_store_explicit(&dst->used, atomic_load_explicit(&src->used, memory_order_relaxed),
+                          memory_order_relaxed);
+    atomic_store_explicit(&dst->value, atomic_load_explicit(&src->value, memory_order_relaxed),
+                          memory_order_relaxed);
+}
+
+/*
+ * Empty slot i and shift back the entries after it that may live closer
+ * to their home slot, so that no probe run is broken.
+ */
+static void
+nat_delete_locked(nat_table_t *table, size_t i)
+{
+    size_t j = i;
+
+    for (;;) {
+        j = (j + 1) & table->mask;
+        nat_slot_t *slot = &table->slots[j];
+        if (atomic_load_explicit(&slot->value, memory_order_relaxed) == NULL)
+            break;
+
+        size_t home = slot->hash & table->mask;
+        int movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            nat_slot_move(&table->slots[i], slot);
+            i = j;
+        }
+    }
+
+    atomic_store_explicit(&table->slots[i].value, NULL, memory_order_relaxed);
+    table->stats.size--;
+}
+
+/*
+ * Returns the slot holding key, or -1 with *empty set to the empty slot
+ * that ends its probe run and *reuse to the first expired slot before it.
+ */
+static ssize_t
+nat_find_locked(nat_table_t *table, const nat_key_t *key, uint32_t hash,
+                ssize_t *empty, ssize_t *reuse)
+{
+    size_t i = hash & table->mask;
+
+    *empty = -1;
+    *reuse = -1;
+    for (size_t n = 0; n <= table->mask; n++, i = (i + 1) & table->mask) {
+        nat_slot_t *slot = &table->slots[i];
+        if (atomic_load_explicit(&slot->value, memory_order_relaxed) == NULL) {
+            *empty = i;
+            if (n > table->stats.max_probe)
+                table->stats.max_probe = n;
+            return -1;
+        }
+        if (slot->hash == hash && memcmp(&slot->key, key, sizeof(nat_key_t)) == 0)
+            return i;
+        if (*reuse == -1 && nat_expired(table, slot))
+            *reuse = i;
+    }
+    return -1;
+}
+
+static size_t
+nat_sweep_locked(nat_table_t *table, size_t budget)
+{
+    size_t freed = 0;
+
+    for (size_t n = 0; n < budget && table->stats.size > 0; n++) {
+        nat_slot_t *slot = &table->slots[table->cursor];
+        void *value      = atomic_load_explicit(&slot->value, memory_order_relaxed);
+
+        if (value != NULL && nat_expired(table, slot)) {
+            // The next entry may shift into this slot; look at it again
+            nat_delete_locked(table, table->cursor);
+            if (table->free_cb != NULL)
+                table->free_cb(value);
+            table->stats.expired++;
+            freed++;
+        } else {
+            table->cursor = (table->cursor + 1) & table->mask;
+        }
+    }
+    return freed;
+}
+
+nat_table_t *
+nat_table_new(size_t capacity, uint32_t timeout, void (*free_cb)(void *value))
+{
+    size_t size = 16;
+    while (size < capacity)
+        size <<= 1;
+
+    nat_table_t *table = ss_malloc(sizeof(nat_table_t));
+    memset(table, 0, sizeof(nat_table_t));
+    table->slots = ss_malloc(size * sizeof(nat_slot_t));
+    memset(table->slots, 0, size * sizeof(nat_slot_t));
+
+    table->mask           = size - 1;
+    table->limit          = size * NAT_TABLE_MAX_LOAD / 100;
+    table->timeout        = timeout > 0 ? timeout : 1;
+    table->free_cb        = free_cb;
+    table->stats.capacity = size;
+    atomic_init(&table->seq, 0);
+    atomic_init(&table->generation, 1);
+    atomic_init(&table->retries, 0);
+    atomic_flag_clear(&table->lock);
+    randombytes_buf(&table->seed, sizeof(table->seed));
+    return table;
+}
+
+void
+nat_table_free(nat_table_t *table, int keep_data)
+{
+    if (!keep_data && table->free_cb != NULL)
+        for (size_t i = 0; i <= table->mask; i++) {
+            void *value = atomic_load_explicit(&table->slots[i].value, memory_order_relaxed);
+            if (value != NULL)
+                table->free_cb(value);
+        }
+    ss_free(table->slots);
+    ss_free(table);
+}
+
+void *
+nat_table_lookup(nat_table_t *table, const nat_key_t *key)
+{
+    uint32_t hash = nat_hash(table, key);
+
+    for (;;) {
+        uint32_t seq = atomic_load_explicit(&table->seq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+
+        nat_slot_t *found = NULL;
+        void *value       = NULL;
+        size_t i          = hash & table->mask;
+        for (size_t n = 0; n <= table->mask; n++, i = (i + 1) & table->mask) {
+            nat_slot_t *slot = &table->slots[i];
+            void *v          = atomic_load_explicit(&slot->value, memory_order_relaxed);
+            if (v == NULL)
+                break;
+            if (slot->hash == hash && memcmp(&slot->key, key, sizeof(nat_key_t)) == 0) {
+                found = slot;
+                value = v;
+                break;
+            }
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&table->seq, memory_order_relaxed) != seq) {
+            atomic_fetch_add_explicit(&table->retries, 1, memory_order_relaxed);
+            continue;
+        }
+
+        if (found == NULL || nat_expired(table, found))
+            return NULL;
+        atomic_store_explicit(&found->used,
+                              atomic_load_explicit(&table->generation, memory_order_relaxed),
+                              memory_order_relaxed);
+        return value;
+    }
+}
+
+int
+nat_table_insert(nat_table_t *table, const nat_key_t *key, void *value)
+{
+    if (value == NULL)
+        return EINVAL;
+
+    uint32_t hash       = nat_hash(table, key);
+    uint32_t generation = atomic_load_explicit(&table->generation, memory_order_relaxed);
+    void *old           = NULL;
+    ssize_t empty, reuse;
+    int ret = 0;
+
+    nat_write_begin(table);
+
+    ssize_t i = nat_find_locked(table, key, hash, &empty, &reuse);
+    if (i != -1) {
+        old = atomic_load_explicit(&table->slots[i].value, memory_order_relaxed);
+    } else if (reuse != -1) {
+        // Take over an expired entry in the probe run
+        i   = reuse;
+        old = atomic_load_explicit(&table->slots[i].value, memory_order_relaxed);
+        table->stats.expired++;
+    } else {
+        if (table->stats.size >= table->limit) {
+            // A bounded sweep; a full scan would hold up every writer
+            if (nat_sweep_locked(table, NAT_TABLE_INSERT_SWEEP) > 0)
+                nat_find_locked(table, key, hash, &empty, &reuse);
+        }
+        if (table->stats.size < table->limit && empty != -1) {
+            i = empty;
+            table->stats.size++;
+        }
+    }
+
+    if (i == -1) {
+        table->stats.full++;
+        ret = ENOSPC;
+    } else {
+        nat_slot_t *slot = &table->slots[i];
+        memcpy(&slot->key, key, sizeof(nat_key_t));
+        slot->hash = hash;
+        atomic_store_explicit(&slot->used, generation, memory_order_relaxed);
+        atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+        table->stats.inserts++;
+    }
+
+    nat_write_end(table);
+    if (old != NULL && old != value && table->free_cb != NULL)
+        table->free_cb(old);
+    return ret;
+}
+
+void *
+nat_table_remove(nat_table_t *table, const nat_key_t *key)
+{
+    uint32_t hash = nat_hash(table, key);
+    void *value   = NULL;
+    ssize_t empty, reuse;
+
+    nat_write_begin(table);
+    ssize_t i = nat_find_locked(table, key, hash, &empty, &reuse);
+    if (i != -1) {
+        value = atomic_load_explicit(&table->slots[i].value, memory_order_relaxed);
+        nat_delete_locked(table, i);
+        table->stats.removes++;
+    }
+    nat_write_end(table);
+    return value;
+}
+
+void
+nat_table_tick(nat_table_t *table, uint32_t generation)
+{
+    atomic_store_explicit(&table->generation, generation, memory_order_relaxed);
+}
+
+size_t
+nat_table_sweep(nat_table_t *table, size_t budget)
+{
+    nat_write_begin(table);
+    size_t freed = nat_sweep_locked(table, budget);
+    nat_write_end(table);
+    return freed;
+}
+
+void
+nat_table_stats(nat_table_t *table, nat_table_stats_t *stats)
+{
+    // The lock alone: readers need not retry for this
+    while (atomic_flag_test_and_set_explicit(&table->lock, memory_order_acquire))
+        ;
+    *stats = table->stats;
+    atomic_flag_clear_explicit(&table->lock, memory_order_release);
+    stats->retries = atomic_load_explicit(&table->retries, memory_order_relaxed);
+}
@@ -0,0 +1,422 @@
+/*
+ * pmtu.c - Per-server path MTU discovery for the UDP relay
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "pmtu.h"
+#include "utils.h"
+
+typedef struct pmtu_server {
+    pmtu_t *pmtu;
+    int index;
+    int family;
+    ev_timer timer;                 // the probe timeout while searching, else the next search
+    size_t mtu;                     // confirmed
+    int searched;                   // a search has ended
+    int searching;
+    int verifying;                  // probing mtu itself, first thing in a search
+    size_t lo;                      // known to get through
+    size_t hi;                      // may still get through
+    size_t trying;
+    int tries;
+    uint32_t first_id;              // of the probes at this size
+    uint32_t last_id;
+    uint64_t probes;
+    uint64_t acks;
+    uint64_t too_big;
+    uint64_t searches;
+} pmtu_server_t;
+
+struct pmtu {
+    struct ev_loop *loop;
+    pmtu_config_t config;
+    pmtu_send_cb send;
+    pmtu_cb cb;
+    void *data;
+    int started;
+    int count;
+    uint32_t next_id;
+    pmtu_server_t server[PMTU_MAX_SERVERS];
+};
+
+// Smallest tunnel MTU the last prober to change published, 0 for none
+static atomic_size_t pmtu_published;
+
+static void pmtu_timer_cb(EV_P_ ev_timer *w, int revents);
+
+static size_t
+pmtu_ip_header(const pmtu_server_t *s)
+{
+    return s->family == AF_INET6 ? 40 : 20;
+}
+
+static void
+pmtu_publish(pmtu_t *pmtu)
+{
+    size_t tunnel = 0;
+
+    for (int i = 0; i < pmtu->count; i++) {
+        const pmtu_server_t *s = &pmtu->server[i];
+        if (!s->searched)
+            continue;
+        size_t mtu = pmtu_tunnel_mtu_for(s->mtu, s->family);
+        if (tunnel == 0 || mtu < tunnel)
+            tunnel = mtu;
+    }
+    atomic_store(&pmtu_published, tunnel);
+}
+
+static void
+pmtu_set_mtu(pmtu_server_t *s, size_t mtu)
+{
+    pmtu_t *pmtu = s->pmtu;
+
+    if (mtu == s->mtu)
+        return;
+    LOGI("pmtu: server %d path MTU %zu", s->index, mtu);
+    s->mtu = mtu;
+    pmtu_publish(pmtu);
+    if (pmtu->cb != NULL)
+        pmtu->cb(pmtu->data, s->index, mtu);
+}
+
+static void
+pmtu_schedule(pmtu_server_t *s, double delay)
+{
+    pmtu_t *pmtu = s->pmtu;
+
+    ev_timer_stop(pmtu->loop, &s->timer);
+    ev_timer_set(&s->timer, delay, 0);
+    ev_timer_start(pmtu->loop, &s->timer);
+}
+
+static void
+pmtu_finish(pmtu_server_t *s)
+{
+    pmtu_t *pmtu = s->pmtu;
+
+    s->searching = 0;
+    s->trying    = 0;
+    s->searched  = 1;
+    pmtu_set_mtu(s, s->lo);
+    // Published even when unchanged, for the first search
+    pmtu_publish(pmtu);
+
+    // Spread by up to 10% so that servers do not search in step
+    pmtu_schedule(s, pmtu->config.reprobe * (0.9 + 0.2 * rand() / RAND_MAX));
+}
+
+static void pmtu_next(pmtu_server_t *s);
+
+static void
+pmtu_send(pmtu_server_t *s)
+{
+    pmtu_t *pmtu = s->pmtu;
+    uint32_t id  = pmtu->next_id++;
+
+    if (s->tries++ == 0)
+        s->first_id = id;
+    s->last_id = id;
+    s->probes++;
+
+    int err = pmtu->send(pmtu->data, s->index,
+                         s->trying - pmtu_ip_header(s) - PMTU_UDP_HEADER, id);
+    if (err == EMSGSIZE) {
+        // The local link is already smaller
+        s->tries = pmtu->config.tries;
+        pmtu_timer_cb(pmtu->loop, &s->timer, 0);
+        return;
+    }
+    pmtu_schedule(s, pmtu->config.timeout);
+}
+
+// Probe the middle of what is left, or end the search
+static void
+pmtu_next(pmtu_server_t *s)
+{
+    pmtu_t *pmtu = s->pmtu;
+
+    if (s->hi < s->lo + pmtu->config.step) {
+        pmtu_finish(s);
+        return;
+    }
+    s->trying = s->lo + (s->hi - s->lo + 1) / 2;
+    s->tries  = 0;
+    pmtu_send(s);
+}
+
+static void
+pmtu_search(pmtu_server_t *s)
+{
+    pmtu_t *pmtu = s->pmtu;
+
+    s->searching = 1;
+    s->searches++;
+    s->lo = s->mtu;
+    s->hi = pmtu->config.max;
+
+    // Confirm the current size first, unless it is the floor
+    if (s->mtu > PMTU_MIN) {
+        s->verifying = 1;
+        s->trying    = s->mtu;
+        s->tries     = 0;
+        pmtu_send(s);
+        return;
+    }
+    pmtu_next(s);
+}
+
+static void
+pmtu_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+    pmtu_server_t *s = w->data;
+    pmtu_t *pmtu     = s->pmtu;
+
+    if (!s->searching) {
+        pmtu_search(s);
+        return;
+    }
+    if (s->tries < pmtu->config.tries) {
+        pmtu_send(s);
+        return;
+    }
+
+    ev_timer_stop(pmtu->loop, &s->timer);
+    if (s->verifying) {
+        // The path shrank without telling: fall back to the floor and search up
+        s->verifying = 0;
+        s->lo        = PMTU_MIN;
+        pmtu_set_mtu(s, PMTU_MIN);
+    }
+    s->hi = s->trying - 1;
+    pmtu_next(s);
+}
+
+pmtu_t *
+pmtu_new(struct ev_loop *loop, const pmtu_config_t *config,
+         pmtu_send_cb send, pmtu_cb cb, void *data)
+{
+    pmtu_t *pmtu = ss_malloc(sizeof(pmtu_t));
+    memset(pmtu, 0, sizeof(pmtu_t));
+    pmtu->loop    = loop;
+    pmtu->send    = send;
+    pmtu->cb      = cb;
+    pmtu->data    = data;
+    pmtu->next_id = 1;
+    if (config != NULL)
+        pmtu->config = *config;
+
+    if (pmtu->config.max < PMTU_MIN)
+        pmtu->config.max = PMTU_DEFAULT_MAX;
+    if (pmtu->config.timeout <= 0)
+        pmtu->config.timeout = PMTU_DEFAULT_TIMEOUT;
+    if (pmtu->config.tries <= 0)
+        pmtu->config.tries = PMTU_DEFAULT_TRIES;
+    if (pmtu->config.step == 0)
+        pmtu->config.step = PMTU_DEFAULT_STEP;
+    if (pmtu->config.reprobe <= 0)
+        pmtu->config.reprobe = PMTU_DEFAULT_REPROBE;
+    return pmtu;
+}
+
+void
+pmtu_free(pmtu_t *pmtu)
+{
+    for (int i = 0; i < pmtu->count; i++)
+        ev_timer_stop(pmtu->loop, &pmtu->server[i].timer);
+    ss_free(pmtu);
+}
+
+int
+pmtu_add(pmtu_t *pmtu, const struct sockaddr *addr)
+{
+    if (pmtu->count >= PMTU_MAX_SERVERS)
+        return -1;
+
+    pmtu_server_t *s = &pmtu->server[pmtu->count];
+    memset(s, 0, sizeof(pmtu_server_t));
+    s->pmtu   = pmtu;
+    s->index  = pmtu->count;
+    s->family = addr->sa_family;
+    s->mtu    = PMTU_MIN;
+    ev_timer_init(&s->timer, pmtu_timer_cb, 0, 0);
+    s->timer.data = s;
+
+    if (pmtu->started)
+        pmtu_search(s);
+    return pmtu->count++;
+}
+
+void
+pmtu_start(pmtu_t *pmtu)
+{
+    if (pmtu->started)
+        return;
+    pmtu->started = 1;
+    for (int i = 0; i < pmtu->count; i++)
+        pmtu_search(&pmtu->server[i]);
+}
+
+void
+pmtu_ack(pmtu_t *pmtu, int server, uint32_t id)
+{
+    if (server < 0 || server >= pmtu->count)
+        return;
+
+    pmtu_server_t *s = &pmtu->server[server];
+    // Any probe at the current size will do, not only the last one
+    if (!s->searching || id < s->first_id || id > s->last_id)
+        return;
+
+    s->acks++;
+    ev_timer_stop(pmtu->loop, &s->timer);
+    s->verifying = 0;
+    s->lo        = s->trying;
+    pmtu_next(s);
+}
+
+void
+pmtu_too_big(pmtu_t *pmtu, int server, size_t mtu)
+{
+    if (server < 0 || server >= pmtu->count)
+        return;
+
+    pmtu_server_t *s = &pmtu->server[server];
+    size_t floor     = s->family == AF_INET6 ? PMTU_MIN : PMTU_MIN_IPV4;
+    if (mtu < floor)
+        mtu = floor;
+    if (mtu >= s->mtu)
+        return;
+
+    s->too_big++;
+    pmtu_set_mtu(s, mtu);
+    if (!s->searching)
+        return;
+
+    if (s->hi > mtu)
+        s->hi = mtu;
+    if (s->lo > mtu)
+        s->lo = mtu;
+    // The size in flight is already known to fail
+    if (s->trying > mtu) {
+        ev_timer_stop(pmtu->loop, &s->timer);
+        s->verifying = 0;
+        pmtu_next(s);
+    }
+}
+
+void
+pmtu_restart(pmtu_t *pmtu)
+{
+    if (!pmtu->started)
+        return;
+    for (int i = 0; i < pmtu->count; i++) {
+        pmtu_server_t *s = &pmtu->server[i];
+        if (s->searching)
+            continue;
+        ev_timer_stop(pmtu->loop, &s->timer);
+        pmtu_search(s);
+    }
+}
+
+size_t
+pmtu_mtu(const pmtu_t *pmtu, int server)
+{
+    if (server < 0 || server >= pmtu->count)
+        return PMTU_MIN;
+    return pmtu->server[server].mtu;
+}
+
+size_t
+pmtu_udp_payload(const pmtu_t *pmtu, int server)
+{
+    if (server < 0 || server >= pmtu->count)
+        return PMTU_MIN - 40 - PMTU_UDP_HEADER;
+    const pmtu_server_t *s = &pmtu->server[server];
+    return s->mtu - pmtu_ip_header(s) - PMTU_UDP_HEADER;
+}
+
+void
+pmtu_server_stats(const pmtu_t *pmtu, int server, pmtu_server_stats_t *stats)
+{
+    memset(stats, 0, sizeof(pmtu_server_stats_t));
+    if (server < 0 || server >= pmtu->count)
+        return;
+
+    const pmtu_server_t *s = &pmtu->server[server];
+    stats->mtu       = s->mtu;
+    stats->payload   = pmtu_udp_payload(pmtu, server);
+    stats->searching = s->searching;
+    stats->trying    = s->searching ? s->trying : 0;
+    stats->probes    = s->probes;
+    stats->acks      = s->acks;
+    stats->too_big   = s->too_big;
+    stats->searches  = s->searches;
+    if (!s->searching && ev_is_active(&s->timer))
+        stats->next_search = ev_timer_remaining(pmtu->loop, (ev_timer *)&s->timer);
+}
+
+size_t
+pmtu_tunnel_mtu(void)
+{
+    return atomic_load(&pmtu_published);
+}
+
+size_t
+pmtu_tunnel_mtu_for(size_t mtu, int family)
+{
+    size_t outer = (family == AF_INET6 ? 40 : 20) + PMTU_UDP_HEADER + PMTU_RELAY_OVERHEAD;
+
+    if (mtu < outer + PMTU_MIN - 20 - PMTU_UDP_HEADER)
+        return PMTU_MIN;
+    return mtu - outer + 20 + PMTU_UDP_HEADER;
+}
+
+int
+pmtu_set_dont_fragment(int fd, int family)
+{
+    int on = 1;
+
+    if (family == AF_INET6) {
+#if defined(IPV6_DONTFRAG)
+        return setsockopt(fd, IPPROTO_IPV6, IPV6_DONTFRAG, &on, sizeof(on));
+#elif defined(IPV6_MTU_DISCOVER)
+        int probe = IPV6_PMTUDISC_PROBE;
+        (void)on;
+        return setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &probe, sizeof(probe));
+#endif
+    } else {
+#if defined(IP_DONTFRAG)
+        return setsockopt(fd, IPPROTO_IP, IP_DONTFRAG, &on, sizeof(on));
+#elif defined(IP_MTU_DISCOVER)
+        // Set DF, and ignore the kernel's cached path MTU so probes go out
+        int probe = IP_PMTUDISC_PROBE;
+        (void)on;
+        return setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &probe, sizeof(probe));
+#endif
+    }
+    (void)on;
+    errno = ENOPROTOOPT;
+    return -1;
+}
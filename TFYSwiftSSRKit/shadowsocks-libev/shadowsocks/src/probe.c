@@ -0,0 +1,482 @@
+/*
+ * probe.c - Probe the remote servers for health and latency
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "netutils.h"
+#include "probe.h"
+#include "utils.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Shortest gap between the end of a probe and a triggered one
+#define PROBE_MIN_GAP 1.0
+
+typedef enum probe_state {
+    PROBE_IDLE,
+    PROBE_CONNECTING,
+    PROBE_SENDING,
+    PROBE_RECEIVING
+} probe_state_t;
+
+typedef struct probe_server {
+    probe_t *probe;
+    int index;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    probe_state_t state;
+    int fd;
+    ev_io io;
+    ev_timer timer;                 // next probe while idle, else the timeout
+    void *ctx;
+    char buf[PROBE_BUF_SIZE];
+    size_t len;
+    size_t sent;
+    ev_tstamp started;
+    ev_tstamp connected;
+    ev_tstamp requested;
+    ev_tstamp first_byte;
+    ev_tstamp finished;
+    int probed;
+    double success;
+    double rtt;
+    probe_result_t last;
+    int failures;
+    uint64_t probes;
+    uint64_t failed;
+} probe_server_t;
+
+struct probe {
+    struct ev_loop *loop;
+    probe_config_t config;
+    probe_handshake_t handshake;
+    int has_handshake;
+    probe_cb cb;
+    void *data;
+    int started;
+    int count;
+    probe_server_t server[PROBE_MAX_SERVERS];
+};
+
+static void probe_io_cb(EV_P_ ev_io *w, int revents);
+static void probe_timer_cb(EV_P_ ev_timer *w, int revents);
+
+static double
+probe_server_health(const probe_t *probe, const probe_server_t *s)
+{
+    if (!s->probed)
+        return 1.0;
+    if (s->rtt <= probe->config.target_rtt)
+        return s->success;
+    return s->success * probe->config.target_rtt / s->rtt;
+}
+
+// interval * 2^failures, capped, then spread by the jitter
+static double
+probe_delay(const probe_t *probe, const probe_server_t *s)
+{
+    double delay = probe->config.interval * pow(2, s->failures);
+    if (delay > probe->config.max_interval)
+        delay = probe->config.max_interval;
+    double spread = probe->config.jitter * (2.0 * rand() / RAND_MAX - 1.0);
+    return delay * (1.0 + spread);
+}
+
+static void
+probe_schedule(probe_server_t *s, double delay)
+{
+    probe_t *probe = s->probe;
+
+    ev_timer_stop(probe->loop, &s->timer);
+    ev_timer_set(&s->timer, delay, 0);
+    ev_timer_start(probe->loop, &s->timer);
+}
+
+static void
+probe_finish(probe_server_t *s, int ok, int error)
+{
+    probe_t *probe = s->probe;
+    ev_tstamp now  = ev_now(probe->loop);
+    double alpha   = probe->config.alpha;
+
+    ev_io_stop(probe->loop, &s->io);
+    if (s->fd != -1) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    if (s->ctx != NULL) {
+        if (probe->handshake.release != NULL)
+            probe->handshake.release(probe->handshake.data, s->ctx);
+        s->ctx = NULL;
+    }
+
+    probe_result_t *result = &s->last;
+    memset(result, 0, sizeof(probe_result_t));
+    result->server = s->index;
+    result->ok     = ok;
+    result->error  = ok ? 0 : error;
+    if (ok) {
+        result->connect_rtt = s->connected - s->started;
+        if (probe->has_handshake) {
+            result->handshake_rtt = s->first_byte - s->requested;
+            result->round_trip    = now - s->requested;
+        }
+    }
+
+    double sample = ok ? 1.0 : 0.0;
+    if (!s->probed) {
+        s->success = sample;
+    } else {
+        s->success += alpha * (sample - s->success);
+    }
+    if (ok) {
+        double rtt = result->connect_rtt;
+        if (result->round_trip > rtt)
+            rtt = result->round_trip;
+        s->rtt = s->probed && s->rtt > 0 ? s->rtt + alpha * (rtt - s->rtt) : rtt;
+    }
+    s->probed = 1;
+
+    s->probes++;
+    if (ok) {
+        s->failures = 0;
+    } else {
+        s->failed++;
+        s->failures++;
+        LOGI("probe: server %d failed: %s", s->index, strerror(error));
+    }
+    result->health = probe_server_health(probe, s);
+
+    s->state    = PROBE_IDLE;
+    s->finished = now;
+    probe_schedule(s, probe_delay(probe, s));
+
+    if (probe->cb != NULL)
+        probe->cb(probe->data, result);
+}
+
+static void
+probe_begin(probe_server_t *s)
+{
+    probe_t *probe = s->probe;
+
+    s->fd = socket(s->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s->fd == -1) {
+        ERROR("probe: socket");
+        probe_finish(s, 0, errno);
+        return;
+    }
+    fcntl(s->fd, F_SETFD, FD_CLOEXEC);
+    setnonblocking(s->fd);
+
+    int opt = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#ifdef SO_NOSIGPIPE
+    set_nosigpipe(s->fd);
+#endif
+
+    s->started    = ev_now(probe->loop);
+    s->connected  = 0;
+    s->requested  = 0;
+    s->first_byte = 0;
+    s->len        = 0;
+    s->sent       = 0;
+
+    if (connect(s->fd, (struct sockaddr *)&s->addr, s->addr_len) == -1
+        && errno != EINPROGRESS) {
+        probe_finish(s, 0, errno);
+        return;
+    }
+
+    s->state = PROBE_CONNECTING;
+    ev_io_set(&s->io, s->fd, EV_WRITE);
+    ev_io_start(probe->loop, &s->io);
+    probe_schedule(s, probe->config.timeout);
+}
+
+static void
+probe_send(probe_server_t *s)
+{
+    probe_t *probe = s->probe;
+
+    while (s->sent < s->len) {
+        ssize_t n = send(s->fd, s->buf + s->sent, s->len - s->sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            probe_finish(s, 0, errno);
+            return;
+        }
+        s->sent += n;
+    }
+
+    s->state = PROBE_RECEIVING;
+    ev_io_stop(probe->loop, &s->io);
+    ev_io_set(&s->io, s->fd, EV_READ);
+    ev_io_start(probe->loop, &s->io);
+}
+
+static void
+probe_connected(probe_server_t *s)
+{
+    probe_t *probe = s->probe;
+    int error      = 0;
+    socklen_t len  = sizeof(error);
+
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+        error = errno;
+    if (error != 0) {
+        probe_finish(s, 0, error);
+        return;
+    }
+
+    s->connected = ev_now(probe->loop);
+    if (!probe->has_handshake) {
+        probe_finish(s, 1, 0);
+        return;
+    }
+
+    ssize_t n = probe->handshake.request(probe->handshake.data, s->index, s->buf, sizeof(s->buf), &s->ctx);
+    if (n <= 0) {
+        probe_finish(s, 0, EINVAL);
+        return;
+    }
+    s->len       = n;
+    s->requested = s->connected;
+    s->state     = PROBE_SENDING;
+    probe_send(s);
+}
+
+static void
+probe_receive(probe_server_t *s)
+{
+    probe_t *probe = s->probe;
+    char buf[PROBE_BUF_SIZE];
+
+    ssize_t n = recv(s->fd, buf, sizeof(buf), 0);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            probe_finish(s, 0, errno);
+        return;
+    }
+    // The server closes on a bad salt or an unreachable target
+    if (n == 0) {
+        probe_finish(s, 0, ECONNRESET);
+        return;
+    }
+
+    if (s->first_byte == 0)
+        s->first_byte = ev_now(probe->loop);
+
+    int r = probe->handshake.response(probe->handshake.data, s->ctx, buf, n);
+    if (r == 1)
+        probe_finish(s, 1, 0);
+    else if (r == -1)
+        probe_finish(s, 0, EBADMSG);
+}
+
+static void
+probe_io_cb(EV_P_ ev_io *w, int revents)
+{
+    probe_server_t *s = w->data;
+
+    switch (s->state) {
+    case PROBE_CONNECTING:
+        probe_connected(s);
+        break;
+    case PROBE_SENDING:
+        probe_send(s);
+        break;
+    case PROBE_RECEIVING:
+        probe_receive(s);
+        break;
+    default:
+        ev_io_stop(EV_A_ w);
+        break;
+    }
+}
+
+static void
+probe_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+    probe_server_t *s = w->data;
+
+    if (s->state == PROBE_IDLE)
+        probe_begin(s);
+    else
+        probe_finish(s, 0, ETIMEDOUT);
+}
+
+probe_t *
+probe_new(struct ev_loop *loop, const probe_config_t *config,
+          const probe_handshake_t *handshake, probe_cb cb, void *data)
+{
+    probe_t *probe = ss_malloc(sizeof(probe_t));
+    memset(probe, 0, sizeof(probe_t));
+    probe->loop = loop;
+    probe->cb   = cb;
+    probe->data = data;
+    if (config != NULL)
+        probe->config = *config;
+    if (handshake != NULL && handshake->request != NULL && handshake->response != NULL) {
+        probe->handshake     = *handshake;
+        probe->has_handshake = 1;
+    }
+
+    if (probe->config.interval <= 0)
+        probe->config.interval = PROBE_DEFAULT_INTERVAL;
+    if (probe->config.max_interval < probe->config.interval)
+        probe->config.max_interval = PROBE_DEFAULT_MAX_INTERVAL > probe->config.interval
+                                     ? PROBE_DEFAULT_MAX_INTERVAL : probe->config.interval;
+    if (probe->config.jitter <= 0 || probe->config.jitter >= 1)
+        probe->config.jitter = PROBE_DEFAULT_JITTER;
+    if (probe->config.timeout <= 0)
+        probe->config.timeout = PROBE_DEFAULT_TIMEOUT;
+    if (probe->config.target_rtt <= 0)
+        probe->config.target_rtt = PROBE_DEFAULT_TARGET_RTT;
+    if (probe->config.alpha <= 0 || probe->config.alpha > 1)
+        probe->config.alpha = PROBE_DEFAULT_ALPHA;
+    return probe;
+}
+
+void
+probe_free(probe_t *probe)
+{
+    for (int i = 0; i < probe->count; i++) {
+        probe_server_t *s = &probe->server[i];
+        ev_timer_stop(probe->loop, &s->timer);
+        ev_io_stop(probe->loop, &s->io);
+        if (s->fd != -1)
+            close(s->fd);
+        if (s->ctx != NULL && probe->handshake.release != NULL)
+            probe->handshake.release(probe->handshake.data, s->ctx);
+    }
+    ss_free(probe);
+}
+
+int
+probe_add(probe_t *probe, const struct sockaddr *addr, socklen_t addr_len)
+{
+    if (probe->count >= PROBE_MAX_SERVERS || addr_len > sizeof(struct sockaddr_storage))
+        return -1;
+
+    probe_server_t *s = &probe->server[probe->count];
+    s->probe = probe;
+    s->index = probe->count;
+    s->fd    = -1;
+    memcpy(&s->addr, addr, addr_len);
+    s->addr_len = addr_len;
+    ev_io_init(&s->io, probe_io_cb, -1, EV_WRITE);
+    s->io.data = s;
+    ev_timer_init(&s->timer, probe_timer_cb, 0, 0);
+    s->timer.data = s;
+
+    if (probe->started)
+        probe_schedule(s, probe->config.interval * probe->config.jitter * rand() / RAND_MAX);
+    return probe->count++;
+}
+
+void
+probe_start(probe_t *probe)
+{
+    if (probe->started)
+        return;
+    probe->started = 1;
+
+    // First probes soon, but not all at once
+    for (int i = 0; i < probe->count; i++)
+        probe_schedule(&probe->server[i],
+                       probe->config.interval * probe->config.jitter * rand() / RAND_MAX);
+}
+
+void
+probe_trigger(probe_t *probe, int server)
+{
+    if (server < 0 || server >= probe->count || !probe->started)
+        return;
+
+    probe_server_t *s = &probe->server[server];
+    if (s->state != PROBE_IDLE)
+        return;
+    if (s->probes > 0 && ev_now(probe->loop) - s->finished < PROBE_MIN_GAP)
+        return;
+
+    ev_timer_stop(probe->loop, &s->timer);
+    probe_begin(s);
+}
+
+double
+probe_health(const probe_t *probe, int server)
+{
+    if (server < 0 || server >= probe->count)
+        return 0;
+    return probe_server_health(probe, &probe->server[server]);
+}
+
+void
+probe_server_stats(const probe_t *probe, int server, probe_server_stats_t *stats)
+{
+    memset(stats, 0, sizeof(probe_server_stats_t));
+    if (server < 0 || server >= probe->count)
+        return;
+
+    const probe_server_t *s = &probe->server[server];
+    stats->health        = probe_server_health(probe, s);
+    stats->success       = s->success;
+    stats->rtt           = s->rtt;
+    stats->connect_rtt   = s->last.connect_rtt;
+    stats->handshake_rtt = s->last.handshake_rtt;
+    stats->round_trip    = s->last.round_trip;
+    stats->failures      = s->failures;
+    stats->probes        = s->probes;
+    stats->failed        = s->failed;
+    if (ev_is_active(&s->timer) && s->state == PROBE_IDLE)
+        stats->next_probe = ev_timer_remaining(probe->loop, (ev_timer *)&s->timer);
+}
+
+int
+probe_failover(const double *health, const int *down, int count, int current,
+               double healthy, double margin)
+{
+    if (current < 0 || current >= count)
+        return -1;
+    if (health[current] >= healthy && !down[current])
+        return current;
+
+    int best = -1;
+    for (int i = 0; i < count; i++) {
+        if (i == current || down[i])
+            continue;
+        if (best == -1 || health[i] > health[best])
+            best = i;
+    }
+    if (best != -1 && health[best] >= health[current] + margin)
+        return best;
+    return down[current] ? -1 : current;
+}
@@ -0,0 +1,278 @@
+/*
+ * probeaead.c - AEAD handshake of the health probes
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <mbedtls/gcm.h>
+#include <sodium.h>
+
+#include "aead.h"
+#include "probeaead.h"
+#include "utils.h"
+
+#define PROBE_AEAD_NONCE_LEN    12
+#define PROBE_AEAD_TAG_LEN      16
+#define PROBE_AEAD_SALT_MAX     32
+#define PROBE_AEAD_HEAD_LEN     (CHUNK_SIZE_LEN + PROBE_AEAD_TAG_LEN)
+
+// The reply side of one probe
+typedef struct probe_aead_reply {
+    int method;
+    size_t key_len;
+    mbedtls_gcm_context gcm;
+    uint8_t subkey[PROBE_AEAD_SALT_MAX];
+    uint8_t nonce[PROBE_AEAD_NONCE_LEN];
+    size_t need;                // bytes up to the end of the first chunk, once known
+    size_t len;
+    uint8_t buf[PROBE_AEAD_SALT_MAX + PROBE_AEAD_HEAD_LEN + CHUNK_SIZE_MASK + PROBE_AEAD_TAG_LEN];
+} probe_aead_reply_t;
+
+static size_t
+probe_aead_key_len(int method)
+{
+    switch (method) {
+    case AES_128_GCM:
+        return 16;
+    case AES_192_GCM:
+        return 24;
+    case AES_256_GCM:
+    case CHACHA20_IETF_POLY1305:
+        return 32;
+    default:
+        return 0;
+    }
+}
+
+static int
+probe_aead_setkey(int method, mbedtls_gcm_context *gcm, const uint8_t *key, size_t key_len)
+{
+    if (method == CHACHA20_IETF_POLY1305)
+        return CRYPTO_OK;
+    return mbedtls_gcm_setkey(gcm, MBEDTLS_CIPHER_ID_AES, key, (unsigned int)key_len * 8)
+           == 0 ? CRYPTO_OK : CRYPTO_ERROR;
+}
+
+// c = E(m) | tag, then the nonce moves on
+static int
+probe_aead_seal(int method, mbedtls_gcm_context *gcm, const uint8_t *key, uint8_t *nonce,
+                const uint8_t *m, size_t mlen, uint8_t *c)
+{
+    int ret;
+    if (method == CHACHA20_IETF_POLY1305) {
+        unsigned long long tlen = 0;
+        ret = crypto_aead_chacha20poly1305_ietf_encrypt_detached(c, c + mlen, &tlen, m, mlen,
+                                                                 NULL, 0, NULL, nonce, key);
+    } else {
+        ret = mbedtls_gcm_crypt_and_tag(gcm, MBEDTLS_GCM_ENCRYPT, mlen,
+                                        nonce, PROBE_AEAD_NONCE_LEN, NULL, 0,
+                                        m, c, PROBE_AEAD_TAG_LEN, c + mlen);
+    }
+    sodium_increment(nonce, PROBE_AEAD_NONCE_LEN);
+    return ret == 0 ? CRYPTO_OK : CRYPTO_ERROR;
+}
+
+// Opens c = E(m) | tag of mlen plaintext bytes in place
+static int
+probe_aead_open(int method, mbedtls_gcm_context *gcm, const uint8_t *key, uint8_t *nonce,
+                uint8_t *c, size_t mlen)
+{
+    int ret;
+    if (method == CHACHA20_IETF_POLY1305) {
+        ret = crypto_aead_chacha20poly1305_ietf_decrypt_detached(c, NULL, c, mlen, c + mlen,
+                                                                 NULL, 0, nonce, key);
+    } else {
+        ret = mbedtls_gcm_auth_decrypt(gcm, mlen, nonce, PROBE_AEAD_NONCE_LEN, NULL, 0,
+                                       c + mlen, PROBE_AEAD_TAG_LEN, c, c);
+    }
+    sodium_increment(nonce, PROBE_AEAD_NONCE_LEN);
+    return ret == 0 ? CRYPTO_OK : CRYPTO_ERROR;
+}
+
+int
+probe_aead_init(probe_aead_t *aead, int method, const uint8_t *key, size_t key_len,
+                const char *host, uint16_t port, const char *payload, size_t payload_len)
+{
+    memset(aead, 0, sizeof(probe_aead_t));
+    if (key_len == 0 || probe_aead_key_len(method) != key_len) {
+        LOGE("probe: unsupported cipher");
+        return -1;
+    }
+
+    // SOCKS5 style address header, as local.c sends it
+    uint8_t *p        = aead->request;
+    size_t host_len   = strlen(host);
+    struct in_addr v4;
+    struct in6_addr v6;
+    if (inet_pton(AF_INET, host, &v4) == 1) {
+        *p++ = 1;
+        memcpy(p, &v4, sizeof(v4));
+        p += sizeof(v4);
+    } else if (inet_pton(AF_INET6, host, &v6) == 1) {
+        *p++ = 4;
+        memcpy(p, &v6, sizeof(v6));
+        p += sizeof(v6);
+    } else if (host_len > 0 && host_len <= 255) {
+        *p++ = 3;
+        *p++ = (uint8_t)host_len;
+        memcpy(p, host, host_len);
+        p += host_len;
+    } else {
+        LOGE("probe: bad target %s", host);
+        return -1;
+    }
+    *p++ = port >> 8;
+    *p++ = port & 0xff;
+
+    if ((size_t)(p - aead->request) + payload_len > PROBE_AEAD_MAX_REQUEST) {
+        LOGE("probe: request too long");
+        return -1;
+    }
+    if (payload_len > 0)
+        memcpy(p, payload, payload_len);
+    aead->request_len = (p - aead->request) + payload_len;
+
+    if (hkdf_psk_init(&aead->psk, key, key_len,
+                      (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN) != 0)
+        return -1;
+    aead->method  = method;
+    aead->key_len = key_len;
+    return 0;
+}
+
+void
+probe_aead_release(probe_aead_t *aead)
+{
+    hkdf_psk_release(&aead->psk);
+    sodium_memzero(aead, sizeof(probe_aead_t));
+}
+
+probe_handshake_t
+probe_aead_handshake(probe_aead_t *aead)
+{
+    probe_handshake_t handshake = {
+        .request  = probe_aead_request,
+        .response = probe_aead_response,
+        .release  = probe_aead_free,
+        .data     = aead
+    };
+    return handshake;
+}
+
+ssize_t
+probe_aead_request(void *data, int server, char *buf, size_t size, void **ctx)
+{
+    probe_aead_t *aead = data;
+    size_t key_len     = aead->key_len;
+    size_t len         = key_len + PROBE_AEAD_HEAD_LEN + aead->request_len + PROBE_AEAD_TAG_LEN;
+
+    (void)server;
+
+    if (key_len == 0 || len > size)
+        return -1;
+
+    uint8_t *out = (uint8_t *)buf;
+    uint8_t subkey[PROBE_AEAD_SALT_MAX];
+    uint8_t nonce[PROBE_AEAD_NONCE_LEN] = { 0 };
+    uint8_t head[CHUNK_SIZE_LEN]        = { aead->request_len >> 8, aead->request_len & 0xff };
+    mbedtls_gcm_context gcm;
+
+    randombytes_buf(out, key_len);
+    if (hkdf_psk_derive(&aead->psk, out, key_len, subkey, key_len) != 0)
+        return -1;
+
+    mbedtls_gcm_init(&gcm);
+    int ret = probe_aead_setkey(aead->method, &gcm, subkey, key_len);
+    if (ret == CRYPTO_OK)
+        ret = probe_aead_seal(aead->method, &gcm, subkey, nonce,
+                              head, CHUNK_SIZE_LEN, out + key_len);
+    if (ret == CRYPTO_OK)
+        ret = probe_aead_seal(aead->method, &gcm, subkey, nonce,
+                              aead->request, aead->request_len,
+                              out + key_len + PROBE_AEAD_HEAD_LEN);
+    mbedtls_gcm_free(&gcm);
+    sodium_memzero(subkey, sizeof(subkey));
+    if (ret != CRYPTO_OK)
+        return -1;
+
+    probe_aead_reply_t *reply = ss_malloc(sizeof(probe_aead_reply_t));
+    memset(reply, 0, sizeof(probe_aead_reply_t));
+    reply->method  = aead->method;
+    reply->key_len = key_len;
+    mbedtls_gcm_init(&reply->gcm);
+    *ctx = reply;
+
+    return len;
+}
+
+int
+probe_aead_response(void *data, void *ctx, const char *buf, size_t len)
+{
+    probe_aead_t *aead        = data;
+    probe_aead_reply_t *reply = ctx;
+    size_t key_len            = reply->key_len;
+    size_t head_end           = key_len + PROBE_AEAD_HEAD_LEN;
+
+    for (;;) {
+        // Anything past the first chunk is not needed
+        size_t want = (reply->need ? reply->need : head_end) - reply->len;
+        size_t n    = len < want ? len : want;
+        memcpy(reply->buf + reply->len, buf, n);
+        reply->len += n;
+        buf        += n;
+        len        -= n;
+
+        if (reply->need != 0)
+            break;
+        if (reply->len < head_end)
+            return 0;
+
+        if (hkdf_psk_derive(&aead->psk, reply->buf, key_len, reply->subkey, key_len) != 0
+            || probe_aead_setkey(reply->method, &reply->gcm, reply->subkey, key_len) != CRYPTO_OK
+            || probe_aead_open(reply->method, &reply->gcm, reply->subkey, reply->nonce,
+                               reply->buf + key_len, CHUNK_SIZE_LEN) != CRYPTO_OK)
+            return -1;
+        size_t plen = (reply->buf[key_len] << 8 | reply->buf[key_len + 1]) & CHUNK_SIZE_MASK;
+        if (plen == 0)
+            return -1;
+        reply->need = head_end + plen + PROBE_AEAD_TAG_LEN;
+    }
+
+    if (reply->len < reply->need)
+        return 0;
+    if (probe_aead_open(reply->method, &reply->gcm, reply->subkey, reply->nonce,
+                        reply->buf + head_end, reply->need - head_end - PROBE_AEAD_TAG_LEN)
+        != CRYPTO_OK)
+        return -1;
+    return 1;
+}
+
+void
+probe_aead_free(void *data, void *ctx)
+{
+    probe_aead_reply_t *reply = ctx;
+
+    (void)data;
+    if (reply == NULL)
+        return;
+    mbedtls_gcm_free(&reply->gcm);
+    sodium_memzero(reply->subkey, sizeof(reply->subkey));
+    ss_free(reply);
+}
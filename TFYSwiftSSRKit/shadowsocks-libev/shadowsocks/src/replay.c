@@ -0,0 +1,320 @@
+/*
+ * replay.c - Sharded, generation-rotating salt replay filter
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sodium.h>
+
+#include "replay.h"
+#include "utils.h"
+
+#define REPLAY_GENERATIONS 3
+#define REPLAY_MAX_HASHES  16
+#define CACHE_LINE         64
+
+/*
+ * Generation slots are indexed by epoch modulo 3: epoch % 3 is written,
+ * (epoch + 2) % 3 is the previous generation that is still checked, and
+ * (epoch + 1) % 3 is cleared by whoever advances the epoch so that it is
+ * empty by the time it becomes current.
+ */
+typedef struct replay_shard {
+    _Atomic uint64_t epoch;
+    _Atomic int64_t born;
+    _Atomic uint64_t count[REPLAY_GENERATIONS];
+    _Atomic uint64_t *bits[REPLAY_GENERATIONS];
+    _Atomic uint64_t checks;
+    _Atomic uint64_t adds;
+    _Atomic uint64_t hits;
+    _Atomic uint64_t rotations;
+} __attribute__((aligned(CACHE_LINE))) replay_shard_t;
+
+struct replay_filter {
+    replay_shard_t *shards;
+    int shard_bits;
+    int nshards;
+    int hashes;
+    int rotate_interval;    // 0: rotate on capacity only
+    uint64_t bits;          // bits per generation per shard
+    uint64_t words;
+    uint64_t capacity;      // entries per generation per shard
+    uint8_t key[crypto_shorthash_siphashx24_KEYBYTES];
+};
+
+static int64_t
+replay_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec;
+}
+
+static int
+round_pow2_bits(int n)
+{
+    int bits = 0;
+    while ((1 << bits) < n && bits < 8)
+        bits++;
+    return bits;
+}
+
+replay_filter_t *
+replay_filter_new(const replay_config_t *config)
+{
+    size_t budget   = REPLAY_DEFAULT_MEM_BUDGET;
+    int shards      = REPLAY_DEFAULT_SHARDS;
+    double error    = REPLAY_DEFAULT_ERROR;
+    int rotate      = 0;
+
+    if (config != NULL) {
+        if (config->mem_budget > 0)
+            budget = config->mem_budget;
+        if (config->shards > 0)
+            shards = config->shards;
+        if (config->error > 0 && config->error < 1)
+            error = config->error;
+        if (config->rotate_interval > 0)
+            rotate = config->rotate_interval;
+    }
+    if (shards > REPLAY_MAX_SHARDS)
+        shards = REPLAY_MAX_SHARDS;
+
+    if (sodium_init() < 0)
+        return NULL;
+
+    replay_filter_t *filter = ss_malloc(sizeof(replay_filter_t));
+    memset(filter, 0, sizeof(replay_filter_t));
+
+    filter->shard_bits      = round_pow2_bits(shards);
+    filter->nshards         = 1 << filter->shard_bits;
+    filter->rotate_interval = rotate;
+
+    // Split the budget evenly, at least one 64-bit word per generation
+    filter->words = budget / (sizeof(uint64_t) * REPLAY_GENERATIONS * filter->nshards);
+    if (filter->words == 0)
+        filter->words = 1;
+    filter->bits = filter->words * 64;
+
+    // n = -m * ln(2)^2 / ln(p), k = -log2(p)
+    double ln2 = log(2.0);
+    filter->capacity = (uint64_t)(-(double)filter->bits * ln2 * ln2 / log(error));
+    if (filter->capacity == 0)
+        filter->capacity = 1;
+    filter->hashes = (int)ceil(-log(error) / ln2);
+    if (filter->hashes < 1)
+        filter->hashes = 1;
+    if (filter->hashes > REPLAY_MAX_HASHES)
+        filter->hashes = REPLAY_MAX_HASHES;
+
+    if (posix_memalign((void **)&filter->shards, CACHE_LINE,
+                       sizeof(replay_shard_t) * filter->nshards) != 0) {
+        ss_free(filter);
+        return NULL;
+    }
+    memset(filter->shards, 0, sizeof(replay_shard_t) * filter->nshards);
+
+    int64_t now = replay_now();
+    for (int i = 0; i < filter->nshards; i++) {
+        replay_shard_t *shard = &filter->shards[i];
+        for (int g = 0; g < REPLAY_GENERATIONS; g++) {
+            shard->bits[g] = calloc(filter->words, sizeof(uint64_t));
+            if (shard->bits[g] == NULL) {
+                replay_filter_free(filter);
+                return NULL;
+            }
+        }
+        atomic_store(&shard->born, now);
+    }
+
+    randombytes_buf(filter->key, sizeof(filter->key));
+
+    return filter;
+}
+
+void
+replay_filter_free(replay_filter_t *filter)
+{
+    if (filter == NULL)
+        return;
+
+    if (filter->shards != NULL) {
+        for (int i = 0; i < filter->nshards; i++)
+            for (int g = 0; g < REPLAY_GENERATIONS; g++)
+                free((void *)filter->shards[i].bits[g]);
+        free(filter->shards);
+    }
+    sodium_memzero(filter->key, sizeof(filter->key));
+    ss_free(filter);
+}
+
+/*
+ * A keyed 128-bit SipHash keeps clients from crafting salts that pile up
+ * in one shard or collide on purpose. The top shard_bits of the second
+ * word pick the shard and the rest of it is the double hashing step, so
+ * the salts of one shard do not all share the high bits of their step.
+ */
+static replay_shard_t *
+replay_hash(replay_filter_t *filter, const void *buffer, int len,
+            uint64_t *h1, uint64_t *h2)
+{
+    uint64_t h[2];
+    crypto_shorthash_siphashx24((unsigned char *)h, buffer, len, filter->key);
+    *h1 = h[0];
+    *h2 = (h[1] & (UINT64_MAX >> filter->shard_bits)) | 1;
+    uint64_t idx = filter->shard_bits ? h[1] >> (64 - filter->shard_bits) : 0;
+    return &filter->shards[idx];
+}
+
+static int
+generation_test(_Atomic uint64_t *bits, const replay_filter_t *filter,
+                uint64_t h1, uint64_t h2)
+{
+    for (int i = 0; i < filter->hashes; i++) {
+        uint64_t bit = (h1 + i * h2) % filter->bits;
+        uint64_t word = atomic_load_explicit(&bits[bit >> 6], memory_order_relaxed);
+        if (!(word & (1ULL << (bit & 63))))
+            return 0;
+    }
+    return 1;
+}
+
+static int
+generation_set(_Atomic uint64_t *bits, const replay_filter_t *filter,
+               uint64_t h1, uint64_t h2)
+{
+    int present = 1;
+    for (int i = 0; i < filter->hashes; i++) {
+        uint64_t bit  = (h1 + i * h2) % filter->bits;
+        uint64_t mask = 1ULL << (bit & 63);
+        uint64_t old  = atomic_fetch_or_explicit(&bits[bit >> 6], mask,
+                                                 memory_order_relaxed);
+        if (!(old & mask))
+            present = 0;
+    }
+    return present;
+}
+
+static void
+shard_maybe_rotate(replay_filter_t *filter, replay_shard_t *shard, uint64_t epoch)
+{
+    int cur     = epoch % REPLAY_GENERATIONS;
+    int64_t now = replay_now();
+    int64_t age = now - atomic_load_explicit(&shard->born, memory_order_relaxed);
+
+    if (atomic_load_explicit(&shard->count[cur], memory_order_relaxed) < filter->capacity
+        && (filter->rotate_interval == 0 || age < filter->rotate_interval))
+        return;
+
+    // Only the thread that wins the epoch bump does the clearing
+    if (!atomic_compare_exchange_strong(&shard->epoch, &epoch, epoch + 1))
+        return;
+
+    int next = (epoch + 2) % REPLAY_GENERATIONS;
+    memset((void *)shard->bits[next], 0, filter->words * sizeof(uint64_t));
+    atomic_store_explicit(&shard->count[next], 0, memory_order_relaxed);
+    atomic_store_explicit(&shard->born, now, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->rotations, 1, memory_order_relaxed);
+}
+
+int
+replay_filter_check(replay_filter_t *filter, const void *buffer, int len)
+{
+    uint64_t h1, h2;
+    replay_shard_t *shard = replay_hash(filter, buffer, len, &h1, &h2);
+    uint64_t epoch        = atomic_load(&shard->epoch);
+    int cur               = epoch % REPLAY_GENERATIONS;
+    int prev              = (epoch + 2) % REPLAY_GENERATIONS;
+
+    atomic_fetch_add_explicit(&shard->checks, 1, memory_order_relaxed);
+
+    int present = generation_test(shard->bits[cur], filter, h1, h2)
+                  || generation_test(shard->bits[prev], filter, h1, h2);
+    if (present)
+        atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+
+    return present;
+}
+
+int
+replay_filter_add(replay_filter_t *filter, const void *buffer, int len)
+{
+    uint64_t h1, h2;
+    replay_shard_t *shard = replay_hash(filter, buffer, len, &h1, &h2);
+    uint64_t epoch        = atomic_load(&shard->epoch);
+    int cur               = epoch % REPLAY_GENERATIONS;
+    int prev              = (epoch + 2) % REPLAY_GENERATIONS;
+
+    atomic_fetch_add_explicit(&shard->adds, 1, memory_order_relaxed);
+
+    int present = generation_set(shard->bits[cur], filter, h1, h2);
+    if (!present) {
+        present = generation_test(shard->bits[prev], filter, h1, h2);
+        atomic_fetch_add_explicit(&shard->count[cur], 1, memory_order_relaxed);
+        shard_maybe_rotate(filter, shard, epoch);
+    }
+    if (present)
+        atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+
+    return present;
+}
+
+static double
+generation_fp_rate(const replay_filter_t *filter, uint64_t count)
+{
+    double fill = 1.0 - exp(-(double)filter->hashes * count / filter->bits);
+    return pow(fill, filter->hashes);
+}
+
+void
+replay_filter_stats(replay_filter_t *filter, replay_stats_t *stats)
+{
+    memset(stats, 0, sizeof(replay_stats_t));
+
+    stats->shards   = filter->nshards;
+    stats->hashes   = filter->hashes;
+    stats->capacity = filter->capacity;
+    stats->bytes    = filter->words * sizeof(uint64_t)
+                      * REPLAY_GENERATIONS * filter->nshards;
+
+    double sum = 0;
+    for (int i = 0; i < filter->nshards; i++) {
+        replay_shard_t *shard = &filter->shards[i];
+        uint64_t epoch        = atomic_load(&shard->epoch);
+        uint64_t cur          = atomic_load(&shard->count[epoch % REPLAY_GENERATIONS]);
+        uint64_t prev         = atomic_load(&shard->count[(epoch + 2) % REPLAY_GENERATIONS]);
+
+        // A lookup is a false positive if either live generation matches
+        double p = 1.0 - (1.0 - generation_fp_rate(filter, cur))
+                   * (1.0 - generation_fp_rate(filter, prev));
+        sum += p;
+        if (p > stats->fp_rate_max)
+            stats->fp_rate_max = p;
+
+        stats->checks    += atomic_load(&shard->checks);
+        stats->adds      += atomic_load(&shard->adds);
+        stats->hits      += atomic_load(&shard->hits);
+        stats->rotations += atomic_load(&shard->rotations);
+    }
+    stats->fp_rate = sum / filter->nshards;
+}
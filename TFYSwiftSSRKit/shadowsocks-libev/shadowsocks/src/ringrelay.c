@@ -0,0 +1,484 @@
+/*
+ * ringrelay.c - Relay between two sockets over fixed rings with watermarks
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ringrelay.h"
+#include "slab.h"
+#include "utils.h"
+
+typedef struct ring_dir {
+    ring_relay_t *relay;
+    int src;
+    int dst;
+    byte_ring_t ring;
+    ev_io rio;
+    ev_io wio;
+    mem_budget_reader_t reader;
+    ring_transform_cb transform;
+    size_t high;
+    size_t low;
+    int reading;
+    int eof;
+    int done;
+    ring_relay_stats_t stats;
+} ring_dir_t;
+
+struct ring_relay {
+    struct ev_loop *loop;
+    ring_dir_t up;
+    ring_dir_t down;
+    size_t reserve;
+    mem_budget_loop_t *budget;
+    char *scratch;          // transform input, one ring worth
+    size_t scratch_size;
+    ring_relay_close_cb close_cb;
+    void *data;
+    int closed;
+};
+
+int
+byte_ring_init(byte_ring_t *ring, size_t capacity)
+{
+    memset(ring, 0, sizeof(byte_ring_t));
+    ring->data = slab_alloc(capacity, NULL);
+    if (ring->data == NULL)
+        return -1;
+    ring->capacity = capacity;
+    return 0;
+}
+
+void
+byte_ring_release(byte_ring_t *ring)
+{
+    slab_free(ring->data);
+    memset(ring, 0, sizeof(byte_ring_t));
+}
+
+int
+byte_ring_free_iov(const byte_ring_t *ring, struct iovec iov[2])
+{
+    size_t space = byte_ring_space(ring);
+    if (space == 0)
+        return 0;
+
+    size_t tail  = (ring->head + ring->len) % ring->capacity;
+    size_t first = min(space, ring->capacity - tail);
+    iov[0].iov_base = ring->data + tail;
+    iov[0].iov_len  = first;
+    if (first == space)
+        return 1;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len  = space - first;
+    return 2;
+}
+
+int
+byte_ring_data_iov(const byte_ring_t *ring, struct iovec iov[2])
+{
+    if (ring->len == 0)
+        return 0;
+
+    size_t first = min(ring->len, ring->capacity - ring->head);
+    iov[0].iov_base = ring->data + ring->head;
+    iov[0].iov_len  = first;
+    if (first == ring->len)
+        return 1;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len  = ring->len - first;
+    return 2;
+}
+
+void
+byte_ring_produce(byte_ring_t *ring, size_t n)
+{
+    ring->len += n;
+}
+
+void
+byte_ring_consume(byte_ring_t *ring, size_t n)
+{
+    ring->len -= n;
+    // Rewind when empty so the next read is a single iovec
+    ring->head = ring->len == 0 ? 0 : (ring->head + n) % ring->capacity;
+}
+
+size_t
+byte_ring_put(byte_ring_t *ring, const void *src, size_t len)
+{
+    struct iovec iov[2];
+    int cnt     = byte_ring_free_iov(ring, iov);
+    size_t done = 0;
+
+    for (int i = 0; i < cnt && done < len; i++) {
+        size_t n = min(iov[i].iov_len, len - done);
+        memcpy(iov[i].iov_base, (const char *)src + done, n);
+        done += n;
+    }
+    byte_ring_produce(ring, done);
+    return done;
+}
+
+ssize_t
+byte_ring_readv(byte_ring_t *ring, int fd)
+{
+    struct iovec iov[2];
+    int cnt = byte_ring_free_iov(ring, iov);
+    if (cnt == 0)
+        return 0;
+
+    ssize_t r = readv(fd, iov, cnt);
+    if (r > 0)
+        byte_ring_produce(ring, (size_t)r);
+    return r;
+}
+
+ssize_t
+byte_ring_writev(byte_ring_t *ring, int fd)
+{
+    struct iovec iov[2];
+    int cnt = byte_ring_data_iov(ring, iov);
+    if (cnt == 0)
+        return 0;
+
+    ssize_t s = writev(fd, iov, cnt);
+    if (s > 0)
+        byte_ring_consume(ring, (size_t)s);
+    return s;
+}
+
+static void
+ring_relay_fail(ring_relay_t *relay, int error)
+{
+    if (relay->closed)
+        return;
+    relay->closed = 1;
+
+    ring_dir_t *dirs[2] = { &relay->up, &relay->down };
+    for (int i = 0; i < 2; i++) {
+        if (relay->budget != NULL)
+            mem_budget_io_stop(&dirs[i]->reader);
+        else
+            ev_io_stop(relay->loop, &dirs[i]->rio);
+        ev_io_stop(relay->loop, &dirs[i]->wio);
+        dirs[i]->reading = 0;
+    }
+
+    if (relay->close_cb != NULL)
+        relay->close_cb(relay->data, error);
+}
+
+static void
+ring_dir_read_start(ring_dir_t *dir)
+{
+    if (dir->reading || dir->eof)
+        return;
+    dir->reading = 1;
+    if (dir->relay->budget != NULL)
+        mem_budget_io_start(&dir->reader);
+    else
+        ev_io_start(dir->relay->loop, &dir->rio);
+}
+
+static void
+ring_dir_read_stop(ring_dir_t *dir)
+{
+    if (!dir->reading)
+        return;
+    dir->reading = 0;
+    if (dir->relay->budget != NULL)
+        mem_budget_io_stop(&dir->reader);
+    else
+        ev_io_stop(dir->relay->loop, &dir->rio);
+}
+
+// Returns -1 when this closed the relay
+static int
+ring_dir_finish(ring_dir_t *dir)
+{
+    ring_relay_t *relay = dir->relay;
+
+    dir->done = 1;
+    ev_io_stop(relay->loop, &dir->wio);
+    shutdown(dir->dst, SHUT_WR);
+
+    if (relay->up.done && relay->down.done) {
+        relay->closed = 1;
+        if (relay->close_cb != NULL)
+            relay->close_cb(relay->data, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write what the ring holds. Returns -1 when the relay has been closed,
+ * in which case it may already be freed.
+ */
+static int
+ring_dir_flush(ring_dir_t *dir)
+{
+    ring_relay_t *relay = dir->relay;
+
+    if (dir->ring.len > 0) {
+        ssize_t s = byte_ring_writev(&dir->ring, dir->dst);
+        if (s < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                ring_relay_fail(relay, errno);
+                return -1;
+            }
+        } else {
+            dir->stats.writes++;
+            dir->stats.bytes += (uint64_t)s;
+        }
+    }
+
+    if (dir->ring.len > 0) {
+        ev_io_start(relay->loop, &dir->wio);
+    } else {
+        ev_io_stop(relay->loop, &dir->wio);
+        if (dir->eof)
+            return ring_dir_finish(dir);
+    }
+
+    if (relay->budget != NULL)
+        mem_budget_reader_queued(&dir->reader, dir->ring.len);
+    if (!dir->reading && dir->ring.len <= dir->low)
+        ring_dir_read_start(dir);
+    return 0;
+}
+
+static ssize_t
+ring_dir_fill(ring_dir_t *dir)
+{
+    ring_relay_t *relay = dir->relay;
+    size_t space        = byte_ring_space(&dir->ring);
+    size_t room         = space;
+
+    if (dir->transform != NULL) {
+        room = space > relay->reserve ? space - relay->reserve : 0;
+        room = min(room, relay->scratch_size);
+    }
+    if (room == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    if (dir->transform == NULL)
+        return byte_ring_readv(&dir->ring, dir->src);
+
+    ssize_t r = recv(dir->src, relay->scratch, room, 0);
+    if (r > 0 && dir->transform(relay->data, relay->scratch, (size_t)r, &dir->ring) == -1) {
+        errno = EPROTO;
+        return -2;
+    }
+    return r;
+}
+
+static void
+ring_dir_read_cb(EV_P_ ev_io *w, int revents)
+{
+    ring_dir_t *dir     = (ring_dir_t *)w->data;
+    ring_relay_t *relay = dir->relay;
+
+    ssize_t r = ring_dir_fill(dir);
+    if (r == 0) {
+        dir->eof = 1;
+        ring_dir_read_stop(dir);
+    } else if (r < 0) {
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        if (r == -1 && errno == ENOBUFS) {
+            // Full ring, the writer restarts reading at the low mark
+            ring_dir_read_stop(dir);
+            return;
+        }
+        ring_relay_fail(relay, errno);
+        return;
+    } else {
+        dir->stats.reads++;
+    }
+
+    // Write straight away; the write watcher only covers what is left
+    if (ring_dir_flush(dir) == -1)
+        return;
+
+    if (dir->reading && dir->ring.len >= dir->high) {
+        ring_dir_read_stop(dir);
+        dir->stats.throttled++;
+    }
+}
+
+static void
+ring_dir_write_cb(EV_P_ ev_io *w, int revents)
+{
+    ring_dir_flush((ring_dir_t *)w->data);
+}
+
+static int
+ring_dir_init(ring_relay_t *relay, ring_dir_t *dir, int src, int dst,
+              const ring_relay_config_t *config, ring_transform_cb transform)
+{
+    size_t size = config->ring_size ? config->ring_size : RING_RELAY_DEFAULT_SIZE;
+    double high = config->high_mark > 0 ? config->high_mark : RING_RELAY_DEFAULT_HIGH;
+    double low  = config->low_mark > 0 ? config->low_mark : RING_RELAY_DEFAULT_LOW;
+
+    dir->relay     = relay;
+    dir->src       = src;
+    dir->dst       = dst;
+    dir->transform = transform;
+
+    dir->high = (size_t)(size * min(high, 1.0));
+    if (transform != NULL && dir->high > size - min(size, relay->reserve))
+        dir->high = size - min(size, relay->reserve);
+    dir->low = min((size_t)(size * low), dir->high);
+
+    // Reading would never start
+    if (dir->high == 0) {
+        LOGE("ring_relay: a %zu byte ring leaves no room to read with reserve %zu",
+             size, transform != NULL ? relay->reserve : 0);
+        errno = EINVAL;
+        return -1;
+    }
+    if (byte_ring_init(&dir->ring, size) == -1)
+        return -1;
+
+    ev_io_init(&dir->rio, ring_dir_read_cb, src, EV_READ);
+    ev_io_init(&dir->wio, ring_dir_write_cb, dst, EV_WRITE);
+    dir->rio.data = dir;
+    dir->wio.data = dir;
+    if (relay->budget != NULL)
+        mem_budget_reader_init(&dir->reader, relay->budget, &dir->rio);
+    return 0;
+}
+
+ring_relay_t *
+ring_relay_new(struct ev_loop *loop, int client_fd, int remote_fd,
+               const ring_relay_config_t *config,
+               ring_relay_close_cb close_cb, void *data)
+{
+    ring_relay_config_t defaults;
+    if (config == NULL) {
+        memset(&defaults, 0, sizeof(ring_relay_config_t));
+        config = &defaults;
+    }
+
+    ring_relay_t *relay = ss_malloc(sizeof(ring_relay_t));
+    memset(relay, 0, sizeof(ring_relay_t));
+    relay->loop     = loop;
+    relay->reserve  = config->reserve;
+    relay->budget   = config->budget;
+    relay->close_cb = close_cb;
+    relay->data     = data;
+
+    if (ring_dir_init(relay, &relay->up, client_fd, remote_fd, config, config->up) == -1
+        || ring_dir_init(relay, &relay->down, remote_fd, client_fd, config, config->down) == -1) {
+        ring_relay_free(relay);
+        return NULL;
+    }
+
+    if (config->up != NULL || config->down != NULL) {
+        relay->scratch_size = relay->up.ring.capacity;
+        relay->scratch      = slab_alloc(relay->scratch_size, NULL);
+        if (relay->scratch == NULL) {
+            ring_relay_free(relay);
+            return NULL;
+        }
+    }
+
+    return relay;
+}
+
+void
+ring_relay_start(ring_relay_t *relay)
+{
+    ring_dir_t *dirs[2] = { &relay->up, &relay->down };
+    for (int i = 0; i < 2; i++) {
+        if (relay->closed)
+            return;
+        if (dirs[i]->ring.len > 0)
+            ev_io_start(relay->loop, &dirs[i]->wio);
+        if (dirs[i]->ring.len < dirs[i]->high)
+            ring_dir_read_start(dirs[i]);
+    }
+}
+
+void
+ring_relay_free(ring_relay_t *relay)
+{
+    if (relay == NULL)
+        return;
+
+    ring_dir_t *dirs[2] = { &relay->up, &relay->down };
+    for (int i = 0; i < 2; i++) {
+        if (dirs[i]->relay == NULL)
+            continue;
+        if (relay->budget != NULL)
+            mem_budget_reader_release(&dirs[i]->reader);
+        else
+            ev_io_stop(relay->loop, &dirs[i]->rio);
+        ev_io_stop(relay->loop, &dirs[i]->wio);
+        byte_ring_release(&dirs[i]->ring);
+    }
+    slab_free(relay->scratch);
+    ss_free(relay);
+}
+
+static int
+ring_dir_push(ring_dir_t *dir, const char *buf, size_t len)
+{
+    if (dir->transform != NULL) {
+        if (byte_ring_space(&dir->ring) < len + dir->relay->reserve)
+            return -1;
+        return dir->transform(dir->relay->data, buf, len, &dir->ring);
+    }
+    if (byte_ring_space(&dir->ring) < len)
+        return -1;
+    byte_ring_put(&dir->ring, buf, len);
+    return 0;
+}
+
+int
+ring_relay_push_up(ring_relay_t *relay, const char *buf, size_t len)
+{
+    return ring_dir_push(&relay->up, buf, len);
+}
+
+int
+ring_relay_push_down(ring_relay_t *relay, const char *buf, size_t len)
+{
+    return ring_dir_push(&relay->down, buf, len);
+}
+
+void
+ring_relay_stats(const ring_relay_t *relay, ring_relay_stats_t *up,
+                 ring_relay_stats_t *down)
+{
+    if (up != NULL) {
+        *up         = relay->up.stats;
+        up->pending = relay->up.ring.len;
+    }
+    if (down != NULL) {
+        *down         = relay->down.stats;
+        down->pending = relay->down.ring.len;
+    }
+}
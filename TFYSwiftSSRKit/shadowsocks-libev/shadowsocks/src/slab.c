@@ -0,0 +1,539 @@
+/*
+ * slab.c - Size-class slab allocator with per-thread caches
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "membudget.h"
+#include "slab.h"
+#include "utils.h"
+
+#define SLAB_MAGIC          0x51ab
+#define SLAB_NO_CLASS       -1
+#define SLAB_SPARE_PAGES    1
+#define SLAB_CACHE_MAX      16
+#define SLAB_PAGE_ALIGN     64
+
+typedef struct slab_page slab_page_t;
+
+/*
+ * In front of every block. page is NULL for blocks that came straight from
+ * ss_malloc, which are freed the same way.
+ */
+typedef struct slab_header {
+    _Alignas(16) slab_page_t *page;
+    uint32_t size;
+    int16_t cls;
+    uint16_t magic;
+} slab_header_t;
+
+#define SLAB_HEADER_LEN sizeof(slab_header_t)
+
+struct slab_page {
+    slab_page_t *prev;              // pages with free blocks
+    slab_page_t *next;
+    void *free;                     // free payloads, linked through their first word
+    uint32_t nfree;
+    int cls;
+};
+
+#define SLAB_PAGE_HEADER_LEN \
+    ((sizeof(slab_page_t) + SLAB_PAGE_ALIGN - 1) & ~(size_t)(SLAB_PAGE_ALIGN - 1))
+
+typedef struct slab_class {
+    pthread_mutex_t lock;
+    size_t size;
+    uint32_t per_page;
+    int cache_max;                  // per thread, at most SLAB_CACHE_MAX
+    slab_page_t *partial;
+    size_t pages;
+    size_t empty_pages;
+    size_t in_use;
+    atomic_uint_fast64_t allocs;
+    atomic_uint_fast64_t frees;
+    atomic_uint_fast64_t cache_hits;
+} slab_class_t;
+
+typedef struct slab_cache {
+    int count[SLAB_CLASS_NUM];
+    void *blocks[SLAB_CLASS_NUM][SLAB_CACHE_MAX];
+} slab_cache_t;
+
+// 64 KB pages for the small class, 128 KB and 256 KB for the others
+static slab_class_t slab_classes[SLAB_CLASS_NUM] = {
+    { .lock = PTHREAD_MUTEX_INITIALIZER, .size = SLAB_CLASS_SMALL,  .per_page = 32, .cache_max = 16 },
+    { .lock = PTHREAD_MUTEX_INITIALIZER, .size = SLAB_CLASS_MEDIUM, .per_page = 8,  .cache_max = 4  },
+    { .lock = PTHREAD_MUTEX_INITIALIZER, .size = SLAB_CLASS_LARGE,  .per_page = 4,  .cache_max = 2  }
+};
+
+static atomic_size_t slab_cap = SLAB_DEFAULT_CAP;
+static atomic_size_t slab_reserved;
+static atomic_uint_fast64_t slab_oversize;
+static atomic_uint_fast64_t slab_overflow;
+
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+static __thread slab_cache_t *slab_tcache;
+
+static pthread_once_t slab_account_once = PTHREAD_ONCE_INIT;
+static mem_account_t *slab_account;
+
+static size_t
+slab_stride(const slab_class_t *c)
+{
+    return SLAB_HEADER_LEN + c->size;
+}
+
+static size_t
+slab_page_bytes(const slab_class_t *c)
+{
+    return SLAB_PAGE_HEADER_LEN + c->per_page * slab_stride(c);
+}
+
+static void
+slab_cache_destroy(void *arg)
+{
+    slab_cache_t *cache = arg;
+    slab_tcache = cache;
+    slab_thread_flush();
+    slab_tcache = NULL;
+    free(cache);
+}
+
+static void
+slab_key_init(void)
+{
+    pthread_key_create(&slab_key, slab_cache_destroy);
+}
+
+static slab_cache_t *
+slab_get_cache(void)
+{
+    if (slab_tcache != NULL)
+        return slab_tcache;
+
+    pthread_once(&slab_once, slab_key_init);
+    slab_tcache = calloc(1, sizeof(slab_cache_t));
+    if (slab_tcache != NULL)
+        pthread_setspecific(slab_key, slab_tcache);
+    return slab_tcache;
+}
+
+static size_t
+slab_shrink(void *data, size_t target)
+{
+    return slab_trim();
+}
+
+static void
+slab_account_init(void)
+{
+    slab_account = mem_budget_register("slab", NULL, slab_shrink, NULL);
+}
+
+static mem_account_t *
+slab_get_account(void)
+{
+    pthread_once(&slab_account_once, slab_account_init);
+    return slab_account;
+}
+
+static void
+slab_list_remove(slab_class_t *c, slab_page_t *page)
+{
+    if (page->prev != NULL)
+        page->prev->next = page->next;
+    else
+        c->partial = page->next;
+    if (page->next != NULL)
+        page->next->prev = page->prev;
+    page->prev = page->next = NULL;
+}
+
+static void
+slab_list_push(slab_class_t *c, slab_page_t *page)
+{
+    page->prev = NULL;
+    page->next = c->partial;
+    if (c->partial != NULL)
+        c->partial->prev = page;
+    c->partial = page;
+}
+
+/*
+ * Make a new page if the cap and the memory budget allow it. Called with
+ * the class lock held.
+ */
+static slab_page_t *
+slab_page_new(slab_class_t *c, int cls)
+{
+    size_t bytes    = slab_page_bytes(c);
+    size_t reserved = atomic_fetch_add(&slab_reserved, bytes);
+    if (reserved + bytes > atomic_load(&slab_cap)) {
+        atomic_fetch_sub(&slab_reserved, bytes);
+        return NULL;
+    }
+
+    if (mem_budget_charge(slab_get_account(), bytes) == -1) {
+        atomic_fetch_sub(&slab_reserved, bytes);
+        return NULL;
+    }
+
+    slab_page_t *page = malloc(bytes);
+    if (page == NULL) {
+        mem_budget_uncharge(slab_account, bytes);
+        atomic_fetch_sub(&slab_reserved, bytes);
+        return NULL;
+    }
+
+    memset(page, 0, sizeof(slab_page_t));
+    page->cls   = cls;
+    page->nfree = c->per_page;
+
+    uint8_t *p = (uint8_t *)page + SLAB_PAGE_HEADER_LEN;
+    for (uint32_t i = 0; i < c->per_page; i++, p += slab_stride(c)) {
+        slab_header_t *hdr = (slab_header_t *)p;
+        hdr->page  = page;
+        hdr->size  = (uint32_t)c->size;
+        hdr->cls   = (int16_t)cls;
+        hdr->magic = SLAB_MAGIC;
+
+        void *payload = p + SLAB_HEADER_LEN;
+        *(void **)payload = page->free;
+        page->free        = payload;
+    }
+
+    slab_list_push(c, page);
+    c->pages++;
+    c->empty_pages++;
+    return page;
+}
+
+// Class lock held, page entirely free
+static void
+slab_page_release(slab_class_t *c, slab_page_t *page)
+{
+    size_t bytes = slab_page_bytes(c);
+    slab_list_remove(c, page);
+    c->pages--;
+    atomic_fetch_sub(&slab_reserved, bytes);
+    mem_budget_uncharge(slab_account, bytes);
+    free(page);
+}
+
+// Class lock held
+static void *
+slab_page_pop(slab_class_t *c, int cls)
+{
+    slab_page_t *page = c->partial;
+    if (page == NULL && (page = slab_page_new(c, cls)) == NULL)
+        return NULL;
+
+    if (page->nfree == c->per_page)
+        c->empty_pages--;
+
+    void *payload = page->free;
+    page->free = *(void **)payload;
+    if (--page->nfree == 0)
+        slab_list_remove(c, page);
+
+    c->in_use++;
+    return payload;
+}
+
+// Class lock held
+static void
+slab_page_push(slab_class_t *c, void *payload)
+{
+    slab_header_t *hdr = (slab_header_t *)((uint8_t *)payload - SLAB_HEADER_LEN);
+    slab_page_t *page  = hdr->page;
+
+    *(void **)payload = page->free;
+    page->free        = payload;
+    if (page->nfree++ == 0)
+        slab_list_push(c, page);
+    c->in_use--;
+
+    if (page->nfree < c->per_page)
+        return;
+
+    // Keep one empty page around so a busy class does not thrash
+    if (c->empty_pages >= SLAB_SPARE_PAGES) {
+        slab_page_release(c, page);
+    } else {
+        c->empty_pages++;
+    }
+}
+
+static void *
+slab_direct_alloc(size_t size, int oversize)
+{
+    if (mem_budget_charge(slab_get_account(), SLAB_HEADER_LEN + size) == -1)
+        return NULL;
+
+    slab_header_t *hdr = ss_malloc(SLAB_HEADER_LEN + size);
+    hdr->page  = NULL;
+    hdr->size  = (uint32_t)size;
+    hdr->cls   = SLAB_NO_CLASS;
+    hdr->magic = SLAB_MAGIC;
+    atomic_fetch_add_explicit(oversize ? &slab_oversize : &slab_overflow, 1,
+                              memory_order_relaxed);
+    return (uint8_t *)hdr + SLAB_HEADER_LEN;
+}
+
+static slab_header_t *
+slab_header(void *ptr)
+{
+    slab_header_t *hdr = (slab_header_t *)((uint8_t *)ptr - SLAB_HEADER_LEN);
+    if (hdr->magic != SLAB_MAGIC) {
+        LOGE("slab: pointer %p was not allocated here", ptr);
+        abort();
+    }
+    return hdr;
+}
+
+void
+slab_set_cap(size_t cap)
+{
+    atomic_store(&slab_cap, cap);
+}
+
+void *
+slab_alloc(size_t size, size_t *usable)
+{
+    int cls = 0;
+    while (cls < SLAB_CLASS_NUM && size > slab_classes[cls].size)
+        cls++;
+
+    if (cls == SLAB_CLASS_NUM) {
+        if (size > UINT32_MAX - SLAB_HEADER_LEN)
+            return NULL;
+        if (usable != NULL)
+            *usable = size;
+        return slab_direct_alloc(size, 1);
+    }
+
+    slab_class_t *c = &slab_classes[cls];
+    if (usable != NULL)
+        *usable = c->size;
+
+    slab_cache_t *cache = slab_get_cache();
+    if (cache != NULL && cache->count[cls] > 0) {
+        atomic_fetch_add_explicit(&c->allocs, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&c->cache_hits, 1, memory_order_relaxed);
+        return cache->blocks[cls][--cache->count[cls]];
+    }
+
+    // Take one block for the caller and half a cache worth for later
+    pthread_mutex_lock(&c->lock);
+    void *payload = slab_page_pop(c, cls);
+    if (payload != NULL && cache != NULL) {
+        while (cache->count[cls] < c->cache_max / 2) {
+            void *extra = slab_page_pop(c, cls);
+            if (extra == NULL)
+                break;
+            cache->blocks[cls][cache->count[cls]++] = extra;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (payload == NULL)
+        payload = slab_direct_alloc(c->size, 0);
+    // A refused request is not an alloc, or allocs and frees would never match
+    if (payload != NULL)
+        atomic_fetch_add_explicit(&c->allocs, 1, memory_order_relaxed);
+    return payload;
+}
+
+void
+slab_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    slab_header_t *hdr = slab_header(ptr);
+    if (hdr->page == NULL) {
+        // An overflow block still counts as a free of its class
+        for (int cls = 0; cls < SLAB_CLASS_NUM; cls++)
+            if (hdr->size == slab_classes[cls].size)
+                atomic_fetch_add_explicit(&slab_classes[cls].frees, 1, memory_order_relaxed);
+        hdr->magic = 0;
+        mem_budget_uncharge(slab_account, SLAB_HEADER_LEN + hdr->size);
+        ss_free(hdr);
+        return;
+    }
+
+    int cls          = hdr->cls;
+    slab_class_t *c  = &slab_classes[cls];
+    atomic_fetch_add_explicit(&c->frees, 1, memory_order_relaxed);
+
+    slab_cache_t *cache = slab_get_cache();
+    if (cache != NULL && cache->count[cls] < c->cache_max) {
+        cache->blocks[cls][cache->count[cls]++] = ptr;
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    slab_page_push(c, ptr);
+    if (cache != NULL) {
+        // Flush half so that alternating alloc/free stays in the cache
+        while (cache->count[cls] > c->cache_max / 2)
+            slab_page_push(c, cache->blocks[cls][--cache->count[cls]]);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void *
+slab_realloc(void *ptr, size_t size, size_t *usable)
+{
+    if (ptr == NULL)
+        return slab_alloc(size, usable);
+
+    size_t old = slab_header(ptr)->size;
+    if (size <= old) {
+        if (usable != NULL)
+            *usable = old;
+        return ptr;
+    }
+
+    void *tmp = slab_alloc(size, usable);
+    if (tmp == NULL)
+        return NULL;
+    memcpy(tmp, ptr, old);
+    slab_free(ptr);
+    return tmp;
+}
+
+int
+slab_balloc(buffer_t *ptr, size_t capacity)
+{
+    size_t usable = 0;
+
+    sodium_memzero(ptr, sizeof(buffer_t));
+    ptr->array = slab_alloc(capacity, &usable);
+    if (ptr->array == NULL)
+        return -1;
+    ptr->capacity = usable;
+    return 0;
+}
+
+int
+slab_brealloc(buffer_t *ptr, size_t len, size_t capacity)
+{
+    if (ptr == NULL)
+        return -1;
+
+    size_t real_capacity = max(len, capacity);
+    if (ptr->capacity < real_capacity) {
+        size_t usable = 0;
+        void *tmp     = slab_realloc(ptr->array, real_capacity, &usable);
+        if (tmp == NULL)
+            return -1;
+        ptr->array    = tmp;
+        ptr->capacity = usable;
+    }
+    return 0;
+}
+
+void
+slab_bfree(buffer_t *ptr)
+{
+    if (ptr == NULL)
+        return;
+    ptr->idx      = 0;
+    ptr->len      = 0;
+    ptr->capacity = 0;
+    if (ptr->array != NULL) {
+        slab_free(ptr->array);
+        ptr->array = NULL;
+    }
+}
+
+void
+slab_thread_flush(void)
+{
+    slab_cache_t *cache = slab_tcache;
+    if (cache == NULL)
+        return;
+
+    for (int cls = 0; cls < SLAB_CLASS_NUM; cls++) {
+        slab_class_t *c = &slab_classes[cls];
+        if (cache->count[cls] == 0)
+            continue;
+        pthread_mutex_lock(&c->lock);
+        while (cache->count[cls] > 0)
+            slab_page_push(c, cache->blocks[cls][--cache->count[cls]]);
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+size_t
+slab_trim(void)
+{
+    size_t released = 0;
+
+    for (int cls = 0; cls < SLAB_CLASS_NUM; cls++) {
+        slab_class_t *c = &slab_classes[cls];
+        pthread_mutex_lock(&c->lock);
+        slab_page_t *page = c->partial;
+        while (page != NULL && c->empty_pages > 0) {
+            slab_page_t *next = page->next;
+            if (page->nfree == c->per_page) {
+                c->empty_pages--;
+                released += slab_page_bytes(c);
+                slab_page_release(c, page);
+            }
+            page = next;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    return released;
+}
+
+void
+slab_stats(slab_stats_t *stats)
+{
+    memset(stats, 0, sizeof(slab_stats_t));
+
+    for (int cls = 0; cls < SLAB_CLASS_NUM; cls++) {
+        slab_class_t *c          = &slab_classes[cls];
+        slab_class_stats_t *out  = &stats->classes[cls];
+
+        pthread_mutex_lock(&c->lock);
+        out->size   = c->size;
+        out->pages  = c->pages;
+        out->blocks = c->pages * c->per_page;
+        out->in_use = c->in_use;
+        pthread_mutex_unlock(&c->lock);
+
+        out->allocs     = atomic_load_explicit(&c->allocs, memory_order_relaxed);
+        out->frees      = atomic_load_explicit(&c->frees, memory_order_relaxed);
+        out->cache_hits = atomic_load_explicit(&c->cache_hits, memory_order_relaxed);
+    }
+
+    stats->cap      = atomic_load(&slab_cap);
+    stats->reserved = atomic_load(&slab_reserved);
+    stats->oversize = atomic_load_explicit(&slab_oversize, memory_order_relaxed);
+    stats->overflow = atomic_load_explicit(&slab_overflow, memory_order_relaxed);
+}
@@ -0,0 +1,370 @@
+/*
+ * splicerelay.c - Relay direct connections without copying through user space
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "splicerelay.h"
+#include "utils.h"
+
+#if defined(__linux__) && defined(SPLICE_F_MOVE)
+#define HAVE_SPLICE 1
+#endif
+
+typedef struct splice_dir {
+    splice_relay_t *relay;
+    int src;
+    int dst;
+    int pipe[2];
+    size_t pipe_size;
+    size_t pending;         // bytes sitting in the pipe
+    ev_io rio;
+    ev_io wio;
+    mem_budget_reader_t reader;
+    int reading;
+    int full;               // the pipe is out of buffer slots
+    int eof;
+    int done;
+    ring_relay_stats_t stats;
+} splice_dir_t;
+
+struct splice_relay {
+    struct ev_loop *loop;
+    splice_relay_mode_t mode;
+    ring_relay_t *ring;
+    splice_dir_t up;
+    splice_dir_t down;
+    mem_budget_loop_t *budget;
+    ring_relay_close_cb close_cb;
+    void *data;
+    int closed;
+};
+
+#ifdef HAVE_SPLICE
+
+#define SPLICE_FLAGS (SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+
+static void
+splice_dir_read_start(splice_dir_t *dir)
+{
+    if (dir->reading || dir->eof)
+        return;
+    dir->reading = 1;
+    dir->full    = 0;
+    if (dir->relay->budget != NULL)
+        mem_budget_io_start(&dir->reader);
+    else
+        ev_io_start(dir->relay->loop, &dir->rio);
+}
+
+static void
+splice_dir_read_stop(splice_dir_t *dir)
+{
+    if (!dir->reading)
+        return;
+    dir->reading = 0;
+    if (dir->relay->budget != NULL)
+        mem_budget_io_stop(&dir->reader);
+    else
+        ev_io_stop(dir->relay->loop, &dir->rio);
+}
+
+static void
+splice_relay_fail(splice_relay_t *relay, int error)
+{
+    if (relay->closed)
+        return;
+    relay->closed = 1;
+
+    splice_dir_t *dirs[2] = { &relay->up, &relay->down };
+    for (int i = 0; i < 2; i++) {
+        splice_dir_read_stop(dirs[i]);
+        ev_io_stop(relay->loop, &dirs[i]->wio);
+    }
+
+    if (relay->close_cb != NULL)
+        relay->close_cb(relay->data, error);
+}
+
+// Returns -1 when this closed the relay
+static int
+splice_dir_finish(splice_dir_t *dir)
+{
+    splice_relay_t *relay = dir->relay;
+
+    dir->done = 1;
+    ev_io_stop(relay->loop, &dir->wio);
+    shutdown(dir->dst, SHUT_WR);
+
+    if (relay->up.done && relay->down.done) {
+        relay->closed = 1;
+        if (relay->close_cb != NULL)
+            relay->close_cb(relay->data, 0);
+        return -1;
+    }
+    return 0;
+}
+
+// Returns -1 when the relay has been closed and may already be freed
+static int
+splice_dir_drain(splice_dir_t *dir)
+{
+    splice_relay_t *relay = dir->relay;
+    int moved             = 0;
+
+    while (dir->pending > 0) {
+        ssize_t s = splice(dir->pipe[0], NULL, dir->dst, NULL, dir->pending, SPLICE_FLAGS);
+        if (s < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                splice_relay_fail(relay, errno);
+                return -1;
+            }
+            break;
+        }
+        dir->pending -= (size_t)s;
+        moved         = 1;
+        dir->stats.writes++;
+        dir->stats.bytes += (uint64_t)s;
+    }
+
+    if (dir->pending > 0) {
+        ev_io_start(relay->loop, &dir->wio);
+    } else {
+        ev_io_stop(relay->loop, &dir->wio);
+        if (dir->eof)
+            return splice_dir_finish(dir);
+    }
+
+    if (relay->budget != NULL)
+        mem_budget_reader_queued(&dir->reader, dir->pending);
+    if (!dir->reading && (dir->pending <= dir->pipe_size / 2 || (dir->full && moved)))
+        splice_dir_read_start(dir);
+    return 0;
+}
+
+static void
+splice_dir_read_cb(EV_P_ ev_io *w, int revents)
+{
+    splice_dir_t *dir     = (splice_dir_t *)w->data;
+    splice_relay_t *relay = dir->relay;
+
+    size_t room = dir->pipe_size - dir->pending;
+    if (room == 0) {
+        splice_dir_read_stop(dir);
+        dir->stats.throttled++;
+        return;
+    }
+
+    ssize_t r = splice(dir->src, NULL, dir->pipe[1], NULL, room, SPLICE_FLAGS);
+    if (r == 0) {
+        dir->eof = 1;
+        splice_dir_read_stop(dir);
+    } else if (r < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            splice_relay_fail(relay, errno);
+        } else if (errno != EINTR && dir->pending > 0) {
+            /*
+             * The pipe counts buffer slots, not bytes: small segments fill
+             * it well under pipe_size while the socket stays readable. Wait
+             * for the writer to free a slot instead of spinning.
+             */
+            splice_dir_read_stop(dir);
+            dir->full = 1;
+            dir->stats.throttled++;
+        }
+        return;
+    } else {
+        dir->pending += (size_t)r;
+        dir->stats.reads++;
+    }
+
+    if (splice_dir_drain(dir) == -1)
+        return;
+
+    if (dir->reading && dir->pending >= dir->pipe_size) {
+        splice_dir_read_stop(dir);
+        dir->stats.throttled++;
+    }
+}
+
+static void
+splice_dir_write_cb(EV_P_ ev_io *w, int revents)
+{
+    splice_dir_drain((splice_dir_t *)w->data);
+}
+
+static int
+splice_dir_init(splice_relay_t *relay, splice_dir_t *dir, int src, int dst,
+                size_t pipe_size)
+{
+    dir->relay   = relay;
+    dir->src     = src;
+    dir->dst     = dst;
+    dir->pipe[0] = dir->pipe[1] = -1;
+
+    if (pipe(dir->pipe) == -1)
+        return -1;
+    for (int i = 0; i < 2; i++)
+        fcntl(dir->pipe[i], F_SETFD, FD_CLOEXEC);
+    setnonblocking(dir->pipe[0]);
+    setnonblocking(dir->pipe[1]);
+
+    int size = -1;
+#ifdef F_SETPIPE_SZ
+    size = fcntl(dir->pipe[1], F_SETPIPE_SZ, (int)pipe_size);
+    if (size == -1)
+        size = fcntl(dir->pipe[1], F_GETPIPE_SZ);
+#endif
+    dir->pipe_size = size > 0 ? (size_t)size : 65536;
+
+    ev_io_init(&dir->rio, splice_dir_read_cb, src, EV_READ);
+    ev_io_init(&dir->wio, splice_dir_write_cb, dst, EV_WRITE);
+    dir->rio.data = dir;
+    dir->wio.data = dir;
+    if (relay->budget != NULL)
+        mem_budget_reader_init(&dir->reader, relay->budget, &dir->rio);
+    return 0;
+}
+
+static void
+splice_dir_release(splice_dir_t *dir)
+{
+    splice_relay_t *relay = dir->relay;
+    if (relay == NULL)
+        return;
+
+    if (relay->budget != NULL)
+        mem_budget_reader_release(&dir->reader);
+    else
+        ev_io_stop(relay->loop, &dir->rio);
+    ev_io_stop(relay->loop, &dir->wio);
+    for (int i = 0; i < 2; i++)
+        if (dir->pipe[i] != -1)
+            close(dir->pipe[i]);
+}
+
+#endif // HAVE_SPLICE
+
+splice_relay_t *
+splice_relay_new(struct ev_loop *loop, int client_fd, int remote_fd,
+                 const splice_relay_config_t *config,
+                 ring_relay_close_cb close_cb, void *data)
+{
+    splice_relay_config_t defaults;
+    if (config == NULL) {
+        memset(&defaults, 0, sizeof(splice_relay_config_t));
+        config = &defaults;
+    }
+
+    splice_relay_t *relay = ss_malloc(sizeof(splice_relay_t));
+    memset(relay, 0, sizeof(splice_relay_t));
+    relay->loop     = loop;
+    relay->budget   = config->budget;
+    relay->close_cb = close_cb;
+    relay->data     = data;
+    relay->mode     = SPLICE_RELAY_COPY;
+
+#ifdef HAVE_SPLICE
+    if (!config->force_copy) {
+        size_t pipe_size = config->pipe_size ? config->pipe_size : SPLICE_RELAY_PIPE_SIZE;
+        if (splice_dir_init(relay, &relay->up, client_fd, remote_fd, pipe_size) == 0
+            && splice_dir_init(relay, &relay->down, remote_fd, client_fd, pipe_size) == 0) {
+            relay->mode = SPLICE_RELAY_SPLICE;
+            return relay;
+        }
+        ERROR("splicerelay: pipe");
+        splice_dir_release(&relay->up);
+        splice_dir_release(&relay->down);
+        memset(&relay->up, 0, sizeof(splice_dir_t));
+        memset(&relay->down, 0, sizeof(splice_dir_t));
+    }
+#endif
+
+    ring_relay_config_t ring_config;
+    memset(&ring_config, 0, sizeof(ring_relay_config_t));
+    ring_config.budget = config->budget;
+
+    relay->ring = ring_relay_new(loop, client_fd, remote_fd, &ring_config, close_cb, data);
+    if (relay->ring == NULL) {
+        ss_free(relay);
+        return NULL;
+    }
+    return relay;
+}
+
+void
+splice_relay_start(splice_relay_t *relay)
+{
+    if (relay->ring != NULL) {
+        ring_relay_start(relay->ring);
+        return;
+    }
+#ifdef HAVE_SPLICE
+    splice_dir_read_start(&relay->up);
+    splice_dir_read_start(&relay->down);
+#endif
+}
+
+void
+splice_relay_free(splice_relay_t *relay)
+{
+    if (relay == NULL)
+        return;
+    if (relay->ring != NULL)
+        ring_relay_free(relay->ring);
+#ifdef HAVE_SPLICE
+    splice_dir_release(&relay->up);
+    splice_dir_release(&relay->down);
+#endif
+    ss_free(relay);
+}
+
+splice_relay_mode_t
+splice_relay_mode(const splice_relay_t *relay)
+{
+    return relay->mode;
+}
+
+void
+splice_relay_stats(const splice_relay_t *relay, ring_relay_stats_t *up,
+                   ring_relay_stats_t *down)
+{
+    if (relay->ring != NULL) {
+        ring_relay_stats(relay->ring, up, down);
+        return;
+    }
+    if (up != NULL) {
+        *up         = relay->up.stats;
+        up->pending = relay->up.pending;
+    }
+    if (down != NULL) {
+        *down         = relay->down.stats;
+        down->pending = relay->down.pending;
+    }
+}
@@ -0,0 +1,239 @@
+/*
+ * timerwheel.c - Hierarchical timing wheel for connection timeouts
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "timerwheel.h"
+#include "utils.h"
+
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_SPAN    ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+struct timer_wheel {
+    struct ev_loop *loop;
+    double resolution;
+    ev_tstamp base;
+    uint64_t tick;              // next tick to run
+    ev_timer watcher;
+    struct cork_dllist slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    timer_wheel_stats_t stats;
+};
+
+static uint64_t
+timer_wheel_now(const timer_wheel_t *wheel)
+{
+    ev_tstamp elapsed = ev_now(wheel->loop) - wheel->base;
+    return elapsed > 0 ? (uint64_t)(elapsed / wheel->resolution) : 0;
+}
+
+/*
+ * The first tick that starts after now. wheel->tick may lag by up to one
+ * resolution until the loop timer runs, and a deadline counted from it
+ * would fire early.
+ */
+static uint64_t
+timer_wheel_next(const timer_wheel_t *wheel)
+{
+    uint64_t next = timer_wheel_now(wheel) + 1;
+    return next > wheel->tick ? next : wheel->tick;
+}
+
+static void
+timer_wheel_link(timer_wheel_t *wheel, timer_wheel_entry_t *entry, uint64_t expires)
+{
+    if (expires < wheel->tick)
+        expires = wheel->tick;
+    uint64_t delta = expires - wheel->tick;
+    // Beyond the top level: park at the far end, the deadline brings it back
+    if (delta >= TIMER_WHEEL_SPAN) {
+        delta   = TIMER_WHEEL_SPAN - 1;
+        expires = wheel->tick + delta;
+    }
+
+    int level = 0;
+    while (delta >= ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))))
+        level++;
+
+    int slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    entry->expires = expires;
+    cork_dllist_add(&wheel->slots[level][slot], &entry->slot);
+}
+
+// Move every timer of a slot one level down, or more
+static void
+timer_wheel_cascade(timer_wheel_t *wheel, int level, int slot)
+{
+    struct cork_dllist pending;
+    struct cork_dllist_item *curr;
+
+    cork_dllist_init(&pending);
+    if (cork_dllist_is_empty(&wheel->slots[level][slot]))
+        return;
+    cork_dllist_add_list_to_tail(&pending, &wheel->slots[level][slot]);
+
+    while ((curr = cork_dllist_head(&pending)) != NULL) {
+        timer_wheel_entry_t *entry = cork_container_of(curr, timer_wheel_entry_t, slot);
+        cork_dllist_remove(curr);
+        timer_wheel_link(wheel, entry, entry->expires);
+        wheel->stats.cascaded++;
+    }
+}
+
+static void
+timer_wheel_run(timer_wheel_t *wheel)
+{
+    uint64_t tick = wheel->tick;
+
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (((tick >> (TIMER_WHEEL_BITS * (level - 1))) & TIMER_WHEEL_MASK) != 0)
+            break;
+        timer_wheel_cascade(wheel, level, (tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    }
+
+    struct cork_dllist *due = &wheel->slots[0][tick & TIMER_WHEEL_MASK];
+    struct cork_dllist_item *curr;
+    while ((curr = cork_dllist_head(due)) != NULL) {
+        timer_wheel_entry_t *entry = cork_container_of(curr, timer_wheel_entry_t, slot);
+        cork_dllist_remove(curr);
+
+        if (entry->deadline > tick) {
+            timer_wheel_link(wheel, entry, entry->deadline);
+            wheel->stats.rearmed++;
+            continue;
+        }
+
+        entry->active = 0;
+        wheel->stats.timers--;
+        wheel->stats.fired++;
+        // May free the entry, or start it again
+        entry->cb(entry, entry->data);
+    }
+
+    wheel->tick = tick + 1;
+}
+
+static void
+timer_wheel_cb_tick(EV_P_ ev_timer *w, int revents)
+{
+    timer_wheel_t *wheel = w->data;
+    uint64_t now         = timer_wheel_now(wheel);
+
+    while (wheel->tick <= now && wheel->stats.timers > 0)
+        timer_wheel_run(wheel);
+
+    if (wheel->stats.timers == 0) {
+        ev_timer_stop(EV_A_ w);
+        wheel->tick = now + 1;
+    }
+}
+
+timer_wheel_t *
+timer_wheel_new(struct ev_loop *loop, double resolution)
+{
+    timer_wheel_t *wheel = ss_malloc(sizeof(timer_wheel_t));
+    memset(wheel, 0, sizeof(timer_wheel_t));
+    wheel->loop       = loop;
+    wheel->resolution = resolution > 0 ? resolution : TIMER_WHEEL_DEFAULT_RESOLUTION;
+    wheel->base       = ev_now(loop);
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+            cork_dllist_init(&wheel->slots[level][slot]);
+
+    ev_timer_init(&wheel->watcher, timer_wheel_cb_tick, wheel->resolution, wheel->resolution);
+    wheel->watcher.data = wheel;
+    return wheel;
+}
+
+void
+timer_wheel_free(timer_wheel_t *wheel)
+{
+    struct cork_dllist_item *curr;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+            while ((curr = cork_dllist_head(&wheel->slots[level][slot])) != NULL) {
+                cork_dllist_remove(curr);
+                cork_container_of(curr, timer_wheel_entry_t, slot)->active = 0;
+            }
+
+    ev_timer_stop(wheel->loop, &wheel->watcher);
+    ss_free(wheel);
+}
+
+void
+timer_wheel_entry_init(timer_wheel_entry_t *entry, timer_wheel_cb cb, void *data)
+{
+    memset(entry, 0, sizeof(timer_wheel_entry_t));
+    entry->cb   = cb;
+    entry->data = data;
+}
+
+void
+timer_wheel_start(timer_wheel_t *wheel, timer_wheel_entry_t *entry, double timeout)
+{
+    if (entry->active)
+        timer_wheel_stop(wheel, entry);
+
+    if (wheel->stats.timers == 0) {
+        // The wheel stood still while empty
+        wheel->tick = timer_wheel_next(wheel);
+        ev_timer_again(wheel->loop, &wheel->watcher);
+    }
+
+    double ticks = ceil(timeout / wheel->resolution);
+    entry->ticks    = ticks >= 1 ? (uint64_t)ticks : 1;
+    entry->deadline = timer_wheel_next(wheel) + entry->ticks;
+    entry->active   = 1;
+    timer_wheel_link(wheel, entry, entry->deadline);
+    wheel->stats.timers++;
+}
+
+void
+timer_wheel_touch(timer_wheel_t *wheel, timer_wheel_entry_t *entry)
+{
+    if (entry->active)
+        entry->deadline = timer_wheel_next(wheel) + entry->ticks;
+}
+
+void
+timer_wheel_stop(timer_wheel_t *wheel, timer_wheel_entry_t *entry)
+{
+    if (!entry->active)
+        return;
+    cork_dllist_remove(&entry->slot);
+    entry->active = 0;
+    wheel->stats.timers--;
+}
+
+double
+timer_wheel_remaining(const timer_wheel_t *wheel, const timer_wheel_entry_t *entry)
+{
+    if (!entry->active || entry->deadline < wheel->tick)
+        return 0;
+    return (entry->deadline - wheel->tick) * wheel->resolution;
+}
+
+void
+timer_wheel_stats(const timer_wheel_t *wheel, timer_wheel_stats_t *stats)
+{
+    *stats = wheel->stats;
+}
@@ -0,0 +1,454 @@
+/*
+ * udpbatch.c - Batched UDP receive and send with GRO/GSO where available
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "udpbatch.h"
+#include "utils.h"
+
+#ifdef __linux__
+#define HAVE_MMSG 1
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif
+// Older headers lack them; the kernel decides whether they work
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#define UDP_GSO_MAX_SEGMENTS    64
+#define UDP_GSO_MAX_BYTES       65000
+#endif
+
+struct udp_batch_sys {
+    uint8_t *slab;                  // slots * slot_size
+#ifdef HAVE_MMSG
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iov[UDP_BATCH_MAX];
+    char control[UDP_BATCH_MAX][CMSG_SPACE(sizeof(uint16_t))];
+    int first[UDP_BATCH_MAX];       // packets covered by each message
+    int npkts[UDP_BATCH_MAX];
+    uint8_t *staging;               // GSO runs, copied back to back
+    uint8_t *gro_buf;
+    size_t gro_off;
+    size_t gro_len;
+    size_t gro_seg;
+    struct sockaddr_storage gro_addr;
+    socklen_t gro_addr_len;
+#endif
+};
+
+udp_batch_t *
+udp_batch_new(int slots, size_t slot_size)
+{
+    if (slots <= 0 || slots > UDP_BATCH_MAX)
+        slots = UDP_BATCH_MAX;
+
+    udp_batch_t *batch = ss_malloc(sizeof(udp_batch_t));
+    memset(batch, 0, sizeof(udp_batch_t));
+    batch->slots     = slots;
+    batch->slot_size = slot_size;
+
+    batch->sys = ss_malloc(sizeof(udp_batch_sys_t));
+    memset(batch->sys, 0, sizeof(udp_batch_sys_t));
+    batch->sys->slab = ss_malloc(slots * slot_size);
+#ifdef HAVE_MMSG
+    batch->sys->staging = ss_malloc(slots * slot_size);
+#endif
+
+    for (int i = 0; i < slots; i++) {
+        batch->pkt[i].data     = batch->sys->slab + i * slot_size;
+        batch->pkt[i].capacity = slot_size;
+    }
+    return batch;
+}
+
+void
+udp_batch_free(udp_batch_t *batch)
+{
+    if (batch == NULL)
+        return;
+#ifdef HAVE_MMSG
+    ss_free(batch->sys->staging);
+    ss_free(batch->sys->gro_buf);
+#endif
+    ss_free(batch->sys->slab);
+    ss_free(batch->sys);
+    ss_free(batch);
+}
+
+int
+udp_batch_enable_offload(udp_batch_t *batch, int fd)
+{
+#ifdef HAVE_MMSG
+    int opt       = 1;
+    socklen_t len = sizeof(opt);
+
+    if (setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) == 0) {
+        if (batch->sys->gro_buf == NULL)
+            batch->sys->gro_buf = ss_malloc(UDP_BATCH_GRO_BUF_SIZE);
+        batch->offload |= UDP_BATCH_GRO;
+    }
+
+    opt = 0;
+    if (getsockopt(fd, SOL_UDP, UDP_SEGMENT, &opt, &len) == 0)
+        batch->offload |= UDP_BATCH_GSO;
+#endif
+    return batch->offload;
+}
+
+int
+udp_batch_pending(const udp_batch_t *batch)
+{
+#ifdef HAVE_MMSG
+    return batch->sys->gro_off < batch->sys->gro_len;
+#else
+    return 0;
+#endif
+}
+
+static void
+udp_batch_slot(udp_batch_t *batch, int i, size_t len)
+{
+    batch->pkt[i].data     = batch->sys->slab + i * batch->slot_size;
+    batch->pkt[i].capacity = batch->slot_size;
+    batch->pkt[i].len      = len;
+}
+
+#ifdef HAVE_MMSG
+
+// Hand out datagrams from the last coalesced read
+static void
+udp_batch_split_gro(udp_batch_t *batch, size_t offset)
+{
+    udp_batch_sys_t *sys = batch->sys;
+
+    while (batch->count < batch->slots && sys->gro_off < sys->gro_len) {
+        size_t seg = sys->gro_len - sys->gro_off;
+        if (seg > sys->gro_seg)
+            seg = sys->gro_seg;
+        if (seg > batch->slot_size - offset) {
+            batch->stats.dropped++;
+        } else {
+            int i = batch->count++;
+            udp_batch_slot(batch, i, seg);
+            memcpy(batch->pkt[i].data + offset, sys->gro_buf + sys->gro_off, seg);
+            memcpy(&batch->addr[i], &sys->gro_addr, sys->gro_addr_len);
+            batch->addr_len[i] = sys->gro_addr_len;
+        }
+        sys->gro_off += seg;
+    }
+}
+
+static int
+udp_batch_recv_gro(udp_batch_t *batch, int fd, size_t offset)
+{
+    udp_batch_sys_t *sys = batch->sys;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    udp_batch_split_gro(batch, offset);
+
+    while (batch->count < batch->slots) {
+        struct iovec iov = { sys->gro_buf, UDP_BATCH_GRO_BUF_SIZE };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_name       = &sys->gro_addr;
+        msg.msg_namelen    = sizeof(struct sockaddr_storage);
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t r = recvmsg(fd, &msg, MSG_DONTWAIT);
+        batch->stats.syscalls++;
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            return batch->count > 0 ? batch->count : -1;
+        }
+
+        size_t seg = (size_t)r;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cm), sizeof(int));
+                if (gso_size > 0 && (size_t)gso_size < seg)
+                    seg = (size_t)gso_size;
+            }
+        }
+
+        // The last datagram lost its tail and can't be told from a whole one
+        if (msg.msg_flags & MSG_TRUNC) {
+            batch->stats.dropped += ((size_t)r + seg - 1) / seg;
+            continue;
+        }
+
+        sys->gro_addr_len = msg.msg_namelen;
+        sys->gro_off      = 0;
+        sys->gro_len      = (size_t)r;
+        sys->gro_seg      = seg;
+        if (seg < (size_t)r)
+            batch->stats.gro_segments += ((size_t)r + seg - 1) / seg;
+        udp_batch_split_gro(batch, offset);
+    }
+
+    batch->stats.received += batch->count;
+    return batch->count;
+}
+
+#endif // HAVE_MMSG
+
+int
+udp_batch_recv(udp_batch_t *batch, int fd, size_t offset)
+{
+    batch->count = 0;
+    if (offset >= batch->slot_size)
+        return -1;
+
+#ifdef HAVE_MMSG
+    udp_batch_sys_t *sys = batch->sys;
+
+    if (batch->offload & UDP_BATCH_GRO)
+        return udp_batch_recv_gro(batch, fd, offset);
+
+    for (int i = 0; i < batch->slots; i++) {
+        sys->iov[i].iov_base = sys->slab + i * batch->slot_size + offset;
+        sys->iov[i].iov_len  = batch->slot_size - offset;
+        memset(&sys->msgs[i], 0, sizeof(struct mmsghdr));
+        sys->msgs[i].msg_hdr.msg_name    = &batch->addr[i];
+        sys->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        sys->msgs[i].msg_hdr.msg_iov     = &sys->iov[i];
+        sys->msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    int n;
+    do {
+        n = recvmmsg(fd, sys->msgs, batch->slots, MSG_DONTWAIT, NULL);
+        batch->stats.syscalls++;
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+    for (int i = 0; i < n; i++) {
+        size_t len = sys->msgs[i].msg_len;
+        // A truncated datagram can't be decrypted, drop it here
+        if (sys->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            len = 0;
+            batch->stats.dropped++;
+        }
+        udp_batch_slot(batch, i, len);
+        batch->addr_len[i] = sys->msgs[i].msg_hdr.msg_namelen;
+    }
+    batch->count           = n;
+    batch->stats.received += n;
+    return n;
+#else
+    while (batch->count < batch->slots) {
+        int i         = batch->count;
+        socklen_t len = sizeof(struct sockaddr_storage);
+        uint8_t *slot = batch->sys->slab + i * batch->slot_size;
+        ssize_t r     = recvfrom(fd, slot + offset, batch->slot_size - offset, MSG_DONTWAIT,
+                                 (struct sockaddr *)&batch->addr[i], &len);
+        batch->stats.syscalls++;
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (batch->count == 0)
+                return -1;
+            break;
+        }
+        udp_batch_slot(batch, i, (size_t)r);
+        batch->addr_len[i] = len;
+        batch->count++;
+    }
+    batch->stats.received += batch->count;
+    return batch->count;
+#endif
+}
+
+#ifdef HAVE_MMSG
+
+static int
+udp_batch_same_dest(const udp_batch_t *batch, int a, int b)
+{
+    return batch->addr_len[a] == batch->addr_len[b]
+           && memcmp(&batch->addr[a], &batch->addr[b], batch->addr_len[a]) == 0;
+}
+
+// Packets [first, first + n) one by one, after the path refused GSO
+static int
+udp_batch_send_each(udp_batch_t *batch, int fd, size_t offset, int first, int n)
+{
+    int sent = 0;
+    for (int i = first; i < first + n; i++) {
+        ssize_t s = sendto(fd, batch->pkt[i].data + offset, batch->pkt[i].len, MSG_DONTWAIT,
+                           (struct sockaddr *)&batch->addr[i], batch->addr_len[i]);
+        batch->stats.syscalls++;
+        if (s < 0)
+            batch->stats.dropped++;
+        else
+            sent++;
+    }
+    return sent;
+}
+
+#endif
+
+int
+udp_batch_send(udp_batch_t *batch, int fd, size_t offset)
+{
+    int sent = 0;
+
+#ifdef HAVE_MMSG
+    udp_batch_sys_t *sys = batch->sys;
+    int nmsg             = 0;
+    size_t staged        = 0;
+
+    for (int i = 0; i < batch->count;) {
+        size_t len = batch->pkt[i].len;
+        if (len == 0) {
+            i++;
+            continue;
+        }
+
+        // A GSO run: same size and address, the last one may be shorter
+        int j        = i + 1;
+        size_t bytes = len;
+        if (batch->offload & UDP_BATCH_GSO) {
+            while (j < batch->count && j - i < UDP_GSO_MAX_SEGMENTS
+                   && batch->pkt[j].len > 0 && batch->pkt[j].len <= len
+                   && bytes + batch->pkt[j].len <= UDP_GSO_MAX_BYTES
+                   && udp_batch_same_dest(batch, i, j)) {
+                bytes += batch->pkt[j].len;
+                if (batch->pkt[j++].len < len)
+                    break;
+            }
+        }
+
+        struct msghdr *hdr = &sys->msgs[nmsg].msg_hdr;
+        memset(&sys->msgs[nmsg], 0, sizeof(struct mmsghdr));
+        hdr->msg_name    = &batch->addr[i];
+        hdr->msg_namelen = batch->addr_len[i];
+        hdr->msg_iov     = &sys->iov[nmsg];
+        hdr->msg_iovlen  = 1;
+
+        if (j - i > 1) {
+            uint8_t *run = sys->staging + staged;
+            for (int k = i; k < j; k++) {
+                memcpy(sys->staging + staged, batch->pkt[k].data + offset, batch->pkt[k].len);
+                staged += batch->pkt[k].len;
+            }
+            sys->iov[nmsg].iov_base = run;
+            sys->iov[nmsg].iov_len  = bytes;
+
+            uint16_t seg = (uint16_t)len;
+            hdr->msg_control    = sys->control[nmsg];
+            hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            struct cmsghdr *cm  = CMSG_FIRSTHDR(hdr);
+            cm->cmsg_level      = SOL_UDP;
+            cm->cmsg_type       = UDP_SEGMENT;
+            cm->cmsg_len        = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cm), &seg, sizeof(uint16_t));
+        } else {
+            sys->iov[nmsg].iov_base = batch->pkt[i].data + offset;
+            sys->iov[nmsg].iov_len  = len;
+        }
+
+        sys->first[nmsg] = i;
+        sys->npkts[nmsg] = j - i;
+        nmsg++;
+        i = j;
+    }
+
+    for (int k = 0; k < nmsg;) {
+        int r = sendmmsg(fd, sys->msgs + k, nmsg - k, MSG_DONTWAIT);
+        batch->stats.syscalls++;
+        if (r > 0) {
+            for (int m = k; m < k + r; m++) {
+                sent += sys->npkts[m];
+                if (sys->npkts[m] > 1)
+                    batch->stats.gso_segments += sys->npkts[m];
+            }
+            k += r;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+
+        if (sys->npkts[k] > 1 && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+            LOGI("udpbatch: GSO refused, sending datagrams one by one");
+            batch->offload &= ~UDP_BATCH_GSO;
+            sent += udp_batch_send_each(batch, fd, offset, sys->first[k], sys->npkts[k]);
+            k++;
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // The socket buffer is full, the rest goes the way of a full queue
+            for (int m = k; m < nmsg; m++)
+                batch->stats.dropped += sys->npkts[m];
+            break;
+        }
+
+        // An error for one destination should not cost the others
+        batch->stats.dropped += sys->npkts[k];
+        k++;
+    }
+#else
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->pkt[i].len == 0)
+            continue;
+        ssize_t s = sendto(fd, batch->pkt[i].data + offset, batch->pkt[i].len, MSG_DONTWAIT,
+                           (struct sockaddr *)&batch->addr[i], batch->addr_len[i]);
+        batch->stats.syscalls++;
+        if (s < 0) {
+            if (errno == EINTR) {
+                i--;
+                continue;
+            }
+            batch->stats.dropped++;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                for (int m = i + 1; m < batch->count; m++)
+                    if (batch->pkt[m].len > 0)
+                        batch->stats.dropped++;
+                break;
+            }
+            continue;
+        }
+        sent++;
+    }
+#endif
+
+    batch->stats.sent += sent;
+    return sent;
+}
@@ -0,0 +1,377 @@
+/*
+ * udpcrypto.c - Batched, allocation free AEAD for UDP datagrams
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <mbedtls/aes.h>
+#include <sodium.h>
+
+#include "hkdf.h"
+#include "udpcrypto.h"
+#include "utils.h"
+
+#define UDP_CRYPTO_NONCE_LEN 12
+#define UDP_CRYPTO_TAG_LEN   16
+#define UDP_CRYPTO_SALT_MAX  32
+#define UDP_CRYPTO_BLOCK     16
+
+/*
+ * Everything a datagram needs besides its own bytes. Each UDP packet uses
+ * a fresh salt and therefore a fresh subkey with an all-zero nonce.
+ *
+ * mbedtls_gcm_setkey() frees and sets up its cipher context again, with a
+ * heap allocation, every time it is called, so AES-GCM is done here on an
+ * mbedtls_aes_context that is initialised once per thread: a new subkey
+ * only rewrites its round keys and the GHASH table below, in place. The
+ * table is the same 4-bit one mbedtls builds without AES-NI or AESCE,
+ * which the vendored config enables neither of.
+ */
+typedef struct udp_crypto_state {
+    const cipher_t *cipher;
+    hkdf_psk_t psk;
+    int aes_init;
+    mbedtls_aes_context aes;
+    uint64_t hl[16];        // multiples of H, low and high halves
+    uint64_t hh[16];
+    uint8_t subkey[UDP_CRYPTO_SALT_MAX];
+    uint8_t salts[UDP_CRYPTO_BATCH * UDP_CRYPTO_SALT_MAX];
+} udp_crypto_state_t;
+
+static __thread udp_crypto_state_t state;
+
+static const uint8_t zero_nonce[UDP_CRYPTO_NONCE_LEN];
+
+size_t
+udp_crypto_headroom(const cipher_t *cipher)
+{
+    return cipher->key_len;
+}
+
+size_t
+udp_crypto_overhead(const cipher_t *cipher)
+{
+    return cipher->key_len + cipher->tag_len;
+}
+
+/*
+ * Bind the thread state to cipher. The key is compared as well as the
+ * pointer so that a cipher freed and reallocated at the same address on
+ * reload does not keep the old PSK.
+ */
+static int
+udp_crypto_bind(const cipher_t *cipher)
+{
+    if (cipher->method < AES_128_GCM || cipher->method > CHACHA20_IETF_POLY1305
+        || cipher->key_len > UDP_CRYPTO_SALT_MAX
+        || cipher->nonce_len != UDP_CRYPTO_NONCE_LEN
+        || cipher->tag_len != UDP_CRYPTO_TAG_LEN) {
+        LOGE("udpcrypto: unsupported cipher");
+        return CRYPTO_ERROR;
+    }
+
+    if (state.cipher == cipher && state.psk.key_len == cipher->key_len
+        && sodium_memcmp(state.psk.key, cipher->key, cipher->key_len) == 0)
+        return CRYPTO_OK;
+
+    if (hkdf_psk_init_cipher(&state.psk, cipher) != 0)
+        return CRYPTO_ERROR;
+    if (!state.aes_init) {
+        mbedtls_aes_init(&state.aes);
+        state.aes_init = 1;
+    }
+    state.cipher = cipher;
+    return CRYPTO_OK;
+}
+
+static inline uint64_t
+load_be64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static inline void
+store_be64(uint8_t *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (uint8_t)v;
+        v  >>= 8;
+    }
+}
+
+// hl/hh[i] = i * H in GF(2^128), i read as a reversed 4-bit polynomial
+static void
+ghash_table(const uint8_t h[UDP_CRYPTO_BLOCK])
+{
+    uint64_t vh = load_be64(h);
+    uint64_t vl = load_be64(h + 8);
+
+    state.hl[8] = vl;
+    state.hh[8] = vh;
+    state.hl[0] = state.hh[0] = 0;
+    for (int i = 4; i > 0; i >>= 1) {
+        uint64_t t = (vl & 1) * 0xe100000000000000ULL;
+        vl          = (vh << 63) | (vl >> 1);
+        vh          = (vh >> 1) ^ t;
+        state.hl[i] = vl;
+        state.hh[i] = vh;
+    }
+    for (int i = 2; i <= 8; i *= 2) {
+        for (int j = 1; j < i; j++) {
+            state.hh[i + j] = state.hh[i] ^ state.hh[j];
+            state.hl[i + j] = state.hl[i] ^ state.hl[j];
+        }
+    }
+}
+
+// x = x * H
+static void
+ghash_mult(uint8_t x[UDP_CRYPTO_BLOCK])
+{
+    static const uint64_t last4[16] = {
+        0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+        0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+    };
+    uint64_t zh = state.hh[x[15] & 0xf];
+    uint64_t zl = state.hl[x[15] & 0xf];
+
+    for (int i = 15; i >= 0; i--) {
+        int lo = x[i] & 0xf;
+        int hi = x[i] >> 4;
+        int rem;
+
+        if (i != 15) {
+            rem = (int)(zl & 0xf);
+            zl  = (zh << 60) | (zl >> 4);
+            zh  = (zh >> 4) ^ (last4[rem] << 48) ^ state.hh[lo];
+            zl ^= state.hl[lo];
+        }
+        rem = (int)(zl & 0xf);
+        zl  = (zh << 60) | (zl >> 4);
+        zh  = (zh >> 4) ^ (last4[rem] << 48) ^ state.hh[hi];
+        zl ^= state.hl[hi];
+    }
+
+    store_be64(x, zh);
+    store_be64(x + 8, zl);
+}
+
+// GHASH of the ciphertext and its length block, without AAD
+static void
+ghash(const uint8_t *c, size_t clen, uint8_t y[UDP_CRYPTO_BLOCK])
+{
+    memset(y, 0, UDP_CRYPTO_BLOCK);
+    for (size_t off = 0; off < clen; off += UDP_CRYPTO_BLOCK) {
+        size_t n = clen - off < UDP_CRYPTO_BLOCK ? clen - off : UDP_CRYPTO_BLOCK;
+        for (size_t i = 0; i < n; i++)
+            y[i] ^= c[off + i];
+        ghash_mult(y);
+    }
+
+    uint8_t len[UDP_CRYPTO_BLOCK] = { 0 };
+    store_be64(len + 8, (uint64_t)clen * 8);
+    for (int i = 0; i < UDP_CRYPTO_BLOCK; i++)
+        y[i] ^= len[i];
+    ghash_mult(y);
+}
+
+// E(K, counter block 1) of the all-zero nonce, which masks the tag
+static void
+gcm_tag_mask(uint8_t mask[UDP_CRYPTO_BLOCK])
+{
+    uint8_t j0[UDP_CRYPTO_BLOCK] = { 0 };
+    j0[15] = 1;
+    mbedtls_aes_crypt_ecb(&state.aes, MBEDTLS_AES_ENCRYPT, j0, mask);
+}
+
+// CTR in place; the data starts at counter block 2
+static void
+gcm_ctr(uint8_t *m, size_t mlen)
+{
+    uint8_t ctr[UDP_CRYPTO_BLOCK] = { 0 };
+    uint8_t ks[UDP_CRYPTO_BLOCK];
+
+    ctr[15] = 1;
+    for (size_t off = 0; off < mlen; off += UDP_CRYPTO_BLOCK) {
+        for (int i = 15; i >= 12 && ++ctr[i] == 0; i--)
+            ;
+        mbedtls_aes_crypt_ecb(&state.aes, MBEDTLS_AES_ENCRYPT, ctr, ks);
+        size_t n = mlen - off < UDP_CRYPTO_BLOCK ? mlen - off : UDP_CRYPTO_BLOCK;
+        for (size_t i = 0; i < n; i++)
+            m[off + i] ^= ks[i];
+    }
+    sodium_memzero(ks, sizeof(ks));
+}
+
+static int
+udp_crypto_setkey(const cipher_t *cipher, const uint8_t *salt)
+{
+    if (hkdf_psk_derive(&state.psk, salt, cipher->key_len,
+                        state.subkey, cipher->key_len) != 0)
+        return CRYPTO_ERROR;
+    if (cipher->method == CHACHA20_IETF_POLY1305)
+        return CRYPTO_OK;
+
+    uint8_t h[UDP_CRYPTO_BLOCK] = { 0 };
+    if (mbedtls_aes_setkey_enc(&state.aes, state.subkey,
+                               (unsigned int)cipher->key_len * 8) != 0)
+        return CRYPTO_ERROR;
+    mbedtls_aes_crypt_ecb(&state.aes, MBEDTLS_AES_ENCRYPT, h, h);
+    ghash_table(h);
+    sodium_memzero(h, sizeof(h));
+    return CRYPTO_OK;
+}
+
+static int
+udp_crypto_seal(const cipher_t *cipher, uint8_t *m, size_t mlen, uint8_t *tag)
+{
+    if (cipher->method == CHACHA20_IETF_POLY1305) {
+        unsigned long long tlen = 0;
+        return crypto_aead_chacha20poly1305_ietf_encrypt_detached(m, tag, &tlen, m, mlen,
+                                                                  NULL, 0, NULL,
+                                                                  zero_nonce, state.subkey)
+               == 0 ? CRYPTO_OK : CRYPTO_ERROR;
+    }
+
+    uint8_t mask[UDP_CRYPTO_BLOCK];
+    gcm_ctr(m, mlen);
+    ghash(m, mlen, tag);
+    gcm_tag_mask(mask);
+    for (int i = 0; i < UDP_CRYPTO_TAG_LEN; i++)
+        tag[i] ^= mask[i];
+    return CRYPTO_OK;
+}
+
+static int
+udp_crypto_open(const cipher_t *cipher, uint8_t *c, size_t clen, const uint8_t *tag)
+{
+    if (cipher->method == CHACHA20_IETF_POLY1305) {
+        return crypto_aead_chacha20poly1305_ietf_decrypt_detached(c, NULL, c, clen, tag,
+                                                                  NULL, 0, zero_nonce,
+                                                                  state.subkey)
+               == 0 ? CRYPTO_OK : CRYPTO_ERROR;
+    }
+
+    // The tag is checked before anything is decrypted
+    uint8_t y[UDP_CRYPTO_BLOCK], mask[UDP_CRYPTO_BLOCK];
+    ghash(c, clen, y);
+    gcm_tag_mask(mask);
+    for (int i = 0; i < UDP_CRYPTO_TAG_LEN; i++)
+        y[i] ^= mask[i];
+    if (sodium_memcmp(y, tag, UDP_CRYPTO_TAG_LEN) != 0)
+        return CRYPTO_ERROR;
+
+    gcm_ctr(c, clen);
+    return CRYPTO_OK;
+}
+
+int
+udp_crypto_encrypt(cipher_t *cipher, udp_packet_t *pkts, size_t count)
+{
+    if (udp_crypto_bind(cipher) != CRYPTO_OK)
+        return 0;
+
+    size_t salt_len = cipher->key_len;
+    size_t tag_len  = cipher->tag_len;
+    int done        = 0;
+
+    for (size_t base = 0; base < count; base += UDP_CRYPTO_BATCH) {
+        size_t n = count - base < UDP_CRYPTO_BATCH ? count - base : UDP_CRYPTO_BATCH;
+
+        // One trip to the CSPRNG for the whole batch
+        randombytes_buf(state.salts, n * salt_len);
+
+        for (size_t i = 0; i < n; i++) {
+            udp_packet_t *pkt = &pkts[base + i];
+            const uint8_t *salt = state.salts + i * salt_len;
+
+            if (pkt->len == 0 || salt_len + pkt->len + tag_len > pkt->capacity) {
+                pkt->len = 0;
+                continue;
+            }
+
+            memcpy(pkt->data, salt, salt_len);
+            if (udp_crypto_setkey(cipher, salt) != CRYPTO_OK
+                || udp_crypto_seal(cipher, pkt->data + salt_len, pkt->len,
+                                   pkt->data + salt_len + pkt->len) != CRYPTO_OK) {
+                pkt->len = 0;
+                continue;
+            }
+            pkt->len += salt_len + tag_len;
+            done++;
+        }
+    }
+
+    sodium_memzero(state.subkey, sizeof(state.subkey));
+    return done;
+}
+
+int
+udp_crypto_decrypt(cipher_t *cipher, replay_filter_t *replay,
+                   udp_packet_t *pkts, size_t count)
+{
+    if (udp_crypto_bind(cipher) != CRYPTO_OK)
+        return 0;
+
+    size_t salt_len = cipher->key_len;
+    size_t tag_len  = cipher->tag_len;
+    int done        = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        udp_packet_t *pkt = &pkts[i];
+
+        if (pkt->len <= salt_len + tag_len) {
+            pkt->len = 0;
+            continue;
+        }
+
+        size_t clen = pkt->len - salt_len - tag_len;
+        if (udp_crypto_setkey(cipher, pkt->data) != CRYPTO_OK
+            || udp_crypto_open(cipher, pkt->data + salt_len, clen,
+                               pkt->data + salt_len + clen) != CRYPTO_OK) {
+            pkt->len = 0;
+            continue;
+        }
+
+        // Only authenticated salts go into the filter
+        if (replay != NULL && replay_filter_add(replay, pkt->data, (int)salt_len)) {
+            LOGE("udpcrypto: repeat salt detected");
+            pkt->len = 0;
+            continue;
+        }
+
+        pkt->len = clen;
+        done++;
+    }
+
+    sodium_memzero(state.subkey, sizeof(state.subkey));
+    return done;
+}
+
+void
+udp_crypto_thread_release(void)
+{
+    if (state.aes_init)
+        mbedtls_aes_free(&state.aes);
+    hkdf_psk_release(&state.psk);
+    sodium_memzero(&state, sizeof(state));
+}
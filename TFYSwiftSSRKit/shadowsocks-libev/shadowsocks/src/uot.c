@@ -0,0 +1,410 @@
+/*
+ * uot.c - UDP over TCP framing and the per-server fallback switch
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+
+#include "uot.h"
+#include "utils.h"
+
+// Datagrams up to this size go out as one mux frame, larger ones as two
+#define UOT_COPY_MAX            2048
+
+size_t
+uot_magic_header(char *buf)
+{
+    size_t len = sizeof(UOT_MAGIC_HOST) - 1;
+    buf[0] = 3;             // domain name
+    buf[1] = (char)len;
+    memcpy(buf + 2, UOT_MAGIC_HOST, len);
+    buf[2 + len] = 0;       // port 0
+    buf[3 + len] = 0;
+    return 4 + len;
+}
+
+int
+uot_is_magic_host(const char *host, size_t len)
+{
+    return len == sizeof(UOT_MAGIC_HOST) - 1 && memcmp(host, UOT_MAGIC_HOST, len) == 0;
+}
+
+size_t
+uot_frame_header(char *buf, const struct sockaddr *addr, size_t len)
+{
+    size_t n;
+
+    if (len > UOT_MAX_PAYLOAD)
+        return 0;
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+        buf[0] = 1;
+        memcpy(buf + 1, &sin->sin_addr, 4);
+        memcpy(buf + 5, &sin->sin_port, 2);
+        n = 7;
+    } else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+        buf[0] = 4;
+        memcpy(buf + 1, &sin6->sin6_addr, 16);
+        memcpy(buf + 17, &sin6->sin6_port, 2);
+        n = 19;
+    } else {
+        return 0;
+    }
+    buf[n]     = (char)(len >> 8);
+    buf[n + 1] = (char)len;
+    return n + 2;
+}
+
+size_t
+uot_frame_header_host(char *buf, const char *host, size_t host_len,
+                      uint16_t port, size_t len)
+{
+    if (len > UOT_MAX_PAYLOAD || host_len == 0 || host_len > 255)
+        return 0;
+    buf[0] = 3;
+    buf[1] = (char)host_len;
+    memcpy(buf + 2, host, host_len);
+    size_t n = 2 + host_len;
+    buf[n]     = (char)(port >> 8);
+    buf[n + 1] = (char)port;
+    buf[n + 2] = (char)(len >> 8);
+    buf[n + 3] = (char)len;
+    return n + 4;
+}
+
+/*
+ * Bytes of the frame starting at buf that are needed to go on: the whole
+ * frame once its header is in, otherwise enough to read the header. 0 for
+ * an unknown address type.
+ */
+static size_t
+uot_frame_want(const char *buf, size_t len)
+{
+    size_t n;
+
+    if (len < 2)
+        return 2;
+    switch ((uint8_t)buf[0]) {
+    case 1:
+        n = 1 + 4 + 2;
+        break;
+    case 4:
+        n = 1 + 16 + 2;
+        break;
+    case 3:
+        if (buf[1] == 0)
+            return 0;
+        n = 2 + (uint8_t)buf[1] + 2;
+        break;
+    default:
+        return 0;
+    }
+    if (len < n + 2)
+        return n + 2;
+    return n + 2 + ((size_t)(uint8_t)buf[n] << 8 | (uint8_t)buf[n + 1]);
+}
+
+ssize_t
+uot_frame_parse(const char *buf, size_t len, uot_datagram_t *dgram)
+{
+    size_t want = uot_frame_want(buf, len);
+
+    if (want == 0)
+        return -1;
+    if (len < want)
+        return 0;
+
+    int atyp    = (uint8_t)buf[0];
+    size_t addr = atyp == 1 ? 4 : atyp == 4 ? 16 : 1 + (uint8_t)buf[1];
+    size_t n    = 1 + addr + 2;
+
+    dgram->atyp    = atyp;
+    dgram->port    = (uint16_t)((uint8_t)buf[n - 2] << 8 | (uint8_t)buf[n - 1]);
+    dgram->payload = buf + n + 2;
+    dgram->len     = want - n - 2;
+    dgram->host    = NULL;
+    dgram->host_len = 0;
+
+    if (atyp == 1) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&dgram->addr;
+        memset(sin, 0, sizeof(struct sockaddr_in));
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, buf + 1, 4);
+        sin->sin_port = htons(dgram->port);
+    } else if (atyp == 4) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&dgram->addr;
+        memset(sin6, 0, sizeof(struct sockaddr_in6));
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, buf + 1, 16);
+        sin6->sin6_port = htons(dgram->port);
+    } else {
+        dgram->addr.ss_family = AF_UNSPEC;
+        dgram->host     = buf + 2;
+        dgram->host_len = addr - 1;
+    }
+    return (ssize_t)want;
+}
+
+int
+uot_send(mux_stream_t *stream, const struct sockaddr *addr,
+         const char *payload, size_t len)
+{
+    char frame[UOT_MAX_HEADER + UOT_COPY_MAX];
+    size_t n = uot_frame_header(frame, addr, len);
+
+    if (n == 0 || mux_stream_writable(stream) < n + len)
+        return -1;
+
+    if (len <= UOT_COPY_MAX) {
+        memcpy(frame + n, payload, len);
+        mux_stream_write(stream, frame, n + len);
+    } else {
+        mux_stream_write(stream, frame, n);
+        mux_stream_write(stream, payload, len);
+    }
+    return 0;
+}
+
+void
+uot_reader_init(uot_reader_t *reader)
+{
+    memset(reader, 0, sizeof(uot_reader_t));
+}
+
+void
+uot_reader_release(uot_reader_t *reader)
+{
+    ss_free(reader->buf);
+    reader->len = 0;
+}
+
+static void
+uot_reader_deliver(uot_reader_t *reader, const uot_datagram_t *dgram,
+                   uot_datagram_cb cb, void *data)
+{
+    reader->frames++;
+    reader->bytes += dgram->len;
+    cb(data, dgram);
+}
+
+ssize_t
+uot_reader_input(uot_reader_t *reader, const char *buf, size_t len,
+                 uot_datagram_cb cb, void *data)
+{
+    uot_datagram_t dgram;
+    size_t taken = 0;
+
+    // Complete the frame left over from the last call, copying no further
+    while (reader->len > 0) {
+        size_t want = uot_frame_want(reader->buf, reader->len);
+        if (want == 0)
+            return -1;
+        if (reader->len < want) {
+            size_t n = want - reader->len;
+            if (n > len - taken)
+                n = len - taken;
+            if (n == 0)
+                return (ssize_t)len;
+            memcpy(reader->buf + reader->len, buf + taken, n);
+            reader->len += n;
+            taken       += n;
+            continue;
+        }
+        uot_frame_parse(reader->buf, reader->len, &dgram);
+        reader->len = 0;
+        uot_reader_deliver(reader, &dgram, cb, data);
+    }
+
+    // Whole frames straight from buf
+    while (taken < len) {
+        ssize_t n = uot_frame_parse(buf + taken, len - taken, &dgram);
+        if (n < 0)
+            return -1;
+        if (n == 0) {
+            if (reader->buf == NULL)
+                reader->buf = ss_malloc(UOT_MAX_FRAME);
+            memcpy(reader->buf, buf + taken, len - taken);
+            reader->len = len - taken;
+            break;
+        }
+        uot_reader_deliver(reader, &dgram, cb, data);
+        taken += n;
+    }
+    return (ssize_t)len;
+}
+
+typedef struct uot_probe {
+    uint32_t id;                // 0 for an empty slot
+    int answered;
+    double sent;
+} uot_probe_t;
+
+struct uot_path {
+    uot_path_config_t config;
+    int tcp;
+    double hold;
+    double switched;            // when the mode last changed
+    uint32_t next_id;
+    uot_probe_t probe[UOT_MAX_WINDOW];
+    uint64_t probes;
+    uint64_t answered;
+    uint64_t to_tcp;
+    uint64_t to_udp;
+};
+
+uot_path_t *
+uot_path_new(const uot_path_config_t *config)
+{
+    uot_path_t *path = ss_malloc(sizeof(uot_path_t));
+    memset(path, 0, sizeof(uot_path_t));
+    if (config != NULL)
+        path->config = *config;
+    if (path->config.window <= 0 || path->config.window > UOT_MAX_WINDOW)
+        path->config.window = UOT_DEFAULT_WINDOW;
+    if (path->config.min_probes <= 0 || path->config.min_probes > path->config.window)
+        path->config.min_probes = UOT_DEFAULT_MIN_PROBES < path->config.window
+                                  ? UOT_DEFAULT_MIN_PROBES : path->config.window;
+    if (path->config.loss_on <= 0 || path->config.loss_on > 1)
+        path->config.loss_on = UOT_DEFAULT_LOSS_ON;
+    if (path->config.loss_off <= 0 || path->config.loss_off >= path->config.loss_on)
+        path->config.loss_off = UOT_DEFAULT_LOSS_OFF < path->config.loss_on
+                                ? UOT_DEFAULT_LOSS_OFF : path->config.loss_on / 2;
+    if (path->config.timeout <= 0)
+        path->config.timeout = UOT_DEFAULT_TIMEOUT;
+    if (path->config.hold <= 0)
+        path->config.hold = UOT_DEFAULT_HOLD;
+    if (path->config.max_hold < path->config.hold)
+        path->config.max_hold = path->config.hold > UOT_DEFAULT_MAX_HOLD
+                                ? path->config.hold : UOT_DEFAULT_MAX_HOLD;
+
+    path->tcp     = path->config.mode == UOT_MODE_ALWAYS;
+    path->hold    = path->config.hold;
+    path->next_id = 1;
+    return path;
+}
+
+void
+uot_path_free(uot_path_t *path)
+{
+    ss_free(path);
+}
+
+uint32_t
+uot_path_probe_sent(uot_path_t *path, double now)
+{
+    uint32_t id = path->next_id++;
+    if (path->next_id == 0)
+        path->next_id = 1;
+
+    uot_probe_t *probe = &path->probe[id % path->config.window];
+    probe->id       = id;
+    probe->answered = 0;
+    probe->sent     = now;
+    path->probes++;
+    return id;
+}
+
+void
+uot_path_probe_answered(uot_path_t *path, uint32_t id, double now)
+{
+    uot_probe_t *probe = &path->probe[id % path->config.window];
+
+    // Late answers stay lost: the loss was already counted
+    if (id == 0 || probe->id != id || probe->answered
+        || now - probe->sent > path->config.timeout)
+        return;
+    probe->answered = 1;
+    path->answered++;
+}
+
+static double
+uot_path_loss(const uot_path_t *path, double now, int *settled)
+{
+    int lost = 0;
+
+    *settled = 0;
+    for (int i = 0; i < path->config.window; i++) {
+        const uot_probe_t *probe = &path->probe[i];
+        if (probe->id == 0)
+            continue;
+        if (probe->answered) {
+            (*settled)++;
+        } else if (now - probe->sent > path->config.timeout) {
+            (*settled)++;
+            lost++;
+        }
+    }
+    return *settled > 0 ? (double)lost / *settled : 0;
+}
+
+// Each mode is judged on probes sent after the switch to it
+static void
+uot_path_switch(uot_path_t *path, int tcp, double now)
+{
+    if (tcp) {
+        // Back so soon: UDP was not really better, wait longer next time
+        if (path->to_udp > 0 && now - path->switched < 2 * path->hold) {
+            path->hold *= 2;
+            if (path->hold > path->config.max_hold)
+                path->hold = path->config.max_hold;
+        } else {
+            path->hold = path->config.hold;
+        }
+        path->to_tcp++;
+    } else {
+        path->to_udp++;
+    }
+
+    LOGI("uot: UDP to this server now goes over %s", tcp ? "TCP" : "UDP");
+    path->tcp      = tcp;
+    path->switched = now;
+    memset(path->probe, 0, sizeof(path->probe));
+}
+
+int
+uot_path_use_tcp(uot_path_t *path, double now)
+{
+    if (path->config.mode != UOT_MODE_AUTO)
+        return path->config.mode == UOT_MODE_ALWAYS;
+
+    int settled;
+    double loss = uot_path_loss(path, now, &settled);
+    if (settled < path->config.min_probes)
+        return path->tcp;
+
+    if (!path->tcp && loss >= path->config.loss_on)
+        uot_path_switch(path, 1, now);
+    else if (path->tcp && loss <= path->config.loss_off && now - path->switched >= path->hold)
+        uot_path_switch(path, 0, now);
+    return path->tcp;
+}
+
+void
+uot_path_stats(uot_path_t *path, double now, uot_path_stats_t *stats)
+{
+    memset(stats, 0, sizeof(uot_path_stats_t));
+    stats->tcp      = uot_path_use_tcp(path, now);
+    stats->loss     = uot_path_loss(path, now, &stats->settled);
+    stats->hold     = path->hold;
+    stats->probes   = path->probes;
+    stats->answered = path->answered;
+    stats->to_tcp   = path->to_tcp;
+    stats->to_udp   = path->to_udp;
+}
@@ -0,0 +1,356 @@
+/*
+ * warmpool.c - Keep connections to the server open ahead of requests
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <libcork/ds.h>
+
+#include "membudget.h"
+#include "netutils.h"
+#include "warmpool.h"
+#include "utils.h"
+
+#define WARM_POOL_RATE_ALPHA    0.3
+#define WARM_POOL_RTT_ALPHA     0.25
+#define WARM_POOL_INITIAL_RTT   0.2
+#define WARM_POOL_MAX_BACKOFF   30.0
+
+typedef struct warm_conn {
+    struct cork_dllist_item entries;
+    warm_pool_t *pool;
+    int fd;
+    ev_tstamp since;
+    ev_io io;
+} warm_conn_t;
+
+struct warm_pool {
+    struct ev_loop *loop;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    warm_pool_config_t config;
+    ev_timer tick;
+    struct cork_dllist idle;        // oldest first
+    struct cork_dllist connecting;
+    size_t nidle;
+    size_t nconnecting;
+    size_t target;
+    uint64_t arrivals;              // since the last tick
+    ev_tstamp last_tick;
+    double rate;
+    double connect_time;
+    int failures;                   // in a row
+    ev_tstamp paused_until;
+    warm_pool_stats_t stats;
+};
+
+static void warm_pool_failed(warm_pool_t *pool);
+static void warm_conn_write_cb(EV_P_ ev_io *w, int revents);
+static void warm_conn_read_cb(EV_P_ ev_io *w, int revents);
+
+static void
+warm_conn_close(warm_conn_t *conn)
+{
+    warm_pool_t *pool = conn->pool;
+
+    ev_io_stop(pool->loop, &conn->io);
+    cork_dllist_remove(&conn->entries);
+    close(conn->fd);
+    ss_free(conn);
+}
+
+static int
+warm_pool_open(warm_pool_t *pool)
+{
+    int fd = socket(pool->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == -1) {
+        ERROR("warmpool: socket");
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    setnonblocking(fd);
+
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#ifdef SO_NOSIGPIPE
+    set_nosigpipe(fd);
+#endif
+
+    if (pool->config.setup != NULL && pool->config.setup(pool->config.data, fd) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&pool->addr, pool->addr_len) == -1
+        && errno != EINPROGRESS) {
+        ERROR("warmpool: connect");
+        close(fd);
+        warm_pool_failed(pool);
+        return -1;
+    }
+
+    warm_conn_t *conn = ss_malloc(sizeof(warm_conn_t));
+    memset(conn, 0, sizeof(warm_conn_t));
+    conn->pool  = pool;
+    conn->fd    = fd;
+    conn->since = ev_now(pool->loop);
+    ev_io_init(&conn->io, warm_conn_write_cb, fd, EV_WRITE);
+    conn->io.data = conn;
+    ev_io_start(pool->loop, &conn->io);
+
+    cork_dllist_add(&pool->connecting, &conn->entries);
+    pool->nconnecting++;
+    pool->stats.opened++;
+    return 0;
+}
+
+static void
+warm_pool_fill(warm_pool_t *pool)
+{
+    if (ev_now(pool->loop) < pool->paused_until)
+        return;
+    if (mem_budget_level() == MEM_BUDGET_PRESSURE)
+        return;
+
+    while (pool->nidle + pool->nconnecting < pool->target)
+        if (warm_pool_open(pool) == -1)
+            break;
+}
+
+static void
+warm_pool_failed(warm_pool_t *pool)
+{
+    pool->stats.failed++;
+    pool->failures++;
+
+    // 1, 2, 4 ... seconds without new connects while the server refuses
+    double backoff = ldexp(1.0, pool->failures - 1);
+    if (backoff > WARM_POOL_MAX_BACKOFF)
+        backoff = WARM_POOL_MAX_BACKOFF;
+    pool->paused_until = ev_now(pool->loop) + backoff;
+}
+
+static void
+warm_conn_write_cb(EV_P_ ev_io *w, int revents)
+{
+    warm_conn_t *conn = (warm_conn_t *)w->data;
+    warm_pool_t *pool = conn->pool;
+
+    int error     = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+        error = errno;
+
+    pool->nconnecting--;
+    if (error != 0) {
+        warm_conn_close(conn);
+        warm_pool_failed(pool);
+        return;
+    }
+
+    ev_tstamp now    = ev_now(pool->loop);
+    double sample    = now - conn->since;
+    pool->connect_time += WARM_POOL_RTT_ALPHA * (sample - pool->connect_time);
+    pool->failures      = 0;
+
+    ev_io_stop(pool->loop, &conn->io);
+    ev_io_init(&conn->io, warm_conn_read_cb, conn->fd, EV_READ);
+    conn->io.data = conn;
+    ev_io_start(pool->loop, &conn->io);
+
+    conn->since = now;
+    cork_dllist_remove(&conn->entries);
+    cork_dllist_add(&pool->idle, &conn->entries);
+    pool->nidle++;
+}
+
+/*
+ * Nothing was sent, so an idle socket has nothing to read: this is the
+ * server closing or resetting it.
+ */
+static void
+warm_conn_read_cb(EV_P_ ev_io *w, int revents)
+{
+    warm_conn_t *conn = (warm_conn_t *)w->data;
+    warm_pool_t *pool = conn->pool;
+
+    pool->nidle--;
+    pool->stats.dead++;
+    warm_conn_close(conn);
+    warm_pool_fill(pool);
+}
+
+static void
+warm_pool_tick_cb(EV_P_ ev_timer *w, int revents)
+{
+    warm_pool_t *pool = (warm_pool_t *)w->data;
+    ev_tstamp now     = ev_now(pool->loop);
+
+    double elapsed = now - pool->last_tick;
+    if (elapsed > 0) {
+        double sample = pool->arrivals / elapsed;
+        pool->rate     += WARM_POOL_RATE_ALPHA * (sample - pool->rate);
+        pool->arrivals  = 0;
+        pool->last_tick = now;
+    }
+
+    // Twice what arrives during one connect, for bursts
+    size_t target = (size_t)ceil(2.0 * pool->rate * pool->connect_time);
+    if (target < pool->config.min_idle)
+        target = pool->config.min_idle;
+    if (target > pool->config.max_idle)
+        target = pool->config.max_idle;
+    pool->target = target;
+
+    struct cork_dllist_item *curr, *next;
+    warm_conn_t *conn;
+
+    cork_dllist_foreach(&pool->connecting, curr, next, warm_conn_t, conn, entries) {
+        if (now - conn->since >= pool->config.connect_timeout) {
+            pool->nconnecting--;
+            warm_conn_close(conn);
+            warm_pool_failed(pool);
+        }
+    }
+
+    cork_dllist_foreach(&pool->idle, curr, next, warm_conn_t, conn, entries) {
+        if (pool->nidle > pool->target
+            || now - conn->since >= pool->config.idle_timeout) {
+            pool->nidle--;
+            pool->stats.expired++;
+            warm_conn_close(conn);
+        }
+    }
+
+    warm_pool_fill(pool);
+}
+
+warm_pool_t *
+warm_pool_new(struct ev_loop *loop, const struct sockaddr *addr,
+              socklen_t addr_len, const warm_pool_config_t *config)
+{
+    if (addr_len > sizeof(struct sockaddr_storage))
+        return NULL;
+
+    warm_pool_t *pool = ss_malloc(sizeof(warm_pool_t));
+    memset(pool, 0, sizeof(warm_pool_t));
+    pool->loop     = loop;
+    pool->addr_len = addr_len;
+    memcpy(&pool->addr, addr, addr_len);
+
+    if (config != NULL)
+        pool->config = *config;
+    if (pool->config.max_idle == 0)
+        pool->config.max_idle = WARM_POOL_DEFAULT_MAX_IDLE;
+    if (pool->config.min_idle > pool->config.max_idle)
+        pool->config.min_idle = pool->config.max_idle;
+    if (pool->config.idle_timeout <= 0)
+        pool->config.idle_timeout = WARM_POOL_DEFAULT_IDLE_TIMEOUT;
+    if (pool->config.connect_timeout <= 0)
+        pool->config.connect_timeout = WARM_POOL_DEFAULT_CONN_TIMEOUT;
+
+    pool->target       = pool->config.min_idle;
+    pool->connect_time = WARM_POOL_INITIAL_RTT;
+    cork_dllist_init(&pool->idle);
+    cork_dllist_init(&pool->connecting);
+
+    ev_timer_init(&pool->tick, warm_pool_tick_cb, WARM_POOL_TICK, WARM_POOL_TICK);
+    pool->tick.data = pool;
+    return pool;
+}
+
+void
+warm_pool_start(warm_pool_t *pool)
+{
+    pool->last_tick = ev_now(pool->loop);
+    ev_timer_start(pool->loop, &pool->tick);
+    warm_pool_fill(pool);
+}
+
+void
+warm_pool_free(warm_pool_t *pool)
+{
+    if (pool == NULL)
+        return;
+
+    ev_timer_stop(pool->loop, &pool->tick);
+
+    struct cork_dllist_item *curr, *next;
+    warm_conn_t *conn;
+    cork_dllist_foreach(&pool->connecting, curr, next, warm_conn_t, conn, entries) {
+        warm_conn_close(conn);
+    }
+    cork_dllist_foreach(&pool->idle, curr, next, warm_conn_t, conn, entries) {
+        warm_conn_close(conn);
+    }
+
+    ss_free(pool);
+}
+
+int
+warm_pool_take(warm_pool_t *pool)
+{
+    pool->arrivals++;
+
+    // Newest first: the oldest are the closest to the server's timeout
+    while (pool->nidle > 0) {
+        warm_conn_t *conn = cork_container_of(cork_dllist_end(&pool->idle),
+                                              warm_conn_t, entries);
+        pool->nidle--;
+
+        char c;
+        ssize_t r = recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            int fd = conn->fd;
+            ev_io_stop(pool->loop, &conn->io);
+            cork_dllist_remove(&conn->entries);
+            ss_free(conn);
+            pool->stats.hits++;
+            warm_pool_fill(pool);
+            return fd;
+        }
+
+        pool->stats.dead++;
+        warm_conn_close(conn);
+    }
+
+    pool->stats.misses++;
+    // Demand outran the estimate, do not wait for the next tick
+    if (pool->target < pool->config.max_idle)
+        pool->target++;
+    warm_pool_fill(pool);
+    return -1;
+}
+
+void
+warm_pool_stats(const warm_pool_t *pool, warm_pool_stats_t *stats)
+{
+    *stats              = pool->stats;
+    stats->idle         = pool->nidle;
+    stats->connecting   = pool->nconnecting;
+    stats->target       = pool->target;
+    stats->rate         = pool->rate;
+    stats->connect_time = pool->connect_time;
+}
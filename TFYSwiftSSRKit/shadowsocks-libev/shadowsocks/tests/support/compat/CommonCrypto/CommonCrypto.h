@@ -0,0 +1,17 @@
+/*
+ * The few CommonCrypto types encrypt.h and aead.h name, for building the
+ * tests on hosts other than Apple's.
+ */
+
+#ifndef _TEST_COMMONCRYPTO_H
+#define _TEST_COMMONCRYPTO_H
+
+#include <stdint.h>
+
+typedef void *CCCryptorRef;
+typedef uint32_t CCOperation;
+typedef uint32_t CCAlgorithm;
+typedef uint32_t CCMode;
+typedef uint32_t CCPadding;
+
+#endif // _TEST_COMMONCRYPTO_H
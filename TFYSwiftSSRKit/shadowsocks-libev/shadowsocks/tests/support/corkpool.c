@@ -0,0 +1,121 @@
+/*
+ * corkpool.c - The libcork mempool calls the modules use, for hosts without the prebuilt library
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libcork/core/mempool.h>
+
+/*
+ * libcork is only in-tree as Apple builds. This follows its mempool
+ * layout: blocks of block_size carved into elements, each behind a one
+ * pointer header that links it into the free list, and nothing returned
+ * to the system before cork_mempool_free(), which insists that every
+ * object has come back.
+ */
+
+struct cork_mempool_object {
+    struct cork_mempool_object *next_free;
+};
+
+struct cork_mempool_block {
+    struct cork_mempool_block *next;
+};
+
+struct cork_mempool {
+    size_t element_size;
+    size_t block_size;
+    struct cork_mempool_object *free_list;
+    struct cork_mempool_block *blocks;
+    size_t allocated_count;
+};
+
+#define OBJECT_SIZE(mp) (sizeof(struct cork_mempool_object) + (mp)->element_size)
+
+struct cork_mempool *
+cork_mempool_new_size_ex(size_t element_size, size_t block_size)
+{
+    struct cork_mempool *mp = calloc(1, sizeof(struct cork_mempool));
+    if (mp == NULL)
+        return NULL;
+    mp->element_size = element_size;
+    mp->block_size   = block_size;
+    return mp;
+}
+
+void
+cork_mempool_free(struct cork_mempool *mp)
+{
+    if (mp->allocated_count != 0) {
+        fprintf(stderr, "cork_mempool_free: %zu objects still allocated\n",
+                mp->allocated_count);
+        abort();
+    }
+    while (mp->blocks != NULL) {
+        struct cork_mempool_block *block = mp->blocks;
+        mp->blocks = block->next;
+        free(block);
+    }
+    free(mp);
+}
+
+static int
+cork_mempool_new_block(struct cork_mempool *mp)
+{
+    size_t header = sizeof(struct cork_mempool_block);
+    size_t count  = (mp->block_size - header) / OBJECT_SIZE(mp);
+    if (count == 0)
+        count = 1;
+
+    struct cork_mempool_block *block = malloc(header + count * OBJECT_SIZE(mp));
+    if (block == NULL)
+        return -1;
+    block->next = mp->blocks;
+    mp->blocks  = block;
+
+    char *p = (char *)block + header;
+    for (size_t i = 0; i < count; i++, p += OBJECT_SIZE(mp)) {
+        struct cork_mempool_object *obj = (struct cork_mempool_object *)p;
+        obj->next_free = mp->free_list;
+        mp->free_list  = obj;
+    }
+    return 0;
+}
+
+void *
+cork_mempool_new_object(struct cork_mempool *mp)
+{
+    if (mp->free_list == NULL && cork_mempool_new_block(mp) == -1)
+        return NULL;
+
+    struct cork_mempool_object *obj = mp->free_list;
+    mp->free_list = obj->next_free;
+    mp->allocated_count++;
+    return obj + 1;
+}
+
+void
+cork_mempool_free_object(struct cork_mempool *mp, void *ptr)
+{
+    struct cork_mempool_object *obj = (struct cork_mempool_object *)ptr - 1;
+    obj->next_free = mp->free_list;
+    mp->free_list  = obj;
+    mp->allocated_count--;
+}
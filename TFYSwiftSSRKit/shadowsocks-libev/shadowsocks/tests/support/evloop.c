@@ -0,0 +1,320 @@
+/*
+ * evloop.c - A poll(2) based stand-in for the parts of libev the modules use
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ev.h>
+
+/*
+ * The tests link this instead of the prebuilt libev so that they build
+ * wherever a C compiler does. It keeps libev's semantics for what the
+ * modules use: io, one-shot and repeating timers, ev_timer_again(),
+ * ev_async_send() from any thread, ev_now() cached per iteration, and
+ * ev_run() returning once nothing is active or ev_break() was called.
+ */
+
+#define EVLOOP_MAX_IO       256
+#define EVLOOP_MAX_TIMERS   256
+#define EVLOOP_MAX_ASYNC    16
+
+struct ev_loop {
+    ev_io *io[EVLOOP_MAX_IO];
+    int nio;
+    ev_timer *timer[EVLOOP_MAX_TIMERS];
+    ev_tstamp due[EVLOOP_MAX_TIMERS];
+    int ntimer;
+    ev_async *async[EVLOOP_MAX_ASYNC];
+    int nasync;
+    int wake[2];
+    ev_tstamp now;
+    int brk;
+};
+
+static ev_tstamp
+evloop_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct ev_loop *
+ev_loop_new(unsigned int flags)
+{
+    struct ev_loop *loop = calloc(1, sizeof(struct ev_loop));
+    if (loop == NULL)
+        return NULL;
+    if (pipe(loop->wake) == -1) {
+        free(loop);
+        return NULL;
+    }
+    fcntl(loop->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(loop->wake[1], F_SETFL, O_NONBLOCK);
+    loop->now = evloop_clock();
+    (void)flags;
+    return loop;
+}
+
+void
+ev_loop_destroy(struct ev_loop *loop)
+{
+    close(loop->wake[0]);
+    close(loop->wake[1]);
+    free(loop);
+}
+
+ev_tstamp
+ev_now(struct ev_loop *loop)
+{
+    return loop->now;
+}
+
+void
+ev_break(struct ev_loop *loop, int how)
+{
+    loop->brk = how != EVBREAK_CANCEL;
+}
+
+void
+ev_io_start(struct ev_loop *loop, ev_io *w)
+{
+    if (w->active || loop->nio == EVLOOP_MAX_IO)
+        return;
+    w->active            = 1;
+    loop->io[loop->nio++] = w;
+}
+
+void
+ev_io_stop(struct ev_loop *loop, ev_io *w)
+{
+    if (!w->active)
+        return;
+    w->active = 0;
+    for (int i = 0; i < loop->nio; i++) {
+        if (loop->io[i] == w) {
+            loop->io[i] = loop->io[--loop->nio];
+            break;
+        }
+    }
+}
+
+static int
+evloop_timer_index(struct ev_loop *loop, ev_timer *w)
+{
+    for (int i = 0; i < loop->ntimer; i++)
+        if (loop->timer[i] == w)
+            return i;
+    return -1;
+}
+
+void
+ev_timer_start(struct ev_loop *loop, ev_timer *w)
+{
+    if (w->active || loop->ntimer == EVLOOP_MAX_TIMERS)
+        return;
+    w->active                 = 1;
+    loop->timer[loop->ntimer] = w;
+    loop->due[loop->ntimer++] = loop->now + w->at;
+}
+
+void
+ev_timer_stop(struct ev_loop *loop, ev_timer *w)
+{
+    if (!w->active)
+        return;
+    w->active = 0;
+    int i     = evloop_timer_index(loop, w);
+    if (i != -1) {
+        loop->ntimer--;
+        loop->timer[i] = loop->timer[loop->ntimer];
+        loop->due[i]   = loop->due[loop->ntimer];
+    }
+}
+
+void
+ev_timer_again(struct ev_loop *loop, ev_timer *w)
+{
+    if (w->active) {
+        if (w->repeat > 0)
+            loop->due[evloop_timer_index(loop, w)] = loop->now + w->repeat;
+        else
+            ev_timer_stop(loop, w);
+    } else if (w->repeat > 0) {
+        w->at = w->repeat;
+        ev_timer_start(loop, w);
+    }
+}
+
+ev_tstamp
+ev_timer_remaining(struct ev_loop *loop, ev_timer *w)
+{
+    int i = w->active ? evloop_timer_index(loop, w) : -1;
+    return i == -1 ? w->at : loop->due[i] - loop->now;
+}
+
+void
+ev_async_start(struct ev_loop *loop, ev_async *w)
+{
+    if (w->active || loop->nasync == EVLOOP_MAX_ASYNC)
+        return;
+    w->active                    = 1;
+    loop->async[loop->nasync++] = w;
+}
+
+void
+ev_async_stop(struct ev_loop *loop, ev_async *w)
+{
+    if (!w->active)
+        return;
+    w->active = 0;
+    for (int i = 0; i < loop->nasync; i++) {
+        if (loop->async[i] == w) {
+            loop->async[i] = loop->async[--loop->nasync];
+            break;
+        }
+    }
+}
+
+void
+ev_async_send(struct ev_loop *loop, ev_async *w)
+{
+    atomic_store((_Atomic sig_atomic_t *)&w->sent, 1);
+    ssize_t n = write(loop->wake[1], "", 1);
+    (void)n;
+}
+
+static int
+evloop_io_active(struct ev_loop *loop, ev_io *w)
+{
+    for (int i = 0; i < loop->nio; i++)
+        if (loop->io[i] == w)
+            return 1;
+    return 0;
+}
+
+static void
+evloop_run_timers(struct ev_loop *loop)
+{
+    // A callback may start and stop timers, so rescan after each one
+    for (int i = 0; i < loop->ntimer && !loop->brk; i++) {
+        if (loop->due[i] > loop->now)
+            continue;
+        ev_timer *w = loop->timer[i];
+        if (w->repeat > 0)
+            loop->due[i] = loop->now + w->repeat;
+        else
+            ev_timer_stop(loop, w);
+        w->cb(loop, w, EV_TIMER);
+        i = -1;
+    }
+}
+
+int
+ev_run(struct ev_loop *loop, int flags)
+{
+    loop->brk = 0;
+    do {
+        struct pollfd fds[EVLOOP_MAX_IO + 1];
+        ev_io *ready[EVLOOP_MAX_IO];
+        int n = loop->nio;
+
+        if (n == 0 && loop->ntimer == 0 && loop->nasync == 0)
+            break;
+
+        double timeout = flags & EVRUN_NOWAIT ? 0 : 60;
+        for (int i = 0; i < loop->ntimer; i++)
+            if (loop->due[i] - loop->now < timeout)
+                timeout = loop->due[i] - loop->now;
+        if (timeout < 0)
+            timeout = 0;
+
+        for (int i = 0; i < n; i++) {
+            ready[i]      = loop->io[i];
+            fds[i].fd     = ready[i]->fd;
+            fds[i].events = (ready[i]->events & EV_READ ? POLLIN : 0)
+                            | (ready[i]->events & EV_WRITE ? POLLOUT : 0);
+        }
+        fds[n].fd     = loop->wake[0];
+        fds[n].events = POLLIN;
+
+        int r = poll(fds, n + 1, (int)(timeout * 1000 + 0.999));
+        loop->now = evloop_clock();
+        if (r == -1 && errno != EINTR)
+            return 0;
+
+        if (r > 0 && fds[n].revents) {
+            char buf[64];
+            while (read(loop->wake[0], buf, sizeof(buf)) > 0) {
+            }
+            for (int i = 0; i < loop->nasync && !loop->brk; i++) {
+                ev_async *w = loop->async[i];
+                if (atomic_exchange((_Atomic sig_atomic_t *)&w->sent, 0))
+                    w->cb(loop, w, EV_ASYNC);
+            }
+        }
+
+        for (int i = 0; r > 0 && i < n && !loop->brk; i++) {
+            if (fds[i].revents == 0 || !evloop_io_active(loop, ready[i]))
+                continue;
+            int revents = 0;
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                revents |= EV_READ;
+            if (fds[i].revents & (POLLOUT | POLLHUP | POLLERR))
+                revents |= EV_WRITE;
+            revents &= ready[i]->events;
+            if (revents)
+                ready[i]->cb(loop, ready[i], revents);
+        }
+
+        evloop_run_timers(loop);
+    } while (!loop->brk && !(flags & (EVRUN_ONCE | EVRUN_NOWAIT)));
+
+    return loop->nio + loop->ntimer + loop->nasync;
+}
+
+int
+evloop_step(struct ev_loop *loop, double until)
+{
+    int next = -1;
+    for (int i = 0; i < loop->ntimer; i++)
+        if (loop->due[i] <= until && (next == -1 || loop->due[i] < loop->due[next]))
+            next = i;
+    if (next == -1) {
+        loop->now = until;
+        return 0;
+    }
+
+    ev_timer *w = loop->timer[next];
+    if (loop->due[next] > loop->now)
+        loop->now = loop->due[next];
+    if (w->repeat > 0)
+        loop->due[next] = loop->now + w->repeat;
+    else
+        ev_timer_stop(loop, w);
+    w->cb(loop, w, EV_TIMER);
+    return 1;
+}
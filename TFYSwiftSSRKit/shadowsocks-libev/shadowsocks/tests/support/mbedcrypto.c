@@ -0,0 +1,442 @@
+/*
+ * mbedcrypto.c - The mbedtls calls the modules use, for hosts without the prebuilt library
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <mbedtls/aes.h>
+#include <mbedtls/gcm.h>
+#include <mbedtls/md.h>
+#include <mbedtls/sha1.h>
+#include <openssl/evp.h>
+
+/*
+ * The in-tree mbedtls headers are 3.x and its libraries are built for
+ * Apple platforms only, while Linux distributions ship 2.x with other
+ * struct layouts. Elsewhere the tests link this: SHA-1 written out, the
+ * mbedtls_md HMAC calls on top of it, and AES and GCM through OpenSSL
+ * with the key kept in the mbedtls context.
+ */
+
+typedef struct mbedcrypto_key {
+    unsigned char key[32];
+    unsigned int bits;
+} mbedcrypto_key_t;
+
+_Static_assert(sizeof(mbedcrypto_key_t) <= sizeof(mbedtls_gcm_context), "gcm context");
+_Static_assert(sizeof(mbedcrypto_key_t) <= sizeof(mbedtls_aes_context), "aes context");
+
+#define ROL(x, n) ((uint32_t)((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+sha1_block(mbedtls_sha1_context *ctx, const unsigned char *p)
+{
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16
+               | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 80; i++)
+        w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2];
+    uint32_t d = ctx->state[3], e = ctx->state[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t t = ROL(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROL(b, 30);
+        b = a;
+        a = t;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+}
+
+void
+mbedtls_sha1_init(mbedtls_sha1_context *ctx)
+{
+    memset(ctx, 0, sizeof(mbedtls_sha1_context));
+}
+
+void
+mbedtls_sha1_free(mbedtls_sha1_context *ctx)
+{
+    if (ctx != NULL)
+        memset(ctx, 0, sizeof(mbedtls_sha1_context));
+}
+
+void
+mbedtls_sha1_clone(mbedtls_sha1_context *dst, const mbedtls_sha1_context *src)
+{
+    *dst = *src;
+}
+
+int
+mbedtls_sha1_starts(mbedtls_sha1_context *ctx)
+{
+    static const uint32_t iv[5] = {
+        0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+    };
+    ctx->total[0] = 0;
+    ctx->total[1] = 0;
+    memcpy(ctx->state, iv, sizeof(iv));
+    return 0;
+}
+
+int
+mbedtls_sha1_update(mbedtls_sha1_context *ctx, const unsigned char *input, size_t ilen)
+{
+    size_t fill = ctx->total[0] & 63;
+
+    ctx->total[0] += (uint32_t)ilen;
+    if (ctx->total[0] < (uint32_t)ilen)
+        ctx->total[1]++;
+
+    while (ilen > 0) {
+        size_t n = 64 - fill < ilen ? 64 - fill : ilen;
+        memcpy(ctx->buffer + fill, input, n);
+        fill  += n;
+        input += n;
+        ilen  -= n;
+        if (fill == 64) {
+            sha1_block(ctx, ctx->buffer);
+            fill = 0;
+        }
+    }
+    return 0;
+}
+
+int
+mbedtls_sha1_finish(mbedtls_sha1_context *ctx, unsigned char output[20])
+{
+    uint64_t bits = ((uint64_t)ctx->total[1] << 32 | ctx->total[0]) << 3;
+    unsigned char pad[72] = { 0x80 };
+    size_t used = ctx->total[0] & 63;
+    size_t n    = used < 56 ? 56 - used : 120 - used;
+
+    for (int i = 0; i < 8; i++)
+        pad[n + i] = (unsigned char)(bits >> (56 - 8 * i));
+    mbedtls_sha1_update(ctx, pad, n + 8);
+    for (int i = 0; i < 20; i++)
+        output[i] = (unsigned char)(ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+    return 0;
+}
+
+int
+mbedtls_sha1(const unsigned char *input, size_t ilen, unsigned char output[20])
+{
+    mbedtls_sha1_context ctx;
+    mbedtls_sha1_init(&ctx);
+    mbedtls_sha1_starts(&ctx);
+    mbedtls_sha1_update(&ctx, input, ilen);
+    mbedtls_sha1_finish(&ctx, output);
+    mbedtls_sha1_free(&ctx);
+    return 0;
+}
+
+/*
+ * SHA-1 only. Like mbedtls, mbedtls_md_setup() allocates the digest
+ * context and both HMAC pads on the heap, so that code written against
+ * this API costs here what it costs with the real library.
+ */
+struct mbedtls_md_info_t {
+    mbedtls_md_type_t type;
+};
+
+static const mbedtls_md_info_t mbedcrypto_sha1_info = { MBEDTLS_MD_SHA1 };
+
+const mbedtls_md_info_t *
+mbedtls_md_info_from_type(mbedtls_md_type_t md_type)
+{
+    return md_type == MBEDTLS_MD_SHA1 ? &mbedcrypto_sha1_info : NULL;
+}
+
+unsigned char
+mbedtls_md_get_size(const mbedtls_md_info_t *md_info)
+{
+    return md_info != NULL ? 20 : 0;
+}
+
+void
+mbedtls_md_init(mbedtls_md_context_t *ctx)
+{
+    memset(ctx, 0, sizeof(mbedtls_md_context_t));
+}
+
+void
+mbedtls_md_free(mbedtls_md_context_t *ctx)
+{
+    if (ctx == NULL)
+        return;
+    if (ctx->md_ctx != NULL) {
+        mbedtls_sha1_free(ctx->md_ctx);
+        free(ctx->md_ctx);
+    }
+    if (ctx->hmac_ctx != NULL) {
+        memset(ctx->hmac_ctx, 0, 2 * 64);
+        free(ctx->hmac_ctx);
+    }
+    memset(ctx, 0, sizeof(mbedtls_md_context_t));
+}
+
+int
+mbedtls_md_setup(mbedtls_md_context_t *ctx, const mbedtls_md_info_t *md_info, int hmac)
+{
+    if (md_info == NULL)
+        return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+    ctx->md_info = md_info;
+    ctx->md_ctx  = calloc(1, sizeof(mbedtls_sha1_context));
+    if (ctx->md_ctx == NULL)
+        return MBEDTLS_ERR_MD_ALLOC_FAILED;
+    mbedtls_sha1_init(ctx->md_ctx);
+    if (hmac) {
+        ctx->hmac_ctx = calloc(2, 64);
+        if (ctx->hmac_ctx == NULL) {
+            mbedtls_md_free(ctx);
+            return MBEDTLS_ERR_MD_ALLOC_FAILED;
+        }
+    }
+    return 0;
+}
+
+int
+mbedtls_md_hmac_starts(mbedtls_md_context_t *ctx, const unsigned char *key, size_t keylen)
+{
+    unsigned char sum[20];
+    unsigned char *ipad = ctx->hmac_ctx, *opad = ipad + 64;
+
+    if (ctx->md_ctx == NULL || ipad == NULL)
+        return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+    if (keylen > 64) {
+        mbedtls_sha1(key, keylen, sum);
+        key    = sum;
+        keylen = 20;
+    }
+    memset(ipad, 0x36, 64);
+    memset(opad, 0x5c, 64);
+    for (size_t i = 0; i < keylen; i++) {
+        ipad[i] ^= key[i];
+        opad[i] ^= key[i];
+    }
+    mbedtls_sha1_starts(ctx->md_ctx);
+    mbedtls_sha1_update(ctx->md_ctx, ipad, 64);
+    return 0;
+}
+
+int
+mbedtls_md_hmac_update(mbedtls_md_context_t *ctx, const unsigned char *input, size_t ilen)
+{
+    if (ctx->md_ctx == NULL || ctx->hmac_ctx == NULL)
+        return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+    mbedtls_sha1_update(ctx->md_ctx, input, ilen);
+    return 0;
+}
+
+int
+mbedtls_md_hmac_finish(mbedtls_md_context_t *ctx, unsigned char *output)
+{
+    unsigned char tmp[20];
+    unsigned char *opad = (unsigned char *)ctx->hmac_ctx + 64;
+
+    if (ctx->md_ctx == NULL || ctx->hmac_ctx == NULL)
+        return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+    mbedtls_sha1_finish(ctx->md_ctx, tmp);
+    mbedtls_sha1_starts(ctx->md_ctx);
+    mbedtls_sha1_update(ctx->md_ctx, opad, 64);
+    mbedtls_sha1_update(ctx->md_ctx, tmp, 20);
+    mbedtls_sha1_finish(ctx->md_ctx, output);
+    return 0;
+}
+
+int
+mbedtls_md_hmac(const mbedtls_md_info_t *md_info, const unsigned char *key, size_t keylen,
+                const unsigned char *input, size_t ilen, unsigned char *output)
+{
+    mbedtls_md_context_t ctx;
+    int ret;
+
+    mbedtls_md_init(&ctx);
+    ret = mbedtls_md_setup(&ctx, md_info, 1);
+    if (ret == 0)
+        ret = mbedtls_md_hmac_starts(&ctx, key, keylen)
+              || mbedtls_md_hmac_update(&ctx, input, ilen)
+              || mbedtls_md_hmac_finish(&ctx, output) ? MBEDTLS_ERR_MD_BAD_INPUT_DATA : 0;
+    mbedtls_md_free(&ctx);
+    return ret;
+}
+
+static int
+mbedcrypto_setkey(void *ctx, const unsigned char *key, unsigned int bits)
+{
+    mbedcrypto_key_t *k = ctx;
+    if (bits != 128 && bits != 192 && bits != 256)
+        return -1;
+    memcpy(k->key, key, bits / 8);
+    k->bits = bits;
+    return 0;
+}
+
+static const EVP_CIPHER *
+mbedcrypto_gcm(unsigned int bits)
+{
+    return bits == 128 ? EVP_aes_128_gcm() : bits == 192 ? EVP_aes_192_gcm() : EVP_aes_256_gcm();
+}
+
+void
+mbedtls_gcm_init(mbedtls_gcm_context *ctx)
+{
+    memset(ctx, 0, sizeof(mbedtls_gcm_context));
+}
+
+void
+mbedtls_gcm_free(mbedtls_gcm_context *ctx)
+{
+    if (ctx != NULL)
+        memset(ctx, 0, sizeof(mbedtls_gcm_context));
+}
+
+int
+mbedtls_gcm_setkey(mbedtls_gcm_context *ctx, mbedtls_cipher_id_t cipher,
+                   const unsigned char *key, unsigned int keybits)
+{
+    return cipher == MBEDTLS_CIPHER_ID_AES ? mbedcrypto_setkey(ctx, key, keybits) : -1;
+}
+
+int
+mbedtls_gcm_crypt_and_tag(mbedtls_gcm_context *ctx, int mode, size_t length,
+                          const unsigned char *iv, size_t iv_len,
+                          const unsigned char *add, size_t add_len,
+                          const unsigned char *input, unsigned char *output,
+                          size_t tag_len, unsigned char *tag)
+{
+    mbedcrypto_key_t *k = (mbedcrypto_key_t *)ctx;
+    EVP_CIPHER_CTX *x   = EVP_CIPHER_CTX_new();
+    int len, ok;
+
+    if (mode != MBEDTLS_GCM_ENCRYPT || x == NULL) {
+        EVP_CIPHER_CTX_free(x);
+        return -1;
+    }
+    ok = EVP_EncryptInit_ex(x, mbedcrypto_gcm(k->bits), NULL, NULL, NULL)
+         && EVP_CIPHER_CTX_ctrl(x, EVP_CTRL_GCM_SET_IVLEN, (int)iv_len, NULL)
+         && EVP_EncryptInit_ex(x, NULL, NULL, k->key, iv)
+         && (add_len == 0 || EVP_EncryptUpdate(x, NULL, &len, add, (int)add_len))
+         && (length == 0 || EVP_EncryptUpdate(x, output, &len, input, (int)length))
+         && EVP_EncryptFinal_ex(x, output, &len)
+         && EVP_CIPHER_CTX_ctrl(x, EVP_CTRL_GCM_GET_TAG, (int)tag_len, tag);
+    EVP_CIPHER_CTX_free(x);
+    return ok ? 0 : -1;
+}
+
+int
+mbedtls_gcm_auth_decrypt(mbedtls_gcm_context *ctx, size_t length,
+                         const unsigned char *iv, size_t iv_len,
+                         const unsigned char *add, size_t add_len,
+                         const unsigned char *tag, size_t tag_len,
+                         const unsigned char *input, unsigned char *output)
+{
+    mbedcrypto_key_t *k = (mbedcrypto_key_t *)ctx;
+    EVP_CIPHER_CTX *x   = EVP_CIPHER_CTX_new();
+    int len, ok;
+
+    if (x == NULL)
+        return -1;
+    ok = EVP_DecryptInit_ex(x, mbedcrypto_gcm(k->bits), NULL, NULL, NULL)
+         && EVP_CIPHER_CTX_ctrl(x, EVP_CTRL_GCM_SET_IVLEN, (int)iv_len, NULL)
+         && EVP_DecryptInit_ex(x, NULL, NULL, k->key, iv)
+         && (add_len == 0 || EVP_DecryptUpdate(x, NULL, &len, add, (int)add_len))
+         && (length == 0 || EVP_DecryptUpdate(x, output, &len, input, (int)length))
+         && EVP_CIPHER_CTX_ctrl(x, EVP_CTRL_GCM_SET_TAG, (int)tag_len, (void *)tag)
+         && EVP_DecryptFinal_ex(x, output + length, &len) > 0;
+    EVP_CIPHER_CTX_free(x);
+    return ok ? 0 : MBEDTLS_ERR_GCM_AUTH_FAILED;
+}
+
+void
+mbedtls_aes_init(mbedtls_aes_context *ctx)
+{
+    memset(ctx, 0, sizeof(mbedtls_aes_context));
+}
+
+void
+mbedtls_aes_free(mbedtls_aes_context *ctx)
+{
+    if (ctx != NULL)
+        memset(ctx, 0, sizeof(mbedtls_aes_context));
+}
+
+int
+mbedtls_aes_setkey_enc(mbedtls_aes_context *ctx, const unsigned char *key, unsigned int keybits)
+{
+    return mbedcrypto_setkey(ctx, key, keybits);
+}
+
+int
+mbedtls_aes_setkey_dec(mbedtls_aes_context *ctx, const unsigned char *key, unsigned int keybits)
+{
+    return mbedcrypto_setkey(ctx, key, keybits);
+}
+
+int
+mbedtls_aes_crypt_ecb(mbedtls_aes_context *ctx, int mode,
+                      const unsigned char input[16], unsigned char output[16])
+{
+    mbedcrypto_key_t *k = (mbedcrypto_key_t *)ctx;
+    const EVP_CIPHER *e = k->bits == 128 ? EVP_aes_128_ecb()
+                          : k->bits == 192 ? EVP_aes_192_ecb() : EVP_aes_256_ecb();
+    EVP_CIPHER_CTX *x   = EVP_CIPHER_CTX_new();
+    unsigned char block[32];
+    int len, ok;
+
+    if (x == NULL)
+        return -1;
+    if (mode == MBEDTLS_AES_ENCRYPT)
+        ok = EVP_EncryptInit_ex(x, e, NULL, k->key, NULL)
+             && EVP_CIPHER_CTX_set_padding(x, 0)
+             && EVP_EncryptUpdate(x, block, &len, input, 16);
+    else
+        ok = EVP_DecryptInit_ex(x, e, NULL, k->key, NULL)
+             && EVP_CIPHER_CTX_set_padding(x, 0)
+             && EVP_DecryptUpdate(x, block, &len, input, 16);
+    EVP_CIPHER_CTX_free(x);
+    if (!ok)
+        return -1;
+    memcpy(output, block, 16);
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * runtime.c - The utils and buffer calls that the prebuilt archive provides
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "encrypt.h"
+#include "netutils.h"
+#include "utils.h"
+
+void *
+ss_malloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL)
+        FATAL("out of memory");
+    return p;
+}
+
+void *
+ss_realloc(void *ptr, size_t new_size)
+{
+    void *p = realloc(ptr, new_size);
+    if (p == NULL && new_size > 0)
+        FATAL("out of memory");
+    return p;
+}
+
+void
+FATAL(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    abort();
+}
+
+void
+ERROR(const char *s)
+{
+    perror(s);
+}
+
+int
+setnonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int
+set_reuseport(int socket)
+{
+    int opt = 1;
+    return setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+}
+
+int
+balloc(buffer_t *ptr, size_t capacity)
+{
+    memset(ptr, 0, sizeof(buffer_t));
+    ptr->array    = ss_malloc(capacity);
+    ptr->capacity = capacity;
+    return (int)capacity;
+}
+
+int
+brealloc(buffer_t *ptr, size_t len, size_t capacity)
+{
+    size_t real_capacity = len > capacity ? len : capacity;
+    if (ptr->capacity < real_capacity) {
+        ptr->array    = ss_realloc(ptr->array, real_capacity);
+        ptr->capacity = real_capacity;
+    }
+    return (int)real_capacity;
+}
+
+void
+bfree(buffer_t *ptr)
+{
+    if (ptr == NULL)
+        return;
+    ptr->idx      = 0;
+    ptr->len      = 0;
+    ptr->capacity = 0;
+    if (ptr->array != NULL)
+        ss_free(ptr->array);
+}
@@ -0,0 +1,73 @@
+/*
+ * test.h - Checks and helpers shared by the module tests and benchmarks
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Each test is one executable that returns 0 or aborts at the first
+ * failed CHECK, so that ctest, ASan and a debugger all see where.
+ */
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+} while (0)
+
+// Monotonic seconds
+double test_now(void);
+
+// Thread CPU seconds, for the benchmarks
+double test_cpu_now(void);
+
+// A connected TCP pair over loopback, both ends blocking
+void test_tcp_pair(int *a, int *b);
+
+// A nonblocking loopback listener; *port is 0 for any and set on return
+int test_listen(uint16_t *port, int backlog);
+
+// Loopback IPv4 address of port
+socklen_t test_loopback(uint16_t port, struct sockaddr_storage *addr);
+
+/*
+ * Simulated time on the stand-in loop, for timers that run for minutes:
+ * fire the earliest timer due by until with ev_now() moved to its due time
+ * and return 1, or move ev_now() to until and return 0. No io is polled.
+ */
+struct ev_loop;
+int evloop_step(struct ev_loop *loop, double until);
+
+/*
+ * Textbook HKDF-SHA1 (RFC 5869) on one-shot mbedtls_sha1() calls, as an
+ * independent reference for hkdf.c. testutil.c also defines the archive's
+ * crypto_hkdf() (declared in aead.h), which hkdf.c must match and the
+ * benchmark measures against.
+ */
+int test_hkdf_sha1(const uint8_t *salt, size_t salt_len, const uint8_t *ikm, size_t ikm_len,
+                   const uint8_t *info, size_t info_len, uint8_t *okm, size_t okm_len);
+
+#endif // _TEST_H
@@ -0,0 +1,202 @@
+/*
+ * testutil.c - Helpers shared by the module tests and benchmarks
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <mbedtls/md.h>
+#include <mbedtls/sha1.h>
+
+#include "aead.h"
+#include "test.h"
+
+double
+test_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double
+test_cpu_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+socklen_t
+test_loopback(uint16_t port, struct sockaddr_storage *addr)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    sin->sin_family      = AF_INET;
+    sin->sin_port        = htons(port);
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return sizeof(struct sockaddr_in);
+}
+
+int
+test_listen(uint16_t *port, int backlog)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = test_loopback(*port, &addr);
+    int opt       = 1;
+    int fd        = socket(AF_INET, SOCK_STREAM, 0);
+
+    CHECK(fd != -1);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    CHECK(bind(fd, (struct sockaddr *)&addr, len) == 0);
+    CHECK(listen(fd, backlog) == 0);
+    CHECK(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    *port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+void
+test_tcp_pair(int *a, int *b)
+{
+    struct sockaddr_storage addr;
+    uint16_t port = 0;
+    int l         = test_listen(&port, 1);
+    socklen_t len = test_loopback(port, &addr);
+
+    fcntl(l, F_SETFL, fcntl(l, F_GETFL, 0) & ~O_NONBLOCK);
+    *a = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(*a != -1);
+    CHECK(connect(*a, (struct sockaddr *)&addr, len) == 0);
+    *b = accept(l, NULL, NULL);
+    CHECK(*b != -1);
+    close(l);
+}
+
+static void
+test_hmac_sha1(const uint8_t *key, size_t key_len, const uint8_t *msg, size_t msg_len,
+               uint8_t out[20])
+{
+    uint8_t k[64] = { 0 };
+    uint8_t buf[64 + 512];
+    uint8_t inner[20];
+
+    CHECK(msg_len <= 512);
+    if (key_len > 64)
+        mbedtls_sha1(key, key_len, k);
+    else
+        memcpy(k, key, key_len);
+
+    for (int i = 0; i < 64; i++)
+        buf[i] = k[i] ^ 0x36;
+    memcpy(buf + 64, msg, msg_len);
+    mbedtls_sha1(buf, 64 + msg_len, inner);
+
+    for (int i = 0; i < 64; i++)
+        buf[i] = k[i] ^ 0x5c;
+    memcpy(buf + 64, inner, 20);
+    mbedtls_sha1(buf, 64 + 20, out);
+}
+
+int
+test_hkdf_sha1(const uint8_t *salt, size_t salt_len, const uint8_t *ikm, size_t ikm_len,
+               const uint8_t *info, size_t info_len, uint8_t *okm, size_t okm_len)
+{
+    uint8_t prk[20], t[20], msg[20 + 256 + 1];
+    size_t done = 0;
+
+    if (okm_len > 255 * 20 || info_len > 256)
+        return -1;
+    test_hmac_sha1(salt, salt_len, ikm, ikm_len, prk);
+    for (int i = 1; done < okm_len; i++) {
+        size_t len = 0;
+        if (i > 1) {
+            memcpy(msg, t, 20);
+            len = 20;
+        }
+        memcpy(msg + len, info, info_len);
+        len     += info_len;
+        msg[len++] = (uint8_t)i;
+        test_hmac_sha1(prk, 20, msg, len, t);
+        size_t n = okm_len - done < 20 ? okm_len - done : 20;
+        memcpy(okm + done, t, n);
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ * crypto_hkdf() as the prebuilt archive has it, from shadowsocks-libev's
+ * crypto.c: a one-shot mbedtls_md_hmac() for the extract step, and an
+ * mbedtls_md_context_t set up, re-keyed for every block and freed again
+ * for the expand step.
+ */
+int
+crypto_hkdf(const mbedtls_md_info_t *md, const unsigned char *salt,
+            size_t salt_len, const unsigned char *ikm, size_t ikm_len,
+            const unsigned char *info, size_t info_len, unsigned char *okm,
+            size_t okm_len)
+{
+    unsigned char null_salt[MBEDTLS_MD_MAX_SIZE] = { 0 };
+    unsigned char prk[MBEDTLS_MD_MAX_SIZE], t[MBEDTLS_MD_MAX_SIZE];
+    size_t hash_len = mbedtls_md_get_size(md), t_len = 0, where = 0;
+    mbedtls_md_context_t ctx;
+    int ret;
+
+    if (salt == NULL) {
+        salt     = null_salt;
+        salt_len = hash_len;
+    }
+    if ((ret = mbedtls_md_hmac(md, salt, salt_len, ikm, ikm_len, prk)) != 0)
+        return ret;
+
+    size_t n = (okm_len + hash_len - 1) / hash_len;
+    if (n > 255)
+        return CRYPTO_ERROR;
+    if (info == NULL)
+        info = (const unsigned char *)"";
+
+    mbedtls_md_init(&ctx);
+    if ((ret = mbedtls_md_setup(&ctx, md, 1)) != 0) {
+        mbedtls_md_free(&ctx);
+        return ret;
+    }
+    for (size_t i = 1; i <= n; i++) {
+        unsigned char c = (unsigned char)i;
+        ret = mbedtls_md_hmac_starts(&ctx, prk, hash_len)
+              || mbedtls_md_hmac_update(&ctx, t, t_len)
+              || mbedtls_md_hmac_update(&ctx, info, info_len)
+              || mbedtls_md_hmac_update(&ctx, &c, 1)
+              || mbedtls_md_hmac_finish(&ctx, t);
+        if (ret != 0) {
+            mbedtls_md_free(&ctx);
+            return ret;
+        }
+        memcpy(okm + where, t, i != n ? hash_len : okm_len - where);
+        where += hash_len;
+        t_len  = hash_len;
+    }
+    mbedtls_md_free(&ctx);
+
+    return 0;
+}
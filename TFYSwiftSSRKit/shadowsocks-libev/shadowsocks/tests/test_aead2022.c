@@ -0,0 +1,471 @@
+/*
+ * test_aead2022.c - SIP022 TCP and UDP round trips, replays and bad headers
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <sodium.h>
+
+#include "aead2022.h"
+#include "blake3.h"
+#include "test.h"
+
+/*
+ * aead2022.c stamps and checks headers with time(). This definition stands
+ * in for libc's, so that a peer can be put out of the timestamp window.
+ */
+static time_t skew;
+
+time_t
+time(time_t *t)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_t now = ts.tv_sec + skew;
+    if (t != NULL)
+        *t = now;
+    return now;
+}
+
+#define CAPACITY 2048
+
+static const replay_config_t sip022_replay = { .rotate_interval = AEAD2022_REPLAY_ROTATE };
+
+// SOCKS5 address of 127.0.0.1:8388, then the payload
+static const uint8_t addr[] = { 1, 127, 0, 0, 1, 0x20, 0xc4 };
+
+static aead2022_cipher_t *
+new_cipher(int method)
+{
+    static const size_t key_len[AEAD2022_CIPHER_NUM] = { 16, 32, 32 };
+    uint8_t key[AEAD2022_MAX_KEY_LEN];
+    char psk[64];
+
+    for (size_t i = 0; i < sizeof(key); i++)
+        key[i] = (uint8_t)(i * 37 + method);
+    sodium_bin2base64(psk, sizeof(psk), key, key_len[method],
+                      sodium_base64_VARIANT_ORIGINAL);
+
+    aead2022_cipher_t *cipher = aead2022_init(method, psk);
+    CHECK(cipher != NULL);
+    return cipher;
+}
+
+static void
+set_buf(buffer_t *buf, const void *data, size_t len)
+{
+    brealloc(buf, len, CAPACITY);
+    memcpy(buf->array, data, len);
+    buf->len = len;
+}
+
+/*
+ * Feed len bytes in pieces of at most step and append whatever plaintext
+ * comes out to out. Returns CRYPTO_ERROR at the first failure.
+ */
+static int
+feed(aead2022_ctx_t *ctx, const uint8_t *data, size_t len, size_t step, buffer_t *out)
+{
+    buffer_t buf = { 0, 0, 0, NULL };
+
+    for (size_t off = 0; off < len; off += step) {
+        size_t n = min(step, len - off);
+        set_buf(&buf, data + off, n);
+        int err = aead2022_decrypt(&buf, ctx, CAPACITY);
+        if (err == CRYPTO_ERROR) {
+            bfree(&buf);
+            return CRYPTO_ERROR;
+        }
+        if (err == CRYPTO_OK) {
+            brealloc(out, out->len + buf.len, CAPACITY);
+            memcpy(out->array + out->len, buf.array, buf.len);
+            out->len += buf.len;
+        }
+    }
+
+    bfree(&buf);
+    return CRYPTO_OK;
+}
+
+// The first flight of a new client stream carrying payload
+static void
+client_request(aead2022_cipher_t *cipher, const char *payload, buffer_t *wire,
+               uint8_t *salt)
+{
+    aead2022_ctx_t e_ctx;
+    aead2022_ctx_init(cipher, &e_ctx, 1, 0);
+    memcpy(salt, e_ctx.salt, cipher->key_len);
+
+    uint8_t req[64];
+    memcpy(req, addr, sizeof(addr));
+    memcpy(req + sizeof(addr), payload, strlen(payload));
+    set_buf(wire, req, sizeof(addr) + strlen(payload));
+    CHECK(aead2022_encrypt(wire, &e_ctx, CAPACITY) == CRYPTO_OK);
+    aead2022_ctx_release(&e_ctx);
+}
+
+// Decrypt a first flight on a fresh server context
+static int
+server_accept(aead2022_cipher_t *cipher, const buffer_t *wire, buffer_t *out)
+{
+    aead2022_ctx_t d_ctx;
+    aead2022_ctx_init(cipher, &d_ctx, 0, 1);
+    int err = feed(&d_ctx, (const uint8_t *)wire->array, wire->len, wire->len, out);
+    aead2022_ctx_release(&d_ctx);
+    return err;
+}
+
+static void
+test_tcp_round_trip(int method)
+{
+    aead2022_cipher_t *cipher = new_cipher(method);
+    cipher->replay = replay_filter_new(&sip022_replay);
+
+    aead2022_ctx_t c_enc, c_dec, s_enc, s_dec;
+    aead2022_ctx_init(cipher, &c_enc, 1, 0);
+    aead2022_ctx_init(cipher, &c_dec, 0, 0);
+    aead2022_ctx_init(cipher, &s_enc, 1, 1);
+    aead2022_ctx_init(cipher, &s_dec, 0, 1);
+    aead2022_ctx_pair(&c_enc, &c_dec);
+    aead2022_ctx_pair(&s_enc, &s_dec);
+
+    buffer_t wire = { 0, 0, 0, NULL }, out = { 0, 0, 0, NULL };
+    uint8_t req[sizeof(addr) + 5];
+    memcpy(req, addr, sizeof(addr));
+    memcpy(req + sizeof(addr), "hello", 5);
+
+    // Request, fed a few bytes at a time through every stage
+    set_buf(&wire, req, sizeof(req));
+    CHECK(aead2022_encrypt(&wire, &c_enc, CAPACITY) == CRYPTO_OK);
+    buffer_t first = { 0, 0, 0, NULL };
+    set_buf(&first, wire.array, wire.len);
+    CHECK(feed(&s_dec, (uint8_t *)wire.array, wire.len, 7, &out) == CRYPTO_OK);
+    CHECK(out.len == sizeof(req) && memcmp(out.array, req, sizeof(req)) == 0);
+
+    // Response, which echoes the request salt
+    out.len = 0;
+    set_buf(&wire, "world", 5);
+    CHECK(aead2022_encrypt(&wire, &s_enc, CAPACITY) == CRYPTO_OK);
+    CHECK(feed(&c_dec, (uint8_t *)wire.array, wire.len, wire.len, &out) == CRYPTO_OK);
+    CHECK(out.len == 5 && memcmp(out.array, "world", 5) == 0);
+
+    // Later chunks in both directions, one larger than a single chunk
+    static uint8_t big[AEAD2022_MAX_CHUNK_SIZE + 1000];
+    for (size_t i = 0; i < sizeof(big); i++)
+        big[i] = (uint8_t)(i * 7);
+    out.len = 0;
+    set_buf(&wire, big, sizeof(big));
+    CHECK(aead2022_encrypt(&wire, &c_enc, CAPACITY) == CRYPTO_OK);
+    CHECK(feed(&s_dec, (uint8_t *)wire.array, wire.len, 4096, &out) == CRYPTO_OK);
+    CHECK(out.len == sizeof(big) && memcmp(out.array, big, sizeof(big)) == 0);
+    out.len = 0;
+    set_buf(&wire, "again", 5);
+    CHECK(aead2022_encrypt(&wire, &s_enc, CAPACITY) == CRYPTO_OK);
+    CHECK(feed(&c_dec, (uint8_t *)wire.array, wire.len, wire.len, &out) == CRYPTO_OK);
+    CHECK(out.len == 5 && memcmp(out.array, "again", 5) == 0);
+
+    // The same first flight on another connection is a replay
+    out.len = 0;
+    CHECK(server_accept(cipher, &first, &out) == CRYPTO_ERROR);
+
+    // A response to some other request is refused by the client
+    aead2022_ctx_t o_req, o_enc, o_dec;
+    aead2022_ctx_init(cipher, &o_req, 1, 0);
+    aead2022_ctx_init(cipher, &o_enc, 1, 1);
+    aead2022_ctx_init(cipher, &o_dec, 0, 0);
+    aead2022_ctx_pair(&o_req, &o_dec);
+    set_buf(&wire, req, sizeof(req));
+    CHECK(aead2022_encrypt(&wire, &o_req, CAPACITY) == CRYPTO_OK);
+    set_buf(&wire, "stray", 5);
+    CHECK(aead2022_encrypt(&wire, &o_enc, CAPACITY) == CRYPTO_OK);
+    CHECK(feed(&o_dec, (uint8_t *)wire.array, wire.len, wire.len, &out) == CRYPTO_ERROR);
+    aead2022_ctx_release(&o_req);
+    aead2022_ctx_release(&o_enc);
+    aead2022_ctx_release(&o_dec);
+
+    aead2022_ctx_release(&c_enc);
+    aead2022_ctx_release(&c_dec);
+    aead2022_ctx_release(&s_enc);
+    aead2022_ctx_release(&s_dec);
+    bfree(&first);
+    bfree(&wire);
+    bfree(&out);
+    replay_filter_free(cipher->replay);
+    aead2022_free(cipher);
+}
+
+/*
+ * A first flight whose header does not verify must not reach the replay
+ * filter: otherwise anyone can fill it, or block a salt before its owner
+ * sends it.
+ */
+static void
+test_tcp_bad_header(int method)
+{
+    aead2022_cipher_t *cipher = new_cipher(method);
+    cipher->replay = replay_filter_new(&sip022_replay);
+    size_t salt_len = cipher->key_len;
+
+    buffer_t wire = { 0, 0, 0, NULL }, bad = { 0, 0, 0, NULL }, out = { 0, 0, 0, NULL };
+    uint8_t salt[AEAD2022_MAX_KEY_LEN];
+
+    // Tampered header tag, then the genuine flight with the same salt
+    client_request(cipher, "tamper", &wire, salt);
+    set_buf(&bad, wire.array, wire.len);
+    bad.array[salt_len + AEAD2022_REQUEST_HEADER_LEN] ^= 1;
+    CHECK(server_accept(cipher, &bad, &out) == CRYPTO_ERROR);
+    CHECK(!replay_filter_check(cipher->replay, salt, (int)salt_len));
+    CHECK(server_accept(cipher, &wire, &out) == CRYPTO_OK);
+    CHECK(replay_filter_check(cipher->replay, salt, (int)salt_len));
+
+    // A salt alone, with garbage after it
+    client_request(cipher, "garbage", &wire, salt);
+    randombytes_buf(wire.array + salt_len, wire.len - salt_len);
+    CHECK(server_accept(cipher, &wire, &out) == CRYPTO_ERROR);
+    CHECK(!replay_filter_check(cipher->replay, salt, (int)salt_len));
+
+    // Authentic but stale: sent from outside the timestamp window
+    skew = -(AEAD2022_TIMESTAMP_WINDOW + 10);
+    client_request(cipher, "stale", &wire, salt);
+    skew = 0;
+    CHECK(server_accept(cipher, &wire, &out) == CRYPTO_ERROR);
+    CHECK(!replay_filter_check(cipher->replay, salt, (int)salt_len));
+
+    replay_stats_t stats;
+    replay_filter_stats(cipher->replay, &stats);
+    CHECK(stats.rotations == 0);
+
+    bfree(&wire);
+    bfree(&bad);
+    bfree(&out);
+    replay_filter_free(cipher->replay);
+    aead2022_free(cipher);
+}
+
+static void
+store_be64(uint8_t *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (uint8_t)v;
+        v  >>= 8;
+    }
+}
+
+static uint64_t
+load_be64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void
+udp_subkey(const aead2022_cipher_t *cipher, uint64_t sid, uint8_t *subkey)
+{
+    uint8_t id[8];
+    blake3_hasher_t hasher;
+    store_be64(id, sid);
+    blake3_hasher_init_derive_key(&hasher, AEAD2022_SUBKEY_CONTEXT);
+    blake3_hasher_update(&hasher, cipher->key, cipher->key_len);
+    blake3_hasher_update(&hasher, id, sizeof(id));
+    blake3_hasher_finalize(&hasher, subkey, cipher->key_len);
+}
+
+/*
+ * The server half of SIP022 UDP, written from the spec and independent of
+ * aead2022.c: open a client packet, and seal a response to it.
+ */
+static size_t
+server_open(const aead2022_cipher_t *cipher, uint8_t *pkt, size_t len, uint64_t *sid,
+            uint64_t *pid, uint8_t **payload)
+{
+    int chacha    = cipher->method == BLAKE3_CHACHA20_POLY1305;
+    size_t prefix = chacha ? AEAD2022_XNONCE_LEN + AEAD2022_UDP_HEADER_LEN
+                    : AEAD2022_UDP_HEADER_LEN;
+    uint8_t *hdr  = pkt + prefix - AEAD2022_UDP_HEADER_LEN;
+    uint8_t *b    = pkt + prefix;
+    size_t blen   = len - prefix - AEAD2022_TAG_LEN;
+
+    if (chacha) {
+        CHECK(crypto_aead_xchacha20poly1305_ietf_decrypt(hdr, NULL, NULL, hdr,
+                                                         len - AEAD2022_XNONCE_LEN,
+                                                         NULL, 0, pkt, cipher->key) == 0);
+    } else {
+        mbedtls_aes_context aes;
+        mbedtls_gcm_context gcm;
+        uint8_t subkey[AEAD2022_MAX_KEY_LEN];
+        mbedtls_aes_init(&aes);
+        mbedtls_aes_setkey_dec(&aes, cipher->key, (unsigned int)cipher->key_len * 8);
+        mbedtls_aes_crypt_ecb(&aes, MBEDTLS_AES_DECRYPT, hdr, hdr);
+        mbedtls_aes_free(&aes);
+        udp_subkey(cipher, load_be64(hdr), subkey);
+        mbedtls_gcm_init(&gcm);
+        mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, subkey, (unsigned int)cipher->key_len * 8);
+        CHECK(mbedtls_gcm_auth_decrypt(&gcm, blen, hdr + 4, AEAD2022_NONCE_LEN, NULL, 0,
+                                       b + blen, AEAD2022_TAG_LEN, b, b) == 0);
+        mbedtls_gcm_free(&gcm);
+    }
+
+    *sid = load_be64(hdr);
+    *pid = load_be64(hdr + 8);
+    CHECK(b[0] == AEAD2022_TYPE_REQUEST);
+    CHECK((time_t)load_be64(b + 1) == time(NULL) || (time_t)load_be64(b + 1) == time(NULL) - 1);
+    size_t padding = (b[9] << 8) | b[10];
+    CHECK(11 + padding <= blen);
+    *payload = b + 11 + padding;
+    return blen - 11 - padding;
+}
+
+static void
+server_reply(const aead2022_cipher_t *cipher, uint64_t sid, uint64_t pid, uint64_t client_sid,
+             const void *payload, size_t plen, buffer_t *out)
+{
+    int chacha    = cipher->method == BLAKE3_CHACHA20_POLY1305;
+    size_t prefix = chacha ? AEAD2022_XNONCE_LEN + AEAD2022_UDP_HEADER_LEN
+                    : AEAD2022_UDP_HEADER_LEN;
+    size_t body   = 1 + 8 + 8 + 2;
+
+    brealloc(out, prefix + body + plen + AEAD2022_TAG_LEN, CAPACITY);
+    out->len = prefix + body + plen + AEAD2022_TAG_LEN;
+    uint8_t *pkt = (uint8_t *)out->array;
+    uint8_t *hdr = pkt + prefix - AEAD2022_UDP_HEADER_LEN;
+    uint8_t *b   = pkt + prefix;
+
+    store_be64(hdr, sid);
+    store_be64(hdr + 8, pid);
+    b[0] = AEAD2022_TYPE_RESPONSE;
+    store_be64(b + 1, (uint64_t)time(NULL));
+    store_be64(b + 9, client_sid);
+    b[17] = b[18] = 0;
+    memcpy(b + body, payload, plen);
+
+    if (chacha) {
+        randombytes_buf(pkt, AEAD2022_XNONCE_LEN);
+        CHECK(crypto_aead_xchacha20poly1305_ietf_encrypt(hdr, NULL, hdr,
+                                                         AEAD2022_UDP_HEADER_LEN + body + plen,
+                                                         NULL, 0, NULL, pkt, cipher->key) == 0);
+    } else {
+        mbedtls_aes_context aes;
+        mbedtls_gcm_context gcm;
+        uint8_t subkey[AEAD2022_MAX_KEY_LEN];
+        udp_subkey(cipher, sid, subkey);
+        mbedtls_gcm_init(&gcm);
+        mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, subkey, (unsigned int)cipher->key_len * 8);
+        CHECK(mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, body + plen, hdr + 4,
+                                        AEAD2022_NONCE_LEN, NULL, 0, b, b, AEAD2022_TAG_LEN,
+                                        b + body + plen) == 0);
+        mbedtls_gcm_free(&gcm);
+        mbedtls_aes_init(&aes);
+        mbedtls_aes_setkey_enc(&aes, cipher->key, (unsigned int)cipher->key_len * 8);
+        mbedtls_aes_crypt_ecb(&aes, MBEDTLS_AES_ENCRYPT, hdr, hdr);
+        mbedtls_aes_free(&aes);
+    }
+}
+
+// Decrypt a copy of pkt, so that it can be sent again
+static int
+client_recv(aead2022_cipher_t *cipher, aead2022_udp_session_t *session, const buffer_t *pkt,
+            buffer_t *out)
+{
+    set_buf(out, pkt->array, pkt->len);
+    return aead2022_udp_decrypt(out, cipher, session, CAPACITY);
+}
+
+static void
+test_udp(int method)
+{
+    aead2022_cipher_t *cipher = new_cipher(method);
+    aead2022_udp_session_t session;
+    aead2022_udp_session_init(cipher, &session);
+
+    buffer_t pkt = { 0, 0, 0, NULL }, out = { 0, 0, 0, NULL };
+    uint8_t req[sizeof(addr) + 4];
+    memcpy(req, addr, sizeof(addr));
+    memcpy(req + sizeof(addr), "ping", 4);
+
+    // Two client packets open on the server side with consecutive ids
+    for (uint64_t i = 0; i < 2; i++) {
+        uint64_t sid, pid;
+        uint8_t *payload;
+        set_buf(&pkt, req, sizeof(req));
+        CHECK(aead2022_udp_encrypt(&pkt, cipher, &session, CAPACITY) == CRYPTO_OK);
+        size_t n = server_open(cipher, (uint8_t *)pkt.array, pkt.len, &sid, &pid, &payload);
+        CHECK(sid == session.session_id && pid == i);
+        CHECK(n == sizeof(req) && memcmp(payload, req, n) == 0);
+    }
+
+    // A response, then the same packet again
+    uint64_t server_sid = 0x1122334455667788ULL;
+    server_reply(cipher, server_sid, 10, session.session_id, "pong", 4, &pkt);
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_OK);
+    CHECK(out.len == 4 && memcmp(out.array, "pong", 4) == 0);
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_ERROR);
+
+    // Out of order within the window is fine, once
+    server_reply(cipher, server_sid, 7, session.session_id, "late", 4, &pkt);
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_OK);
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_ERROR);
+    server_reply(cipher, server_sid, 100, session.session_id, "jump", 4, &pkt);
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_OK);
+    server_reply(cipher, server_sid, 20, session.session_id, "old", 3, &pkt);
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_ERROR);
+
+    // A tampered packet neither decrypts nor uses up its packet id
+    server_reply(cipher, server_sid, 101, session.session_id, "next", 4, &pkt);
+    pkt.array[pkt.len - 1] ^= 1;
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_ERROR);
+    pkt.array[pkt.len - 1] ^= 1;
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_OK);
+
+    // Nor does a forged new server session replace the current one
+    server_reply(cipher, server_sid + 1, 0, session.session_id, "forged", 6, &pkt);
+    pkt.array[pkt.len - 5] ^= 1;
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_ERROR);
+    CHECK(session.peer_session_id == server_sid);
+    server_reply(cipher, server_sid, 102, session.session_id, "still", 5, &pkt);
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_OK);
+
+    // Responses meant for another client, or out of the time window
+    server_reply(cipher, server_sid, 103, session.session_id + 1, "other", 5, &pkt);
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_ERROR);
+    skew = AEAD2022_TIMESTAMP_WINDOW + 10;
+    server_reply(cipher, server_sid, 104, session.session_id, "stale", 5, &pkt);
+    skew = 0;
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_ERROR);
+    server_reply(cipher, server_sid, 104, session.session_id, "fresh", 5, &pkt);
+    CHECK(client_recv(cipher, &session, &pkt, &out) == CRYPTO_OK);
+
+    aead2022_udp_session_release(&session);
+    bfree(&pkt);
+    bfree(&out);
+    aead2022_free(cipher);
+}
+
+int
+main(void)
+{
+    for (int method = 0; method < AEAD2022_CIPHER_NUM; method++) {
+        test_tcp_round_trip(method);
+        test_tcp_bad_header(method);
+        test_udp(method);
+    }
+    return 0;
+}
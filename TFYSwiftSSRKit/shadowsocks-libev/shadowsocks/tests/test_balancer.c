@@ -0,0 +1,228 @@
+/*
+ * test_balancer.c - Costs, policies, ejection and health of balancer
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "balancer.h"
+#include "test.h"
+
+static balancer_server_stats_t
+stats_of(balancer_t *lb, int server, double now)
+{
+    balancer_server_stats_t stats;
+    balancer_server_stats(lb, server, now, &stats);
+    return stats;
+}
+
+static int
+near(double a, double b)
+{
+    return fabs(a - b) < 1e-9;
+}
+
+// Each server is tried before any has a cost, then the fastest wins
+static void
+test_least_pending(void)
+{
+    balancer_config_t config = { .policy = BALANCER_LEAST_PENDING };
+    balancer_t *lb           = balancer_new(3, &config);
+    static const double connect_time[] = { 0.1, 0.05, 0.2 };
+
+    for (int i = 0; i < 3; i++)
+        CHECK(balancer_pick(lb, 0) == i);
+    for (int i = 0; i < 3; i++) {
+        CHECK(stats_of(lb, i, 0).pending == 1);
+        balancer_report(lb, i, 1, 1, connect_time[i]);
+        CHECK(stats_of(lb, i, 1).pending == 0 && stats_of(lb, i, 1).latency == connect_time[i]);
+    }
+
+    for (int i = 0; i < 10; i++) {
+        CHECK(balancer_pick(lb, 2) == 1);
+        balancer_report(lb, 1, 2, 1, 0.05);
+    }
+
+    // Fewest pending first, whatever the latency
+    CHECK(balancer_pick(lb, 3) == 1);
+    CHECK(balancer_pick(lb, 3) == 0);
+    CHECK(balancer_pick(lb, 3) == 2);
+    CHECK(balancer_pick(lb, 3) == 1);
+
+    // The EWMA moves by alpha towards each sample
+    for (int i = 0; i < 3; i++)
+        balancer_report(lb, i, 4, 1, 0.15);
+    balancer_report(lb, 1, 4, 1, 0.15);
+    CHECK(near(stats_of(lb, 0, 4).latency, 0.1 + BALANCER_DEFAULT_ALPHA * 0.05));
+    CHECK(near(stats_of(lb, 2, 4).latency, 0.2 - BALANCER_DEFAULT_ALPHA * 0.05));
+    CHECK(stats_of(lb, 1, 4).picks == 13 && stats_of(lb, 1, 4).pending == 0);
+
+    balancer_free(lb);
+}
+
+// Two choices never take the slow server while a fast one is idle
+static void
+test_p2c(void)
+{
+    balancer_t *lb = balancer_new(4, NULL);
+    int picks[4]   = { 0 };
+
+    srand(1);
+    for (int i = 0; i < 4; i++)
+        balancer_report(lb, i, 0, 1, i == 0 ? 1.0 : 0.01);
+    for (int i = 0; i < 1000; i++) {
+        int s = balancer_pick(lb, 1);
+        picks[s]++;
+        balancer_report(lb, s, 1, 1, s == 0 ? 1.0 : 0.01);
+    }
+    CHECK(picks[0] == 0);
+    for (int i = 1; i < 4; i++)
+        CHECK(picks[i] > 200);
+
+    // Without reports the fast servers queue up until the slow one is cheaper
+    memset(picks, 0, sizeof(picks));
+    for (int i = 0; i < 600; i++)
+        picks[balancer_pick(lb, 2)]++;
+    CHECK(picks[0] > 0 && picks[0] < 20);
+    CHECK(stats_of(lb, 0, 2).pending == picks[0]);
+
+    balancer_free(lb);
+}
+
+static void
+fail(balancer_t *lb, int server, double now, int times)
+{
+    for (int i = 0; i < times; i++)
+        balancer_report(lb, server, now, 0, 0);
+}
+
+static void
+test_eject(void)
+{
+    balancer_config_t config = { .policy = BALANCER_LEAST_PENDING, .eject = 10 };
+    balancer_t *lb           = balancer_new(2, &config);
+
+    fail(lb, 0, 0, BALANCER_DEFAULT_FAILURES - 1);
+    CHECK(!stats_of(lb, 0, 0).ejected);
+    fail(lb, 0, 0, 1);
+    CHECK(stats_of(lb, 0, 0).ejected && stats_of(lb, 0, 5).ejected_for == 5);
+    CHECK(stats_of(lb, 0, 0).ejections == 1 && stats_of(lb, 0, 0).failures == 3);
+    for (int i = 0; i < 5; i++)
+        CHECK(balancer_pick(lb, 5) == 1);
+
+    // Back in, and out again after a single failure, for twice as long
+    CHECK(!stats_of(lb, 0, 10).ejected);
+    fail(lb, 0, 10, 1);
+    CHECK(stats_of(lb, 0, 10).ejected_for == 20);
+    for (int i = 0; i < 5; i++)
+        fail(lb, 0, 30 + i * 1000, 1);
+    CHECK(stats_of(lb, 0, 4030).ejected_for == BALANCER_MAX_EJECT);
+
+    // One success clears the record
+    balancer_report(lb, 0, 5000, 1, 0.1);
+    fail(lb, 0, 5000, BALANCER_DEFAULT_FAILURES - 1);
+    CHECK(!stats_of(lb, 0, 5000).ejected);
+    fail(lb, 0, 5000, 1);
+    CHECK(stats_of(lb, 0, 5000).ejected_for == 10);
+
+    // With both out, the one due back first, and one reachable before that
+    fail(lb, 1, 5001, BALANCER_DEFAULT_FAILURES);
+    CHECK(balancer_pick(lb, 5002) == 0);
+    balancer_set_health(lb, 0, 0);
+    CHECK(balancer_pick(lb, 5002) == 1);
+
+    balancer_free(lb);
+}
+
+// Failures fade while unused, and probes scale or veto a server
+static void
+test_health(void)
+{
+    balancer_config_t config = { .policy = BALANCER_LEAST_PENDING };
+    balancer_t *lb           = balancer_new(3, &config);
+
+    for (int i = 0; i < 3; i++)
+        balancer_report(lb, balancer_pick(lb, 0), 0, 1, 0.1);
+
+    fail(lb, 0, 0, 1);
+    CHECK(near(stats_of(lb, 0, 0).failure_rate, BALANCER_DEFAULT_ALPHA));
+    CHECK(near(stats_of(lb, 0, 30).failure_rate, BALANCER_DEFAULT_ALPHA * exp(-1)));
+    int s = balancer_pick(lb, 1);
+    CHECK(s != 0);
+    balancer_report(lb, s, 1, 1, 0.1);
+
+    // A failed server that never connected is charged the others' latency
+    balancer_t *fresh = balancer_new(2, &config);
+    balancer_report(fresh, balancer_pick(fresh, 0), 0, 1, 0.1);
+    fail(fresh, balancer_pick(fresh, 0), 0, 1);
+    CHECK(balancer_pick(fresh, 0) == 0);
+    balancer_free(fresh);
+
+    balancer_set_health(lb, 1, 0.5);
+    balancer_set_health(lb, 2, 7);
+    CHECK(stats_of(lb, 1, 0).health == 0.5 && stats_of(lb, 2, 0).health == 1);
+    for (int i = 0; i < 4; i++) {
+        CHECK(balancer_pick(lb, 1000) == 2);
+        balancer_report(lb, 2, 1000, 1, 0.1);
+    }
+    balancer_set_health(lb, 2, -1);
+    CHECK(stats_of(lb, 2, 0).health == 0);
+    CHECK(balancer_pick(lb, 1000) == 0);
+
+    balancer_free(lb);
+}
+
+static void
+test_errors(void)
+{
+    balancer_t *lb = balancer_new(0, NULL);
+    CHECK(balancer_pick(lb, 0) == -1);
+    balancer_free(lb);
+
+    lb = balancer_new(BALANCER_MAX_SERVERS + 5, NULL);
+    balancer_report(lb, BALANCER_MAX_SERVERS, 0, 0, 0);
+    balancer_report(lb, -1, 0, 0, 0);
+    balancer_set_health(lb, BALANCER_MAX_SERVERS, 0);
+    for (int i = 0; i < 3 * BALANCER_MAX_SERVERS; i++) {
+        int s = balancer_pick(lb, 0);
+        CHECK(s >= 0 && s < BALANCER_MAX_SERVERS);
+    }
+    CHECK(stats_of(lb, BALANCER_MAX_SERVERS, 0).picks == 0);
+    balancer_free(lb);
+
+    // Reports with nothing pending do not go below zero
+    lb = balancer_new(1, NULL);
+    CHECK(balancer_pick(lb, 0) == 0);
+    for (int i = 0; i < 3; i++)
+        balancer_report(lb, 0, 0, 1, 0.1);
+    CHECK(stats_of(lb, 0, 0).pending == 0);
+    CHECK(balancer_pick(lb, 0) == 0 && stats_of(lb, 0, 0).pending == 1);
+    balancer_free(lb);
+}
+
+int
+main(void)
+{
+    test_least_pending();
+    test_p2c();
+    test_eject();
+    test_health();
+    test_errors();
+    return 0;
+}
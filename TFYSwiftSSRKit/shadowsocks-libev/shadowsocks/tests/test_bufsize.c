@@ -0,0 +1,242 @@
+/*
+ * test_bufsize.c - Growth, shrinking and buffer replacement of bufsize
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bufsize.h"
+#include "slab.h"
+#include "utils.h"
+#include "test.h"
+
+#define MIN BUF_SIZE_MIN_DEFAULT
+
+static char junk[256 * 1024];
+
+// A read that filled the buffer, with more left behind on the socket
+static size_t
+full_read(buf_sizer_t *sizer, int rfd, int wfd, int peer, size_t capacity)
+{
+    CHECK(write(peer, junk, 1) == 1);
+    usleep(1000);
+    size_t next = buf_sizer_on_read(sizer, rfd, wfd, capacity, capacity, 0);
+    CHECK(read(rfd, junk, 1) == 1);
+    return next;
+}
+
+static void
+check_stats(size_t connections, size_t bytes)
+{
+    buf_sizer_stats_t stats;
+    size_t total = 0;
+
+    buf_sizer_stats(&stats);
+    for (int i = 0; i < BUF_SIZE_BUCKETS; i++)
+        total += stats.buckets[i];
+    CHECK(stats.connections == connections && stats.bytes == bytes);
+    CHECK(total == connections);
+}
+
+static void
+test_grow(void)
+{
+    buf_policy_t policy = { .max_size = 8 * MIN };
+    buf_sizer_t sizer;
+    int a, b;
+
+    buf_policy_configure(&policy);
+    test_tcp_pair(&a, &b);
+    buf_sizer_init(&sizer, b, -1, 0);
+    CHECK(sizer.size == MIN && sizer.rcvbuf > 0);
+    check_stats(1, MIN);
+
+    // A full read with nothing left queued is not a reason to grow
+    CHECK(buf_sizer_on_read(&sizer, b, -1, MIN, MIN, 0) == MIN);
+    CHECK(buf_sizer_on_read(&sizer, -1, -1, MIN, MIN, 0) == MIN);
+
+    // Doubling from the capacity the slab gave, up to max_size
+    CHECK(full_read(&sizer, b, -1, a, MIN) == 2 * MIN);
+    CHECK(full_read(&sizer, b, -1, a, 3 * MIN) == 6 * MIN);
+    CHECK(full_read(&sizer, b, -1, a, 6 * MIN) == 8 * MIN);
+    CHECK(full_read(&sizer, b, -1, a, 8 * MIN) == 8 * MIN);
+    CHECK(sizer.grows == 3 && sizer.peak == 8 * MIN);
+    check_stats(1, 8 * MIN);
+
+    // and down again when the policy lowers the ceiling
+    policy.max_size = 4 * MIN;
+    buf_policy_configure(&policy);
+    CHECK(buf_sizer_on_read(&sizer, b, -1, MIN, 8 * MIN, 0) == 4 * MIN);
+    check_stats(1, 4 * MIN);
+
+    buf_sizer_release(&sizer);
+    buf_sizer_release(&sizer);
+    check_stats(0, 0);
+    close(a);
+    close(b);
+
+    // Past what the socket can deliver in one read, growth stops
+    int small = 4096;
+    test_tcp_pair(&a, &b);
+    setsockopt(b, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    buf_policy_configure(NULL);
+    buf_sizer_init(&sizer, b, -1, 0);
+    size_t rcvbuf = sizer.rcvbuf;
+    CHECK(rcvbuf >= (size_t)small && rcvbuf < BUF_SIZE_MAX_DEFAULT);
+    size_t size = MIN;
+    for (int i = 0; i < 10; i++)
+        size = full_read(&sizer, b, -1, a, size);
+    CHECK(size == max((size_t)MIN, rcvbuf));
+    buf_sizer_release(&sizer);
+    close(a);
+    close(b);
+}
+
+// No growth while the side this buffer is written to has a full send queue
+static void
+test_held(void)
+{
+    buf_sizer_stats_t stats;
+    buf_sizer_t sizer;
+    int a, b, c, d;
+    int small = 4096;
+
+    test_tcp_pair(&a, &b);
+    test_tcp_pair(&c, &d);
+    setsockopt(d, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    setsockopt(c, SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    setnonblocking(c);
+    while (write(c, junk, sizeof(junk)) > 0)
+        ;
+    CHECK(errno == EAGAIN || errno == EWOULDBLOCK);
+    usleep(10000);
+
+    buf_sizer_init(&sizer, b, c, 0);
+    CHECK(sizer.sndbuf > 0);
+    CHECK(full_read(&sizer, b, c, a, MIN) == MIN);
+    buf_sizer_stats(&stats);
+    CHECK(stats.held == 1 && sizer.grows == 0);
+
+    // Once the peer catches up, the read may grow again
+    setnonblocking(d);
+    for (int i = 0; i < 1000 && sizer.size == MIN; i++) {
+        while (read(d, junk, sizeof(junk)) > 0)
+            ;
+        full_read(&sizer, b, c, a, MIN);
+    }
+    CHECK(sizer.size == 2 * MIN);
+
+    buf_sizer_release(&sizer);
+    close(a);
+    close(b);
+    close(c);
+    close(d);
+}
+
+static void
+test_shrink(void)
+{
+    buf_policy_t policy = { .shrink_reads = 4, .idle_timeout = 5 };
+    buf_sizer_t sizer;
+    int a, b;
+
+    buf_policy_configure(&policy);
+    test_tcp_pair(&a, &b);
+    buf_sizer_init(&sizer, b, -1, 100);
+    size_t size = MIN;
+    for (int i = 0; i < 3; i++)
+        size = full_read(&sizer, b, -1, a, size);
+    CHECK(size == 8 * MIN);
+    close(a);
+    close(b);
+
+    // Small reads halve it once there are shrink_reads of them in a row
+    for (int i = 0; i < 3; i++)
+        CHECK(buf_sizer_on_read(&sizer, -1, -1, 10, size, 101) == 8 * MIN);
+    CHECK(buf_sizer_on_read(&sizer, -1, -1, size / 2, size, 101) == 8 * MIN);
+    for (int i = 0; i < 3; i++)
+        CHECK(buf_sizer_on_read(&sizer, -1, -1, 10, size, 101) == 8 * MIN);
+    CHECK(buf_sizer_on_read(&sizer, -1, -1, 10, size, 101) == 4 * MIN);
+    CHECK(sizer.shrinks == 1);
+
+    // Idle for idle_timeout drops it to min_size
+    CHECK(buf_sizer_on_idle(&sizer, 105.9) == 4 * MIN);
+    CHECK(buf_sizer_on_idle(&sizer, 106) == MIN);
+    CHECK(buf_sizer_on_idle(&sizer, 200) == MIN);
+    CHECK(sizer.shrinks == 2 && sizer.peak == 8 * MIN);
+    check_stats(1, MIN);
+
+    buf_sizer_release(&sizer);
+    buf_policy_configure(NULL);
+    buf_policy_get(&policy);
+    CHECK(policy.min_size == MIN && policy.max_size == BUF_SIZE_MAX_DEFAULT);
+    CHECK(policy.shrink_reads == BUF_SIZE_SHRINK_READS);
+    CHECK(policy.idle_timeout == BUF_SIZE_IDLE_DEFAULT);
+}
+
+// Buffers are replaced while empty, from balloc first and the slab after
+static void
+test_apply(void)
+{
+    buf_sizer_t sizer;
+    buffer_t buf;
+    int a, b;
+
+    test_tcp_pair(&a, &b);
+    balloc(&buf, MIN);
+    buf_sizer_init(&sizer, b, -1, 0);
+    CHECK(buf_sizer_apply(&sizer, &buf) == 0 && sizer.owned);
+    CHECK(buf.capacity >= MIN);
+
+    char *array = buf.array;
+    CHECK(buf_sizer_apply(&sizer, &buf) == 0 && buf.array == array);
+
+    // Not while it holds data
+    CHECK(full_read(&sizer, b, -1, a, buf.capacity) == 2 * MIN);
+    buf.len = 1;
+    CHECK(buf_sizer_apply(&sizer, &buf) == -1 && buf.array == array);
+    buf.len = 0;
+    CHECK(buf_sizer_apply(&sizer, &buf) == 0);
+    CHECK(buf.capacity >= 2 * MIN && sizer.applied == 2 * MIN);
+
+    buf_sizer_free_buffer(&sizer, &buf);
+    CHECK(buf.array == NULL);
+    buf_sizer_release(&sizer);
+    check_stats(0, 0);
+    close(a);
+    close(b);
+
+    slab_stats_t stats;
+    slab_thread_flush();
+    slab_stats(&stats);
+    for (int cls = 0; cls < SLAB_CLASS_NUM; cls++)
+        CHECK(stats.classes[cls].in_use == 0);
+}
+
+int
+main(void)
+{
+    test_grow();
+    test_held();
+    test_shrink();
+    test_apply();
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * test_connpool.c - Wiring, reuse and budget refusals of connpool
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "connpool.h"
+#include "membudget.h"
+#include "slab.h"
+#include "test.h"
+
+#define BLOCKS   100
+#define PER_CHUNK 8
+
+static size_t
+account_used(const char *name)
+{
+    mem_budget_stats_t stats;
+    mem_budget_stats(&stats);
+    for (int i = 0; i < stats.accounts; i++)
+        if (strcmp(stats.account[i].name, name) == 0)
+            return stats.account[i].used;
+    return 0;
+}
+
+static void
+check_wired(conn_block_t *block, size_t buf_size)
+{
+    server_t *server = &block->server;
+    remote_t *remote = &block->remote;
+
+    CHECK((uintptr_t)block % CONN_POOL_CACHE_LINE == 0);
+    CHECK(server->fd == -1 && remote->fd == -1);
+    CHECK(server->recv_ctx->server == server && server->send_ctx->server == server);
+    CHECK(remote->recv_ctx->remote == remote && remote->send_ctx->remote == remote);
+    CHECK(server->e_ctx == &block->e_ctx && server->d_ctx == &block->d_ctx);
+    CHECK(server->chunk == &block->chunk);
+    CHECK(server->remote == NULL && remote->server == NULL);
+    CHECK(conn_block_of_server(server) == block && conn_block_of_remote(remote) == block);
+
+    if (buf_size == 0) {
+        CHECK(server->buf->array == NULL && remote->buf->array == NULL);
+        return;
+    }
+    CHECK(server->buf->capacity >= buf_size && remote->buf->capacity >= buf_size);
+    CHECK(server->buf_capacity == (ssize_t)server->buf->capacity);
+    CHECK(remote->buf_capacity == (ssize_t)remote->buf->capacity);
+}
+
+// Blocks spanning several mempool chunks, written in full, do not overlap
+static void
+test_blocks(void)
+{
+    static conn_block_t *blocks[BLOCKS];
+    conn_pool_t *pool = conn_pool_new(PER_CHUNK);
+    conn_pool_stats_t stats;
+
+    for (int i = 0; i < BLOCKS; i++) {
+        blocks[i] = conn_pool_acquire(pool, i % 2 ? 2048 : 0);
+        CHECK(blocks[i] != NULL);
+        check_wired(blocks[i], i % 2 ? 2048 : 0);
+    }
+    conn_block_link_remote(blocks[0]);
+    CHECK(blocks[0]->server.remote == &blocks[0]->remote);
+    CHECK(blocks[0]->remote.server == &blocks[0]->server);
+
+    for (int i = 0; i < BLOCKS; i++) {
+        blocks[i]->server.stage = i;
+        if (blocks[i]->server_buf.array != NULL)
+            memset(blocks[i]->server_buf.array, i, blocks[i]->server_buf.capacity);
+    }
+    for (int i = 0; i < BLOCKS; i++) {
+        CHECK(blocks[i]->server.stage == i && blocks[i]->server.buf == &blocks[i]->server_buf);
+        for (size_t j = 0; j < blocks[i]->server_buf.capacity; j++)
+            CHECK((uint8_t)blocks[i]->server_buf.array[j] == i);
+    }
+
+    conn_pool_stats(pool, &stats);
+    CHECK(stats.live == BLOCKS && stats.peak == BLOCKS && stats.acquired == BLOCKS);
+    CHECK(stats.block_size >= sizeof(conn_block_t));
+    CHECK(account_used("connpool") >= BLOCKS * sizeof(conn_block_t));
+
+    // Released blocks are handed out again, wiped and rewired
+    conn_block_t *last = blocks[BLOCKS - 1];
+    conn_pool_release(pool, last);
+    conn_block_t *again = conn_pool_acquire(pool, 0);
+    CHECK(again == last);
+    check_wired(again, 0);
+    blocks[BLOCKS - 1] = again;
+
+    for (int i = 0; i < BLOCKS; i++)
+        conn_pool_release(pool, blocks[i]);
+    conn_pool_release(pool, NULL);
+    conn_pool_stats(pool, &stats);
+    CHECK(stats.live == 0 && stats.peak == BLOCKS);
+    CHECK(stats.acquired == BLOCKS + 1 && stats.released == BLOCKS + 1);
+    CHECK(account_used("connpool") == 0);
+    conn_pool_free(pool);
+
+    // The buffers went back to the slab, which gives its pages up on trim
+    slab_thread_flush();
+    slab_trim();
+    CHECK(account_used("slab") == 0);
+}
+
+// A refusal leaves nothing charged and nothing counted
+static void
+test_refused(void)
+{
+    conn_pool_t *pool = conn_pool_new(0);
+    conn_pool_stats_t stats;
+
+    // Room for the block, not for two 64 KB buffers
+    mem_budget_config_t config = { .soft_limit = 100 * 1024, .hard_limit = 100 * 1024 };
+    mem_budget_configure(&config);
+    CHECK(conn_pool_acquire(pool, SLAB_CLASS_LARGE) == NULL);
+    CHECK(account_used("connpool") == 0 && account_used("slab") == 0);
+
+    // and past the hard limit, not even the block
+    config.soft_limit = config.hard_limit = 64;
+    mem_budget_configure(&config);
+    CHECK(conn_pool_acquire(pool, 0) == NULL);
+    mem_budget_configure(NULL);
+
+    conn_pool_stats(pool, &stats);
+    CHECK(stats.live == 0 && stats.acquired == 0);
+
+    conn_block_t *block = conn_pool_acquire(pool, SLAB_CLASS_LARGE);
+    CHECK(block != NULL);
+    check_wired(block, SLAB_CLASS_LARGE);
+    conn_pool_release(pool, block);
+    conn_pool_free(pool);
+}
+
+int
+main(void)
+{
+    test_blocks();
+    test_refused();
+    return 0;
+}
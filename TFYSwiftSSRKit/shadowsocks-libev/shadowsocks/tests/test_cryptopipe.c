@@ -0,0 +1,351 @@
+/*
+ * test_cryptopipe.c - Offloaded AEAD chunks against an inline reference
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <mbedtls/gcm.h>
+#include <sodium.h>
+
+#include "cryptopipe.h"
+#include "utils.h"
+#include "test.h"
+
+#define TOTAL   (4 * 1024 * 1024)
+#define BATCH   100000              // not a multiple of the chunk size
+#define READ    70001               // socket reads cut chunks anywhere
+#define MAX_OUT (2 * TOTAL)        // room for any chunking of TOTAL
+
+static const size_t key_lens[] = { 16, 24, 32, 32 };
+
+static struct ev_loop *loop;
+static uint8_t subkey[32];
+static uint8_t *plain, *wire, *result;
+
+/*
+ * The reference: one chunk at a time on the calling thread, with a fresh
+ * context per call, in the layout aead.c writes.
+ */
+static void
+ref_seal(int method, const uint8_t *nonce, const uint8_t *m, size_t mlen, uint8_t *c)
+{
+    if (method == CHACHA20_IETF_POLY1305) {
+        CHECK(crypto_aead_chacha20poly1305_ietf_encrypt_detached(c, c + mlen, NULL, m, mlen,
+                                                                 NULL, 0, NULL, nonce,
+                                                                 subkey) == 0);
+        return;
+    }
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    CHECK(mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, subkey,
+                             (unsigned int)key_lens[method] * 8) == 0);
+    CHECK(mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, mlen, nonce,
+                                    CRYPTO_PIPE_NONCE_LEN, NULL, 0, m, c,
+                                    CRYPTO_PIPE_TAG_LEN, c + mlen) == 0);
+    mbedtls_gcm_free(&gcm);
+}
+
+static int
+ref_open(int method, const uint8_t *nonce, const uint8_t *c, size_t mlen, uint8_t *m)
+{
+    if (method == CHACHA20_IETF_POLY1305)
+        return crypto_aead_chacha20poly1305_ietf_decrypt_detached(m, NULL, c, mlen, c + mlen,
+                                                                  NULL, 0, nonce, subkey);
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    CHECK(mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, subkey,
+                             (unsigned int)key_lens[method] * 8) == 0);
+    int ret = mbedtls_gcm_auth_decrypt(&gcm, mlen, nonce, CRYPTO_PIPE_NONCE_LEN, NULL, 0,
+                                       c + mlen, CRYPTO_PIPE_TAG_LEN, c, m);
+    mbedtls_gcm_free(&gcm);
+    return ret;
+}
+
+static size_t
+ref_encode(int method, const uint8_t *m, size_t len, uint8_t *c)
+{
+    uint8_t nonce[CRYPTO_PIPE_NONCE_LEN] = { 0 };
+    size_t olen = 0;
+    for (size_t off = 0; off < len;) {
+        size_t plen = len - off < CRYPTO_PIPE_CHUNK_SIZE ? len - off : CRYPTO_PIPE_CHUNK_SIZE;
+        uint8_t len_buf[CHUNK_SIZE_LEN] = { (uint8_t)(plen >> 8), (uint8_t)plen };
+        ref_seal(method, nonce, len_buf, CHUNK_SIZE_LEN, c + olen);
+        sodium_increment(nonce, sizeof(nonce));
+        olen += CHUNK_SIZE_LEN + CRYPTO_PIPE_TAG_LEN;
+        ref_seal(method, nonce, m + off, plen, c + olen);
+        sodium_increment(nonce, sizeof(nonce));
+        olen += plen + CRYPTO_PIPE_TAG_LEN;
+        off  += plen;
+    }
+    return olen;
+}
+
+static size_t
+ref_decode(int method, const uint8_t *c, size_t len, uint8_t *m)
+{
+    uint8_t nonce[CRYPTO_PIPE_NONCE_LEN] = { 0 };
+    size_t mlen = 0;
+    for (size_t off = 0; off < len;) {
+        uint8_t len_buf[CHUNK_SIZE_LEN];
+        CHECK(ref_open(method, nonce, c + off, CHUNK_SIZE_LEN, len_buf) == 0);
+        sodium_increment(nonce, sizeof(nonce));
+        size_t plen = ((size_t)len_buf[0] << 8 | len_buf[1]) & CHUNK_SIZE_MASK;
+        off += CHUNK_SIZE_LEN + CRYPTO_PIPE_TAG_LEN;
+        CHECK(ref_open(method, nonce, c + off, plen, m + mlen) == 0);
+        sodium_increment(nonce, sizeof(nonce));
+        off  += plen + CRYPTO_PIPE_TAG_LEN;
+        mlen += plen;
+    }
+    return mlen;
+}
+
+typedef struct sink {
+    buffer_t *expect[TOTAL / 1000];   // in buffers, in submission order
+    int submitted;
+    int delivered;
+    int errors;
+    int cancelled;
+    uint8_t *out;
+    size_t out_len;
+} sink_t;
+
+static void
+sink_cb(crypto_pipe_stream_t *stream, buffer_t *in, buffer_t *out, int status, void *data)
+{
+    sink_t *sink = data;
+    (void)stream;
+
+    CHECK(in == sink->expect[sink->delivered]);
+    sink->delivered++;
+    if (status == CRYPTO_OK) {
+        memcpy(sink->out + sink->out_len, out->array, out->len);
+        sink->out_len += out->len;
+    } else if (status == CRYPTO_ERROR) {
+        sink->errors++;
+    } else {
+        CHECK(status == CRYPTO_PIPE_CANCELLED);
+        sink->cancelled++;
+    }
+    if (out != in) {
+        bfree(out);
+        ss_free(out);
+    }
+    bfree(in);
+    ss_free(in);
+}
+
+static void
+wait_for(sink_t *sink)
+{
+    while (sink->delivered < sink->submitted)
+        ev_run(loop, EVRUN_ONCE);
+}
+
+static buffer_t *
+new_buffer(const uint8_t *data, size_t len, size_t capacity)
+{
+    buffer_t *buf = ss_malloc(sizeof(buffer_t));
+    balloc(buf, capacity);
+    if (len > 0)
+        memcpy(buf->array, data, len);
+    buf->len = len;
+    return buf;
+}
+
+static void
+submit(crypto_pipe_stream_t *stream, sink_t *sink, int enc, uint8_t *nonce,
+       buffer_t *in, buffer_t *out, size_t chunks)
+{
+    sink->expect[sink->submitted++] = in;
+    CHECK(crypto_pipe_submit(stream, enc, nonce, in, out) == CRYPTO_OK);
+    crypto_pipe_nonce_add(nonce, CRYPTO_PIPE_NONCE_LEN, 2 * chunks);
+}
+
+// Batches go out in order across workers and a backlog
+static void
+test_encrypt(crypto_pipe_t *pipe, int method)
+{
+    static sink_t sink;
+    uint8_t nonce[CRYPTO_PIPE_NONCE_LEN] = { 0 };
+
+    memset(&sink, 0, sizeof(sink));
+    sink.out = wire;
+    crypto_pipe_stream_t *stream = crypto_pipe_stream_new(pipe, method, subkey,
+                                                          key_lens[method], sink_cb, &sink);
+    CHECK(stream != NULL);
+
+    for (size_t off = 0; off < TOTAL; off += BATCH) {
+        size_t len = TOTAL - off < BATCH ? TOTAL - off : BATCH;
+        buffer_t *in  = new_buffer(plain + off, len, len);
+        buffer_t *out = new_buffer(NULL, 0, crypto_pipe_sealed_len(len));
+        submit(stream, &sink, 1, nonce, in, out, crypto_pipe_chunks(len));
+    }
+    wait_for(&sink);
+    crypto_pipe_stream_close(stream);
+
+    CHECK(sink.errors == 0 && sink.out_len == crypto_pipe_sealed_len(BATCH) * (TOTAL / BATCH)
+          + crypto_pipe_sealed_len(TOTAL % BATCH));
+    CHECK(ref_decode(method, wire, sink.out_len, result) == TOTAL);
+    CHECK(memcmp(result, plain, TOTAL) == 0);
+}
+
+// Reads cut anywhere are scanned to whole chunks and opened in place
+static void
+test_decrypt(crypto_pipe_t *pipe, int method)
+{
+    static sink_t sink;
+    uint8_t nonce[CRYPTO_PIPE_NONCE_LEN] = { 0 };
+    size_t wire_len = ref_encode(method, plain, TOTAL, wire);
+    size_t start = 0, end = 0;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.out = result;
+    crypto_pipe_stream_t *stream = crypto_pipe_stream_new(pipe, method, subkey,
+                                                          key_lens[method], sink_cb, &sink);
+
+    while (end < wire_len) {
+        end = end + READ < wire_len ? end + READ : wire_len;
+        size_t consumed, chunks;
+        CHECK(crypto_pipe_stream_scan(stream, nonce, wire + start, end - start,
+                                      &consumed, &chunks) == CRYPTO_OK);
+        if (consumed == 0)
+            continue;
+        buffer_t *in = new_buffer(wire + start, consumed, consumed);
+        submit(stream, &sink, 0, nonce, in, in, chunks);
+        start += consumed;
+    }
+    CHECK(start == wire_len);
+    wait_for(&sink);
+    CHECK(sink.errors == 0 && sink.out_len == TOTAL);
+    CHECK(memcmp(result, plain, TOTAL) == 0);
+
+    // A forged length is caught by the scan, a forged payload by the worker
+    uint8_t bad[CRYPTO_PIPE_CHUNK_SIZE + 34];
+    size_t bad_len = ref_encode(method, plain, 1000, bad);
+    size_t consumed, chunks;
+    bad[0] ^= 1;
+    CHECK(crypto_pipe_stream_scan(stream, nonce, bad, bad_len, &consumed, &chunks)
+          == CRYPTO_ERROR);
+    bad[0] ^= 1;
+    memset(nonce, 0, sizeof(nonce));
+    CHECK(crypto_pipe_stream_scan(stream, nonce, bad, bad_len, &consumed, &chunks)
+          == CRYPTO_OK && consumed == bad_len && chunks == 1);
+    bad[bad_len - 1] ^= 1;
+    buffer_t *in = new_buffer(bad, bad_len, bad_len);
+    submit(stream, &sink, 0, nonce, in, in, 1);
+    wait_for(&sink);
+    CHECK(sink.errors == 1);
+    crypto_pipe_stream_close(stream);
+}
+
+// Closing with jobs out returns every buffer, cancelled, in order
+static void
+test_cancel(crypto_pipe_t *pipe)
+{
+    static sink_t sink;
+    uint8_t nonce[CRYPTO_PIPE_NONCE_LEN] = { 0 };
+
+    memset(&sink, 0, sizeof(sink));
+    sink.out = wire;
+    crypto_pipe_stream_t *stream = crypto_pipe_stream_new(pipe, AES_128_GCM, subkey, 16,
+                                                          sink_cb, &sink);
+    for (int i = 0; i < 20; i++) {
+        buffer_t *in  = new_buffer(plain, BATCH, BATCH);
+        buffer_t *out = new_buffer(NULL, 0, crypto_pipe_sealed_len(BATCH));
+        submit(stream, &sink, 1, nonce, in, out, crypto_pipe_chunks(BATCH));
+    }
+    CHECK(crypto_pipe_stream_inflight(stream) == 20);
+    crypto_pipe_stream_close(stream);
+    wait_for(&sink);
+    CHECK(sink.cancelled == 20 && sink.out_len == 0);
+}
+
+static void
+test_offload(crypto_pipe_t *pipe)
+{
+    static sink_t sink;
+    crypto_pipe_stream_t *bulk = crypto_pipe_stream_new(pipe, AES_128_GCM, subkey, 16,
+                                                        sink_cb, &sink);
+    crypto_pipe_stream_t *chat = crypto_pipe_stream_new(pipe, AES_128_GCM, subkey, 16,
+                                                        sink_cb, &sink);
+    ev_tstamp t = ev_now(loop);
+
+    // No estimate yet, then 655 KB/s against a 500 KB/s threshold
+    CHECK(!crypto_pipe_stream_offload(bulk, 64 * 1024));
+    CHECK(!crypto_pipe_stream_offload(chat, 1000));
+    evloop_step(loop, t + 0.2);
+    CHECK(crypto_pipe_stream_offload(bulk, 64 * 1024));
+    CHECK(!crypto_pipe_stream_offload(chat, 1000));
+
+    // A fast stream still keeps its small writes inline
+    CHECK(!crypto_pipe_stream_offload(bulk, 1000));
+
+    crypto_pipe_stream_close(bulk);
+    crypto_pipe_stream_close(chat);
+}
+
+static void
+test_sizes(void)
+{
+    uint8_t nonce[CRYPTO_PIPE_NONCE_LEN] = { 0xff, 0xff, 0xfe };
+    crypto_pipe_nonce_add(nonce, sizeof(nonce), 2);
+    CHECK(nonce[0] == 1 && nonce[1] == 0 && nonce[2] == 0xff && nonce[3] == 0);
+
+    CHECK(crypto_pipe_chunks(1) == 1);
+    CHECK(crypto_pipe_chunks(CRYPTO_PIPE_CHUNK_SIZE) == 1);
+    CHECK(crypto_pipe_chunks(CRYPTO_PIPE_CHUNK_SIZE + 1) == 2);
+    CHECK(crypto_pipe_sealed_len(CRYPTO_PIPE_CHUNK_SIZE + 1) == CRYPTO_PIPE_CHUNK_SIZE + 1 + 2 * 34);
+}
+
+int
+main(void)
+{
+    crypto_pipe_config_t config = { .workers = 3, .queue_depth = 2, .threshold = 500000 };
+    crypto_pipe_stats_t stats;
+
+    CHECK(sodium_init() >= 0);
+    randombytes_buf(subkey, sizeof(subkey));
+    plain  = ss_malloc(TOTAL);
+    wire   = ss_malloc(MAX_OUT);
+    result = ss_malloc(MAX_OUT);
+    randombytes_buf(plain, TOTAL);
+
+    loop = ev_loop_new(0);
+    crypto_pipe_t *pipe = crypto_pipe_new(loop, &config);
+    CHECK(pipe != NULL);
+
+    test_sizes();
+    for (int method = AES_128_GCM; method <= CHACHA20_IETF_POLY1305; method++) {
+        test_encrypt(pipe, method);
+        test_decrypt(pipe, method);
+    }
+    test_cancel(pipe);
+    test_offload(pipe);
+
+    crypto_pipe_stats(pipe, &stats);
+    CHECK(stats.workers == 3 && stats.backlog == 0);
+    CHECK(stats.submitted == stats.completed && stats.failed == 4);
+
+    crypto_pipe_free(pipe);
+    ev_loop_destroy(loop);
+    ss_free(plain);
+    ss_free(wire);
+    ss_free(result);
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * test_fastopen.c - Connecting and the per-server backoff of fastopen
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fastopen.h"
+#include "utils.h"
+#include "test.h"
+
+/*
+ * fastopen.c times its backoff with clock_gettime(). This definition
+ * stands in for libc's, so that the test decides when an hour has passed.
+ */
+static time_t now = 1000;
+
+int
+clock_gettime(clockid_t clock, struct timespec *ts)
+{
+    (void)clock;
+    ts->tv_sec  = now;
+    ts->tv_nsec = 0;
+    return 0;
+}
+
+static fast_open_stats_t
+stats_of(fast_open_server_t *server)
+{
+    fast_open_stats_t stats;
+    fast_open_stats(server, &stats);
+    return stats;
+}
+
+// What fast_open_connect() leaves behind after the kernel took SYN data
+static void
+attempt(fast_open_conn_t *conn, fast_open_server_t *server)
+{
+    memset(conn, 0, sizeof(fast_open_conn_t));
+    conn->server    = server;
+    conn->attempted = 1;
+    conn->syn_data  = 1;
+}
+
+static void
+test_backoff(void)
+{
+    fast_open_server_t *server = fast_open_server_new();
+    fast_open_conn_t conn;
+
+    CHECK(stats_of(server).disabled_for == 0);
+
+    // Refused or unreachable says nothing about SYN data, nor does a
+    // failure after the server answered or without SYN data
+    attempt(&conn, server);
+    fast_open_failed(&conn, ECONNREFUSED);
+    attempt(&conn, server);
+    fast_open_response(&conn);
+    fast_open_failed(&conn, ETIMEDOUT);
+    attempt(&conn, server);
+    conn.syn_data = 0;
+    fast_open_failed(&conn, ETIMEDOUT);
+    CHECK(stats_of(server).blackholes == 0 && stats_of(server).disabled_for == 0);
+
+    // A timeout after SYN data turns TFO off, and again for twice as long
+    attempt(&conn, server);
+    fast_open_failed(&conn, ETIMEDOUT);
+    fast_open_failed(&conn, ETIMEDOUT);
+    CHECK(stats_of(server).blackholes == 1);
+    CHECK(stats_of(server).disabled_for == FAST_OPEN_MIN_BACKOFF && !stats_of(server).enabled);
+    now += FAST_OPEN_MIN_BACKOFF;
+    CHECK(stats_of(server).disabled_for == 0);
+    attempt(&conn, server);
+    fast_open_failed(&conn, ECONNRESET);
+    CHECK(stats_of(server).disabled_for == 2 * FAST_OPEN_MIN_BACKOFF);
+
+    // up to the maximum
+    for (int i = 0; i < 10; i++) {
+        now += stats_of(server).disabled_for;
+        attempt(&conn, server);
+        fast_open_failed(&conn, ETIMEDOUT);
+    }
+    CHECK(stats_of(server).disabled_for == FAST_OPEN_MAX_BACKOFF);
+
+    // A clean connect that got its answer starts over from the minimum
+    now += FAST_OPEN_MAX_BACKOFF;
+    attempt(&conn, server);
+    fast_open_response(&conn);
+    attempt(&conn, server);
+    fast_open_failed(&conn, ETIMEDOUT);
+    CHECK(stats_of(server).disabled_for == FAST_OPEN_MIN_BACKOFF);
+    CHECK(stats_of(server).blackholes == 13);
+
+    now += FAST_OPEN_MIN_BACKOFF;
+    fast_open_server_free(server);
+}
+
+#ifdef __linux__
+// SYN data the server did not acknowledge, FAST_OPEN_MAX_NOT_ACKED times
+static void
+test_not_acked(void)
+{
+    fast_open_server_t *server = fast_open_server_new();
+    fast_open_conn_t conn;
+    int a, b;
+
+    // A plain connection: TCP_INFO shows no acknowledged SYN data
+    test_tcp_pair(&a, &b);
+    for (int i = 0; i < FAST_OPEN_MAX_NOT_ACKED - 1; i++) {
+        attempt(&conn, server);
+        fast_open_connected(&conn, a);
+        fast_open_connected(&conn, a);
+    }
+    CHECK(stats_of(server).syn_data_not_acked == FAST_OPEN_MAX_NOT_ACKED - 1);
+    CHECK(stats_of(server).disabled_for == 0);
+
+    // Not attempted, or no SYN data: nothing to judge
+    memset(&conn, 0, sizeof(conn));
+    conn.server = server;
+    fast_open_connected(&conn, a);
+    attempt(&conn, server);
+    conn.syn_data = 0;
+    fast_open_connected(&conn, a);
+    CHECK(stats_of(server).syn_data_not_acked == FAST_OPEN_MAX_NOT_ACKED - 1);
+
+    attempt(&conn, server);
+    fast_open_connected(&conn, a);
+    CHECK(stats_of(server).disabled_for == FAST_OPEN_MIN_BACKOFF);
+    CHECK(stats_of(server).blackholes == 0);
+
+    now += FAST_OPEN_MIN_BACKOFF;
+    close(a);
+    close(b);
+    fast_open_server_free(server);
+}
+#endif
+
+static int
+wait_writable(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int error         = 0;
+    socklen_t len     = sizeof(error);
+
+    CHECK(poll(&pfd, 1, 2000) == 1);
+    CHECK(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0);
+    return error;
+}
+
+// Whatever the kernel does with the SYN, the server gets every byte once
+static void
+test_connect(void)
+{
+    fast_open_server_t *server = fast_open_server_new();
+    fast_open_conn_t conn;
+    struct sockaddr_storage addr;
+    uint16_t port = 0;
+    int listener  = test_listen(&port, 8);
+    socklen_t len = test_loopback(port, &addr);
+    char buf[16];
+
+    for (int round = 0; round < 2; round++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        setnonblocking(fd);
+        ssize_t s = fast_open_connect(&conn, server, fd, (struct sockaddr *)&addr, len,
+                                      "request", 7);
+        CHECK(s >= 0 && s <= 7);
+        CHECK(conn.attempted == (stats_of(server).attempts == (uint64_t)round + 1));
+        CHECK(conn.syn_data == (s > 0));
+
+        CHECK(wait_writable(fd) == 0);
+        fast_open_connected(&conn, fd);
+        CHECK(conn.connected == conn.attempted);
+        if (s < 7)
+            CHECK(send(fd, "request" + s, 7 - s, 0) == 7 - s);
+
+        int peer = -1;
+        for (int i = 0; i < 200 && peer == -1; i++) {
+            peer = accept(listener, NULL, NULL);
+            if (peer == -1)
+                usleep(5000);
+        }
+        CHECK(peer != -1);
+        CHECK(recv(peer, buf, 7, MSG_WAITALL) == 7 && memcmp(buf, "request", 7) == 0);
+        fast_open_response(&conn);
+        close(peer);
+        close(fd);
+    }
+
+    // While disabled, and without data, connects go the plain way
+    attempt(&conn, server);
+    fast_open_failed(&conn, ETIMEDOUT);
+    for (int round = 0; round < 2; round++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        setnonblocking(fd);
+        CHECK(fast_open_connect(&conn, server, fd, (struct sockaddr *)&addr, len,
+                                "request", round == 0 ? 7 : 0) == 0);
+        CHECK(!conn.attempted && wait_writable(fd) == 0);
+        close(fd);
+    }
+    // Only the one with data counts, and only if the system has TFO at all
+    CHECK(stats_of(server).fallbacks == (stats_of(server).attempts > 0));
+
+    close(listener);
+    fast_open_server_free(server);
+}
+
+int
+main(void)
+{
+    test_backoff();
+#ifdef __linux__
+    test_not_acked();
+#endif
+    test_connect();
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * test_fec.c - Recovery, loss and malformed input for the FEC codec
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "fec.h"
+#include "test.h"
+
+#define DATAGRAMS 20000
+
+static fec_decoder_t *decoder;
+static int seen[DATAGRAMS];
+static int corrupt;
+static double loss;
+static int drop[FEC_MAX_DATA + FEC_MAX_PARITY];
+static int sent;
+
+static void
+fill(char *buf, int seq, size_t len)
+{
+    memcpy(buf, &seq, sizeof(seq));
+    for (size_t i = sizeof(seq); i < len; i++)
+        buf[i] = (char)(seq * 31 + i * 7);
+}
+
+static void
+delivered(void *data, const char *payload, size_t len)
+{
+    (void)data;
+    int seq;
+    CHECK(len >= sizeof(seq));
+    memcpy(&seq, payload, sizeof(seq));
+    CHECK(seq >= 0 && seq < DATAGRAMS);
+    for (size_t i = sizeof(seq); i < len; i++)
+        if (payload[i] != (char)(seq * 31 + i * 7)) {
+            corrupt++;
+            return;
+        }
+    seen[seq]++;
+}
+
+static void
+lossy(void *data, const char *packet, size_t len)
+{
+    (void)data;
+    CHECK(len <= FEC_MAX_PACKET);
+    if ((double)rand() / RAND_MAX >= loss)
+        CHECK(fec_decode(decoder, packet, len) == 0);
+}
+
+static void
+planned(void *data, const char *packet, size_t len)
+{
+    (void)data;
+    if (!drop[sent++])
+        CHECK(fec_decode(decoder, packet, len) == 0);
+}
+
+static void
+discard(void *data, const char *packet, size_t len)
+{
+    (void)data;
+    (void)packet;
+    (void)len;
+}
+
+// Any parity packets of a group rebuild as many lost packets of it
+static void
+exact(int k, int m)
+{
+    fec_config_t config    = { .data = k, .parity = m };
+    fec_encoder_t *encoder = fec_encoder_new(&config, planned, NULL);
+    char buf[FEC_MAX_PAYLOAD];
+
+    memset(seen, 0, sizeof(seen));
+    decoder = fec_decoder_new(delivered, NULL);
+    for (int group = 0; group < 100; group++) {
+        memset(drop, 0, sizeof(drop));
+        for (int lost = 0; lost < m;) {
+            int i = rand() % (k + m);
+            if (!drop[i]) {
+                drop[i] = 1;
+                lost++;
+            }
+        }
+        sent = 0;
+        for (int i = 0; i < k; i++) {
+            int seq = group * k + i;
+            size_t len = sizeof(seq) + rand() % 1000;
+            fill(buf, seq, len);
+            CHECK(fec_encode(encoder, buf, len, 0) == 0);
+        }
+        CHECK(sent == k + m);
+        for (int i = 0; i < k; i++)
+            CHECK(seen[group * k + i] == 1);
+    }
+    CHECK(corrupt == 0);
+    fec_encoder_free(encoder);
+    fec_decoder_free(decoder);
+}
+
+// Random loss: nothing arrives twice or damaged, and less is lost than on the wire
+static void
+random_loss(int k, int m, double p)
+{
+    fec_config_t config    = { .data = k, .parity = m };
+    fec_encoder_t *encoder = fec_encoder_new(&config, lossy, NULL);
+    char buf[FEC_MAX_PAYLOAD];
+    int missing = 0;
+
+    memset(seen, 0, sizeof(seen));
+    loss    = p;
+    decoder = fec_decoder_new(delivered, NULL);
+    for (int seq = 0; seq < DATAGRAMS; seq++) {
+        size_t len = sizeof(seq) + rand() % 1400;
+        fill(buf, seq, len);
+        CHECK(fec_encode(encoder, buf, len, seq * 0.001) == 0);
+        fec_encoder_poll(encoder, seq * 0.001);
+    }
+    fec_encoder_poll(encoder, 1e9);
+
+    for (int seq = 0; seq < DATAGRAMS; seq++) {
+        CHECK(seen[seq] <= 1);
+        missing += !seen[seq];
+    }
+    fec_decoder_stats_t stats;
+    fec_decoder_stats(decoder, &stats);
+    CHECK(corrupt == 0);
+    CHECK(stats.malformed == 0);
+    CHECK(p == 0 ? missing == 0 : missing < DATAGRAMS * p / 2);
+    CHECK(p == 0 || stats.recovered > 0);
+    fec_encoder_free(encoder);
+    fec_decoder_free(decoder);
+}
+
+int
+main(void)
+{
+    srand(1);
+
+    for (int k = 1; k <= FEC_MAX_DATA; k *= 2)
+        for (int m = 1; m <= FEC_MAX_PARITY && m <= 2 * k; m *= 2)
+            exact(k, m);
+    exact(10, 5);
+
+    random_loss(8, 2, 0);
+    random_loss(8, 2, 0.05);
+    random_loss(8, 4, 0.2);
+    random_loss(32, 16, 0.3);
+
+    // Payloads over FEC_MAX_PAYLOAD are refused, not truncated
+    fec_config_t config    = { .adapt = 1 };
+    fec_encoder_t *encoder = fec_encoder_new(&config, discard, NULL);
+    fec_encoder_stats_t stats;
+    static char big[FEC_MAX_PAYLOAD + 1];
+    CHECK(fec_encode(encoder, big, sizeof(big), 0) == -1);
+    fec_encoder_stats(encoder, &stats);
+    CHECK(stats.oversized == 1);
+
+    // The parity count follows the loss it is told
+    fec_encoder_set_loss(encoder, 0);
+    fec_encoder_stats(encoder, &stats);
+    int low = stats.parity;
+    fec_encoder_set_loss(encoder, 0.2);
+    fec_encoder_stats(encoder, &stats);
+    CHECK(low >= 1 && stats.parity > low);
+    fec_encoder_free(encoder);
+
+    // Garbage, and headers that look right over garbage, are rejected or ignored
+    decoder = fec_decoder_new(discard, NULL);
+    char packet[FEC_MAX_PACKET + 16];
+    for (int i = 0; i < 100000; i++) {
+        size_t len = rand() % sizeof(packet);
+        for (size_t j = 0; j < len; j++)
+            packet[j] = (char)rand();
+        if (len >= FEC_HEADER_SIZE && rand() & 1) {
+            packet[0] = packet[1] = packet[2] = 0;
+            packet[5] = (char)(1 + rand() % FEC_MAX_DATA);
+            packet[6] = (char)(1 + rand() % FEC_MAX_PARITY);
+            packet[4] = (char)(rand() % (packet[5] + packet[6]));
+            packet[7] = 0;
+        }
+        fec_decode(decoder, packet, len);
+    }
+    fec_decoder_free(decoder);
+    return 0;
+}
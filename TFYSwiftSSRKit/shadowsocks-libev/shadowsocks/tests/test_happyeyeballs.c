@@ -0,0 +1,333 @@
+/*
+ * test_happyeyeballs.c - Racing, delays, failures and family preference
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+
+#include "happyeyeballs.h"
+#include "utils.h"
+#include "test.h"
+
+#define FILLERS 4
+
+static struct ev_loop *loop;
+static ev_tstamp started;
+
+static struct {
+    int called;
+    int fd;
+    int error;
+    int family;
+    uint16_t port;
+} result;
+
+static void
+on_done(void *data, int fd, const struct sockaddr *addr, socklen_t addr_len, int error)
+{
+    CHECK(data == &result);
+    result.called++;
+    result.fd    = fd;
+    result.error = error;
+    if (fd != -1) {
+        CHECK(addr != NULL && addr_len > 0);
+        result.family = addr->sa_family;
+        result.port   = ntohs(((const struct sockaddr_in *)addr)->sin_port);
+    }
+}
+
+static happy_eyeballs_t *
+race_new(const happy_eyeballs_config_t *config)
+{
+    memset(&result, 0, sizeof(result));
+    started = ev_now(loop);
+    return happy_eyeballs_new(loop, config, on_done, &result);
+}
+
+/*
+ * Run the loop until the race has called back. Returns the seconds it took
+ * in ev_now() time, which the race's timers go by.
+ */
+static double
+run(void)
+{
+    double deadline = test_now() + 5;
+    while (!result.called && test_now() < deadline)
+        ev_run(loop, EVRUN_ONCE);
+    CHECK(result.called == 1);
+    return ev_now(loop) - started;
+}
+
+static happy_eyeballs_stats_t
+totals(void)
+{
+    happy_eyeballs_stats_t stats;
+    happy_eyeballs_stats(&stats);
+    return stats;
+}
+
+static void
+add4(happy_eyeballs_t *race, uint16_t port)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = test_loopback(port, &addr);
+    CHECK(happy_eyeballs_add(race, (struct sockaddr *)&addr, len) == 0);
+}
+
+static void
+add6(happy_eyeballs_t *race, uint16_t port)
+{
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr   = in6addr_loopback;
+    addr.sin6_port   = htons(port);
+    CHECK(happy_eyeballs_add(race, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+}
+
+static uint16_t
+closed_port(void)
+{
+    uint16_t port = 0;
+    close(test_listen(&port, 1));
+    return port;
+}
+
+/*
+ * A listener whose accept queue is full: the kernel drops further SYNs,
+ * so a connect to it stays in progress.
+ */
+static int
+full_listener(uint16_t *port, int *fillers)
+{
+    struct sockaddr_storage addr;
+    int listener  = test_listen(port, 0);
+    socklen_t len = test_loopback(*port, &addr);
+
+    for (int i = 0; i < FILLERS; i++) {
+        fillers[i] = socket(AF_INET, SOCK_STREAM, 0);
+        setnonblocking(fillers[i]);
+        connect(fillers[i], (struct sockaddr *)&addr, len);
+    }
+    usleep(50000);
+    return listener;
+}
+
+static void
+close_all(int listener, int *fillers)
+{
+    for (int i = 0; i < FILLERS; i++)
+        close(fillers[i]);
+    close(listener);
+}
+
+static void
+accept_winner(int listener)
+{
+    CHECK(result.fd >= 0 && result.error == 0);
+    close(result.fd);
+    usleep(1000);
+    int fd = accept(listener, NULL, NULL);
+    CHECK(fd != -1);
+    close(fd);
+}
+
+// A refused IPv6 attempt hands over to IPv4 at once, which is then preferred
+static void
+test_fallback(void)
+{
+    uint16_t port  = 0;
+    int listener   = test_listen(&port, 8);
+    uint16_t down  = closed_port();
+
+    happy_eyeballs_set_network(1);
+    happy_eyeballs_stats_t before = totals();
+    CHECK(before.preferred == AF_INET6);
+
+    happy_eyeballs_t *race = race_new(NULL);
+    add6(race, down);
+    CHECK(totals().attempts == before.attempts + 1);
+    add4(race, port);
+    happy_eyeballs_resolved(race);
+    CHECK(run() < HAPPY_EYEBALLS_ATTEMPT_DELAY);
+    CHECK(result.family == AF_INET && result.port == port);
+    accept_winner(listener);
+
+    happy_eyeballs_stats_t after = totals();
+    CHECK(after.attempts == before.attempts + 2 && after.ipv4_wins == before.ipv4_wins + 1);
+    CHECK(after.races == before.races + 1 && after.preferred == AF_INET);
+
+    // Remembered per network
+    happy_eyeballs_set_network(2);
+    CHECK(totals().preferred == AF_INET6);
+    happy_eyeballs_set_network(1);
+    CHECK(totals().preferred == AF_INET);
+
+    close(listener);
+}
+
+// An attempt that hangs gets company after attempt_delay
+static void
+test_delay(void)
+{
+    uint16_t port = 0, stuck = 0;
+    int fillers[FILLERS];
+    int listener = test_listen(&port, 8);
+    int full     = full_listener(&stuck, fillers);
+
+    happy_eyeballs_config_t config = { .attempt_delay = 0.1 };
+    happy_eyeballs_t *race         = race_new(&config);
+    happy_eyeballs_stats_t before  = totals();
+    add4(race, stuck);
+    add4(race, port);
+    happy_eyeballs_resolved(race);
+    CHECK(totals().attempts == before.attempts + 1);
+
+    double took = run();
+    CHECK(took >= 0.1 && took < 0.5);
+    CHECK(result.port == port && totals().attempts == before.attempts + 2);
+    accept_winner(listener);
+
+    close_all(full, fillers);
+    close(listener);
+}
+
+// Only the other family in: wait for the resolver a moment
+static void
+test_resolution_delay(void)
+{
+    uint16_t port = 0;
+    int listener  = test_listen(&port, 8);
+
+    happy_eyeballs_set_network(3);
+    happy_eyeballs_stats_t before = totals();
+    happy_eyeballs_t *race        = race_new(NULL);
+    add4(race, port);
+    CHECK(totals().attempts == before.attempts);
+    CHECK(run() >= HAPPY_EYEBALLS_RESOLUTION_DELAY);
+    accept_winner(listener);
+
+    // or until the resolver says it is done
+    happy_eyeballs_set_network(4);
+    race = race_new(NULL);
+    add4(race, port);
+    CHECK(totals().attempts == before.attempts + 1);
+    happy_eyeballs_resolved(race);
+    CHECK(totals().attempts == before.attempts + 2);
+    run();
+    accept_winner(listener);
+
+    happy_eyeballs_set_network(1);
+    close(listener);
+}
+
+static int
+refuse_setup(void *data, int fd)
+{
+    CHECK(data == &result && fd >= 0);
+    errno = EPERM;
+    return -1;
+}
+
+static void
+test_failure(void)
+{
+    uint16_t down[2] = { closed_port(), closed_port() };
+
+    // Every address refused: the last error, once
+    happy_eyeballs_stats_t before = totals();
+    happy_eyeballs_t *race        = race_new(NULL);
+    struct sockaddr_un unix_addr  = { .sun_family = AF_UNIX };
+    CHECK(happy_eyeballs_add(race, (struct sockaddr *)&unix_addr, sizeof(unix_addr)) == -1);
+    add4(race, down[0]);
+    add4(race, down[0]);
+    add4(race, down[1]);
+    happy_eyeballs_resolved(race);
+    run();
+    CHECK(result.fd == -1 && result.error == ECONNREFUSED);
+    CHECK(totals().attempts == before.attempts + 2 && totals().failures == before.failures + 1);
+
+    // Nothing resolved
+    race = race_new(NULL);
+    happy_eyeballs_resolved(race);
+    CHECK(result.called == 1 && result.error == EHOSTUNREACH);
+
+    // setup refuses the socket
+    happy_eyeballs_config_t config = { .setup = refuse_setup, .data = &result };
+    race = race_new(&config);
+    add4(race, down[0]);
+    CHECK(!result.called);
+    happy_eyeballs_resolved(race);
+    CHECK(result.called == 1 && result.error == EPERM);
+}
+
+static void
+test_timeout(void)
+{
+    uint16_t stuck = 0;
+    int fillers[FILLERS];
+    int full = full_listener(&stuck, fillers);
+
+    happy_eyeballs_config_t config = { .timeout = 0.3 };
+    happy_eyeballs_t *race         = race_new(&config);
+    add4(race, stuck);
+    happy_eyeballs_resolved(race);
+    double took = run();
+    CHECK(result.fd == -1 && result.error == ETIMEDOUT);
+    CHECK(took >= 0.3 && took < 1);
+
+    // A cancelled race never calls back
+    race = race_new(&config);
+    add4(race, stuck);
+    happy_eyeballs_cancel(race);
+    double deadline = test_now() + 0.4;
+    while (test_now() < deadline)
+        ev_run(loop, EVRUN_NOWAIT);
+    CHECK(!result.called);
+
+    close_all(full, fillers);
+}
+
+static void
+test_resolve(void)
+{
+    struct sockaddr_storage addrs[4];
+
+    CHECK(happy_eyeballs_resolve("127.0.0.1", "8388", addrs, 4) == 1);
+    CHECK(addrs[0].ss_family == AF_INET);
+    CHECK(((struct sockaddr_in *)&addrs[0])->sin_port == htons(8388));
+    CHECK(happy_eyeballs_resolve("127.0.0.1", "8388", addrs, 0) == 0);
+}
+
+int
+main(void)
+{
+    loop = ev_loop_new(0);
+    test_fallback();
+    test_delay();
+    test_resolution_delay();
+    test_failure();
+    test_timeout();
+    test_resolve();
+    ev_loop_destroy(loop);
+    return 0;
+}
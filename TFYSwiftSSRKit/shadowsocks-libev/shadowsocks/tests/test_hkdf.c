@@ -0,0 +1,146 @@
+/*
+ * test_hkdf.c - Session subkey derivation against RFC 5869 and a textbook HKDF
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "aead.h"
+#include "blake3.h"
+#include "hkdf.h"
+#include "test.h"
+
+static void
+from_hex(const char *hex, uint8_t *out, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        CHECK(sscanf(hex + 2 * i, "%2hhx", &out[i]) == 1);
+}
+
+// RFC 5869 A.4 and A.6, the SHA-1 cases
+static void
+test_rfc5869(void)
+{
+    uint8_t ikm[22], salt[13], info[10], okm[42], want[42];
+    hkdf_psk_t psk;
+
+    memset(ikm, 0x0b, sizeof(ikm));
+    for (int i = 0; i < 13; i++)
+        salt[i] = i;
+    for (int i = 0; i < 10; i++)
+        info[i] = 0xf0 + i;
+
+    CHECK(hkdf_psk_init(&psk, ikm, 11, info, sizeof(info)) == 0);
+    CHECK(hkdf_psk_derive(&psk, salt, sizeof(salt), okm, sizeof(okm)) == 0);
+    from_hex("085a01ea1b10f36933068b56efa5ad81a4f14b822f5b091568a9"
+             "cdd4f155fda2c22e422478d305f3f896", want, sizeof(want));
+    CHECK(memcmp(okm, want, sizeof(okm)) == 0);
+
+    CHECK(hkdf_psk_init(&psk, ikm, 22, NULL, 0) == 0);
+    CHECK(hkdf_psk_derive(&psk, NULL, 0, okm, sizeof(okm)) == 0);
+    from_hex("0ac1af7002b3d761d1e55298da9d0506b9ae52057220a306e07b"
+             "6b87e8df21d0ea00033de03984d34918", want, sizeof(want));
+    CHECK(memcmp(okm, want, sizeof(okm)) == 0);
+    hkdf_psk_release(&psk);
+}
+
+// Every key size and output length a cipher can ask for, and then some,
+// against both the textbook HKDF and crypto_hkdf()
+static void
+test_reference(void)
+{
+    const mbedtls_md_info_t *sha1 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA1);
+    uint8_t key[32], salt[32], a[200], b[200], c[200];
+    hkdf_psk_t psk;
+
+    for (int i = 0; i < 32; i++) {
+        key[i]  = i * 7 + 1;
+        salt[i] = i * 13 + 5;
+    }
+    for (size_t key_len = 16; key_len <= 32; key_len += 8) {
+        CHECK(hkdf_psk_init(&psk, key, key_len,
+                            (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN) == 0);
+        for (size_t len = 1; len < sizeof(a); len++) {
+            CHECK(hkdf_psk_derive(&psk, salt, key_len, a, len) == 0);
+            CHECK(test_hkdf_sha1(salt, key_len, key, key_len,
+                                 (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN, b, len) == 0);
+            CHECK(memcmp(a, b, len) == 0);
+            CHECK(crypto_hkdf(sha1, salt, key_len, key, key_len,
+                              (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN, c, len) == 0);
+            CHECK(memcmp(a, c, len) == 0);
+        }
+        hkdf_psk_release(&psk);
+    }
+
+    // A fresh salt must give a fresh subkey
+    CHECK(hkdf_psk_init(&psk, key, 32, (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN) == 0);
+    CHECK(hkdf_psk_derive(&psk, salt, 32, a, 32) == 0);
+    salt[0] ^= 1;
+    CHECK(hkdf_psk_derive(&psk, salt, 32, b, 32) == 0);
+    CHECK(memcmp(a, b, 32) != 0);
+    hkdf_psk_release(&psk);
+}
+
+static void
+test_bad_lengths(void)
+{
+    uint8_t key[MAX_KEY_LENGTH + 1] = { 0 }, info[HKDF_MAX_INFO_LEN + 1] = { 0 };
+    uint8_t salt[65] = { 0 }, okm[32];
+    hkdf_psk_t psk;
+
+    CHECK(hkdf_psk_init(&psk, key, sizeof(key), info, 1) == -1);
+    CHECK(hkdf_psk_init(&psk, key, 32, info, sizeof(info)) == -1);
+    CHECK(hkdf_psk_init(&psk, key, 32, info, 9) == 0);
+    CHECK(hkdf_psk_derive(&psk, salt, sizeof(salt), okm, sizeof(okm)) == -1);
+    CHECK(hkdf_psk_derive(&psk, salt, 32, okm, HKDF_MAX_OKM_LEN + 1) == -1);
+}
+
+// The 2022 session subkey with the context hashed once up front
+static void
+test_blake3_context(void)
+{
+    uint8_t material[40] = { 0 }, context_key[BLAKE3_KEY_LEN], a[32], b[32], want[32];
+    blake3_hasher_t hasher;
+
+    for (int i = 0; i < 32; i++)
+        material[i] = i;
+
+    blake3_hasher_init_derive_key(&hasher, "shadowsocks 2022 session subkey");
+    blake3_hasher_update(&hasher, material, sizeof(material));
+    blake3_hasher_finalize(&hasher, a, sizeof(a));
+
+    blake3_derive_context_key("shadowsocks 2022 session subkey", context_key);
+    blake3_hasher_init_derive_key_raw(&hasher, context_key);
+    blake3_hasher_update(&hasher, material, sizeof(material));
+    blake3_hasher_finalize(&hasher, b, sizeof(b));
+
+    from_hex("8d43988b5f38b2d757761afda06c2d0232f10f372608ea86e0031825f548c775",
+             want, sizeof(want));
+    CHECK(memcmp(a, want, sizeof(a)) == 0);
+    CHECK(memcmp(b, want, sizeof(b)) == 0);
+}
+
+int
+main(void)
+{
+    test_rfc5869();
+    test_reference();
+    test_bad_lengths();
+    test_blake3_context();
+    return 0;
+}
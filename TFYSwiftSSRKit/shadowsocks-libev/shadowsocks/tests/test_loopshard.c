@@ -0,0 +1,258 @@
+/*
+ * test_loopshard.c - Accepting, snapshots and counters of loopshard
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "loopshard.h"
+#include "test.h"
+
+#define WORKERS 4
+#define CLIENTS 200
+#define BURST   40              // well past any fixed accept batch
+
+static atomic_int started;
+static atomic_int stopped;
+static atomic_int released;
+static atomic_int accepted[LOOP_SHARD_MAX_WORKERS];
+static atomic_int stale;        // accepts that saw an old snapshot
+static atomic_int hold;         // keeps the first loop from polling
+static int recording;
+static _Atomic(void *) expected;
+static int values[2];
+
+// ev_now() of each accept, to tell how many loop iterations a burst took
+static ev_tstamp accepted_at[BURST];
+static atomic_int naccepted_at;
+
+static char port[8];
+
+static void
+on_start(loop_shard_t *shard, void *data)
+{
+    CHECK(data == values && shard->loop != NULL && shard->budget != NULL);
+    atomic_fetch_add(&started, 1);
+    while (shard->index == 0 && atomic_load(&hold))
+        usleep(1000);
+}
+
+static void
+on_stop(loop_shard_t *shard, void *data)
+{
+    (void)shard;
+    (void)data;
+    atomic_fetch_add(&stopped, 1);
+}
+
+static void
+on_accept(loop_shard_t *shard, int fd, struct sockaddr_storage *addr, void *data)
+{
+    (void)data;
+    CHECK(addr->ss_family == AF_INET);
+    CHECK(fcntl(fd, F_GETFL, 0) & O_NONBLOCK);
+
+    if (loop_shard_snapshot(shard) != expected)
+        atomic_fetch_add(&stale, 1);
+    if (recording && atomic_load(&naccepted_at) < BURST) {
+        accepted_at[atomic_load(&naccepted_at)] = ev_now(shard->loop);
+        atomic_fetch_add(&naccepted_at, 1);
+    }
+
+    loop_shard_conn_opened(shard);
+    loop_shard_add_traffic(shard, 1, 2);
+    atomic_fetch_add(&accepted[shard->index], 1);
+    close(fd);
+}
+
+static void
+on_release(void *value)
+{
+    CHECK(value == &values[0] || value == &values[1]);
+    atomic_fetch_add(&released, 1);
+}
+
+// A port that was free a moment ago, for every worker to bind
+static void
+pick_port(void)
+{
+    uint16_t number = 0;
+    close(test_listen(&number, 1));
+    snprintf(port, sizeof(port), "%u", number);
+}
+
+static void
+connect_clients(int n)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = test_loopback((uint16_t)atoi(port), &addr);
+
+    for (int i = 0; i < n; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        CHECK(connect(fd, (struct sockaddr *)&addr, len) == 0);
+        close(fd);
+    }
+}
+
+static void
+wait_accepted(loop_shard_group_t *group, uint64_t n)
+{
+    loop_shard_stats_t stats;
+    double deadline = test_now() + 10;
+    do {
+        usleep(1000);
+        loop_shard_group_stats(group, &stats);
+    } while (stats.accepted < n && test_now() < deadline);
+    CHECK(stats.accepted == n);
+}
+
+static void
+reset(void)
+{
+    atomic_store(&started, 0);
+    atomic_store(&stopped, 0);
+    atomic_store(&released, 0);
+    atomic_store(&stale, 0);
+    for (int i = 0; i < LOOP_SHARD_MAX_WORKERS; i++)
+        atomic_store(&accepted[i], 0);
+    expected = &values[0];
+}
+
+static void
+test_group(loop_shard_mode_t mode)
+{
+    loop_shard_config_t config = {
+        .host      = "127.0.0.1",
+        .port      = port,
+        .workers   = WORKERS,
+        .mode      = mode,
+        .accept_cb = on_accept,
+        .start_cb  = on_start,
+        .stop_cb   = on_stop,
+        .data      = values,
+    };
+    loop_shard_stats_t stats;
+
+    reset();
+    pick_port();
+    loop_shard_group_t *group = loop_shard_group_new(&config, &values[0], on_release);
+    CHECK(group != NULL);
+    CHECK(loop_shard_group_workers(group) == WORKERS);
+    CHECK(loop_shard_group_mode(group) == mode);
+
+    connect_clients(CLIENTS);
+    wait_accepted(group, CLIENTS);
+    CHECK(atomic_load(&started) == WORKERS && atomic_load(&stale) == 0);
+
+    // Every loop has its own listener, so the kernel spreads the work
+    if (mode == LOOP_SHARD_REUSEPORT) {
+        int busy = 0;
+        for (int i = 0; i < WORKERS; i++)
+            busy += atomic_load(&accepted[i]) > 0;
+        CHECK(busy > 1);
+    }
+
+    loop_shard_group_stats(group, &stats);
+    CHECK(stats.active == CLIENTS && stats.bytes_up == CLIENTS && stats.bytes_down == 2 * CLIENTS);
+    for (int i = 0; i < WORKERS; i++) {
+        loop_shard_stats(group, i, &stats);
+        CHECK(stats.accepted == (uint64_t)atomic_load(&accepted[i]));
+    }
+    loop_shard_stats(group, WORKERS, &stats);
+    CHECK(stats.accepted == 0 && stats.active == 0);
+
+    // The old snapshot goes once every worker has moved to the new one
+    expected = &values[1];
+    loop_shard_publish(group, &values[1]);
+    double deadline = test_now() + 10;
+    while (atomic_load(&released) == 0 && test_now() < deadline)
+        usleep(1000);
+    CHECK(atomic_load(&released) == 1);
+    connect_clients(CLIENTS);
+    wait_accepted(group, 2 * CLIENTS);
+    CHECK(atomic_load(&stale) == 0);
+
+    loop_shard_group_free(group);
+    CHECK(atomic_load(&stopped) == WORKERS && atomic_load(&released) == 2);
+}
+
+// A backlog on a shared listener is taken in one wakeup
+static void
+test_drain(void)
+{
+    loop_shard_config_t config = {
+        .host      = "127.0.0.1",
+        .port      = port,
+        .workers   = 1,
+        .mode      = LOOP_SHARD_SHARED,
+        .accept_cb = on_accept,
+        .start_cb  = on_start,
+        .data      = values,
+    };
+
+    reset();
+    pick_port();
+    recording = 1;
+    atomic_store(&hold, 1);
+    loop_shard_group_t *group = loop_shard_group_new(&config, &values[0], NULL);
+    CHECK(group != NULL);
+
+    connect_clients(BURST);
+    atomic_store(&hold, 0);
+    wait_accepted(group, BURST);
+
+    CHECK(atomic_load(&naccepted_at) == BURST);
+    for (int i = 1; i < BURST; i++)
+        CHECK(accepted_at[i] == accepted_at[0]);
+    loop_shard_group_free(group);
+    recording = 0;
+}
+
+static void
+test_errors(void)
+{
+    loop_shard_config_t config = { .host = "256.0.0.1", .port = "0", .workers = 2 };
+    CHECK(loop_shard_group_new(&config, NULL, NULL) == NULL);
+
+    // One worker per CPU, up to the maximum
+    config.host    = "127.0.0.1";
+    config.workers = 0;
+    config.mode    = LOOP_SHARD_SHARED;
+    loop_shard_group_t *group = loop_shard_group_new(&config, NULL, NULL);
+    CHECK(group != NULL);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > LOOP_SHARD_MAX_WORKERS)
+        cpus = LOOP_SHARD_MAX_WORKERS;
+    CHECK(loop_shard_group_workers(group) == cpus);
+    loop_shard_group_free(group);
+}
+
+int
+main(void)
+{
+#ifdef __linux__
+    test_group(LOOP_SHARD_REUSEPORT);
+#endif
+    test_group(LOOP_SHARD_SHARED);
+    test_drain();
+    test_errors();
+    return 0;
+}
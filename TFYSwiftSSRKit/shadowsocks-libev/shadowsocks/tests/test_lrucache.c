@@ -0,0 +1,260 @@
+/*
+ * test_lrucache.c - LRU order, expiry, budget and threads for lrucache
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "lrucache.h"
+#include "membudget.h"
+#include "test.h"
+
+/*
+ * lrucache.c reads the clock with time(). This definition stands in for
+ * libc's, so that expiry can run on a simulated clock for minutes of
+ * timeouts; with simulated off it is the real one.
+ */
+static int simulated;
+static time_t simulated_now;
+
+time_t
+time(time_t *t)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_t now = simulated ? simulated_now : ts.tv_sec;
+    if (t != NULL)
+        *t = now;
+    return now;
+}
+
+static int freed;
+
+static void
+free_int(void *p)
+{
+    freed++;
+    free(p);
+}
+
+static int *
+new_int(int v)
+{
+    int *p = malloc(sizeof(int));
+    *p = v;
+    return p;
+}
+
+static int
+lookup_int(lru_cache_t *cache, int key)
+{
+    void *result;
+    CHECK(lru_cache_lookup(cache, &key, sizeof(key), &result) == 0);
+    return result == NULL ? -1 : *(int *)result;
+}
+
+static void
+test_lru(void)
+{
+    lru_cache_t *cache;
+    lru_cache_stats_t stats;
+
+    freed = 0;
+    CHECK(lru_cache_create(&cache, 100, free_int) == 0);
+    lru_cache_stats(cache, &stats);
+    CHECK(stats.shards == 1);
+
+    for (int i = 0; i < 100; i++)
+        CHECK(lru_cache_insert(cache, &i, sizeof(i), new_int(i)) == 0);
+
+    // A lookup makes 0 recent, so 1 is the one evicted
+    CHECK(lookup_int(cache, 0) == 0);
+    int key = 100;
+    CHECK(lru_cache_insert(cache, &key, sizeof(key), new_int(key)) == 0);
+    key = 1;
+    CHECK(!lru_cache_key_exist(cache, &key, sizeof(key)));
+    key = 0;
+    CHECK(lru_cache_key_exist(cache, &key, sizeof(key)));
+    CHECK(freed == 1);
+
+    // Replacing with the same payload frees nothing, with another the old one
+    void *same;
+    lru_cache_lookup(cache, &key, sizeof(key), &same);
+    CHECK(lru_cache_insert(cache, &key, sizeof(key), same) == 0);
+    CHECK(freed == 1);
+    CHECK(lru_cache_insert(cache, &key, sizeof(key), new_int(7)) == 0);
+    CHECK(freed == 2 && lookup_int(cache, 0) == 7);
+
+    CHECK(lru_cache_remove(cache, &key, sizeof(key)) == 0);
+    CHECK(lru_cache_remove(cache, &key, sizeof(key)) == EINVAL);
+    lru_cache_stats(cache, &stats);
+    CHECK(stats.entries == 99 && stats.evictions == 1 && stats.replaced == 2);
+    CHECK(lookup_int(cache, 1) == -1);
+
+    lru_cache_delete(cache, 0);
+    CHECK(freed == 102);
+
+    // Binary keys of any length
+    char big[300];
+    memset(big, 'k', sizeof(big));
+    CHECK(lru_cache_create(&cache, 1000, NULL) == 0);
+    CHECK(lru_cache_insert(cache, big, sizeof(big), big) == 0);
+    CHECK(lru_cache_key_exist(cache, big, sizeof(big)));
+    CHECK(!lru_cache_key_exist(cache, big, sizeof(big) - 1));
+    lru_cache_delete(cache, 1);
+}
+
+static void
+test_expiry(void)
+{
+    lru_cache_t *cache;
+    lru_cache_stats_t stats;
+
+    simulated     = 1;
+    simulated_now = 1000;
+    freed         = 0;
+    CHECK(lru_cache_create(&cache, 10000, free_int) == 0);
+
+    // Timeouts up to 300 s, past the bucket ring, and entries that never expire
+    for (int i = 0; i < 3000; i++)
+        lru_cache_insert_with_timeout(cache, &i, sizeof(i), new_int(i), 1 + i % 300);
+    for (int i = 3000; i < 3100; i++)
+        lru_cache_insert(cache, &i, sizeof(i), new_int(i));
+
+    simulated_now = 1299;
+    CHECK(lookup_int(cache, 299) == 299);
+    simulated_now = 1300;
+    CHECK(lookup_int(cache, 299) == -1);
+
+    simulated_now = 1301;
+    lru_cache_cleanup_expired(cache);
+    lru_cache_stats(cache, &stats);
+    CHECK(stats.entries == 100 && freed == 3000);
+
+    simulated_now = 100000;
+    lru_cache_cleanup_expired(cache);
+    lru_cache_stats(cache, &stats);
+    CHECK(stats.entries == 100);
+
+    // Each second's sweep takes exactly the entries that came due
+    for (int i = 0; i < 1000; i++)
+        lru_cache_insert_with_timeout(cache, &i, sizeof(i), new_int(i), 1 + i % 500);
+    for (int t = 1; t <= 500; t++) {
+        simulated_now = 100000 + t;
+        lru_cache_cleanup_expired(cache);
+        lru_cache_stats(cache, &stats);
+        CHECK(stats.entries == (size_t)(100 + 1000 - 2 * t));
+    }
+
+    lru_cache_delete(cache, 0);
+    simulated = 0;
+}
+
+static void
+test_budget(void)
+{
+    mem_budget_config_t config = { .soft_limit = 64 * 1024, .hard_limit = 128 * 1024 };
+    struct ev_loop *loop       = ev_loop_new(0);
+    mem_budget_loop_t *owner   = mem_budget_attach(loop);
+    mem_budget_stats_t budget;
+    lru_cache_stats_t stats;
+    lru_cache_t *cache;
+
+    mem_budget_configure(&config);
+    CHECK(lru_cache_create(&cache, 100000, NULL) == 0);
+    CHECK(lru_cache_set_budget(cache, "cache") == 0);
+
+    // Inserts fail with ENOMEM at the hard limit, never past it
+    int i, ret = 0;
+    for (i = 0; i < 100000 && ret == 0; i++)
+        ret = lru_cache_insert(cache, &i, sizeof(i), &config);
+    CHECK(ret == ENOMEM);
+    mem_budget_stats(&budget);
+    CHECK(budget.used <= config.hard_limit && budget.denied > 0);
+    CHECK(budget.level == MEM_BUDGET_PRESSURE);
+
+    // The loop asks the cache to shrink, least recently used first
+    lru_cache_stats(cache, &stats);
+    size_t before = stats.entries;
+    ev_run(loop, EVRUN_NOWAIT);
+    lru_cache_stats(cache, &stats);
+    mem_budget_stats(&budget);
+    CHECK(stats.entries < before);
+    CHECK(budget.used <= config.soft_limit * MEM_BUDGET_DEFAULT_RESUME);
+    CHECK(budget.account[0].shrunk > 0);
+    int oldest = 0, newest = i - 2;
+    CHECK(!lru_cache_key_exist(cache, &oldest, sizeof(oldest)));
+    CHECK(lru_cache_key_exist(cache, &newest, sizeof(newest)));
+
+    lru_cache_delete(cache, 1);
+    mem_budget_stats(&budget);
+    CHECK(budget.used == 0);
+    mem_budget_detach(owner);
+    ev_loop_destroy(loop);
+    mem_budget_configure(NULL);
+}
+
+static lru_cache_t *shared;
+
+static void *
+worker(void *arg)
+{
+    unsigned seed = (unsigned)(long)arg;
+    void *result;
+
+    for (int i = 0; i < 200000; i++) {
+        int key = rand_r(&seed) % 5000;
+        if (rand_r(&seed) % 4 == 0) {
+            lru_cache_insert(shared, &key, sizeof(key), (void *)(long)(key + 1));
+        } else {
+            lru_cache_lookup(shared, &key, sizeof(key), &result);
+            CHECK(result == NULL || (long)result == key + 1);
+        }
+    }
+    return NULL;
+}
+
+static void
+test_threads(void)
+{
+    lru_cache_stats_t stats;
+    pthread_t threads[4];
+
+    CHECK(lru_cache_create(&shared, 4096, NULL) == 0);
+    for (long t = 0; t < 4; t++)
+        pthread_create(&threads[t], NULL, worker, (void *)t);
+    for (int t = 0; t < 4; t++)
+        pthread_join(threads[t], NULL);
+    lru_cache_stats(shared, &stats);
+    CHECK(stats.entries <= 4096 && stats.shards > 1);
+    CHECK(stats.hits > 0 && stats.evictions > 0);
+    lru_cache_delete(shared, 1);
+}
+
+int
+main(void)
+{
+    test_lru();
+    test_expiry();
+    test_budget();
+    test_threads();
+    return 0;
+}
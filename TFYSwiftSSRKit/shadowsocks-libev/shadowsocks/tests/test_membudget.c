@@ -0,0 +1,226 @@
+/*
+ * test_membudget.c - Limits, paused readers and shrink callbacks of membudget
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+
+#include "membudget.h"
+#include "test.h"
+
+#define SOFT 1000
+#define HARD 4000
+
+static void
+configure(void)
+{
+    mem_budget_config_t config = { .soft_limit = SOFT, .hard_limit = HARD };
+    mem_budget_configure(&config);
+}
+
+static int
+accounts(void)
+{
+    mem_budget_stats_t stats;
+    mem_budget_stats(&stats);
+    return stats.accounts;
+}
+
+static size_t
+paused_readers(void)
+{
+    mem_budget_stats_t stats;
+    mem_budget_stats(&stats);
+    return stats.paused_readers;
+}
+
+static void
+test_limits(void)
+{
+    mem_budget_stats_t stats;
+    configure();
+    mem_account_t *a = mem_budget_register("a", NULL, NULL, NULL);
+    CHECK(a != NULL);
+
+    CHECK(mem_budget_charge(a, 900) == 0);
+    CHECK(mem_budget_level() == MEM_BUDGET_NORMAL);
+    CHECK(mem_budget_charge(a, 200) == 0);
+    CHECK(mem_budget_level() == MEM_BUDGET_PRESSURE);
+
+    // Refused charges are not recorded
+    CHECK(mem_budget_charge(a, HARD) == -1);
+    mem_budget_stats(&stats);
+    CHECK(stats.used == 1100 && stats.denied == 1 && stats.account[0].denied == 1);
+
+    // Pressure lasts until usage falls under resume_ratio * soft
+    mem_budget_uncharge(a, 200);
+    CHECK(mem_budget_level() == MEM_BUDGET_PRESSURE);
+    mem_budget_uncharge(a, 200);
+    CHECK(mem_budget_level() == MEM_BUDGET_NORMAL);
+
+    // An unregistered account keeps its slot until it is back to zero
+    mem_budget_unregister(a);
+    CHECK(accounts() == 1);
+    mem_budget_uncharge(a, 10000);
+    mem_budget_stats(&stats);
+    CHECK(stats.accounts == 0 && stats.used == 0);
+}
+
+static void
+io_cb(EV_P_ ev_io *w, int revents)
+{
+    (void)loop;
+    (void)w;
+    (void)revents;
+}
+
+static void
+test_readers(void)
+{
+    struct ev_loop *loop     = ev_loop_new(0);
+    mem_budget_loop_t *owner = mem_budget_attach(loop);
+    mem_account_t *a         = mem_budget_register("a", owner, NULL, NULL);
+    int fds[2];
+    ev_io idle_io, busy_io;
+    mem_budget_reader_t idle, busy;
+
+    configure();
+    CHECK(pipe(fds) == 0);
+    ev_io_init(&idle_io, io_cb, fds[0], EV_READ);
+    ev_io_init(&busy_io, io_cb, fds[0], EV_READ);
+    mem_budget_reader_init(&idle, owner, &idle_io);
+    mem_budget_reader_init(&busy, owner, &busy_io);
+    mem_budget_io_start(&idle);
+    mem_budget_io_start(&busy);
+    mem_budget_reader_queued(&busy, 100);
+
+    // Under pressure only the reader with writes queued stops
+    CHECK(mem_budget_charge(a, SOFT + 1) == 0);
+    ev_run(loop, EVRUN_NOWAIT);
+    CHECK(ev_is_active(&idle_io) && !ev_is_active(&busy_io));
+    CHECK(busy.paused && paused_readers() == 1);
+
+    // and starts again once its own queue drains
+    mem_budget_reader_queued(&busy, 0);
+    CHECK(ev_is_active(&busy_io) && paused_readers() == 0);
+    mem_budget_reader_queued(&busy, 100);
+    CHECK(!ev_is_active(&busy_io));
+
+    // Everything runs again when the pressure is over
+    mem_budget_uncharge(a, SOFT + 1);
+    ev_run(loop, EVRUN_NOWAIT);
+    CHECK(ev_is_active(&idle_io) && ev_is_active(&busy_io));
+    CHECK(!busy.paused && paused_readers() == 0);
+
+    /*
+     * A start under pressure leaves the reader paused. If the relay starts
+     * it again after the pressure ends but before the loop has caught up,
+     * the pause must go, or the reader would be skipped the next time.
+     */
+    mem_budget_io_stop(&busy);
+    CHECK(mem_budget_charge(a, SOFT + 1) == 0);
+    mem_budget_io_start(&busy);
+    CHECK(busy.paused && !ev_is_active(&busy_io));
+    mem_budget_uncharge(a, SOFT + 1);
+    mem_budget_io_start(&busy);
+    CHECK(!busy.paused && ev_is_active(&busy_io) && paused_readers() == 0);
+    CHECK(mem_budget_charge(a, SOFT + 1) == 0);
+    mem_budget_reader_queued(&busy, 100);
+    CHECK(busy.paused && !ev_is_active(&busy_io));
+    ev_run(loop, EVRUN_NOWAIT);
+    CHECK(busy.paused && !ev_is_active(&busy_io) && paused_readers() == 1);
+
+    mem_budget_uncharge(a, SOFT + 1);
+    ev_run(loop, EVRUN_NOWAIT);
+    CHECK(ev_is_active(&busy_io) && paused_readers() == 0);
+
+    mem_budget_reader_release(&idle);
+    mem_budget_reader_release(&busy);
+    CHECK(!ev_is_active(&idle_io) && !ev_is_active(&busy_io));
+    mem_budget_unregister(a);
+    mem_budget_detach(owner);
+    ev_loop_destroy(loop);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+typedef struct shrinker {
+    mem_account_t *account;
+    mem_account_t *victim;  // unregistered from the callback, with itself
+    int calls;
+} shrinker_t;
+
+static size_t
+shrink_cb(void *data, size_t target)
+{
+    shrinker_t *s = (shrinker_t *)data;
+    s->calls++;
+    if (s->victim != NULL) {
+        mem_budget_unregister(s->victim);
+        mem_budget_unregister(s->account);
+        return 0;
+    }
+    mem_budget_uncharge(s->account, target);
+    return target;
+}
+
+static void
+test_shrink(void)
+{
+    struct ev_loop *loop     = ev_loop_new(0);
+    mem_budget_loop_t *owner = mem_budget_attach(loop);
+    shrinker_t first         = { 0 }, second = { 0 };
+    mem_budget_stats_t stats;
+
+    configure();
+
+    // A callback that unregisters an account whose turn is still to come
+    first.account  = mem_budget_register("first", owner, shrink_cb, &first);
+    second.account = mem_budget_register("second", owner, shrink_cb, &second);
+    first.victim   = second.account;
+    CHECK(mem_budget_charge(first.account, SOFT + 1) == 0);
+    ev_run(loop, EVRUN_NOWAIT);
+    CHECK(first.calls == 1 && second.calls == 0);
+    mem_budget_uncharge(first.account, SOFT + 1);
+    CHECK(accounts() == 0);
+
+    // An ordinary callback gives back down to the resume mark
+    second.account = mem_budget_register("second", owner, shrink_cb, &second);
+    second.victim  = NULL;
+    CHECK(mem_budget_charge(second.account, SOFT + 1) == 0);
+    ev_run(loop, EVRUN_NOWAIT);
+    mem_budget_stats(&stats);
+    CHECK(second.calls == 1);
+    CHECK(stats.used == (size_t)(SOFT * MEM_BUDGET_DEFAULT_RESUME));
+    CHECK(stats.account[0].shrunk == SOFT + 1 - stats.used);
+
+    mem_budget_uncharge(second.account, stats.used);
+    mem_budget_unregister(second.account);
+    mem_budget_detach(owner);
+    ev_loop_destroy(loop);
+}
+
+int
+main(void)
+{
+    test_limits();
+    test_readers();
+    test_shrink();
+    mem_budget_configure(NULL);
+    return 0;
+}
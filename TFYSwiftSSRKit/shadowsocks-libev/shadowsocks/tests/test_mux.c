@@ -0,0 +1,506 @@
+/*
+ * test_mux.c - Mux sessions against a local stand-in server
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "mux.h"
+#include "utils.h"
+#include "test.h"
+
+#define STREAMS     45
+#define MAX_STREAMS 40
+#define SLOW        3
+
+/*
+ * The client session talks over a loopback connection to a stand-in for
+ * the server: a server session on the same loop that echoes every stream
+ * back, and only returns credit for what it could echo. More streams are
+ * opened than the server takes, and one client reader stops consuming.
+ */
+
+typedef struct conn {
+    int fd;
+    mux_session_t *session;
+    ev_io read;
+    ev_io write;
+} conn_t;
+
+typedef struct echo {
+    mux_stream_t *stream;
+    char *buf;
+    size_t len;
+    int fin;
+    int closed;
+} echo_t;
+
+typedef struct client_stream {
+    mux_stream_t *stream;
+    uint8_t seed;
+    size_t total;
+    size_t sent;
+    size_t got;
+    int slow;
+    int fin;
+    int closed;
+    int error;
+} client_stream_t;
+
+static struct ev_loop *loop;
+static conn_t client, server;
+static echo_t echoes[STREAMS];
+static int accepted;
+static client_stream_t streams[STREAMS];
+static int closed, close_target;
+static uint32_t pong;
+
+static void
+conn_read_cb(EV_P_ ev_io *w, int revents)
+{
+    (void)revents;
+    conn_t *conn = w->data;
+    char buf[16384];
+
+    ssize_t n = read(conn->fd, buf, sizeof(buf));
+    if (n <= 0) {
+        CHECK(n == 0 || errno == EAGAIN);
+        if (n == 0)
+            ev_io_stop(EV_A_ w);
+        return;
+    }
+    CHECK(mux_session_input(conn->session, buf, n) == 0);
+}
+
+static void
+conn_write_cb(EV_P_ ev_io *w, int revents)
+{
+    (void)revents;
+    conn_t *conn = w->data;
+    struct iovec iov[2];
+
+    int count = mux_session_output(conn->session, iov);
+    if (count > 0) {
+        ssize_t n = writev(conn->fd, iov, count);
+        CHECK(n > 0 || errno == EAGAIN);
+        if (n > 0)
+            mux_session_consume(conn->session, n);
+    }
+    if (mux_session_pending(conn->session) == 0)
+        ev_io_stop(EV_A_ w);
+}
+
+static void
+on_output(void *data)
+{
+    conn_t *conn = data;
+    ev_io_start(loop, &conn->write);
+}
+
+static void
+conn_init(conn_t *conn, int fd, mux_role_t role, const mux_config_t *config,
+          const mux_callbacks_t *callbacks)
+{
+    setnonblocking(fd);
+    conn->fd      = fd;
+    conn->session = mux_session_new(role, config, callbacks, conn);
+    ev_io_init(&conn->read, conn_read_cb, fd, EV_READ);
+    ev_io_init(&conn->write, conn_write_cb, fd, EV_WRITE);
+    conn->read.data  = conn;
+    conn->write.data = conn;
+    ev_io_start(loop, &conn->read);
+}
+
+static void
+echo_flush(echo_t *e)
+{
+    while (e->stream != NULL && e->len > 0) {
+        ssize_t n = mux_stream_write(e->stream, e->buf, e->len);
+        if (n <= 0)
+            break;
+        memmove(e->buf, e->buf + n, e->len - n);
+        e->len -= n;
+        mux_stream_consumed(e->stream, n);
+    }
+    if (e->stream != NULL && e->fin && e->len == 0 && !e->closed) {
+        e->closed = 1;
+        mux_stream_close(e->stream);
+    }
+}
+
+static void
+echo_accept(void *data, mux_stream_t *stream)
+{
+    (void)data;
+    echo_t *e = &echoes[accepted++];
+    e->stream = stream;
+    e->buf    = ss_malloc(MUX_DEFAULT_WINDOW);
+    mux_stream_set_data(stream, e);
+}
+
+static void
+echo_data(void *data, mux_stream_t *stream, const char *buf, size_t len)
+{
+    (void)data;
+    echo_t *e = mux_stream_data(stream);
+
+    // The window bounds what the client may send ahead of our credit
+    CHECK(e->len + len <= MUX_DEFAULT_WINDOW);
+    memcpy(e->buf + e->len, buf, len);
+    e->len += len;
+    echo_flush(e);
+}
+
+static void
+echo_fin(void *data, mux_stream_t *stream)
+{
+    (void)data;
+    echo_t *e = mux_stream_data(stream);
+    e->fin = 1;
+    echo_flush(e);
+}
+
+static void
+echo_writable(void *data, mux_stream_t *stream)
+{
+    (void)data;
+    echo_flush(mux_stream_data(stream));
+}
+
+static void
+echo_close(void *data, mux_stream_t *stream, int error)
+{
+    (void)data;
+    (void)error;
+    echo_t *e = mux_stream_data(stream);
+    e->stream = NULL;
+}
+
+static void
+client_push(client_stream_t *s)
+{
+    char buf[8192];
+
+    while (s->stream != NULL && s->sent < s->total) {
+        size_t len = s->total - s->sent;
+        if (len > sizeof(buf))
+            len = sizeof(buf);
+        for (size_t i = 0; i < len; i++)
+            buf[i] = (char)(s->seed + s->sent + i);
+        ssize_t n = mux_stream_write(s->stream, buf, len);
+        if (n <= 0)
+            return;
+        s->sent += n;
+    }
+    if (s->stream != NULL && s->sent == s->total && !s->fin) {
+        s->fin = 1;
+        mux_stream_close(s->stream);
+    }
+}
+
+static void
+client_data(void *data, mux_stream_t *stream, const char *buf, size_t len)
+{
+    (void)data;
+    client_stream_t *s = mux_stream_data(stream);
+
+    for (size_t i = 0; i < len; i++)
+        CHECK((uint8_t)buf[i] == (uint8_t)(s->seed + s->got + i));
+    s->got += len;
+    if (!s->slow)
+        mux_stream_consumed(stream, len);
+}
+
+static void
+client_writable(void *data, mux_stream_t *stream)
+{
+    (void)data;
+    client_push(mux_stream_data(stream));
+}
+
+static void
+client_fin(void *data, mux_stream_t *stream)
+{
+    (void)data;
+    (void)stream;
+}
+
+static void
+client_close(void *data, mux_stream_t *stream, int error)
+{
+    (void)data;
+    client_stream_t *s = mux_stream_data(stream);
+
+    s->stream = NULL;
+    s->closed = 1;
+    s->error  = error;
+    if (++closed == close_target)
+        ev_break(loop, EVBREAK_ALL);
+}
+
+static void
+client_pong(void *data, uint32_t opaque)
+{
+    (void)data;
+    pong = opaque;
+}
+
+static void
+watchdog_cb(EV_P_ ev_timer *w, int revents)
+{
+    (void)loop;
+    (void)w;
+    (void)revents;
+    CHECK(!"the session stalled");
+}
+
+static void
+test_server(void)
+{
+    mux_callbacks_t client_cb = { .on_data     = client_data, .on_fin = client_fin,
+                                  .on_writable = client_writable, .on_close = client_close,
+                                  .on_output   = on_output, .on_pong = client_pong };
+    mux_callbacks_t server_cb = { .on_accept   = echo_accept, .on_data = echo_data,
+                                  .on_fin      = echo_fin, .on_writable = echo_writable,
+                                  .on_close    = echo_close, .on_output = on_output };
+    mux_config_t server_config = { .max_streams = MAX_STREAMS };
+    int client_fd, server_fd;
+    ev_timer watchdog;
+
+    loop = ev_loop_new(0);
+    test_tcp_pair(&client_fd, &server_fd);
+    conn_init(&client, client_fd, MUX_ROLE_CLIENT, NULL, &client_cb);
+    conn_init(&server, server_fd, MUX_ROLE_SERVER, &server_config, &server_cb);
+    ev_timer_init(&watchdog, watchdog_cb, 30, 0);
+    ev_timer_start(loop, &watchdog);
+
+    for (int i = 0; i < STREAMS; i++) {
+        client_stream_t *s = &streams[i];
+        s->seed   = (uint8_t)(i * 7);
+        s->total  = (i % 5) * 300000 + i * 13;
+        s->slow   = i == SLOW;
+        s->stream = mux_stream_open(client.session, s);
+        CHECK(s->stream != NULL);
+    }
+    CHECK(mux_session_ping(client.session, 0xabcd) == 0);
+    for (int i = 0; i < STREAMS; i++)
+        client_push(&streams[i]);
+
+    // Everything but the slow reader's stream finishes
+    close_target = STREAMS - 1;
+    ev_run(loop, 0);
+    int done = 0, refused = 0;
+    for (int i = 0; i < STREAMS; i++) {
+        client_stream_t *s = &streams[i];
+        if (i == SLOW)
+            continue;
+        CHECK(s->closed);
+        if (s->error == 0) {
+            CHECK(s->got == s->total);
+            done++;
+        } else {
+            refused++;
+        }
+    }
+    CHECK(done == MAX_STREAMS - 1 && refused == STREAMS - MAX_STREAMS);
+    CHECK(pong == 0xabcd);
+
+    // The slow stream holds back only itself, a window's worth in
+    client_stream_t *slow = &streams[SLOW];
+    CHECK(!slow->closed && slow->got < slow->total && slow->got <= MUX_DEFAULT_WINDOW);
+    mux_stats_t stats;
+    mux_session_stats(client.session, &stats);
+    CHECK(stats.streams == 1 && stats.stalls > 0);
+
+    slow->slow = 0;
+    mux_stream_consumed(slow->stream, slow->got);
+    close_target = STREAMS;
+    ev_run(loop, 0);
+    CHECK(slow->closed && slow->error == 0 && slow->got == slow->total);
+
+    mux_session_stats(server.session, &stats);
+    CHECK(stats.accepted == MAX_STREAMS && stats.refused == STREAMS - MAX_STREAMS);
+    CHECK(stats.streams == 0);
+
+    // GO_AWAY from the server: the client opens nothing more
+    mux_session_go_away(server.session);
+    while (mux_session_accepting(client.session))
+        ev_run(loop, EVRUN_ONCE);
+    CHECK(mux_stream_open(client.session, NULL) == NULL);
+
+    ev_timer_stop(loop, &watchdog);
+    ev_io_stop(loop, &client.read);
+    ev_io_stop(loop, &client.write);
+    ev_io_stop(loop, &server.read);
+    ev_io_stop(loop, &server.write);
+    mux_session_free(client.session);
+    mux_session_free(server.session);
+    for (int i = 0; i < accepted; i++)
+        ss_free(echoes[i].buf);
+    close(client_fd);
+    close(server_fd);
+    ev_loop_destroy(loop);
+}
+
+static mux_stream_t *resettable[4];
+
+static void
+reset_others(void *data, mux_stream_t *stream)
+{
+    (void)data;
+    for (int i = 0; i < 4; i++)
+        if (resettable[i] != NULL && resettable[i] != stream) {
+            mux_stream_reset(resettable[i]);
+            resettable[i] = NULL;
+        }
+}
+
+// on_writable may reset the streams the session is about to visit
+static void
+test_reset_from_callback(void)
+{
+    mux_callbacks_t callbacks = { .on_writable = reset_others };
+    mux_config_t config       = { .output_size = 8192 };
+    mux_session_t *session    = mux_session_new(MUX_ROLE_CLIENT, &config, &callbacks, NULL);
+    static char buf[20000];
+
+    for (int i = 0; i < 4; i++)
+        resettable[i] = mux_stream_open(session, NULL);
+    for (int i = 0; i < 4; i++)
+        mux_stream_write(resettable[i], buf, sizeof(buf));
+    mux_session_consume(session, mux_session_pending(session));
+    CHECK(mux_session_streams(session) == 1);
+    mux_session_free(session);
+}
+
+static uint32_t reset_id;
+
+static void
+note_reset(void *data, mux_stream_t *stream, int error)
+{
+    (void)data;
+    if (error == ECONNRESET)
+        reset_id = mux_stream_id(stream);
+}
+
+// Move everything one session has queued into the other
+static void
+deliver(mux_session_t *from, mux_session_t *to)
+{
+    struct iovec iov[2];
+    while (mux_session_pending(from) > 0) {
+        int n = mux_session_output(from, iov);
+        for (int i = 0; i < n; i++) {
+            CHECK(mux_session_input(to, iov[i].iov_base, iov[i].iov_len) == 0);
+            mux_session_consume(from, iov[i].iov_len);
+        }
+    }
+}
+
+// A reset with no room left in the output still reaches the peer
+static void
+test_reset_when_full(void)
+{
+    mux_callbacks_t callbacks = { .on_close = note_reset };
+    mux_config_t config       = { .output_size = 4096 };
+    mux_session_t *client     = mux_session_new(MUX_ROLE_CLIENT, &config, NULL, NULL);
+    mux_session_t *server     = mux_session_new(MUX_ROLE_SERVER, NULL, &callbacks, NULL);
+    static char buf[8192];
+
+    // Data up to the control reserve, then SYNs until even that is used
+    mux_stream_t *victim = mux_stream_open(client, NULL);
+    uint32_t id          = mux_stream_id(victim);
+    CHECK(mux_stream_write(victim, buf, sizeof(buf)) > 0);
+    while (mux_session_pending(client) + MUX_HEADER_SIZE <= config.output_size)
+        CHECK(mux_stream_open(client, NULL) != NULL);
+
+    mux_stream_reset(victim);
+    reset_id = 0;
+    deliver(client, server);
+    CHECK(reset_id == id);
+
+    mux_session_free(client);
+    mux_session_free(server);
+}
+
+static void
+test_protocol(void)
+{
+    mux_callbacks_t callbacks = { 0 };
+    mux_session_t *session    = mux_session_new(MUX_ROLE_SERVER, NULL, &callbacks, NULL);
+
+    // An unknown version is a protocol error
+    CHECK(mux_session_input(session, "\x07\0\0\0\0\0\0\1\0\0\0\0", MUX_HEADER_SIZE) == -1);
+    mux_session_free(session);
+
+    // and so is more credit than a 32-bit window can hold
+    session = mux_session_new(MUX_ROLE_SERVER, NULL, &callbacks, NULL);
+    CHECK(mux_session_input(session, "\0\1\0\1\0\0\0\1\0\0\0\0", MUX_HEADER_SIZE) == 0);
+    CHECK(mux_session_input(session, "\0\1\0\0\0\0\0\1\xff\xfb\xff\xff", MUX_HEADER_SIZE) == 0);
+    CHECK(mux_session_input(session, "\0\1\0\0\0\0\0\1\0\4\0\0", MUX_HEADER_SIZE) == -1);
+    mux_session_free(session);
+
+    char header[64];
+    size_t len = mux_magic_header(header);
+    CHECK(len == 4 + strlen(MUX_MAGIC_HOST));
+    CHECK(mux_is_magic_host(MUX_MAGIC_HOST, strlen(MUX_MAGIC_HOST)));
+    CHECK(!mux_is_magic_host("example.com", 11));
+}
+
+static void
+test_pool(void)
+{
+    mux_callbacks_t callbacks = { 0 };
+    mux_pool_t *pool          = mux_pool_new(2);
+    mux_session_t *a          = mux_session_new(MUX_ROLE_CLIENT, NULL, &callbacks, NULL);
+    mux_session_t *b          = mux_session_new(MUX_ROLE_CLIENT, NULL, &callbacks, NULL);
+
+    CHECK(mux_pool_pick(pool) == NULL && mux_pool_can_grow(pool));
+    CHECK(mux_pool_add(pool, a) == 0);
+    CHECK(mux_pool_pick(pool) == a);
+
+    // A busy session: new connections first, then the least loaded
+    mux_stream_open(a, NULL);
+    CHECK(mux_pool_pick(pool) == NULL && mux_pool_can_grow(pool));
+    CHECK(mux_pool_add(pool, b) == 0);
+    CHECK(!mux_pool_can_grow(pool));
+    CHECK(mux_pool_pick(pool) == b);
+    mux_stream_open(b, NULL);
+    mux_stream_open(b, NULL);
+    CHECK(mux_pool_pick(pool) == a);
+
+    mux_pool_remove(pool, a);
+    CHECK(mux_pool_can_grow(pool) && mux_pool_pick(pool) == NULL);
+    mux_pool_free(pool);
+    mux_session_free(a);
+    mux_session_free(b);
+}
+
+int
+main(void)
+{
+    test_server();
+    test_reset_from_callback();
+    test_reset_when_full();
+    test_protocol();
+    test_pool();
+    return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * test_nattable.c - NAT table inserts, expiry, the load limit and lock-free lookups
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "nattable.h"
+#include "test.h"
+
+#define KEYS 4096
+
+static nat_key_t keys[KEYS];
+static long values[KEYS];
+static atomic_long freed;
+
+static void
+free_value(void *value)
+{
+    (void)value;
+    atomic_fetch_add(&freed, 1);
+}
+
+static void
+make_keys(void)
+{
+    for (int i = 0; i < KEYS; i++) {
+        struct sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family            = AF_INET6;
+        addr.sin6_port              = htons(1024 + i);
+        addr.sin6_addr.s6_addr[0]   = 0x20;
+        addr.sin6_addr.s6_addr[14]  = i >> 8;
+        addr.sin6_addr.s6_addr[15]  = i & 0xff;
+        nat_key_set(&keys[i], IPPROTO_UDP, (struct sockaddr *)&addr, NULL);
+        values[i] = i;
+    }
+}
+
+static void
+test_basic(void)
+{
+    nat_table_t *table = nat_table_new(100, 10, free_value);
+    nat_table_stats_t stats;
+    long other = -1;
+
+    atomic_store(&freed, 0);
+    nat_table_stats(table, &stats);
+    CHECK(stats.capacity == 128 && stats.size == 0);
+
+    for (int i = 0; i < 64; i++)
+        CHECK(nat_table_insert(table, &keys[i], &values[i]) == 0);
+    for (int i = 0; i < 64; i++)
+        CHECK(nat_table_lookup(table, &keys[i]) == &values[i]);
+    CHECK(nat_table_lookup(table, &keys[64]) == NULL);
+
+    // Replacing frees the old value, reinserting the same one does not
+    CHECK(nat_table_insert(table, &keys[0], &other) == 0);
+    CHECK(atomic_load(&freed) == 1);
+    CHECK(nat_table_lookup(table, &keys[0]) == &other);
+    CHECK(nat_table_insert(table, &keys[0], &other) == 0);
+    CHECK(atomic_load(&freed) == 1);
+    CHECK(nat_table_insert(table, &keys[1], NULL) == EINVAL);
+
+    // Removing returns the value without freeing it and keeps probe runs whole
+    for (int i = 1; i < 64; i += 2)
+        CHECK(nat_table_remove(table, &keys[i]) == &values[i]);
+    CHECK(nat_table_remove(table, &keys[1]) == NULL);
+    for (int i = 2; i < 64; i += 2)
+        CHECK(nat_table_lookup(table, &keys[i]) == &values[i]);
+    CHECK(atomic_load(&freed) == 1);
+
+    nat_table_stats(table, &stats);
+    CHECK(stats.size == 32 && stats.removes == 32);
+
+    nat_table_free(table, 0);
+    CHECK(atomic_load(&freed) == 33);
+}
+
+// The IPv4 and IPv6 halves of a key and the destination all count
+static void
+test_keys(void)
+{
+    struct sockaddr_in a, b;
+    nat_key_t ka, kb;
+
+    memset(&a, 0, sizeof(a));
+    a.sin_family      = AF_INET;
+    a.sin_port        = htons(53);
+    a.sin_addr.s_addr = htonl(0x0a000001);
+    b                 = a;
+
+    nat_key_set(&ka, IPPROTO_UDP, (struct sockaddr *)&a, NULL);
+    nat_key_set(&kb, IPPROTO_UDP, (struct sockaddr *)&b, NULL);
+    CHECK(memcmp(&ka, &kb, sizeof(ka)) == 0);
+
+    b.sin_port = htons(54);
+    nat_key_set(&kb, IPPROTO_UDP, (struct sockaddr *)&b, NULL);
+    CHECK(memcmp(&ka, &kb, sizeof(ka)) != 0);
+
+    nat_key_set(&kb, IPPROTO_UDP, (struct sockaddr *)&a, (struct sockaddr *)&b);
+    CHECK(memcmp(&ka, &kb, sizeof(ka)) != 0);
+    CHECK(kb.dst_port == htons(54));
+}
+
+static void
+test_expiry(void)
+{
+    nat_table_t *table = nat_table_new(256, 5, free_value);
+    nat_table_stats_t stats;
+
+    atomic_store(&freed, 0);
+    for (int i = 0; i < 100; i++)
+        CHECK(nat_table_insert(table, &keys[i], &values[i]) == 0);
+
+    // Entries looked up keep living, the rest expire after timeout ticks
+    for (uint32_t generation = 2; generation <= 8; generation++) {
+        nat_table_tick(table, generation);
+        for (int i = 0; i < 50; i++)
+            CHECK(nat_table_lookup(table, &keys[i]) == &values[i]);
+    }
+    for (int i = 50; i < 100; i++)
+        CHECK(nat_table_lookup(table, &keys[i]) == NULL);
+    CHECK(atomic_load(&freed) == 0);
+
+    // The sweep looks at budget slots per call, an expired one counting too
+    size_t swept = nat_table_sweep(table, 16);
+    CHECK(swept <= 16);
+    for (int n = 0; n < 2 * 256 / 16; n++)
+        swept += nat_table_sweep(table, 16);
+    CHECK(swept == 50 && atomic_load(&freed) == 50);
+    for (int i = 0; i < 50; i++)
+        CHECK(nat_table_lookup(table, &keys[i]) == &values[i]);
+
+    nat_table_stats(table, &stats);
+    CHECK(stats.size == 50 && stats.expired == 50);
+    nat_table_free(table, 1);
+    CHECK(atomic_load(&freed) == 50);
+}
+
+// At the load limit an insert sweeps a bounded window, then gives up
+static void
+test_limit(void)
+{
+    nat_table_t *table = nat_table_new(1024, 2, free_value);
+    nat_table_stats_t stats;
+    int limit = 1024 * NAT_TABLE_MAX_LOAD / 100;
+
+    atomic_store(&freed, 0);
+    for (int i = 0; i < limit; i++)
+        CHECK(nat_table_insert(table, &keys[i], &values[i]) == 0);
+    CHECK(nat_table_insert(table, &keys[limit], &values[limit]) == ENOSPC);
+
+    // Everything expired: the insert takes over an expired slot in its probe
+    // run, or reclaims from at most the sweep window when that run is empty
+    nat_table_tick(table, 10);
+    CHECK(nat_table_insert(table, &keys[limit], &values[limit]) == 0);
+    nat_table_stats(table, &stats);
+    CHECK(stats.expired >= 1 && stats.expired <= NAT_TABLE_INSERT_SWEEP);
+    CHECK(stats.size + stats.expired == (size_t)limit + 1);
+
+    // Keep only the newest entries alive, so the window finds nothing to reclaim
+    nat_table_tick(table, 11);
+    nat_table_sweep(table, 2048);
+    nat_table_stats(table, &stats);
+    size_t live = stats.size;
+    for (size_t i = live; i < (size_t)limit; i++)
+        CHECK(nat_table_insert(table, &keys[KEYS - 1 - i], &values[KEYS - 1 - i]) == 0);
+    nat_table_stats(table, &stats);
+    uint64_t expired = stats.expired;
+    uint64_t full    = stats.full;
+    CHECK(nat_table_insert(table, &keys[limit + 1], &values[limit + 1]) == ENOSPC);
+    nat_table_stats(table, &stats);
+    CHECK(stats.expired == expired && stats.full == full + 1);
+
+    nat_table_free(table, 0);
+}
+
+typedef struct reader {
+    nat_table_t *table;
+    atomic_int *stop;
+    unsigned seed;
+    long lookups;
+    long wrong;
+} reader_t;
+
+static void *
+reader_main(void *arg)
+{
+    reader_t *r = arg;
+
+    while (!atomic_load(r->stop)) {
+        int i   = rand_r(&r->seed) % KEYS;
+        long *v = nat_table_lookup(r->table, &keys[i]);
+        r->lookups++;
+        if (v != NULL && *v != i)
+            r->wrong++;
+    }
+    return NULL;
+}
+
+// Lookups on other threads never see another key's value while a writer churns
+static void
+test_concurrent(void)
+{
+    nat_table_t *table = nat_table_new(KEYS * 2, 30, NULL);
+    atomic_int stop    = 0;
+    reader_t readers[3];
+    pthread_t threads[3];
+    unsigned seed = 7;
+
+    for (int i = 0; i < KEYS / 2; i++)
+        CHECK(nat_table_insert(table, &keys[i], &values[i]) == 0);
+    for (int t = 0; t < 3; t++) {
+        readers[t] = (reader_t) { .table = table, .stop = &stop, .seed = t + 1 };
+        CHECK(pthread_create(&threads[t], NULL, reader_main, &readers[t]) == 0);
+    }
+
+    double end          = test_now() + 0.5;
+    uint32_t generation = 1;
+    for (long ops = 1; test_now() < end; ops++) {
+        int i = rand_r(&seed) % KEYS;
+        if (rand_r(&seed) & 1)
+            nat_table_insert(table, &keys[i], &values[i]);
+        else
+            nat_table_remove(table, &keys[i]);
+        if (ops % 1000 == 0) {
+            nat_table_tick(table, ++generation);
+            nat_table_sweep(table, 64);
+        }
+    }
+
+    atomic_store(&stop, 1);
+    long lookups = 0;
+    for (int t = 0; t < 3; t++) {
+        pthread_join(threads[t], NULL);
+        CHECK(readers[t].wrong == 0);
+        lookups += readers[t].lookups;
+    }
+    CHECK(lookups > 0);
+    nat_table_free(table, 1);
+}
+
+int
+main(void)
+{
+    make_keys();
+    test_basic();
+    test_keys();
+    test_expiry();
+    test_limit();
+    test_concurrent();
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * test_pmtu.c - Path MTU searches against simulated paths
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "pmtu.h"
+#include "test.h"
+
+/*
+ * Four servers behind paths of known MTU that drop 10% of what fits and
+ * everything that does not. Acks come back 50 ms after the probe, on the
+ * stand-in loop's simulated clock, so the ten-minute reprobes run at once.
+ */
+
+#define MAX_ACKS 1024
+
+typedef struct {
+    double at;
+    int server;
+    uint32_t id;
+} ack_t;
+
+static struct ev_loop *loop;
+static pmtu_t *prober;
+static size_t path[4] = { 1492, 1500, 1280, 1400 };
+static size_t link_mtu = 1500;
+static ack_t acks[MAX_ACKS];
+static int nacks;
+static int changes;
+
+static int
+send_probe(void *data, int server, size_t payload, uint32_t id)
+{
+    (void)data;
+    size_t size = payload + (server == 1 ? 40 : 20) + 8;
+    if (size > link_mtu)
+        return EMSGSIZE;
+    if (size <= path[server] && rand() % 100 >= 10) {
+        CHECK(nacks < MAX_ACKS);
+        acks[nacks++] = (ack_t) { ev_now(loop) + 0.05, server, id };
+    }
+    return 0;
+}
+
+static void
+mtu_changed(void *data, int server, size_t mtu)
+{
+    (void)data;
+    (void)server;
+    (void)mtu;
+    changes++;
+}
+
+static void
+run(double until)
+{
+    for (;;) {
+        int next = -1;
+        for (int i = 0; i < nacks; i++)
+            if (acks[i].at <= until && (next == -1 || acks[i].at < acks[next].at))
+                next = i;
+        if (evloop_step(loop, next == -1 ? until : acks[next].at))
+            continue;
+        if (next == -1)
+            return;
+        ack_t ack = acks[next];
+        acks[next] = acks[--nacks];
+        pmtu_ack(prober, ack.server, ack.id);
+    }
+}
+
+static size_t
+learnt(int server)
+{
+    pmtu_server_stats_t stats;
+    pmtu_server_stats(prober, server, &stats);
+    return stats.mtu;
+}
+
+int
+main(void)
+{
+    srand(5);
+    loop   = ev_loop_new(0);
+    prober = pmtu_new(loop, NULL, send_probe, mtu_changed, NULL);
+    CHECK(prober != NULL);
+
+    struct sockaddr_in v4   = { .sin_family = AF_INET };
+    struct sockaddr_in6 v6  = { .sin6_family = AF_INET6 };
+    CHECK(pmtu_add(prober, (struct sockaddr *)&v4) == 0);
+    CHECK(pmtu_add(prober, (struct sockaddr *)&v6) == 1);
+    CHECK(pmtu_add(prober, (struct sockaddr *)&v4) == 2);
+    CHECK(pmtu_add(prober, (struct sockaddr *)&v4) == 3);
+    CHECK(pmtu_tunnel_mtu() == 0);
+    CHECK(pmtu_mtu(prober, 0) == PMTU_MIN);
+
+    double start = ev_now(loop);
+    pmtu_start(prober);
+    run(start + 60);
+    for (int i = 0; i < 4; i++) {
+        size_t mtu = learnt(i);
+        CHECK(mtu <= path[i]);
+        CHECK(mtu + PMTU_DEFAULT_STEP > path[i]);
+        CHECK(pmtu_udp_payload(prober, i) == mtu - (i == 1 ? 40 : 20) - 8);
+    }
+    CHECK(changes >= 3);
+
+    // The tunnel MTU follows the worst path, here the 1280 one, less the relay's overhead
+    size_t tunnel = pmtu_tunnel_mtu_for(learnt(2), AF_INET);
+    CHECK(pmtu_tunnel_mtu() == (tunnel < PMTU_MIN ? PMTU_MIN : tunnel));
+    CHECK(pmtu_tunnel_mtu_for(1500, AF_INET) == 1500 - 20 - 8 - PMTU_RELAY_OVERHEAD + 28);
+    CHECK(pmtu_tunnel_mtu_for(1500, AF_INET6) == 1500 - 40 - 8 - PMTU_RELAY_OVERHEAD + 28);
+    CHECK(pmtu_tunnel_mtu_for(576, AF_INET) == PMTU_MIN);
+
+    // A path that shrinks silently is found at the next search
+    path[0] = 1400;
+    run(start + 60 + PMTU_DEFAULT_REPROBE + 100);
+    CHECK(learnt(0) <= 1400 && learnt(0) + PMTU_DEFAULT_STEP > 1400);
+
+    // and one that grows back at the one after
+    path[0] = 1492;
+    run(start + 60 + 2 * (PMTU_DEFAULT_REPROBE + 100));
+    CHECK(learnt(0) + PMTU_DEFAULT_STEP > 1492);
+
+    // Too-big reports apply at once, down to PMTU_MIN
+    pmtu_too_big(prober, 3, 1300);
+    CHECK(learnt(3) == 1300);
+    pmtu_too_big(prober, 1, 600);
+    CHECK(learnt(1) == PMTU_MIN);
+
+    // EMSGSIZE from a smaller local link fails a size without waiting
+    link_mtu = 1420;
+    pmtu_restart(prober);
+    run(ev_now(loop) + 60);
+    CHECK(learnt(1) <= 1420 && learnt(1) + PMTU_DEFAULT_STEP > 1420);
+
+    pmtu_free(prober);
+    ev_loop_destroy(loop);
+    return 0;
+}
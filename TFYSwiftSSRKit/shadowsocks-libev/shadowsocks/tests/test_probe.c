@@ -0,0 +1,362 @@
+/*
+ * test_probe.c - Health probes and their AEAD handshake against a stand-in server
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mbedtls/gcm.h>
+#include <sodium.h>
+
+#include "aead.h"
+#include "probe.h"
+#include "probeaead.h"
+#include "test.h"
+
+#define TARGET_HOST "example.com"
+#define TARGET_PORT 80
+#define REQUEST     "HEAD / HTTP/1.1\r\nHost: example.com\r\n\r\n"
+#define REPLY       "HTTP/1.1 204 No Content\r\n\r\n"
+
+static const int methods[]     = { AES_128_GCM, AES_256_GCM, CHACHA20_IETF_POLY1305 };
+static const size_t key_lens[] = { 16, 32, 32 };
+
+/*
+ * A Shadowsocks AEAD server reduced to one exchange: it opens the first
+ * chunk, checks the address header and payload, and answers one chunk.
+ * It is written against the protocol, not probeaead.c, using the
+ * textbook HKDF from the test support.
+ */
+typedef struct server {
+    int method;
+    size_t key_len;
+    uint8_t key[32];
+    int fd;
+    uint16_t port;
+    int exchanges;
+    atomic_int stop;
+    pthread_t thread;
+} server_t;
+
+static void
+crypt_chunk(const server_t *srv, const uint8_t *subkey, uint64_t counter, int seal,
+            uint8_t *data, size_t len, int *ok)
+{
+    uint8_t nonce[12] = { 0 };
+    memcpy(nonce, &counter, sizeof(counter));
+    if (srv->method == CHACHA20_IETF_POLY1305) {
+        unsigned long long tlen;
+        *ok = seal
+              ? crypto_aead_chacha20poly1305_ietf_encrypt_detached(data, data + len, &tlen,
+                                                                    data, len, NULL, 0, NULL,
+                                                                    nonce, subkey) == 0
+              : crypto_aead_chacha20poly1305_ietf_decrypt_detached(data, NULL, data, len,
+                                                                    data + len, NULL, 0,
+                                                                    nonce, subkey) == 0;
+        return;
+    }
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, subkey, (unsigned int)srv->key_len * 8);
+    *ok = seal
+          ? mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, len, nonce, 12, NULL, 0,
+                                      data, data, 16, data + len) == 0
+          : mbedtls_gcm_auth_decrypt(&gcm, len, nonce, 12, NULL, 0, data + len, 16,
+                                     data, data) == 0;
+    mbedtls_gcm_free(&gcm);
+}
+
+static int
+read_full(int fd, uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void
+server_exchange(server_t *srv, int fd)
+{
+    uint8_t salt[32], subkey[32], head[18], body[2048];
+    int ok;
+
+    if (read_full(fd, salt, srv->key_len) || read_full(fd, head, sizeof(head)))
+        return;
+    test_hkdf_sha1(salt, srv->key_len, srv->key, srv->key_len,
+                   (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN, subkey, srv->key_len);
+    crypt_chunk(srv, subkey, 0, 0, head, 2, &ok);
+    if (!ok)
+        return;     // a real server drops the connection on a bad tag
+    size_t len = head[0] << 8 | head[1];
+    CHECK(len + 16 <= sizeof(body));
+    if (read_full(fd, body, len + 16))
+        return;
+    crypt_chunk(srv, subkey, 1, 0, body, len, &ok);
+    CHECK(ok);
+
+    // ATYP domain, length, name, port, then the payload
+    size_t host_len = strlen(TARGET_HOST);
+    CHECK(body[0] == 3 && body[1] == host_len);
+    CHECK(memcmp(body + 2, TARGET_HOST, host_len) == 0);
+    CHECK((body[2 + host_len] << 8 | body[3 + host_len]) == TARGET_PORT);
+    CHECK(len == 4 + host_len + strlen(REQUEST));
+    CHECK(memcmp(body + 4 + host_len, REQUEST, strlen(REQUEST)) == 0);
+
+    // The reply goes out in two writes to split it across reads
+    uint8_t reply[32 + 18 + sizeof(REPLY) + 16];
+    size_t plen = strlen(REPLY);
+    randombytes_buf(reply, srv->key_len);
+    test_hkdf_sha1(reply, srv->key_len, srv->key, srv->key_len,
+                   (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN, subkey, srv->key_len);
+    uint8_t *p = reply + srv->key_len;
+    p[0] = plen >> 8;
+    p[1] = plen & 0xff;
+    crypt_chunk(srv, subkey, 0, 1, p, 2, &ok);
+    memcpy(p + 18, REPLY, plen);
+    crypt_chunk(srv, subkey, 1, 1, p + 18, plen, &ok);
+    size_t total = srv->key_len + 18 + plen + 16;
+    // The prober may already be gone when the test tears it down
+    if (write(fd, reply, 7) != 7)
+        return;
+    usleep(2000);
+    if (write(fd, reply + 7, total - 7) != (ssize_t)(total - 7))
+        return;
+    srv->exchanges++;
+}
+
+static void *
+server_main(void *arg)
+{
+    server_t *srv = arg;
+    while (!atomic_load(&srv->stop)) {
+        struct pollfd pfd = { .fd = srv->fd, .events = POLLIN };
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+        int fd = accept(srv->fd, NULL, NULL);
+        if (fd == -1)
+            continue;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+        server_exchange(srv, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void
+server_start(server_t *srv, int method, size_t key_len, uint8_t key_byte)
+{
+    memset(srv, 0, sizeof(server_t));
+    srv->method  = method;
+    srv->key_len = key_len;
+    memset(srv->key, key_byte, sizeof(srv->key));
+    srv->fd = test_listen(&srv->port, 16);
+    CHECK(pthread_create(&srv->thread, NULL, server_main, srv) == 0);
+}
+
+static void
+server_stop(server_t *srv)
+{
+    atomic_store(&srv->stop, 1);
+    pthread_join(srv->thread, NULL);
+    close(srv->fd);
+}
+
+typedef struct results {
+    int count[3];
+    probe_result_t last[3];
+} results_t;
+
+static void
+on_result(void *data, const probe_result_t *result)
+{
+    results_t *r = data;
+    r->count[result->server]++;
+    r->last[result->server] = *result;
+}
+
+// A good server, one with another key and a closed port, for each cipher
+static void
+test_probe_servers(int m)
+{
+    struct ev_loop *loop = ev_loop_new(0);
+    server_t good, wrong;
+    uint8_t key[32];
+    probe_aead_t aead;
+    results_t results;
+
+    memset(&results, 0, sizeof(results));
+
+    server_start(&good, methods[m], key_lens[m], 0x42);
+    server_start(&wrong, methods[m], key_lens[m], 0x24);
+    memset(key, 0x42, sizeof(key));
+    CHECK(probe_aead_init(&aead, methods[m], key, key_lens[m], TARGET_HOST, TARGET_PORT,
+                          REQUEST, strlen(REQUEST)) == 0);
+
+    uint16_t closed_port = 0;
+    close(test_listen(&closed_port, 1));
+
+    probe_config_t config       = { .interval = 0.05, .timeout = 1.0 };
+    probe_handshake_t handshake = probe_aead_handshake(&aead);
+    probe_t *probe              = probe_new(loop, &config, &handshake, on_result, &results);
+    struct sockaddr_storage addr;
+    uint16_t ports[3] = { good.port, wrong.port, closed_port };
+    for (int i = 0; i < 3; i++) {
+        socklen_t len = test_loopback(ports[i], &addr);
+        CHECK(probe_add(probe, (struct sockaddr *)&addr, len) == i);
+    }
+    probe_start(probe);
+
+    double deadline = test_now() + 10;
+    while (test_now() < deadline
+           && (results.count[0] < 3 || results.count[1] < 3 || results.count[2] < 3))
+        ev_run(loop, EVRUN_ONCE);
+
+    CHECK(results.count[0] >= 3 && results.count[1] >= 3 && results.count[2] >= 3);
+    CHECK(results.last[0].ok);
+    CHECK(results.last[0].handshake_rtt > 0);
+    CHECK(results.last[0].round_trip >= results.last[0].handshake_rtt);
+    CHECK(!results.last[1].ok);
+    CHECK(!results.last[2].ok);
+    CHECK(good.exchanges >= 3);
+    CHECK(wrong.exchanges == 0);
+
+    probe_server_stats_t stats;
+    probe_server_stats(probe, 0, &stats);
+    CHECK(stats.failures == 0 && stats.health > 0.5);
+    probe_server_stats(probe, 1, &stats);
+    CHECK(stats.failures >= 3 && stats.health == 0);
+    CHECK(probe_health(probe, 2) == 0);
+
+    probe_free(probe);
+    probe_aead_release(&aead);
+    server_stop(&good);
+    server_stop(&wrong);
+    ev_loop_destroy(loop);
+}
+
+// Replies arriving whole, a byte at a time, and damaged
+static void
+test_aead_reply(void)
+{
+    uint8_t key[32];
+    probe_aead_t aead;
+    char request[PROBE_BUF_SIZE];
+    void *ctx = NULL;
+
+    memset(key, 7, sizeof(key));
+    CHECK(probe_aead_init(&aead, CHACHA20_IETF_POLY1305, key, 32, "10.1.2.3", 53, "x", 1) == 0);
+    CHECK(aead.request_len == 1 + 4 + 2 + 1 && aead.request[0] == 1);
+
+    // The server's reply: its own salt, then a 5 byte chunk
+    for (int mode = 0; mode < 3; mode++) {
+        server_t srv = { .method = CHACHA20_IETF_POLY1305, .key_len = 32 };
+        memcpy(srv.key, key, sizeof(key));
+        uint8_t reply[32 + 18 + 64 + 16], subkey[32];
+        size_t plen = 5;
+        int ok;
+
+        randombytes_buf(reply, 32);
+        test_hkdf_sha1(reply, 32, key, 32, (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN,
+                       subkey, 32);
+        reply[32] = 0;
+        reply[33] = (uint8_t)plen;
+        crypt_chunk(&srv, subkey, 0, 1, reply + 32, 2, &ok);
+        memcpy(reply + 50, "hello", plen);
+        crypt_chunk(&srv, subkey, 1, 1, reply + 50, plen, &ok);
+        size_t total = 50 + plen + 16;
+
+        CHECK(probe_aead_request(&aead, 0, request, sizeof(request), &ctx) > 0);
+        int r = 0;
+        if (mode == 0) {
+            // Whole, with trailing bytes of a second chunk
+            uint8_t more[sizeof(reply) + 10] = { 0 };
+            memcpy(more, reply, total);
+            r = probe_aead_response(&aead, ctx, (char *)more, total + 10);
+            CHECK(r == 1);
+        } else if (mode == 1) {
+            for (size_t i = 0; i < total; i++) {
+                r = probe_aead_response(&aead, ctx, (char *)reply + i, 1);
+                CHECK(r == (i + 1 == total ? 1 : 0));
+            }
+        } else {
+            reply[total - 1] ^= 1;
+            r = probe_aead_response(&aead, ctx, (char *)reply, total);
+            CHECK(r == -1);
+        }
+        probe_aead_free(&aead, ctx);
+    }
+
+    probe_aead_release(&aead);
+
+    CHECK(probe_aead_init(&aead, AES_256_GCM, key, 16, "h", 1, NULL, 0) == -1);
+    CHECK(probe_aead_init(&aead, 99, key, 32, "h", 1, NULL, 0) == -1);
+}
+
+static void
+test_failover(void)
+{
+    double health[3] = { 0.9, 1.0, 0.2 };
+    int down[3]      = { 0, 0, 0 };
+
+    // Healthy enough: stay, even with a better server around
+    CHECK(probe_failover(health, down, 3, 0, 0.5, 0.2) == 0);
+
+    // Slow: move to the best other server once it is clearly better
+    health[0] = 0.3;
+    CHECK(probe_failover(health, down, 3, 0, 0.5, 0.2) == 1);
+    health[1] = 0.4;
+    CHECK(probe_failover(health, down, 3, 0, 0.5, 0.2) == 0);
+
+    // Down: a down server is never picked, and nothing left means reconnect
+    down[0]   = 1;
+    health[0] = 0;
+    CHECK(probe_failover(health, down, 3, 0, 0.5, 0.2) == 1);
+    down[1] = 1;
+    CHECK(probe_failover(health, down, 3, 0, 0.5, 0.2) == 2);
+    down[2] = 1;
+    CHECK(probe_failover(health, down, 3, 0, 0.5, 0.2) == -1);
+
+    // A lone server
+    down[0]   = 0;
+    health[0] = 0.1;
+    CHECK(probe_failover(health, down, 1, 0, 0.5, 0.2) == 0);
+    CHECK(probe_failover(health, down, 1, 5, 0.5, 0.2) == -1);
+}
+
+int
+main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    CHECK(sodium_init() != -1);
+    test_failover();
+    test_aead_reply();
+    for (int m = 0; m < 3; m++)
+        test_probe_servers(m);
+    return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * test_replay.c - Rotation, counters and false positives of the replay filter
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "replay.h"
+#include "test.h"
+
+/*
+ * replay.c ages generations with clock_gettime(). This definition stands
+ * in for libc's, so that the test decides when a minute has passed.
+ */
+static time_t now = 1000;
+
+int
+clock_gettime(clockid_t clock, struct timespec *ts)
+{
+    (void)clock;
+    ts->tv_sec  = now;
+    ts->tv_nsec = 0;
+    return 0;
+}
+
+#define SALT_LEN 32
+#define OLD      100                // salts added before the filter fills
+
+static void
+salt_of(uint8_t *salt, uint32_t tag, uint32_t i)
+{
+    memset(salt, 0, SALT_LEN);
+    memcpy(salt, &tag, sizeof(tag));
+    memcpy(salt + sizeof(tag), &i, sizeof(i));
+}
+
+static int
+add(replay_filter_t *filter, uint32_t tag, uint32_t i)
+{
+    uint8_t salt[SALT_LEN];
+    salt_of(salt, tag, i);
+    return replay_filter_add(filter, salt, SALT_LEN);
+}
+
+static int
+check(replay_filter_t *filter, uint32_t tag, uint32_t i)
+{
+    uint8_t salt[SALT_LEN];
+    salt_of(salt, tag, i);
+    return replay_filter_check(filter, salt, SALT_LEN);
+}
+
+static uint64_t
+rotations(replay_filter_t *filter)
+{
+    replay_stats_t stats;
+    replay_filter_stats(filter, &stats);
+    return stats.rotations;
+}
+
+static int
+old_present(replay_filter_t *filter)
+{
+    int present = 0;
+    for (uint32_t i = 0; i < OLD; i++)
+        present += check(filter, 1, i);
+    return present;
+}
+
+// Add fresh salts until the single shard retires a generation
+static size_t
+fill(replay_filter_t *filter, uint32_t tag)
+{
+    uint64_t before = rotations(filter);
+    size_t n        = 0;
+    while (rotations(filter) == before) {
+        add(filter, tag, (uint32_t)n++);
+        CHECK(n < 1000000);
+    }
+    return n;
+}
+
+static void
+test_counters(void)
+{
+    replay_filter_t *filter = replay_filter_new(NULL);
+    replay_stats_t stats;
+
+    // The check then add of a new salt, then the same for its replay
+    CHECK(check(filter, 0, 0) == 0 && add(filter, 0, 0) == 0);
+    CHECK(check(filter, 0, 0) == 1);
+    replay_filter_stats(filter, &stats);
+    CHECK(stats.checks == 2 && stats.adds == 1 && stats.hits == 1);
+    CHECK(add(filter, 0, 0) == 1);
+    replay_filter_stats(filter, &stats);
+    CHECK(stats.checks == 2 && stats.adds == 2 && stats.hits == 2);
+    CHECK(stats.shards == REPLAY_DEFAULT_SHARDS && stats.rotations == 0);
+
+    replay_filter_free(filter);
+}
+
+static void
+test_capacity(void)
+{
+    replay_config_t config  = { .mem_budget = 3 * 1024, .shards = 1, .error = 0.01 };
+    replay_filter_t *filter = replay_filter_new(&config);
+    replay_stats_t stats;
+
+    replay_filter_stats(filter, &stats);
+    CHECK(stats.shards == 1 && stats.bytes == 3 * 1024);
+    for (uint32_t i = 0; i < OLD; i++)
+        CHECK(add(filter, 1, i) == 0);
+
+    // Without a rotate interval, age alone never retires a generation
+    now += 24 * 3600;
+    CHECK(add(filter, 1, OLD) == 0);
+    CHECK(rotations(filter) == 0);
+
+    // A full generation becomes the previous one and is still checked
+    size_t n = fill(filter, 2) + OLD + 1;
+    CHECK(n >= stats.capacity && n < stats.capacity + stats.capacity / 20);
+    CHECK(old_present(filter) == OLD);
+
+    // and is dropped once the next one fills, bar false positives
+    fill(filter, 3);
+    CHECK(old_present(filter) < OLD / 10);
+
+    replay_filter_free(filter);
+}
+
+static void
+test_interval(void)
+{
+    replay_config_t config  = { .shards = 1, .rotate_interval = 60 };
+    replay_filter_t *filter = replay_filter_new(&config);
+
+    CHECK(add(filter, 4, 0) == 0);
+    now += 59;
+    CHECK(add(filter, 4, 1) == 0);
+    CHECK(rotations(filter) == 0);
+
+    // The add that finds the generation too old still goes into it
+    now += 1;
+    CHECK(add(filter, 4, 2) == 0);
+    CHECK(rotations(filter) == 1);
+
+    // A salt is remembered for at least one interval after it is added
+    now += 59;
+    CHECK(add(filter, 4, 3) == 0);
+    CHECK(rotations(filter) == 1);
+    CHECK(check(filter, 4, 0) && check(filter, 4, 1) && check(filter, 4, 2));
+
+    // and for less than two
+    now += 1;
+    CHECK(add(filter, 4, 4) == 0);
+    CHECK(rotations(filter) == 2);
+    CHECK(!check(filter, 4, 0) && !check(filter, 4, 1) && !check(filter, 4, 2));
+    CHECK(check(filter, 4, 3) && check(filter, 4, 4));
+
+    replay_filter_free(filter);
+}
+
+static void
+test_false_positives(void)
+{
+    replay_config_t config  = { .mem_budget = 64 * 1024, .error = 0.01 };
+    replay_filter_t *filter = replay_filter_new(&config);
+    replay_stats_t stats;
+    const uint32_t queries = 200000;
+
+    // Half of every shard's capacity, if the salts spread evenly
+    replay_filter_stats(filter, &stats);
+    uint32_t n = (uint32_t)(stats.capacity * stats.shards / 2);
+    for (uint32_t i = 0; i < n; i++)
+        add(filter, 5, i);
+    replay_filter_stats(filter, &stats);
+    CHECK(stats.rotations == 0);
+
+    uint32_t hits = 0;
+    for (uint32_t i = 0; i < queries; i++)
+        hits += check(filter, 6, i);
+    double measured = (double)hits / queries;
+    printf("false positives: %.2e measured, %.2e estimated, %.2e worst shard\n",
+           measured, stats.fp_rate, stats.fp_rate_max);
+    CHECK(stats.fp_rate_max < config.error);
+    CHECK(measured < 2 * stats.fp_rate_max + 10.0 / queries);
+
+    replay_filter_free(filter);
+}
+
+int
+main(void)
+{
+    test_counters();
+    test_capacity();
+    test_interval();
+    test_false_positives();
+    return 0;
+}
@@ -0,0 +1,375 @@
+/*
+ * test_ringrelay.c - Wrapping, transforms and flow control of ringrelay
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "ringrelay.h"
+#include "utils.h"
+#include "test.h"
+
+#define BYTES      (4L * 1024 * 1024)
+#define SLOW_BYTES (1024L * 1024)
+#define MASK       0x5a
+
+/*
+ * As in test_splice, threads on blocking sockets stream a pattern with a
+ * period of 251 through the relay. Upstream is masked byte for byte, and
+ * downstream every byte is sent twice, so the relay's output differs in
+ * content and in length from what it read.
+ */
+
+typedef struct stream {
+    int fd;
+    long bytes;                     // pattern bytes written or checked
+    long limit;
+    int doubled;
+    int slow;
+    int bad;
+} stream_t;
+
+static struct ev_loop *loop;
+static int close_error = -1;
+
+static void *
+source(void *arg)
+{
+    stream_t *s = arg;
+    char buf[32768 + 5];
+
+    while (s->bytes < s->limit) {
+        size_t len = 1 + (size_t)(s->bytes * 7919) % sizeof(buf);
+        if (len > (size_t)(s->limit - s->bytes))
+            len = s->limit - s->bytes;
+        for (size_t i = 0; i < len; i++)
+            buf[i] = (char)((s->bytes + i) % 251);
+        ssize_t n = write(s->fd, buf, len);
+        if (n <= 0)
+            break;
+        s->bytes += n;
+    }
+    shutdown(s->fd, SHUT_WR);
+    return NULL;
+}
+
+static void *
+sink(void *arg)
+{
+    stream_t *s = arg;
+    char buf[65536];
+    long received     = 0;
+    double slow_until = test_now() + 0.2;
+    ssize_t n;
+
+    while ((n = read(s->fd, buf, s->slow ? 4096 : sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            long at = s->doubled ? (received + i) / 2 : received + i;
+            char expected = (char)(at % 251);
+            if (!s->doubled)
+                expected ^= MASK;
+            if (buf[i] != expected)
+                s->bad++;
+        }
+        received += n;
+        // A trickle at first, long enough for the ring to fill
+        if (s->slow && test_now() < slow_until)
+            usleep(10000);
+    }
+    s->bytes = s->doubled ? received / 2 : received;
+    return NULL;
+}
+
+static int
+mask(void *data, const char *in, size_t len, byte_ring_t *out)
+{
+    (void)data;
+    char buf[65536];
+    CHECK(len <= sizeof(buf));
+    for (size_t i = 0; i < len; i++)
+        buf[i] = in[i] ^ MASK;
+    CHECK(byte_ring_put(out, buf, len) == len);
+    return 0;
+}
+
+static int
+twice(void *data, const char *in, size_t len, byte_ring_t *out)
+{
+    (void)data;
+    for (size_t i = 0; i < len; i++) {
+        char pair[2] = { in[i], in[i] };
+        CHECK(byte_ring_put(out, pair, 2) == 2);
+    }
+    return 0;
+}
+
+static int
+refuse(void *data, const char *in, size_t len, byte_ring_t *out)
+{
+    (void)data;
+    (void)in;
+    (void)len;
+    (void)out;
+    return -1;
+}
+
+static void
+closed(void *data, int error)
+{
+    (void)data;
+    close_error = error;
+    ev_break(loop, EVBREAK_ALL);
+}
+
+static void
+test_ring(void)
+{
+    byte_ring_t ring;
+    struct iovec iov[2];
+    char out[10];
+
+    CHECK(byte_ring_init(&ring, 10) == 0);
+    CHECK(byte_ring_data_iov(&ring, iov) == 0);
+    CHECK(byte_ring_free_iov(&ring, iov) == 1 && iov[0].iov_len == 10);
+
+    // Pending data that wraps is two iovecs, and so is the space around it
+    CHECK(byte_ring_put(&ring, "abcdefg", 7) == 7);
+    byte_ring_consume(&ring, 5);
+    CHECK(byte_ring_put(&ring, "hijklm", 6) == 6);
+    CHECK(byte_ring_data_iov(&ring, iov) == 2);
+    CHECK(iov[0].iov_len == 5 && memcmp(iov[0].iov_base, "fghij", 5) == 0);
+    CHECK(iov[1].iov_len == 3 && memcmp(iov[1].iov_base, "klm", 3) == 0);
+    CHECK(byte_ring_free_iov(&ring, iov) == 1 && iov[0].iov_len == 2);
+    CHECK(byte_ring_put(&ring, "nopq", 4) == 2);
+    CHECK(byte_ring_space(&ring) == 0 && byte_ring_free_iov(&ring, iov) == 0);
+
+    byte_ring_consume(&ring, 7);
+    CHECK(byte_ring_free_iov(&ring, iov) == 2);
+    CHECK(iov[0].iov_len + iov[1].iov_len == 7);
+
+    // Through a socket: writev drains both iovecs, readv fills both
+    int a, b;
+    test_tcp_pair(&a, &b);
+    CHECK(byte_ring_writev(&ring, a) == 3 && ring.len == 0 && ring.head == 0);
+    CHECK(read(b, out, sizeof(out)) == 3 && memcmp(out, "mno", 3) == 0);
+
+    CHECK(byte_ring_put(&ring, "0123456", 7) == 7);
+    byte_ring_consume(&ring, 6);
+    CHECK(write(a, "ABCDEFGHI", 9) == 9);
+    CHECK(byte_ring_readv(&ring, b) == 9 && ring.len == 10);
+    CHECK(byte_ring_readv(&ring, b) == 0);
+    CHECK(byte_ring_writev(&ring, b) == 10 && ring.len == 0);
+    CHECK(read(a, out, sizeof(out)) == 10 && memcmp(out, "6ABCDEFGHI", 10) == 0);
+
+    close(a);
+    close(b);
+    byte_ring_release(&ring);
+}
+
+static void
+relay_pair(int *app, int *relay_client, int *relay_remote, int *server)
+{
+    test_tcp_pair(app, relay_client);
+    test_tcp_pair(relay_remote, server);
+    setnonblocking(*relay_client);
+    setnonblocking(*relay_remote);
+}
+
+static void
+close_pair(int app, int relay_client, int relay_remote, int server)
+{
+    close(app);
+    close(relay_client);
+    close(relay_remote);
+    close(server);
+}
+
+static void
+test_transforms(void)
+{
+    int app, relay_client, relay_remote, server;
+    relay_pair(&app, &relay_client, &relay_remote, &server);
+
+    // Doubling needs as much room for its output as it read
+    loop        = ev_loop_new(0);
+    close_error = -1;
+    ring_relay_config_t config = {
+        .up      = mask,
+        .down    = twice,
+        .reserve = RING_RELAY_DEFAULT_SIZE / 2,
+    };
+    ring_relay_t *relay = ring_relay_new(loop, relay_client, relay_remote,
+                                         &config, closed, NULL);
+    CHECK(relay != NULL);
+
+    stream_t up_in   = { .fd = app, .limit = BYTES };
+    stream_t up_out  = { .fd = server };
+    stream_t down_in = { .fd = server, .limit = BYTES };
+    stream_t down_out = { .fd = app, .doubled = 1 };
+    pthread_t threads[4];
+    pthread_create(&threads[0], NULL, source, &up_in);
+    pthread_create(&threads[1], NULL, sink, &up_out);
+    pthread_create(&threads[2], NULL, source, &down_in);
+    pthread_create(&threads[3], NULL, sink, &down_out);
+
+    ring_relay_start(relay);
+    ev_run(loop, 0);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    CHECK(close_error == 0);
+    CHECK(up_out.bytes == BYTES && up_out.bad == 0);
+    CHECK(down_out.bytes == BYTES && down_out.bad == 0);
+
+    ring_relay_stats_t up, down;
+    ring_relay_stats(relay, &up, &down);
+    CHECK(up.bytes == BYTES && down.bytes == 2 * BYTES);
+    CHECK(up.pending == 0 && down.pending == 0);
+    CHECK(up.reads > 0 && up.writes > 0 && down.reads > 0 && down.writes > 0);
+
+    ring_relay_free(relay);
+    ev_loop_destroy(loop);
+    close_pair(app, relay_client, relay_remote, server);
+}
+
+// A slow reader stops the relay reading at the high mark, not the ring
+static void
+test_throttle(void)
+{
+    int app, relay_client, relay_remote, server;
+    int small = 4096;
+    relay_pair(&app, &relay_client, &relay_remote, &server);
+    setsockopt(relay_client, SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    shutdown(app, SHUT_WR);
+
+    loop        = ev_loop_new(0);
+    close_error = -1;
+    ring_relay_config_t config = { .ring_size = 16384, .down = mask };
+    ring_relay_t *relay        = ring_relay_new(loop, relay_client, relay_remote,
+                                                &config, closed, NULL);
+    CHECK(relay != NULL);
+
+    stream_t in  = { .fd = server, .limit = SLOW_BYTES };
+    stream_t out = { .fd = app, .slow = 1 };
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, source, &in);
+    pthread_create(&threads[1], NULL, sink, &out);
+
+    ring_relay_start(relay);
+    ev_run(loop, 0);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    CHECK(close_error == 0);
+    CHECK(out.bytes == SLOW_BYTES && out.bad == 0);
+
+    ring_relay_stats_t up, down;
+    ring_relay_stats(relay, &up, &down);
+    CHECK(down.throttled > 0 && up.bytes == 0);
+
+    ring_relay_free(relay);
+    ev_loop_destroy(loop);
+    close_pair(app, relay_client, relay_remote, server);
+}
+
+// Pushed bytes go out ahead of what is read, through the transform
+static void
+test_push(void)
+{
+    int app, relay_client, relay_remote, server;
+    char buf[64];
+    relay_pair(&app, &relay_client, &relay_remote, &server);
+
+    loop        = ev_loop_new(0);
+    close_error = -1;
+    ring_relay_config_t config = { .ring_size = 1024, .down = twice, .reserve = 512 };
+    ring_relay_t *relay        = ring_relay_new(loop, relay_client, relay_remote,
+                                                &config, closed, NULL);
+    CHECK(relay != NULL);
+
+    static char big[1024];
+    CHECK(ring_relay_push_up(relay, big, sizeof(big) + 1) == -1);
+    CHECK(ring_relay_push_down(relay, big, 513) == -1);
+    CHECK(ring_relay_push_up(relay, "request", 7) == 0);
+    CHECK(ring_relay_push_down(relay, "ok", 2) == 0);
+
+    CHECK(write(app, "+body", 5) == 5);
+    shutdown(app, SHUT_WR);
+    shutdown(server, SHUT_WR);
+    ring_relay_start(relay);
+    ev_run(loop, 0);
+    CHECK(close_error == 0);
+
+    CHECK(read(server, buf, sizeof(buf)) == 12 && memcmp(buf, "request+body", 12) == 0);
+    CHECK(read(server, buf, sizeof(buf)) == 0);
+    CHECK(read(app, buf, sizeof(buf)) == 4 && memcmp(buf, "ookk", 4) == 0);
+    CHECK(read(app, buf, sizeof(buf)) == 0);
+
+    ring_relay_free(relay);
+    ev_loop_destroy(loop);
+    close_pair(app, relay_client, relay_remote, server);
+}
+
+static void
+test_errors(void)
+{
+    int app, relay_client, relay_remote, server;
+    relay_pair(&app, &relay_client, &relay_remote, &server);
+    loop = ev_loop_new(0);
+
+    // Configurations under which a direction could never read
+    ring_relay_config_t config = { .ring_size = 1024, .up = mask, .reserve = 1024 };
+    errno = 0;
+    CHECK(ring_relay_new(loop, relay_client, relay_remote, &config, closed, NULL) == NULL);
+    CHECK(errno == EINVAL);
+    ring_relay_config_t tiny = { .ring_size = 1024, .high_mark = 0.0001 };
+    errno = 0;
+    CHECK(ring_relay_new(loop, relay_client, relay_remote, &tiny, closed, NULL) == NULL);
+    CHECK(errno == EINVAL);
+
+    // A transform that refuses its input closes the relay with EPROTO
+    close_error = -1;
+    config.reserve = 0;
+    config.up      = refuse;
+    ring_relay_t *relay = ring_relay_new(loop, relay_client, relay_remote,
+                                         &config, closed, NULL);
+    CHECK(relay != NULL);
+    CHECK(write(app, "bad", 3) == 3);
+    ring_relay_start(relay);
+    ev_run(loop, 0);
+    CHECK(close_error == EPROTO);
+
+    ring_relay_free(relay);
+    ev_loop_destroy(loop);
+    close_pair(app, relay_client, relay_remote, server);
+}
+
+int
+main(void)
+{
+    test_ring();
+    test_transforms();
+    test_throttle();
+    test_push();
+    test_errors();
+    return 0;
+}
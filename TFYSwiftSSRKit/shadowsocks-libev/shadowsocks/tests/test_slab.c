@@ -0,0 +1,213 @@
+/*
+ * test_slab.c - Size classes, the page cap and thread caches of slab
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "membudget.h"
+#include "slab.h"
+#include "test.h"
+
+#define THREADS 8
+#define ROUNDS  20000
+#define SLOTS   64
+
+static size_t
+slab_used(void)
+{
+    mem_budget_stats_t stats;
+    mem_budget_stats(&stats);
+    for (int i = 0; i < stats.accounts; i++)
+        if (strcmp(stats.account[i].name, "slab") == 0)
+            return stats.account[i].used;
+    return 0;
+}
+
+// Everything handed out is back, and no page is left once trimmed
+static void
+check_balanced(void)
+{
+    slab_stats_t stats;
+
+    slab_thread_flush();
+    slab_stats(&stats);
+    for (int cls = 0; cls < SLAB_CLASS_NUM; cls++) {
+        CHECK(stats.classes[cls].in_use == 0);
+        CHECK(stats.classes[cls].allocs == stats.classes[cls].frees);
+        CHECK(stats.classes[cls].pages <= 1);
+    }
+    CHECK(slab_used() == stats.reserved);
+
+    CHECK(slab_trim() == stats.reserved);
+    slab_stats(&stats);
+    CHECK(stats.reserved == 0 && slab_used() == 0);
+}
+
+static void
+test_classes(void)
+{
+    static const size_t sizes[][2] = {
+        { 1, SLAB_CLASS_SMALL },
+        { SLAB_CLASS_SMALL, SLAB_CLASS_SMALL },
+        { SLAB_CLASS_SMALL + 1, SLAB_CLASS_MEDIUM },
+        { SLAB_CLASS_MEDIUM, SLAB_CLASS_MEDIUM },
+        { SLAB_CLASS_LARGE, SLAB_CLASS_LARGE },
+        { SLAB_CLASS_LARGE + 1, SLAB_CLASS_LARGE + 1 },
+    };
+    void *p[6];
+    slab_stats_t stats;
+
+    for (int i = 0; i < 6; i++) {
+        size_t usable = 0;
+        p[i] = slab_alloc(sizes[i][0], &usable);
+        CHECK(p[i] != NULL && usable == sizes[i][1]);
+        memset(p[i], i, usable);
+    }
+    slab_stats(&stats);
+    CHECK(stats.oversize == 1 && stats.overflow == 0);
+    CHECK(stats.classes[0].in_use >= 2 && stats.classes[0].size == SLAB_CLASS_SMALL);
+
+    // Growing moves the data to a larger class, shrinking keeps the block
+    size_t usable = 0;
+    void *q = slab_realloc(p[0], SLAB_CLASS_MEDIUM + 1, &usable);
+    CHECK(q != p[0] && usable == SLAB_CLASS_LARGE);
+    for (size_t j = 0; j < SLAB_CLASS_SMALL; j++)
+        CHECK(((uint8_t *)q)[j] == 0);
+    p[0] = q;
+    CHECK(slab_realloc(p[0], 10, &usable) == p[0] && usable == SLAB_CLASS_LARGE);
+
+    for (int i = 1; i < 6; i++)
+        for (size_t j = 0; j < sizes[i][1]; j += 1000)
+            CHECK(((uint8_t *)p[i])[j] == i);
+    for (int i = 0; i < 6; i++)
+        slab_free(p[i]);
+    slab_free(NULL);
+    check_balanced();
+}
+
+static void
+test_buffers(void)
+{
+    buffer_t buf;
+
+    CHECK(slab_balloc(&buf, 100) == 0);
+    CHECK(buf.capacity == SLAB_CLASS_SMALL && buf.len == 0 && buf.idx == 0);
+    memcpy(buf.array, "payload", 7);
+    buf.len = 7;
+
+    CHECK(slab_brealloc(&buf, buf.len, SLAB_CLASS_SMALL) == 0);
+    CHECK(buf.capacity == SLAB_CLASS_SMALL);
+    CHECK(slab_brealloc(&buf, buf.len, 5000) == 0);
+    CHECK(buf.capacity == SLAB_CLASS_MEDIUM && memcmp(buf.array, "payload", 7) == 0);
+
+    slab_bfree(&buf);
+    CHECK(buf.array == NULL && buf.capacity == 0 && buf.len == 0);
+    check_balanced();
+}
+
+// Past the cap blocks come from ss_malloc, past the budget nothing does
+static void
+test_limits(void)
+{
+    void *p[8];
+    slab_stats_t stats;
+
+    slab_set_cap(0);
+    for (int i = 0; i < 8; i++)
+        CHECK((p[i] = slab_alloc(SLAB_CLASS_LARGE, NULL)) != NULL);
+    slab_stats(&stats);
+    CHECK(stats.overflow == 8 && stats.reserved == 0 && stats.classes[2].pages == 0);
+    for (int i = 0; i < 8; i++)
+        slab_free(p[i]);
+    CHECK(slab_used() == 0);
+    slab_set_cap(SLAB_DEFAULT_CAP);
+
+    // A page does not fit in 100 KB, a single block does, a second not
+    mem_budget_config_t config = { .soft_limit = 100 * 1024, .hard_limit = 100 * 1024 };
+    mem_budget_configure(&config);
+    CHECK((p[0] = slab_alloc(SLAB_CLASS_LARGE, NULL)) != NULL);
+    CHECK(slab_alloc(SLAB_CLASS_LARGE, NULL) == NULL);
+    slab_free(p[0]);
+    mem_budget_configure(NULL);
+
+    // The refused request is not counted as an alloc
+    slab_stats(&stats);
+    CHECK(stats.classes[2].allocs == stats.classes[2].frees);
+    CHECK(slab_used() == 0);
+}
+
+static void *
+stress(void *arg)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    uint8_t tag       = (uint8_t)(uintptr_t)arg;
+    void *slot[SLOTS] = { NULL };
+    size_t len[SLOTS] = { 0 };
+
+    for (int round = 0; round < ROUNDS; round++) {
+        int i = rand_r(&seed) % SLOTS;
+        if (slot[i] != NULL) {
+            for (size_t j = 0; j < len[i]; j += 97)
+                CHECK(((uint8_t *)slot[i])[j] == tag);
+            if (rand_r(&seed) % 2) {
+                slab_free(slot[i]);
+                slot[i] = NULL;
+                continue;
+            }
+        }
+        size_t size = 1 + rand_r(&seed) % (SLAB_CLASS_LARGE + 4096);
+        void *p     = slab_realloc(slot[i], size, NULL);
+        CHECK(p != NULL);
+        memset(p, tag, size);
+        slot[i] = p;
+        len[i]  = size;
+    }
+    for (int i = 0; i < SLOTS; i++)
+        slab_free(slot[i]);
+    return NULL;
+}
+
+// Thread caches go back to their pages when the threads exit
+static void
+test_threads(void)
+{
+    pthread_t threads[THREADS];
+    slab_stats_t stats;
+
+    for (uintptr_t i = 0; i < THREADS; i++)
+        CHECK(pthread_create(&threads[i], NULL, stress, (void *)(i + 1)) == 0);
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    slab_stats(&stats);
+    for (int cls = 0; cls < SLAB_CLASS_NUM; cls++)
+        CHECK(stats.classes[cls].cache_hits > 0);
+    check_balanced();
+}
+
+int
+main(void)
+{
+    test_classes();
+    test_buffers();
+    test_limits();
+    test_threads();
+    return 0;
+}
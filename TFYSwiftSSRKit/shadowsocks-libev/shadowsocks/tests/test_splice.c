@@ -0,0 +1,249 @@
+/*
+ * test_splice.c - Both directions through the splice and copy relays
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "splicerelay.h"
+#include "utils.h"
+#include "test.h"
+
+#define BYTES      (8L * 1024 * 1024)
+#define SLOW_BYTES (256L * 1024)
+
+/*
+ * An application and a server, each on blocking sockets in their own
+ * threads, stream BYTES at each other through the relay and check every
+ * byte of what arrives. 251 is prime, so a chunk lost, doubled or
+ * reordered shows up.
+ */
+
+typedef struct stream {
+    int fd;
+    long bytes;
+    int bad;
+} stream_t;
+
+static struct ev_loop *loop;
+static int close_error = -1;
+
+static void *
+source(void *arg)
+{
+    stream_t *s = arg;
+    char buf[65536 + 3];
+
+    while (s->bytes < BYTES) {
+        // Odd sizes, so writes and reads fall out of step
+        size_t len = 1 + (size_t)(s->bytes * 7919) % sizeof(buf);
+        if (len > (size_t)(BYTES - s->bytes))
+            len = BYTES - s->bytes;
+        for (size_t i = 0; i < len; i++)
+            buf[i] = (char)((s->bytes + i) % 251);
+        ssize_t n = write(s->fd, buf, len);
+        if (n <= 0)
+            break;
+        s->bytes += n;
+    }
+    shutdown(s->fd, SHUT_WR);
+    return NULL;
+}
+
+static void *
+sink(void *arg)
+{
+    stream_t *s = arg;
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = read(s->fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++)
+            if (buf[i] != (char)((s->bytes + i) % 251))
+                s->bad++;
+        s->bytes += n;
+    }
+    return NULL;
+}
+
+static void
+closed(void *data, int error)
+{
+    (void)data;
+    close_error = error;
+    ev_break(loop, EVBREAK_ALL);
+}
+
+static splice_relay_mode_t
+run(int force_copy)
+{
+    int app, relay_client, relay_remote, server;
+    test_tcp_pair(&app, &relay_client);
+    test_tcp_pair(&relay_remote, &server);
+    setnonblocking(relay_client);
+    setnonblocking(relay_remote);
+
+    loop        = ev_loop_new(0);
+    close_error = -1;
+    splice_relay_config_t config = { .force_copy = force_copy };
+    splice_relay_t *relay        = splice_relay_new(loop, relay_client, relay_remote,
+                                                    &config, closed, NULL);
+    CHECK(relay != NULL);
+
+    stream_t up_in = { .fd = app }, up_out = { .fd = server };
+    stream_t down_in = { .fd = server }, down_out = { .fd = app };
+    pthread_t threads[4];
+    pthread_create(&threads[0], NULL, source, &up_in);
+    pthread_create(&threads[1], NULL, sink, &up_out);
+    pthread_create(&threads[2], NULL, source, &down_in);
+    pthread_create(&threads[3], NULL, sink, &down_out);
+
+    splice_relay_start(relay);
+    ev_run(loop, 0);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    // Both EOFs were passed on, after every byte
+    CHECK(close_error == 0);
+    CHECK(up_in.bytes == BYTES && up_out.bytes == BYTES && up_out.bad == 0);
+    CHECK(down_in.bytes == BYTES && down_out.bytes == BYTES && down_out.bad == 0);
+
+    ring_relay_stats_t up, down;
+    splice_relay_stats(relay, &up, &down);
+    CHECK(up.bytes == BYTES && down.bytes == BYTES);
+    CHECK(up.pending == 0 && down.pending == 0);
+
+    splice_relay_mode_t mode = splice_relay_mode(relay);
+    splice_relay_free(relay);
+    ev_loop_destroy(loop);
+    close(app);
+    close(relay_client);
+    close(relay_remote);
+    close(server);
+    return mode;
+}
+
+/*
+ * Many small segments into a reader that drains slowly: the pipe fills by
+ * buffer slots long before pipe_size bytes, so splice() into it fails with
+ * EAGAIN while the source is still readable. The relay must wait for the
+ * writer then, not spin on the read watcher.
+ */
+static void *
+small_source(void *arg)
+{
+    stream_t *s = arg;
+    char buf[64];
+    int one = 1;
+
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    while (s->bytes < SLOW_BYTES) {
+        for (size_t i = 0; i < sizeof(buf); i++)
+            buf[i] = (char)((s->bytes + i) % 251);
+        ssize_t n = write(s->fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        s->bytes += n;
+    }
+    shutdown(s->fd, SHUT_WR);
+    return NULL;
+}
+
+static void *
+slow_sink(void *arg)
+{
+    stream_t *s = arg;
+    char buf[4096];
+    double slow_until = test_now() + 0.3;
+    ssize_t n;
+
+    // A trickle at first, so that the pipe fills up with small buffers
+    while ((n = read(s->fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++)
+            if (buf[i] != (char)((s->bytes + i) % 251))
+                s->bad++;
+        s->bytes += n;
+        if (test_now() < slow_until)
+            usleep(1000);
+    }
+    return NULL;
+}
+
+static void
+run_slow_reader(int force_copy)
+{
+    int app, relay_client, relay_remote, server;
+    int small = 4096;
+    test_tcp_pair(&app, &relay_client);
+    test_tcp_pair(&relay_remote, &server);
+    setsockopt(app, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    setsockopt(relay_client, SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    setnonblocking(relay_client);
+    setnonblocking(relay_remote);
+    shutdown(app, SHUT_WR);
+
+    loop        = ev_loop_new(0);
+    close_error = -1;
+    splice_relay_config_t config = { .force_copy = force_copy };
+    splice_relay_t *relay        = splice_relay_new(loop, relay_client, relay_remote,
+                                                    &config, closed, NULL);
+    stream_t in = { .fd = server }, out = { .fd = app };
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, small_source, &in);
+    pthread_create(&threads[1], NULL, slow_sink, &out);
+
+    double cpu  = test_cpu_now();
+    double wall = test_now();
+    splice_relay_start(relay);
+    ev_run(loop, 0);
+    cpu  = test_cpu_now() - cpu;
+    wall = test_now() - wall;
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    CHECK(close_error == 0);
+    CHECK(out.bytes == SLOW_BYTES && out.bad == 0);
+    // Waiting on the writer costs next to no CPU
+    CHECK(cpu < wall / 50);
+
+    splice_relay_free(relay);
+    ev_loop_destroy(loop);
+    close(app);
+    close(relay_client);
+    close(relay_remote);
+    close(server);
+}
+
+int
+main(void)
+{
+#ifdef __linux__
+    CHECK(run(0) == SPLICE_RELAY_SPLICE);
+#else
+    CHECK(run(0) == SPLICE_RELAY_COPY);
+#endif
+    CHECK(run(1) == SPLICE_RELAY_COPY);
+    run_slow_reader(0);
+    run_slow_reader(1);
+    return 0;
+}
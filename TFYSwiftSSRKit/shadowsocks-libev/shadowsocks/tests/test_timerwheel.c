@@ -0,0 +1,191 @@
+/*
+ * test_timerwheel.c - Firing, touching, cascading and stopping timers
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "timerwheel.h"
+#include "test.h"
+
+#define RESOLUTION 0.1
+
+static struct ev_loop *loop;
+
+typedef struct timer {
+    timer_wheel_entry_t entry;
+    timer_wheel_t *wheel;
+    double timeout;
+    int fired;
+    int restarts;               // starts itself again this many times
+    ev_tstamp fired_at;
+} test_timer_t;
+
+static void
+on_fire(timer_wheel_entry_t *entry, void *data)
+{
+    test_timer_t *timer = data;
+    CHECK(entry == &timer->entry && !entry->active);
+    timer->fired++;
+    timer->fired_at = ev_now(loop);
+    if (timer->restarts > 0) {
+        timer->restarts--;
+        timer_wheel_start(timer->wheel, entry, timer->timeout);
+    }
+}
+
+static void
+timer_start(test_timer_t *timer, timer_wheel_t *wheel, double timeout)
+{
+    memset(timer, 0, sizeof(test_timer_t));
+    timer->wheel   = wheel;
+    timer->timeout = timeout;
+    timer_wheel_entry_init(&timer->entry, on_fire, timer);
+    timer_wheel_start(wheel, &timer->entry, timeout);
+}
+
+static timer_wheel_stats_t
+stats_of(timer_wheel_t *wheel)
+{
+    timer_wheel_stats_t stats;
+    timer_wheel_stats(wheel, &stats);
+    return stats;
+}
+
+// Never early, at most two resolutions late
+static void
+check_fired(const test_timer_t *timer, ev_tstamp started)
+{
+    double late = timer->fired_at - started - timer->timeout;
+    CHECK(timer->fired == 1);
+    CHECK(late > -1e-9 && late <= 2 * RESOLUTION + 1e-9);
+}
+
+// From one tick to level 3, every timer fires on time
+static void
+test_fire(void)
+{
+    static const double timeouts[] = { 0.05, 0.3, 1, 6.35, 7, 500, 30000 };
+    const int n                    = sizeof(timeouts) / sizeof(timeouts[0]);
+    timer_wheel_t *wheel           = timer_wheel_new(loop, RESOLUTION);
+    test_timer_t timers[sizeof(timeouts) / sizeof(timeouts[0])];
+
+    // Started part way into a tick
+    while (evloop_step(loop, ev_now(loop) + 0.03))
+        ;
+    ev_tstamp started = ev_now(loop);
+    for (int i = 0; i < n; i++)
+        timer_start(&timers[i], wheel, timeouts[i]);
+    CHECK(stats_of(wheel).timers == (uint64_t)n);
+    double remaining = timer_wheel_remaining(wheel, &timers[2].entry);
+    CHECK(remaining >= 1 && remaining <= 1 + 2 * RESOLUTION);
+
+    while (evloop_step(loop, started + 31000))
+        ;
+    for (int i = 0; i < n; i++)
+        check_fired(&timers[i], started);
+
+    timer_wheel_stats_t stats = stats_of(wheel);
+    CHECK(stats.timers == 0 && stats.fired == (uint64_t)n && stats.rearmed == 0);
+    CHECK(stats.cascaded >= 4);
+    CHECK(timer_wheel_remaining(wheel, &timers[0].entry) == 0);
+
+    // An empty wheel keeps no loop timer running
+    CHECK(evloop_step(loop, ev_now(loop) + 10) == 0);
+    timer_wheel_free(wheel);
+}
+
+// A touched timer is relinked once per period, and fires a timeout after the last touch
+static void
+test_touch(void)
+{
+    timer_wheel_t *wheel = timer_wheel_new(loop, RESOLUTION);
+    test_timer_t timer;
+
+    timer_start(&timer, wheel, 1);
+    ev_tstamp touched = ev_now(loop);
+    for (int i = 0; i < 100; i++) {
+        while (evloop_step(loop, touched + 0.25))
+            ;
+        touched = ev_now(loop);
+        timer_wheel_touch(wheel, &timer.entry);
+    }
+    CHECK(timer.fired == 0);
+    uint64_t rearmed = stats_of(wheel).rearmed;
+    CHECK(rearmed >= 20 && rearmed <= 30);
+
+    while (evloop_step(loop, touched + 5))
+        ;
+    check_fired(&timer, touched);
+
+    // Touching an inactive timer does nothing
+    timer_wheel_touch(wheel, &timer.entry);
+    CHECK(!timer.entry.active && stats_of(wheel).timers == 0);
+    timer_wheel_free(wheel);
+}
+
+static void
+test_stop(void)
+{
+    timer_wheel_t *wheel = timer_wheel_new(loop, RESOLUTION);
+    test_timer_t stopped, restarted, repeating, left;
+
+    timer_start(&stopped, wheel, 0.5);
+    timer_start(&restarted, wheel, 0.5);
+    timer_start(&repeating, wheel, 0.2);
+    repeating.restarts = 2;
+
+    // Stop, and start again with another timeout
+    timer_wheel_stop(wheel, &stopped.entry);
+    timer_wheel_stop(wheel, &stopped.entry);
+    CHECK(!stopped.entry.active && timer_wheel_remaining(wheel, &stopped.entry) == 0);
+    ev_tstamp started = ev_now(loop);
+    timer_wheel_start(wheel, &restarted.entry, 2);
+    restarted.timeout = 2;
+    CHECK(stats_of(wheel).timers == 2);
+
+    while (evloop_step(loop, started + 3))
+        ;
+    CHECK(stopped.fired == 0);
+    check_fired(&restarted, started);
+    CHECK(repeating.fired == 3 && repeating.fired_at - started >= 0.6 - 1e-9);
+
+    // Freeing the wheel leaves its timers inactive, uncalled
+    timer_start(&left, wheel, 1);
+    timer_wheel_free(wheel);
+    CHECK(!left.entry.active && left.fired == 0);
+    CHECK(evloop_step(loop, ev_now(loop) + 10) == 0);
+
+    // Beyond what the levels reach the timer is parked, not lost
+    wheel = timer_wheel_new(loop, RESOLUTION);
+    timer_start(&left, wheel, 3e6);
+    CHECK(timer_wheel_remaining(wheel, &left.entry) >= 3e6);
+    timer_wheel_stop(wheel, &left.entry);
+    timer_wheel_free(wheel);
+}
+
+int
+main(void)
+{
+    loop = ev_loop_new(0);
+    test_fire();
+    test_touch();
+    test_stop();
+    ev_loop_destroy(loop);
+    return 0;
+}
@@ -0,0 +1,289 @@
+/*
+ * test_udpbatch.c - Batched receive and send, GRO splitting and GSO runs
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/syscall.h>
+
+#include "udpbatch.h"
+#include "utils.h"
+#include "test.h"
+
+#define SLOT   256
+#define OFFSET 16
+
+#ifdef __linux__
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/*
+ * Loopback rarely coalesces on its own, so a coalesced read is made up
+ * here: while reads are queued, this recvmsg() stands in for libc's and
+ * returns them, cmsg, flags and all. Otherwise it is the real system call.
+ */
+typedef struct fake_read {
+    size_t len;                     // bytes of datagrams from one sender
+    size_t seg;                     // their size, 0 for no UDP_GRO cmsg
+    int trunc;
+    uint8_t tag;                    // first datagram's bytes; the next ones count up
+} fake_read_t;
+
+static fake_read_t fakes[8];
+static int nfakes, next_fake;
+
+ssize_t
+recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    if (next_fake == nfakes)
+        return syscall(SYS_recvmsg, fd, msg, flags);
+
+    fake_read_t *f = &fakes[next_fake++];
+    uint8_t *buf   = msg->msg_iov[0].iov_base;
+    size_t seg     = f->seg > 0 ? f->seg : f->len;
+    size_t len     = f->len < msg->msg_iov[0].iov_len ? f->len : msg->msg_iov[0].iov_len;
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (uint8_t)(f->tag + i / seg);
+
+    msg->msg_namelen = test_loopback(4242, msg->msg_name);
+    msg->msg_flags   = f->trunc ? MSG_TRUNC : 0;
+    if (f->seg > 0) {
+        struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+        int gso_size       = (int)f->seg;
+        cm->cmsg_level     = SOL_UDP;
+        cm->cmsg_type      = UDP_GRO;
+        cm->cmsg_len       = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &gso_size, sizeof(int));
+        msg->msg_controllen = CMSG_SPACE(sizeof(int));
+    } else {
+        msg->msg_controllen = 0;
+    }
+    return (ssize_t)len;
+}
+#endif
+
+static int
+udp_socket(uint16_t *port)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = test_loopback(0, &addr);
+    int fd        = socket(AF_INET, SOCK_DGRAM, 0);
+
+    CHECK(fd != -1);
+    CHECK(bind(fd, (struct sockaddr *)&addr, len) == 0);
+    CHECK(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    *port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+    setnonblocking(fd);
+    return fd;
+}
+
+static void
+check_packet(const udp_batch_t *batch, int i, size_t len, uint8_t tag)
+{
+    CHECK(batch->pkt[i].len == len && batch->pkt[i].capacity == SLOT);
+    for (size_t j = 0; j < len; j++)
+        CHECK(batch->pkt[i].data[OFFSET + j] == tag);
+}
+
+// Receive until n datagrams have come in or a second has passed
+static int
+recv_all(udp_batch_t *batch, int fd, size_t *lens, uint8_t *tags, int n)
+{
+    double deadline = test_now() + 1;
+    int got         = 0;
+
+    while (got < n && test_now() < deadline) {
+        int r = udp_batch_recv(batch, fd, OFFSET);
+        CHECK(r >= 0);
+        for (int i = 0; i < r && got < n; i++, got++) {
+            lens[got] = batch->pkt[i].len;
+            tags[got] = batch->pkt[i].data[OFFSET];
+            for (size_t j = 0; j < lens[got]; j++)
+                CHECK(batch->pkt[i].data[OFFSET + j] == tags[got]);
+        }
+        if (r == 0)
+            usleep(1000);
+    }
+    return got;
+}
+
+static void
+test_recv(void)
+{
+    uint16_t rx_port, tx_port;
+    int rx = udp_socket(&rx_port);
+    int tx = udp_socket(&tx_port);
+    struct sockaddr_storage addr;
+    socklen_t len = test_loopback(rx_port, &addr);
+    uint8_t buf[SLOT + 64];
+
+    // Ten datagrams, the fourth too long for its slot
+    for (int i = 0; i < 10; i++) {
+        size_t n = i == 3 ? sizeof(buf) : (size_t)(10 * i + 1);
+        memset(buf, i, n);
+        CHECK(sendto(tx, buf, n, 0, (struct sockaddr *)&addr, len) == (ssize_t)n);
+    }
+    usleep(10000);
+
+    udp_batch_t *batch = udp_batch_new(8, SLOT);
+    CHECK(batch->slots == 8 && batch->slot_size == SLOT);
+    CHECK(udp_batch_recv(batch, rx, OFFSET) == 8);
+    for (int i = 0; i < 8; i++) {
+        struct sockaddr_in *from = (struct sockaddr_in *)&batch->addr[i];
+        CHECK(from->sin_port == htons(tx_port));
+        if (i != 3)
+            check_packet(batch, i, 10 * i + 1, (uint8_t)i);
+    }
+#ifdef __linux__
+    // recvmmsg reports the truncation, and the datagram goes
+    CHECK(batch->pkt[3].len == 0 && batch->stats.dropped == 1);
+#endif
+    CHECK(udp_batch_recv(batch, rx, OFFSET) == 2);
+    check_packet(batch, 0, 81, 8);
+    check_packet(batch, 1, 91, 9);
+    CHECK(udp_batch_recv(batch, rx, OFFSET) == 0);
+    CHECK(udp_batch_recv(batch, rx, SLOT) == -1);
+    CHECK(batch->stats.received == 10);
+
+    udp_batch_free(batch);
+    close(rx);
+    close(tx);
+}
+
+/*
+ * Runs to one address leave as GSO sends where the kernel has it, and
+ * whatever the path does with them, every datagram arrives as it was.
+ */
+static void
+test_send(void)
+{
+    static const struct {
+        size_t len;
+        int to_b;
+    } plan[] = {
+        { 200, 0 }, { 200, 0 }, { 200, 0 }, { 200, 0 }, { 200, 0 }, { 120, 0 },
+        { 200, 1 }, { 200, 1 }, { 200, 1 }, { 0, 0 }, { 50, 0 }, { 50, 0 },
+    };
+    const int npkts = sizeof(plan) / sizeof(plan[0]);
+    uint16_t a_port, b_port, tx_port;
+    int a  = udp_socket(&a_port);
+    int b  = udp_socket(&b_port);
+    int tx = udp_socket(&tx_port);
+
+    udp_batch_t *batch = udp_batch_new(UDP_BATCH_MAX, SLOT);
+    udp_batch_t *recv  = udp_batch_new(UDP_BATCH_MAX, SLOT);
+    int offload        = udp_batch_enable_offload(batch, tx);
+    udp_batch_enable_offload(recv, a);
+
+    for (int i = 0; i < npkts; i++) {
+        batch->addr_len[i] = test_loopback(plan[i].to_b ? b_port : a_port, &batch->addr[i]);
+        batch->pkt[i].len  = plan[i].len;
+        memset(batch->pkt[i].data + OFFSET, i, plan[i].len);
+    }
+    batch->count = npkts;
+    CHECK(udp_batch_send(batch, tx, OFFSET) == npkts - 1);
+    CHECK(batch->stats.sent == (uint64_t)npkts - 1 && batch->stats.dropped == 0);
+    if (offload & UDP_BATCH_GSO)
+        CHECK(batch->stats.gso_segments == 11);
+
+    size_t lens[UDP_BATCH_MAX];
+    uint8_t tags[UDP_BATCH_MAX];
+    CHECK(recv_all(recv, a, lens, tags, 8) == 8);
+    static const uint8_t a_tags[] = { 0, 1, 2, 3, 4, 5, 10, 11 };
+    for (int i = 0; i < 8; i++)
+        CHECK(tags[i] == a_tags[i] && lens[i] == plan[a_tags[i]].len);
+    CHECK(recv_all(recv, b, lens, tags, 3) == 3);
+    for (int i = 0; i < 3; i++)
+        CHECK(tags[i] == 6 + i && lens[i] == 200);
+
+    udp_batch_free(batch);
+    udp_batch_free(recv);
+    close(a);
+    close(b);
+    close(tx);
+}
+
+#ifdef __linux__
+static void
+test_gro(void)
+{
+    uint16_t port;
+    int fd             = udp_socket(&port);
+    udp_batch_t *batch = udp_batch_new(4, SLOT);
+
+    if (!(udp_batch_enable_offload(batch, fd) & UDP_BATCH_GRO)) {
+        udp_batch_free(batch);
+        close(fd);
+        return;
+    }
+
+    fakes[0] = (fake_read_t){ .len = 600, .seg = 100, .tag = 10 };
+    fakes[1] = (fake_read_t){ .len = 300, .seg = 100, .trunc = 1, .tag = 20 };
+    fakes[2] = (fake_read_t){ .len = 250, .seg = 100, .tag = 30 };
+    fakes[3] = (fake_read_t){ .len = SLOT, .tag = 40 };
+    fakes[4] = (fake_read_t){ .len = 70, .tag = 50 };
+    nfakes   = 5;
+
+    // Six datagrams for four slots: two wait for the next receive
+    CHECK(udp_batch_recv(batch, fd, OFFSET) == 4);
+    for (int i = 0; i < 4; i++) {
+        check_packet(batch, i, 100, (uint8_t)(10 + i));
+        CHECK(((struct sockaddr_in *)&batch->addr[i])->sin_port == htons(4242));
+    }
+    CHECK(udp_batch_pending(batch) && next_fake == 1);
+
+    // The truncated read is dropped whole, not handed out as three
+    CHECK(udp_batch_recv(batch, fd, OFFSET) == 4);
+    check_packet(batch, 0, 100, 14);
+    check_packet(batch, 1, 100, 15);
+    check_packet(batch, 2, 100, 30);
+    check_packet(batch, 3, 100, 31);
+    CHECK(batch->stats.dropped == 3);
+
+    // The tail of the last read, then a datagram too long for a slot
+    CHECK(udp_batch_recv(batch, fd, OFFSET) == 2);
+    check_packet(batch, 0, 50, 32);
+    check_packet(batch, 1, 70, 50);
+    CHECK(!udp_batch_pending(batch) && next_fake == nfakes);
+    CHECK(udp_batch_recv(batch, fd, OFFSET) == 0);
+
+    CHECK(batch->stats.dropped == 4 && batch->stats.received == 10);
+    CHECK(batch->stats.gro_segments == 9);
+
+    udp_batch_free(batch);
+    close(fd);
+}
+#endif
+
+int
+main(void)
+{
+    test_recv();
+    test_send();
+#ifdef __linux__
+    test_gro();
+#endif
+    return 0;
+}
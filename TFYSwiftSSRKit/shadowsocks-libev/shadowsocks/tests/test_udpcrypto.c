@@ -0,0 +1,255 @@
+/*
+ * test_udpcrypto.c - Per-packet subkeys of udpcrypto against a reference AEAD
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <mbedtls/gcm.h>
+#include <sodium.h>
+
+#include "udpcrypto.h"
+#include "test.h"
+
+#define PACKETS  150                // more than two UDP_CRYPTO_BATCH rounds
+#define MAX_DATA 1500
+#define ROOM     (MAX_DATA + 64)
+
+static const size_t key_lens[AEAD_CIPHER_NUM] = { 16, 24, 32, 32 };
+
+static uint8_t key[32];
+static uint8_t bufs[PACKETS][ROOM];
+static udp_packet_t pkts[PACKETS];
+
+static cipher_t
+new_cipher(int method)
+{
+    cipher_t cipher;
+    memset(&cipher, 0, sizeof(cipher));
+    for (size_t i = 0; i < sizeof(key); i++)
+        key[i] = (uint8_t)(i * 13 + method);
+    cipher.method    = method;
+    cipher.key       = key;
+    cipher.key_len   = key_lens[method];
+    cipher.nonce_len = 12;
+    cipher.tag_len   = 16;
+    return cipher;
+}
+
+// Lengths around every block boundary, and a long tail
+static size_t
+payload_len(size_t i)
+{
+    return i < 40 ? i + 1 : 40 + (i * 97) % (MAX_DATA - 40);
+}
+
+static uint8_t
+payload_byte(size_t i, size_t j)
+{
+    return (uint8_t)(i * 31 + j * 7);
+}
+
+/*
+ * The reference: HKDF-SHA1 from tests/support and one-shot AEAD calls,
+ * with a fresh context per packet, the way aead.c does it.
+ */
+static void
+subkey_of(const cipher_t *cipher, const uint8_t *salt, uint8_t *subkey)
+{
+    CHECK(test_hkdf_sha1(salt, cipher->key_len, cipher->key, cipher->key_len,
+                         (const uint8_t *)SUBKEY_INFO, SUBKEY_INFO_LEN,
+                         subkey, cipher->key_len) == 0);
+}
+
+static int
+reference_open(const cipher_t *cipher, uint8_t *pkt, size_t len)
+{
+    static const uint8_t nonce[12];
+    uint8_t subkey[32];
+    size_t salt_len = cipher->key_len;
+    size_t clen     = len - salt_len - 16;
+    uint8_t *c      = pkt + salt_len;
+
+    subkey_of(cipher, pkt, subkey);
+    if (cipher->method == CHACHA20_IETF_POLY1305)
+        return crypto_aead_chacha20poly1305_ietf_decrypt_detached(c, NULL, c, clen, c + clen,
+                                                                  NULL, 0, nonce, subkey);
+
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    CHECK(mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, subkey,
+                             (unsigned int)salt_len * 8) == 0);
+    int ret = mbedtls_gcm_auth_decrypt(&gcm, clen, nonce, sizeof(nonce), NULL, 0,
+                                       c + clen, 16, c, c);
+    mbedtls_gcm_free(&gcm);
+    return ret;
+}
+
+static size_t
+reference_seal(const cipher_t *cipher, uint8_t *pkt, const uint8_t *m, size_t mlen)
+{
+    static const uint8_t nonce[12];
+    uint8_t subkey[32];
+    size_t salt_len = cipher->key_len;
+    uint8_t *c      = pkt + salt_len;
+
+    randombytes_buf(pkt, salt_len);
+    subkey_of(cipher, pkt, subkey);
+    if (cipher->method == CHACHA20_IETF_POLY1305) {
+        CHECK(crypto_aead_chacha20poly1305_ietf_encrypt_detached(c, c + mlen, NULL, m, mlen,
+                                                                 NULL, 0, NULL, nonce,
+                                                                 subkey) == 0);
+    } else {
+        mbedtls_gcm_context gcm;
+        mbedtls_gcm_init(&gcm);
+        CHECK(mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, subkey,
+                                 (unsigned int)salt_len * 8) == 0);
+        CHECK(mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, mlen, nonce, sizeof(nonce),
+                                        NULL, 0, m, c, 16, c + mlen) == 0);
+        mbedtls_gcm_free(&gcm);
+    }
+    return salt_len + mlen + 16;
+}
+
+static void
+fill_plaintext(const cipher_t *cipher)
+{
+    size_t headroom = udp_crypto_headroom(cipher);
+    for (size_t i = 0; i < PACKETS; i++) {
+        pkts[i].data     = bufs[i];
+        pkts[i].capacity = ROOM;
+        pkts[i].len      = payload_len(i);
+        for (size_t j = 0; j < pkts[i].len; j++)
+            bufs[i][headroom + j] = payload_byte(i, j);
+    }
+}
+
+static int
+is_payload(size_t i, const uint8_t *p, size_t len)
+{
+    if (len != payload_len(i))
+        return 0;
+    for (size_t j = 0; j < len; j++)
+        if (p[j] != payload_byte(i, j))
+            return 0;
+    return 1;
+}
+
+static void
+test_encrypt(int method)
+{
+    cipher_t cipher = new_cipher(method);
+    size_t salt_len = cipher.key_len;
+    size_t headroom = udp_crypto_headroom(&cipher);
+
+    // Packet 5 has no room for its tag, and 6 is empty
+    fill_plaintext(&cipher);
+    pkts[5].capacity = salt_len + pkts[5].len + 15;
+    pkts[6].len      = 0;
+    CHECK(udp_crypto_encrypt(&cipher, pkts, PACKETS) == PACKETS - 2);
+    CHECK(pkts[5].len == 0 && pkts[6].len == 0);
+
+    for (size_t i = 0; i < PACKETS; i++) {
+        if (i == 5 || i == 6)
+            continue;
+        CHECK(pkts[i].len == payload_len(i) + udp_crypto_overhead(&cipher));
+        // Every packet has its own salt, and so its own subkey
+        for (size_t k = 0; k < i; k++)
+            CHECK(k == 5 || k == 6 || memcmp(bufs[i], bufs[k], salt_len) != 0);
+        CHECK(reference_open(&cipher, bufs[i], pkts[i].len) == 0);
+        CHECK(is_payload(i, bufs[i] + headroom, payload_len(i)));
+    }
+    udp_crypto_thread_release();
+}
+
+static void
+test_decrypt(int method)
+{
+    static uint8_t plain[MAX_DATA];
+    static uint8_t sealed[PACKETS][ROOM];
+    static size_t sealed_len[PACKETS];
+    cipher_t cipher     = new_cipher(method);
+    size_t headroom     = udp_crypto_headroom(&cipher);
+    replay_filter_t *rf = replay_filter_new(NULL);
+
+    for (size_t i = 0; i < PACKETS; i++) {
+        for (size_t j = 0; j < payload_len(i); j++)
+            plain[j] = payload_byte(i, j);
+        sealed_len[i] = reference_seal(&cipher, sealed[i], plain, payload_len(i));
+    }
+
+    // Tampered body, tampered tag, and a packet too short for any plaintext
+    for (size_t i = 0; i < PACKETS; i++) {
+        memcpy(bufs[i], sealed[i], sealed_len[i]);
+        pkts[i].data     = bufs[i];
+        pkts[i].capacity = ROOM;
+        pkts[i].len      = sealed_len[i];
+    }
+    bufs[3][headroom] ^= 0x80;
+    bufs[4][sealed_len[4] - 1] ^= 1;
+    pkts[7].len = headroom + 16;
+    CHECK(udp_crypto_decrypt(&cipher, rf, pkts, PACKETS) == PACKETS - 3);
+    CHECK(pkts[3].len == 0 && pkts[4].len == 0 && pkts[7].len == 0);
+    for (size_t i = 0; i < PACKETS; i++)
+        CHECK(i == 3 || i == 4 || i == 7
+              || is_payload(i, bufs[i] + headroom, pkts[i].len));
+
+    // Only the rejected ones are still new to the replay filter
+    for (size_t i = 0; i < PACKETS; i++) {
+        memcpy(bufs[i], sealed[i], sealed_len[i]);
+        pkts[i].len = sealed_len[i];
+    }
+    CHECK(udp_crypto_decrypt(&cipher, rf, pkts, PACKETS) == 3);
+    CHECK(pkts[3].len > 0 && pkts[4].len > 0 && pkts[7].len > 0);
+    CHECK(is_payload(4, bufs[4] + headroom, pkts[4].len));
+
+    replay_filter_free(rf);
+    udp_crypto_thread_release();
+}
+
+static void
+test_round_trip(int method)
+{
+    cipher_t cipher = new_cipher(method);
+    size_t headroom = udp_crypto_headroom(&cipher);
+
+    fill_plaintext(&cipher);
+    CHECK(udp_crypto_encrypt(&cipher, pkts, PACKETS) == PACKETS);
+    CHECK(udp_crypto_decrypt(&cipher, NULL, pkts, PACKETS) == PACKETS);
+    for (size_t i = 0; i < PACKETS; i++)
+        CHECK(is_payload(i, bufs[i] + headroom, pkts[i].len));
+
+    // A different PSK at the same address is picked up
+    fill_plaintext(&cipher);
+    CHECK(udp_crypto_encrypt(&cipher, pkts, 1) == 1);
+    key[0] ^= 1;
+    CHECK(udp_crypto_decrypt(&cipher, NULL, pkts, 1) == 0);
+    udp_crypto_thread_release();
+}
+
+int
+main(void)
+{
+    CHECK(sodium_init() >= 0);
+    for (int method = 0; method < AEAD_CIPHER_NUM; method++) {
+        test_encrypt(method);
+        test_decrypt(method);
+        test_round_trip(method);
+    }
+    return 0;
+}
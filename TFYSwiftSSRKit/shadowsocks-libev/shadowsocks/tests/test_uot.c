@@ -0,0 +1,326 @@
+/*
+ * test_uot.c - UDP over a mux stream: framing, dropping whole and path switching
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "uot.h"
+#include "test.h"
+
+#define DATAGRAMS 3000
+
+typedef struct sent {
+    size_t len;
+    int atyp;
+    uint8_t first;
+} sent_t;
+
+static sent_t sent[DATAGRAMS + 1000];
+static int sent_count, received, bad;
+static uot_reader_t reader;
+static mux_stream_t *server_stream;
+static int consume = 1, header_seen;
+
+static void
+on_datagram(void *data, const uot_datagram_t *dgram)
+{
+    (void)data;
+    sent_t *s = &sent[received++];
+
+    if (dgram->len != s->len || dgram->atyp != s->atyp)
+        bad++;
+    for (size_t k = 0; k < dgram->len; k++)
+        if ((uint8_t)dgram->payload[k] != (uint8_t)(s->first + k)) {
+            bad++;
+            break;
+        }
+    if (dgram->atyp == 1 && (dgram->port != 53
+                             || ((struct sockaddr_in *)&dgram->addr)->sin_port != htons(53)))
+        bad++;
+    if (dgram->atyp == 4 && dgram->port != 443)
+        bad++;
+    if (dgram->atyp == 3 && (dgram->port != 8080 || dgram->host_len != 11
+                             || memcmp(dgram->host, "example.com", 11) != 0))
+        bad++;
+}
+
+static void
+on_accept(void *data, mux_stream_t *stream)
+{
+    (void)data;
+    server_stream = stream;
+}
+
+static void
+on_data(void *data, mux_stream_t *stream, const char *buf, size_t len)
+{
+    (void)data;
+    size_t all = len;
+
+    if (!header_seen) {
+        char magic[64];
+        size_t magic_len = uot_magic_header(magic);
+        CHECK(len >= magic_len && memcmp(buf, magic, magic_len) == 0);
+        buf        += magic_len;
+        len        -= magic_len;
+        header_seen = 1;
+    }
+    CHECK(uot_reader_input(&reader, buf, len, on_datagram, NULL) == (ssize_t)len);
+    if (consume)
+        mux_stream_consumed(stream, all);
+}
+
+static void
+on_stream(void *data, mux_stream_t *stream)
+{
+    (void)data;
+    (void)stream;
+}
+
+static void
+on_close(void *data, mux_stream_t *stream, int error)
+{
+    (void)data;
+    (void)stream;
+    (void)error;
+}
+
+// Move a's output to b in random pieces
+static int
+pump(mux_session_t *a, mux_session_t *b)
+{
+    int moved = 0;
+
+    while (mux_session_pending(a) > 0) {
+        struct iovec iov[2];
+        mux_session_output(a, iov);
+        size_t chunk = 1 + rand() % 3000;
+        if (chunk > iov[0].iov_len)
+            chunk = iov[0].iov_len;
+        CHECK(mux_session_input(b, iov[0].iov_base, chunk) == 0);
+        mux_session_consume(a, chunk);
+        moved = 1;
+    }
+    return moved;
+}
+
+static void
+send_one(mux_stream_t *stream, int atyp, size_t len, const struct sockaddr *addr)
+{
+    static char payload[UOT_MAX_PAYLOAD];
+    uint8_t first = (uint8_t)sent_count;
+    int ret;
+
+    for (size_t k = 0; k < len; k++)
+        payload[k] = (char)(first + k);
+    if (atyp == 3) {
+        char header[UOT_MAX_HEADER];
+        size_t header_len = uot_frame_header_host(header, "example.com", 11, 8080, len);
+        ret = -1;
+        if (mux_stream_writable(stream) >= header_len + len) {
+            CHECK(mux_stream_write(stream, header, header_len) == (ssize_t)header_len);
+            CHECK(mux_stream_write(stream, payload, len) == (ssize_t)len);
+            ret = 0;
+        }
+    } else {
+        ret = uot_send(stream, addr, payload, len);
+    }
+    if (ret == 0)
+        sent[sent_count++] = (sent_t) { .len = len, .atyp = atyp, .first = first };
+}
+
+static void
+test_stream(void)
+{
+    mux_callbacks_t server_cb = { .on_accept   = on_accept, .on_data = on_data, .on_fin = on_stream,
+                                  .on_writable = on_stream, .on_close = on_close };
+    mux_callbacks_t client_cb = { .on_fin = on_stream, .on_writable = on_stream, .on_close = on_close };
+    mux_session_t *client     = mux_session_new(MUX_ROLE_CLIENT, NULL, &client_cb, NULL);
+    mux_session_t *server     = mux_session_new(MUX_ROLE_SERVER, NULL, &server_cb, NULL);
+    mux_stream_t *stream      = mux_stream_open(client, NULL);
+    char magic[64];
+    size_t magic_len = uot_magic_header(magic);
+
+    CHECK(mux_stream_write(stream, magic, magic_len) == (ssize_t)magic_len);
+    uot_reader_init(&reader);
+
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+    memset(&v4, 0, sizeof(v4));
+    memset(&v6, 0, sizeof(v6));
+    v4.sin_family  = AF_INET;
+    v4.sin_port    = htons(53);
+    v6.sin6_family = AF_INET6;
+    v6.sin6_port   = htons(443);
+    inet_pton(AF_INET, "8.8.8.8", &v4.sin_addr);
+    inet_pton(AF_INET6, "2001:db8::1", &v6.sin6_addr);
+
+    // IPv4, IPv6 and domain destinations, empty and maximum sized payloads
+    for (int i = 0; i < DATAGRAMS; i++) {
+        size_t len = i % 100 == 0 ? UOT_MAX_PAYLOAD : i % 7 == 0 ? 0 : (size_t)(rand() % 3000);
+        int atyp   = i % 3 == 0 ? 1 : i % 3 == 1 ? 4 : 3;
+        send_one(stream, atyp, len, atyp == 1 ? (struct sockaddr *)&v4 : (struct sockaddr *)&v6);
+        if (rand() % 4 == 0) {
+            pump(client, server);
+            pump(server, client);
+        }
+    }
+    while (pump(client, server) | pump(server, client))
+        ;
+    CHECK(server_stream != NULL);
+    CHECK(sent_count > DATAGRAMS / 2);
+    CHECK(received == sent_count && bad == 0);
+    CHECK(reader.frames == (uint64_t)sent_count);
+
+    // A reader that stops consuming: the window fills and datagrams drop whole
+    consume = 0;
+    int dropped = 0;
+    for (int i = 0; i < 400; i++) {
+        int before = sent_count;
+        send_one(stream, 1, 1400, (struct sockaddr *)&v4);
+        dropped += sent_count == before;
+        pump(client, server);
+        pump(server, client);
+    }
+    CHECK(dropped > 0);
+    CHECK(received == sent_count && bad == 0);
+
+    uot_reader_release(&reader);
+    mux_session_free(client);
+    mux_session_free(server);
+}
+
+static void
+test_frames(void)
+{
+    uot_reader_t r;
+    uot_datagram_t dgram;
+    char frame[UOT_MAX_HEADER + 4];
+    struct sockaddr_in v4;
+
+    memset(&v4, 0, sizeof(v4));
+    v4.sin_family = AF_INET;
+    v4.sin_port   = htons(53);
+
+    size_t header_len = uot_frame_header(frame, (struct sockaddr *)&v4, 4);
+    CHECK(header_len == 1 + 4 + 2 + 2);
+    memcpy(frame + header_len, "abcd", 4);
+    CHECK(uot_frame_parse(frame, header_len + 4, &dgram) == (ssize_t)(header_len + 4));
+    CHECK(dgram.len == 4 && memcmp(dgram.payload, "abcd", 4) == 0);
+    CHECK(uot_frame_parse(frame, header_len + 3, &dgram) == 0);
+    CHECK(uot_frame_header(frame, (struct sockaddr *)&v4, UOT_MAX_PAYLOAD + 1) == 0);
+
+    // Unknown address type, and a domain of length 0
+    uot_reader_init(&r);
+    CHECK(uot_reader_input(&r, "\x09\0\0", 3, on_datagram, NULL) == -1);
+    uot_reader_release(&r);
+    uot_reader_init(&r);
+    CHECK(uot_reader_input(&r, "\x03", 1, on_datagram, NULL) == 1);
+    CHECK(uot_reader_input(&r, "\x00", 1, on_datagram, NULL) == -1);
+    uot_reader_release(&r);
+
+    CHECK(uot_is_magic_host(UOT_MAGIC_HOST, strlen(UOT_MAGIC_HOST)));
+    CHECK(!uot_is_magic_host("example.com", 11));
+}
+
+static void
+probe(uot_path_t *path, double *now, int answer)
+{
+    uint32_t id = uot_path_probe_sent(path, *now);
+    if (answer)
+        uot_path_probe_answered(path, id, *now + 0.05);
+    *now += 1;
+}
+
+static void
+test_path(void)
+{
+    uot_path_t *path = uot_path_new(NULL);
+    uot_path_stats_t stats;
+    double now = 0;
+
+    for (int i = 0; i < 30; i++) {
+        probe(path, &now, 1);
+        CHECK(!uot_path_use_tcp(path, now));
+    }
+
+    // Half the probes lost: over to the stream within the window
+    int switched = -1;
+    for (int i = 0; i < 40; i++) {
+        probe(path, &now, i % 2);
+        if (uot_path_use_tcp(path, now) && switched < 0)
+            switched = i;
+    }
+    CHECK(switched > 0 && switched < 15);
+
+    // UDP recovers: back once the hold has passed, not before
+    double tcp_since = now - (39 - switched);
+    int back = -1;
+    for (int i = 0; i < 100 && back < 0; i++) {
+        probe(path, &now, 1);
+        if (!uot_path_use_tcp(path, now))
+            back = i;
+    }
+    CHECK(back >= 0);
+    CHECK(now - tcp_since >= UOT_DEFAULT_HOLD);
+    uot_path_stats(path, now, &stats);
+    CHECK(stats.to_tcp == 1 && stats.to_udp == 1);
+
+    // Lossy again right away: the next hold is doubled
+    for (int i = 0; i < 15; i++) {
+        probe(path, &now, 0);
+        uot_path_use_tcp(path, now);
+    }
+    uot_path_stats(path, now, &stats);
+    CHECK(stats.tcp && stats.hold >= 2 * UOT_DEFAULT_HOLD - 1);
+    uot_path_free(path);
+
+    // An answer after the timeout counts as lost
+    path = uot_path_new(NULL);
+    uint32_t id = uot_path_probe_sent(path, 0);
+    uot_path_probe_answered(path, id, UOT_DEFAULT_TIMEOUT + 3);
+    uot_path_stats(path, 10, &stats);
+    CHECK(stats.answered == 0 && stats.settled == 1);
+    uot_path_free(path);
+
+    uot_path_config_t config = { .mode = UOT_MODE_ALWAYS };
+    path = uot_path_new(&config);
+    CHECK(uot_path_use_tcp(path, 0));
+    uot_path_free(path);
+
+    config.mode = UOT_MODE_OFF;
+    path        = uot_path_new(&config);
+    now         = 0;
+    for (int i = 0; i < 30; i++)
+        probe(path, &now, 0);
+    CHECK(!uot_path_use_tcp(path, now));
+    uot_path_free(path);
+}
+
+int
+main(void)
+{
+    srand(3);
+    test_stream();
+    test_frames();
+    test_path();
+    return 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * test_warmpool.c - Refilling, taking, expiry and backoff of warmpool
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "membudget.h"
+#include "warmpool.h"
+#include "test.h"
+
+static struct ev_loop *loop;
+static struct sockaddr_storage server_addr;
+static socklen_t server_len;
+
+static warm_pool_stats_t
+stats_of(warm_pool_t *pool)
+{
+    warm_pool_stats_t stats;
+    warm_pool_stats(pool, &stats);
+    return stats;
+}
+
+// Run the loop until the connects in flight have finished
+static void
+settle(warm_pool_t *pool)
+{
+    double deadline = test_now() + 2;
+    while (stats_of(pool).connecting > 0 && test_now() < deadline)
+        ev_run(loop, EVRUN_ONCE);
+    CHECK(stats_of(pool).connecting == 0);
+}
+
+static int
+accept_one(int listener)
+{
+    double deadline = test_now() + 1;
+    int fd;
+    while ((fd = accept(listener, NULL, NULL)) == -1 && test_now() < deadline)
+        usleep(1000);
+    CHECK(fd != -1);
+    return fd;
+}
+
+static warm_pool_t *
+pool_new(uint16_t port, const warm_pool_config_t *config)
+{
+    server_len = test_loopback(port, &server_addr);
+    loop       = ev_loop_new(0);
+    return warm_pool_new(loop, (struct sockaddr *)&server_addr, server_len, config);
+}
+
+static void
+pool_free(warm_pool_t *pool)
+{
+    warm_pool_free(pool);
+    ev_loop_destroy(loop);
+}
+
+static void
+test_take(void)
+{
+    uint16_t port = 0;
+    int listener  = test_listen(&port, 64);
+    warm_pool_config_t config = { .min_idle = 3 };
+    warm_pool_t *pool         = pool_new(port, &config);
+    char c;
+
+    warm_pool_start(pool);
+    CHECK(stats_of(pool).connecting == 3 && stats_of(pool).opened == 3);
+    settle(pool);
+    CHECK(stats_of(pool).idle == 3);
+
+    int server[4];
+    for (int i = 0; i < 3; i++)
+        server[i] = accept_one(listener);
+
+    // A ready socket, with nothing written on it, and one opened in its place
+    int fd = warm_pool_take(pool);
+    CHECK(fd != -1);
+    CHECK(stats_of(pool).hits == 1 && stats_of(pool).idle == 2);
+    CHECK(stats_of(pool).connecting == 1);
+    CHECK(write(fd, "x", 1) == 1);
+    int peer = -1;
+    for (int i = 0; i < 3 && peer == -1; i++) {
+        usleep(1000);
+        if (recv(server[i], &c, 1, MSG_DONTWAIT) == 1)
+            peer = i;
+    }
+    CHECK(peer != -1 && c == 'x');
+    for (int i = 0; i < 3; i++)
+        if (i != peer)
+            CHECK(recv(server[i], &c, 1, MSG_DONTWAIT) == -1 && errno == EAGAIN);
+    close(fd);
+    settle(pool);
+    server[3] = accept_one(listener);
+
+    // The server closes an idle socket: it is noticed and replaced
+    int closing = (peer + 1) % 3;
+    close(server[closing]);
+    double deadline = test_now() + 2;
+    while (stats_of(pool).dead == 0 && test_now() < deadline)
+        ev_run(loop, EVRUN_ONCE);
+    CHECK(stats_of(pool).dead == 1 && stats_of(pool).opened == 5);
+    settle(pool);
+    CHECK(stats_of(pool).idle == 3);
+
+    for (int i = 0; i < 4; i++)
+        if (i != closing)
+            close(server[i]);
+    pool_free(pool);
+    close(listener);
+}
+
+// Without a ready socket the request misses and raises the target
+static void
+test_miss(void)
+{
+    uint16_t port = 0;
+    int listener  = test_listen(&port, 64);
+    warm_pool_config_t config = { .max_idle = 2 };
+    warm_pool_t *pool         = pool_new(port, &config);
+
+    warm_pool_start(pool);
+    CHECK(stats_of(pool).opened == 0 && stats_of(pool).target == 0);
+    CHECK(warm_pool_take(pool) == -1);
+    CHECK(stats_of(pool).misses == 1 && stats_of(pool).target == 1);
+    CHECK(stats_of(pool).connecting == 1);
+    CHECK(warm_pool_take(pool) == -1);
+    CHECK(warm_pool_take(pool) == -1);
+    CHECK(stats_of(pool).misses == 3 && stats_of(pool).target == 2);
+    CHECK(stats_of(pool).opened == 2);
+
+    pool_free(pool);
+    close(listener);
+}
+
+// The arrival rate follows the takes, smoothed once per tick
+static void
+test_ticks(void)
+{
+    uint16_t port = 0;
+    int listener  = test_listen(&port, 64);
+    warm_pool_config_t config = { .min_idle = 2 };
+    warm_pool_t *pool         = pool_new(port, &config);
+
+    warm_pool_start(pool);
+    ev_tstamp start = ev_now(loop);
+    settle(pool);
+    CHECK(stats_of(pool).idle == 2);
+
+    for (int i = 0; i < 20; i++) {
+        int fd = warm_pool_take(pool);
+        if (fd != -1)
+            close(fd);
+    }
+    warm_pool_stats_t stats = stats_of(pool);
+    CHECK(stats.hits == 2 && stats.misses == 18);
+
+    // Simulated seconds from here; connects in flight are not polled
+    while (evloop_step(loop, start + 1.5))
+        ;
+    stats = stats_of(pool);
+    CHECK(fabs(stats.rate - 0.3 * 20) < 1e-9);
+    CHECK(stats.target >= config.min_idle && stats.target <= WARM_POOL_DEFAULT_MAX_IDLE);
+
+    pool_free(pool);
+    close(listener);
+}
+
+// Idle sockets are closed at idle_timeout and replaced
+static void
+test_expiry(void)
+{
+    uint16_t port = 0;
+    int listener  = test_listen(&port, 64);
+    warm_pool_config_t config = { .min_idle = 2, .max_idle = 2, .idle_timeout = 2.5 };
+    warm_pool_t *pool         = pool_new(port, &config);
+
+    warm_pool_start(pool);
+    settle(pool);
+    ev_tstamp idle_since = ev_now(loop);
+    CHECK(stats_of(pool).idle == 2);
+
+    while (evloop_step(loop, idle_since + 2.5))
+        ;
+    CHECK(stats_of(pool).expired == 0 && stats_of(pool).idle == 2);
+    while (evloop_step(loop, idle_since + 3.5))
+        ;
+    CHECK(stats_of(pool).expired == 2 && stats_of(pool).idle == 0);
+    CHECK(stats_of(pool).connecting == 2 && stats_of(pool).opened == 4);
+
+    pool_free(pool);
+    close(listener);
+}
+
+// Refused connects pause refilling for 1, 2, 4 ... seconds
+static void
+test_backoff(void)
+{
+    uint16_t port = 0;
+    close(test_listen(&port, 1));   // nobody listens there any more
+    warm_pool_config_t config = { .min_idle = 2 };
+    warm_pool_t *pool         = pool_new(port, &config);
+
+    warm_pool_start(pool);
+    double deadline = test_now() + 2;
+    while (stats_of(pool).failed < 2 && test_now() < deadline)
+        ev_run(loop, EVRUN_ONCE);
+    CHECK(stats_of(pool).failed == 2 && stats_of(pool).opened == 2);
+    CHECK(stats_of(pool).idle == 0 && stats_of(pool).connecting == 0);
+
+    // Two failures in a row: nothing for two seconds
+    ev_tstamp failed_at = ev_now(loop);
+    while (evloop_step(loop, failed_at + 1.9))
+        ;
+    CHECK(stats_of(pool).opened == 2);
+    while (evloop_step(loop, failed_at + 3.1))
+        ;
+    CHECK(stats_of(pool).opened == 4);
+
+    pool_free(pool);
+}
+
+static int setups;
+
+static int
+refuse_setup(void *data, int fd)
+{
+    CHECK(data == &setups && fd >= 0);
+    setups++;
+    return -1;
+}
+
+// Nothing is opened under memory pressure or when setup refuses the socket
+static void
+test_refused(void)
+{
+    uint16_t port = 0;
+    int listener  = test_listen(&port, 64);
+    warm_pool_config_t config = { .min_idle = 2 };
+    warm_pool_t *pool         = pool_new(port, &config);
+
+    mem_budget_config_t budget = { .soft_limit = 100, .hard_limit = 1000 };
+    mem_budget_configure(&budget);
+    mem_account_t *account = mem_budget_register("test", NULL, NULL, NULL);
+    CHECK(mem_budget_charge(account, 500) == 0);
+    CHECK(mem_budget_level() == MEM_BUDGET_PRESSURE);
+    warm_pool_start(pool);
+    CHECK(stats_of(pool).opened == 0);
+    mem_budget_uncharge(account, 500);
+    mem_budget_unregister(account);
+    mem_budget_configure(NULL);
+    pool_free(pool);
+
+    config.setup = refuse_setup;
+    config.data  = &setups;
+    pool         = pool_new(port, &config);
+    warm_pool_start(pool);
+    CHECK(setups == 1 && stats_of(pool).opened == 0);
+    pool_free(pool);
+    close(listener);
+}
+
+int
+main(void)
+{
+    test_take();
+    test_miss();
+    test_ticks();
+    test_expiry();
+    test_backoff();
+    test_refused();
+    return 0;
+}